@@ -12,6 +12,7 @@
 
 
 #define EPSILON 1e-8
+#define MRES_MAX_LEVEL 8
 
 
 
@@ -313,9 +314,9 @@ static void bingham_MLE_grad_desc(bingham_t *B, double **X, int n)
 
 /*
  * Compute MLE parameters concentration parameters B->Z given scatter matrix S with principal components B->V
- * using NN lookup.
+ * using NN lookup (followed by a local search if fast = 0, or by Newton's method if fast = 1).
  */
-static void bingham_MLE_NN(bingham_t *B, double **S)
+static void bingham_MLE_NN_internal(bingham_t *B, double **S, int fast)
 {
   int d = B->d;
 
@@ -350,12 +351,202 @@ static void bingham_MLE_NN(bingham_t *B, double **S)
 
   //mult(dY, dY, 1/(double)n, d-1);
 
-  bingham_dY_params_3d(B->Z, &B->F, dY);
+  if (fast)
+    bingham_dY_params_3d_fast(B->Z, &B->F, dY);
+  else
+    bingham_dY_params_3d(B->Z, &B->F, dY);
 
   //bingham_F(B);  //dbug
 }
 
 
+/*
+ * Compute MLE parameters concentration parameters B->Z given scatter matrix S with principal components B->V
+ * using NN lookup.
+ */
+static void bingham_MLE_NN(bingham_t *B, double **S)
+{
+  bingham_MLE_NN_internal(B, S, 0);
+}
+
+
+
+//------------------- Bingham arena allocation -------------------//
+
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_BLOCK_SIZE 4096
+
+
+static bingham_arena_block_t *bingham_arena_new_block(size_t size)
+{
+  bingham_arena_block_t *block;
+  safe_calloc(block, 1, bingham_arena_block_t);
+  safe_malloc(block->data, size, char);
+  block->size = size;
+
+  return block;
+}
+
+
+/*
+ * Initialize an arena.  Memory is grabbed from the system in blocks of (at least) block_size bytes.
+ */
+void bingham_arena_init(bingham_arena_t *A, size_t block_size)
+{
+  A->block_size = MAX(block_size, ARENA_MIN_BLOCK_SIZE);
+  A->blocks = bingham_arena_new_block(A->block_size);
+}
+
+
+/*
+ * Bump-allocate size bytes (aligned to ARENA_ALIGN) from an arena.
+ */
+void *bingham_arena_alloc(bingham_arena_t *A, size_t size)
+{
+  size = (size + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+
+  bingham_arena_block_t *block = A->blocks;
+  if (block == NULL || block->used + size > block->size) {
+    bingham_arena_block_t *new_block = bingham_arena_new_block(MAX(A->block_size, size));
+    new_block->next = block;
+    A->blocks = block = new_block;
+  }
+
+  void *p = block->data + block->used;
+  block->used += size;
+
+  return p;
+}
+
+
+/*
+ * Release everything allocated in an arena (without giving the memory back to the system).
+ * If the arena spilled over into more than one block, the blocks are coalesced into a single
+ * block big enough to hold them all, so that repeated use (e.g. one filter step per reset)
+ * settles into one contiguous block.
+ */
+void bingham_arena_reset(bingham_arena_t *A)
+{
+  bingham_arena_block_t *block = A->blocks;
+  if (block == NULL)
+    return;
+
+  if (block->next) {
+    size_t size = 0;
+    while (block) {
+      bingham_arena_block_t *next = block->next;
+      size += block->size;
+      free(block->data);
+      free(block);
+      block = next;
+    }
+    A->block_size = MAX(A->block_size, size);
+    A->blocks = bingham_arena_new_block(A->block_size);
+  }
+  else
+    block->used = 0;
+}
+
+
+/*
+ * Free the contents of an arena.
+ */
+void bingham_arena_free(bingham_arena_t *A)
+{
+  bingham_arena_block_t *block = A->blocks;
+  while (block) {
+    bingham_arena_block_t *next = block->next;
+    free(block->data);
+    free(block);
+    block = next;
+  }
+  A->blocks = NULL;
+}
+
+
+/*
+ * Zeroed allocation from an arena, or from the heap if A is NULL.
+ */
+static void *bingham_calloc(size_t n, size_t size, bingham_arena_t *A)
+{
+  void *p;
+  if (A) {
+    p = bingham_arena_alloc(A, n*size);
+    memset(p, 0, n*size);
+  }
+  else {
+    p = calloc(n, size);
+    test_alloc(p);
+  }
+
+  return p;
+}
+
+
+/*
+ * Create a new n-by-m 2d matrix of doubles in an arena, or on the heap if A is NULL.
+ */
+static double **bingham_new_matrix2(int n, int m, bingham_arena_t *A)
+{
+  if (A == NULL)
+    return new_matrix2(n, m);
+
+  if (n*m == 0) return NULL;
+  int i;
+  double **X = (double **)bingham_arena_alloc(A, n*sizeof(double *) + n*m*sizeof(double));
+  double *raw = (double *)(X + n);
+  memset(raw, 0, n*m*sizeof(double));
+  for (i = 0; i < n; i++)
+    X[i] = raw + m*i;
+
+  return X;
+}
+
+
+/*
+ * Allocate the contents of a bingham (in an arena, or on the heap if A is NULL).
+ */
+static void bingham_alloc_internal(bingham_t *B, int d, bingham_arena_t *A)
+{
+  if (A == NULL) {
+    bingham_alloc(B, d);
+    return;
+  }
+
+  B->d = d;
+  B->V = bingham_new_matrix2(d-1, d, A);
+  B->Z = (double *)bingham_calloc(d-1, sizeof(double), A);
+  B->F = 0;
+  B->stats = NULL;
+}
+
+
+/*
+ * Free the contents of a bingham, unless they live in an arena.
+ */
+static void bingham_free_internal(bingham_t *B, bingham_arena_t *A)
+{
+  if (A == NULL)
+    bingham_free(B);
+}
+
+
+static void bingham_fit_scatter_internal(bingham_t *B, double **S, int d, bingham_arena_t *A);
+
+
+/*
+ * Drop the (now stale) stats of a bingham.
+ */
+static void bingham_clear_stats(bingham_t *B, bingham_arena_t *A)
+{
+  if (A == NULL)
+    bingham_free_stats(B);
+  else
+    B->stats = NULL;
+}
+
+
 
 //------------------- Bingham API -------------------//
 
@@ -365,8 +556,10 @@ static void bingham_MLE_NN(bingham_t *B, double **S)
  */
 void bingham_init()
 {
+  TRACE_BEGIN("bingham_init");
   bingham_constants_init();
   hypersphere_init();
+  TRACE_END();
 }
 
 
@@ -467,6 +660,25 @@ void bingham_alloc(bingham_t *B, int d)
 }
 
 
+/*
+ * Allocate the contents of a bingham in an arena.
+ */
+void bingham_alloc_arena(bingham_t *B, int d, bingham_arena_t *A)
+{
+  bingham_alloc_internal(B, d, A);
+}
+
+
+/*
+ * Allocate dst in an arena, and copy the contents (but not the stats) of src into it.
+ */
+void bingham_copy_arena(bingham_t *dst, bingham_t *src, bingham_arena_t *A)
+{
+  bingham_alloc_internal(dst, src->d, A);
+  bingham_copy(dst, src);
+}
+
+
 /*
  * Create a new Bingham distribution.
  *
@@ -607,9 +819,13 @@ int bingham_is_uniform(bingham_t *B)
 }
 
 
+/*
+ * Computes the mode of a bingham, by projecting the coordinate axis that is farthest from the
+ * span of B->V onto its orthogonal complement (so the mode doesn't depend on a random stream).
+ */
 void bingham_mode(double *mode, bingham_t *B)
 {
-  int i, d = B->d;
+  int i, j, d = B->d;
 
   if (bingham_is_uniform(B)) {
     mode[0] = 1;
@@ -620,23 +836,28 @@ void bingham_mode(double *mode, bingham_t *B)
 
   double **V = B->V;
 
-  double epsilon = 1e-16;
-  while (1) {
-    for (i = 0; i < d; i++)
-      mode[i] = frand() - .5;
-
-    double u[d];
-    for (i = 0; i < d-1; i++) {
-      proj(u, mode, V[i], d);
-      sub(mode, mode, u, d);
+  int axis = 0;
+  double min_c = DBL_MAX;
+  for (j = 0; j < d; j++) {
+    double c = 0;
+    for (i = 0; i < d-1; i++)
+      c += V[i][j]*V[i][j];
+    if (c < min_c) {
+      min_c = c;
+      axis = j;
     }
+  }
 
-    double n = norm(mode,d);
-    if (n > epsilon) {
-      mult(mode, mode, 1.0/n, d);
-      break;
-    }
+  for (j = 0; j < d; j++)
+    mode[j] = (j == axis);
+
+  double u[d];
+  for (i = 0; i < d-1; i++) {
+    proj(u, mode, V[i], d);
+    sub(mode, mode, u, d);
   }
+
+  normalize(mode, mode, d);
 }
 
 /*
@@ -706,21 +927,51 @@ void bingham_mode(double *mode, bingham_t *B)
 */
 
 /*
- * Computes some statistics of a bingham.
- * Note: allocates space in B->stats.
+ * Computes the scatter matrix of a bingham, S = sigma*mode'*mode + sum{sigma_i*V[i]'*V[i]},
+ * given its normalization constant derivatives dF and its mode (which is ignored if B is uniform).
  */
-void bingham_stats(bingham_t *B)
+static void bingham_scatter_internal(double **S, bingham_t *B, double *dF, double *mode)
 {
-  if (B->stats)
+  int i, j, k, d = B->d;
+
+  for (j = 0; j < d; j++)
+    for (k = 0; k < d; k++)
+      S[j][k] = 0;
+
+  if (bingham_is_uniform(B)) {
+    for (i = 0; i < d; i++)
+      S[i][i] = 1.0/(double)d;
     return;
+  }
+
+  double *v = mode;
+  double sigma = 1 - sum(dF, d-1)/B->F;
+  for (i = 0; i <= d-1; i++) {
+    if (i > 0) {
+      v = B->V[i-1];
+      sigma = dF[i-1]/B->F;
+    }
+    for (j = 0; j < d; j++)
+      for (k = j; k < d; k++)
+	S[j][k] += sigma*v[j]*v[k];
+  }
+  for (j = 0; j < d; j++)
+    for (k = 0; k < j; k++)
+      S[j][k] = S[k][j];
+}
 
-  int i, j, d = B->d;
-  double F = B->F;
 
-  safe_calloc(B->stats, 1, bingham_stats_t);
+/*
+ * Fills in the statistics of a bingham, given preallocated B->stats->dF and B->stats->scatter
+ * (and B->stats->mode, if B is not uniform).  Doesn't allocate, so it's safe to call on different
+ * binghams from multiple threads.
+ */
+static void bingham_stats_fill(bingham_t *B)
+{
+  int i, d = B->d;
+  double F = B->F;
 
   // look up dF
-  safe_calloc(B->stats->dF, d-1, double);
   if (d == 4)
     bingham_dF_lookup_3d(B->stats->dF, B->Z);
   else if (d == 3) {
@@ -738,42 +989,50 @@ void bingham_stats(bingham_t *B)
   for (i = 0; i < d-1; i++)
     B->stats->entropy -= B->Z[i] * B->stats->dF[i] / F;
 
-  if (!bingham_is_uniform(B)) {
-
-    // compute the mode
-    safe_calloc(B->stats->mode, d, double);
+  // compute the mode
+  if (!bingham_is_uniform(B))
     bingham_mode(B->stats->mode, B);
 
-    // compute the scatter matrix
-    double **Si = new_matrix2(d, d);
-    double **S = new_matrix2(d, d);
-    double **v;
-    double *vt[d];
-    double sigma;
-    v = &B->stats->mode;
-    for (j = 0; j < d; j++)
-      vt[j] = &v[0][j];
-    matrix_mult(Si, vt, v, d, 1, d);
-    sigma = 1 - sum(B->stats->dF, d-1)/F;
-    mult(Si[0], Si[0], sigma, d*d);
-    matrix_add(S, S, Si, d, d);
-    for (i = 0; i < d-1; i++) {
-      v = &B->V[i];
-      for (j = 0; j < d; j++)
-	vt[j] = &v[0][j];
-      matrix_mult(Si, vt, v, d, 1, d);
-      sigma = B->stats->dF[i]/F;
-      mult(Si[0], Si[0], sigma, d*d);
-      matrix_add(S, S, Si, d, d);
-    }
-    free_matrix2(Si);
-    B->stats->scatter = S;
-  }
-  else {  // bingham is uniform
-    B->stats->scatter = new_matrix2(d, d);
-    for (i = 0; i < d; i++)
-      B->stats->scatter[i][i] = 1.0/(double)d;
-  }
+  bingham_scatter_internal(B->stats->scatter, B, B->stats->dF, B->stats->mode);
+}
+
+
+/*
+ * Computes some statistics of a bingham (allocating them in an arena, or on the heap if A is NULL).
+ */
+static void bingham_stats_internal(bingham_t *B, bingham_arena_t *A)
+{
+  if (B->stats)
+    return;
+
+  int d = B->d;
+
+  B->stats = (bingham_stats_t *)bingham_calloc(1, sizeof(bingham_stats_t), A);
+  B->stats->dF = (double *)bingham_calloc(d-1, sizeof(double), A);
+  B->stats->scatter = bingham_new_matrix2(d, d, A);
+  if (!bingham_is_uniform(B))
+    B->stats->mode = (double *)bingham_calloc(d, sizeof(double), A);
+
+  bingham_stats_fill(B);
+}
+
+
+/*
+ * Computes some statistics of a bingham.
+ * Note: allocates space in B->stats.
+ */
+void bingham_stats(bingham_t *B)
+{
+  bingham_stats_internal(B, NULL);
+}
+
+
+/*
+ * Computes some statistics of an arena-allocated bingham, allocating B->stats in A.
+ */
+void bingham_stats_arena(bingham_t *B, bingham_arena_t *A)
+{
+  bingham_stats_internal(B, A);
 }
 
 
@@ -868,67 +1127,103 @@ double bingham_KL_divergence(bingham_t *B1, bingham_t *B2)
 }
 
 
+/*
+ * Merge two binghams: B = a*B1 + (1-a)*B2 (allocating B in an arena, or on the heap if A is NULL).
+ */
+static void bingham_merge_internal(bingham_t *B, bingham_t *B1, bingham_t *B2, double alpha, bingham_arena_t *A)
+{
+  bingham_stats_internal(B1, A);
+  bingham_stats_internal(B2, A);
+
+  int i, d = B1->d;
+  double S_raw[d*d], *S[d];
+  for (i = 0; i < d; i++)
+    S[i] = S_raw + d*i;
+
+  for (i = 0; i < d*d; i++)
+    S_raw[i] = alpha*B1->stats->scatter[0][i] + (1-alpha)*B2->stats->scatter[0][i];
+
+  bingham_fit_scatter_internal(B, S, d, A);
+}
+
+
 /*
  * Merge two binghams: B = a*B1 + (1-a)*B2.
  */
 void bingham_merge(bingham_t *B, bingham_t *B1, bingham_t *B2, double alpha)
 {
-  bingham_stats(B1);
-  bingham_stats(B2);
+  bingham_merge_internal(B, B1, B2, alpha, NULL);
+}
 
-  int d = B1->d;
-  double **S = new_matrix2(d, d);
-  matrix_copy(S, B2->stats->scatter, d, d);
-  mult(S[0], S[0], (1-alpha)/alpha, d*d);
-  matrix_add(S, S, B1->stats->scatter, d, d);
-  mult(S[0], S[0], alpha, d*d);
 
-  bingham_fit_scatter(B, S, d);
+/*
+ * Allocate a bingham for bingham_merge_fill(), with room for its stats (in an arena, or on the heap if A is NULL).
+ */
+static bingham_t *bingham_merge_alloc(int d, bingham_arena_t *A)
+{
+  bingham_t *B = (bingham_t *)bingham_calloc(1, sizeof(bingham_t), A);
+  B->d = d;
+  B->V = bingham_new_matrix2(d, d, A);
+  B->Z = (double *)bingham_calloc(d-1, sizeof(double), A);
+  B->stats = (bingham_stats_t *)bingham_calloc(1, sizeof(bingham_stats_t), A);
+  B->stats->dF = (double *)bingham_calloc(d-1, sizeof(double), A);
+  B->stats->mode = (double *)bingham_calloc(d, sizeof(double), A);
+  B->stats->scatter = bingham_new_matrix2(d, d, A);
 
-  free_matrix2(S);
+  return B;
 }
 
 
 /*
- * Compose two S^3 Binghams: B = quaternion_mult(B1,B2).  Note that this is an approximation,
- * as the Bingham distribution is not closed under composition.
+ * Merge two binghams (which must already have stats):  B = a*B1 + (1-a)*B2, and compute B's stats,
+ * where B was allocated with bingham_merge_alloc().  Same as bingham_merge() followed by
+ * bingham_stats(), but doesn't allocate, so it's safe to call from multiple threads.
  */
-void bingham_compose(bingham_t *B, bingham_t *B1, bingham_t *B2)
+static void bingham_merge_fill(bingham_t *B, bingham_t *B1, bingham_t *B2, double alpha)
 {
-  bingham_stats(B1);
-  if (B1 != B2)
-    bingham_stats(B2);
+  int i, d = B1->d;
+  double S_raw[d*d], *S[d];
+  for (i = 0; i < d; i++)
+    S[i] = S_raw + d*i;
 
-  double d = B1->d;
+  for (i = 0; i < d*d; i++)
+    S_raw[i] = alpha*B1->stats->scatter[0][i] + (1-alpha)*B2->stats->scatter[0][i];
 
-  if (d != 4) {
-    fprintf(stderr, "Error: bingham_compose() is only implemented for d = 4!  Exiting...\n");
-    exit(1);
-  }
+  double eigenvals[d];
+  eigen_symm(eigenvals, B->V, S, d);
+  bingham_MLE_NN(B, S);
 
-  double a11 = B1->stats->scatter[0][0];
-  double a12 = B1->stats->scatter[0][1];
-  double a13 = B1->stats->scatter[0][2];
-  double a14 = B1->stats->scatter[0][3];
-  double a22 = B1->stats->scatter[1][1];
-  double a23 = B1->stats->scatter[1][2];
-  double a24 = B1->stats->scatter[1][3];
-  double a33 = B1->stats->scatter[2][2];
-  double a34 = B1->stats->scatter[2][3];
-  double a44 = B1->stats->scatter[3][3];
-
-  double b11 = B2->stats->scatter[0][0];
-  double b12 = B2->stats->scatter[0][1];
-  double b13 = B2->stats->scatter[0][2];
-  double b14 = B2->stats->scatter[0][3];
-  double b22 = B2->stats->scatter[1][1];
-  double b23 = B2->stats->scatter[1][2];
-  double b24 = B2->stats->scatter[1][3];
-  double b33 = B2->stats->scatter[2][2];
-  double b34 = B2->stats->scatter[2][3];
-  double b44 = B2->stats->scatter[3][3];
+  bingham_stats_fill(B);
+}
 
-  double **S = new_matrix2(d, d);
+
+/*
+ * Compute the scatter matrix S of a composed S^3 Bingham, B = quaternion_mult(B1,B2),
+ * from the scatter matrices S1 and S2 of B1 and B2 (unrolled quaternion product moments).
+ */
+void bingham_compose_scatter(double **S, double **S1, double **S2)
+{
+  double a11 = S1[0][0];
+  double a12 = S1[0][1];
+  double a13 = S1[0][2];
+  double a14 = S1[0][3];
+  double a22 = S1[1][1];
+  double a23 = S1[1][2];
+  double a24 = S1[1][3];
+  double a33 = S1[2][2];
+  double a34 = S1[2][3];
+  double a44 = S1[3][3];
+
+  double b11 = S2[0][0];
+  double b12 = S2[0][1];
+  double b13 = S2[0][2];
+  double b14 = S2[0][3];
+  double b22 = S2[1][1];
+  double b23 = S2[1][2];
+  double b24 = S2[1][3];
+  double b33 = S2[2][2];
+  double b34 = S2[2][3];
+  double b44 = S2[3][3];
 
   S[0][0] =
     a11*b11 - 2*a12*b12 - 2*a13*b13 - 2*a14*b14 + a22*b22 + 2*a23*b23 + 2*a24*b24 + a33*b33 + 2*a34*b34 + a44*b44;
@@ -956,8 +1251,57 @@ void bingham_compose(bingham_t *B, bingham_t *B1, bingham_t *B2)
     a33*b12 + a34*b11 + a23*b24 + a24*b23 - a12*b44 - a22*b34 - a34*b22 + a44*b12;
   S[3][3] =
     2*a14*b14 - 2*a13*b24 + 2*a24*b13 + 2*a12*b34 - 2*a23*b23 - 2*a34*b12 + a11*b44 + a22*b33 + a33*b22 + a44*b11;
+}
+
+
+/*
+ * Fit an S^3 bingham to a scatter matrix S without allocating memory.  Assumes B is already allocated
+ * (in A, or on the heap if A is NULL).  B's old stats are dropped:  freed if A is NULL, and only
+ * unlinked (left to the arena) otherwise.
+ */
+static void bingham_fit_scatter_3d_noalloc(bingham_t *B, double **S, bingham_arena_t *A)
+{
+  int i, d = 4;
+  double S_raw[d*d], *S2[d];
+  double V_raw[d*d], *V[d];
+  for (i = 0; i < d; i++) {
+    S2[i] = S_raw + d*i;
+    V[i] = V_raw + d*i;
+    memcpy(S2[i], S[i], d*sizeof(double));
+  }
+
+  // use PCA to get B->V
+  double eigenvals[d];
+  eigen_symm_inplace(eigenvals, V, S2, d);
+
+  bingham_clear_stats(B, A);
+  B->d = d;
+  for (i = 0; i < d-1; i++)
+    memcpy(B->V[i], V[i], d*sizeof(double));
+
+  bingham_MLE_NN_internal(B, S, 1);
+}
 
-  int i = 0; printf("S = ["); for (i = 0; i < 16; i++) printf("%f ", S[0][i]); printf("]\n");  //dbug
+
+/*
+ * Compose two S^3 Binghams: B = quaternion_mult(B1,B2).  Note that this is an approximation,
+ * as the Bingham distribution is not closed under composition.
+ */
+void bingham_compose(bingham_t *B, bingham_t *B1, bingham_t *B2)
+{
+  bingham_stats(B1);
+  if (B1 != B2)
+    bingham_stats(B2);
+
+  int d = B1->d;
+
+  if (d != 4) {
+    fprintf(stderr, "Error: bingham_compose() is only implemented for d = 4!  Exiting...\n");
+    exit(1);
+  }
+
+  double **S = new_matrix2(d, d);
+  bingham_compose_scatter(S, B1->stats->scatter, B2->stats->scatter);
 
   if (B == B1 || B == B2)
     bingham_free(B);
@@ -967,38 +1311,95 @@ void bingham_compose(bingham_t *B, bingham_t *B1, bingham_t *B2)
 }
 
 
+static void bingham_compose_array_internal(bingham_t *B, bingham_t *B1, bingham_t *B2, int n, bingham_arena_t *A)
+{
+  int i, j, d = 4;
+  double S_raw[3][d*d], *S[3][d];
+  for (i = 0; i < 3; i++)
+    for (j = 0; j < d; j++)
+      S[i][j] = S_raw[i] + d*j;
+  double **S1 = S[0], **S2 = S[1], **S12 = S[2];
+
+  for (i = 0; i < n; i++) {
+    if (B1[i].d != 4 || B2[i].d != 4) {
+      fprintf(stderr, "Error: bingham_compose_array() is only implemented for d = 4!  Exiting...\n");
+      exit(1);
+    }
+
+    bingham_t *b[2] = {&B1[i], &B2[i]};
+    double **Sb[2] = {S1, S2};
+    for (j = 0; j < 2; j++) {
+      if (b[j]->stats)
+	memcpy(Sb[j][0], b[j]->stats->scatter[0], d*d*sizeof(double));
+      else {
+	double dF[d-1], mode[d];
+	bingham_dF_lookup_3d(dF, b[j]->Z);
+	if (!bingham_is_uniform(b[j]))
+	  bingham_mode(mode, b[j]);
+	bingham_scatter_internal(Sb[j], b[j], dF, mode);
+      }
+    }
+
+    bingham_compose_scatter(S12, S1, S2);
+    bingham_fit_scatter_3d_noalloc(&B[i], S12, A);
+  }
+}
+
+
+/*
+ * Compose n pairs of S^3 Binghams: B[i] = quaternion_mult(B1[i],B2[i]).  Assumes the B[i] are
+ * already allocated on the heap (B may alias B1 or B2).  Unlike bingham_compose(), this doesn't
+ * compute or allocate B1[i]->stats and B2[i]->stats (but uses them if they are already there),
+ * and it doesn't allocate any memory.  Any old B[i]->stats are freed, since they no longer match
+ * B[i]; use bingham_compose_array_arena() if the B[i] live in an arena.
+ */
+void bingham_compose_array(bingham_t *B, bingham_t *B1, bingham_t *B2, int n)
+{
+  bingham_compose_array_internal(B, B1, B2, n, NULL);
+}
+
+
+/*
+ * Compose n pairs of S^3 Binghams allocated in an arena.  Like bingham_compose_array(), except
+ * that the old B[i]->stats are only unlinked, not freed (their memory belongs to A).
+ */
+void bingham_compose_array_arena(bingham_t *B, bingham_t *B1, bingham_t *B2, int n, bingham_arena_t *A)
+{
+  bingham_compose_array_internal(B, B1, B2, n, A);
+}
+
+
 /*
  * Compute the true PDF at x of a composed S^3 Bingham, B = quaternion_mult(B1,B2).
  */
 double bingham_compose_true_pdf(double *x, bingham_t *B1, bingham_t *B2)
 {
-  int d = 4;
-  double **C = new_matrix2(d,d);
-  double **C1 = new_matrix2(d,d);
-  double **C2 = new_matrix2(d,d);
-  double w[d], xw[d];
+  int i, j, k, d = 4;
+  double C_raw[d*d], *C[d];
+  double V_raw[d*d], *V[d];
+  for (i = 0; i < d; i++) {
+    C[i] = C_raw + d*i;
+    V[i] = V_raw + d*i;
+  }
+  memset(C_raw, 0, d*d*sizeof(double));
 
-  int i;
+  // C = sum{B1->Z[i]*B1->V[i]'*B1->V[i]} + sum{B2->Z[i]*xw'*xw}, with xw = x*inv(B2->V[i])
+  double w[d], xw[d];
   for (i = 0; i < d-1; i++) {
-    // C1
-    outer_prod(C1, B1->V[i], B1->V[i], d, d);
-    mult(C1[0], C1[0], B1->Z[i], d*d);
-
-    // C2
+    double *v1 = B1->V[i], z1 = B1->Z[i], z2 = B2->Z[i];
     quaternion_inverse(w, B2->V[i]);
     quaternion_mult(xw, x, w);
-    outer_prod(C2, xw, xw, d, d);
-    mult(C2[0], C2[0], B2->Z[i], d*d);
-
-    // C += C1 + C2
-    matrix_add(C, C, C1, d, d);
-    matrix_add(C, C, C2, d, d);
+    for (j = 0; j < d; j++)
+      for (k = j; k < d; k++)
+	C[j][k] += z1*v1[j]*v1[k] + z2*xw[j]*xw[k];
   }
+  for (j = 0; j < d; j++)
+    for (k = 0; k < j; k++)
+      C[j][k] = C[k][j];
 
   // compute eigenvalues of C
   double z[d];
-  double **V = C1;  // save an alloc
-  eigen_symm(z, V, C, d);
+  eigen_symm_inplace(z, V, C, d);
   double z2[d-1];
   // set the smallest z[i] (in magnitude) to zero
   for (i = 0; i < d-1; i++)
@@ -1010,10 +1411,6 @@ double bingham_compose_true_pdf(double *x, bingham_t *B1, bingham_t *B2)
   double p = exp(z[0]) * bingham_F_lookup_3d(z2) / (B1->F * B2->F);
   //double p = exp(z[0]) * bingham_F_3d(z2[0], z2[1], z2[2]) / (B1->F * B2->F);
 
-  free_matrix2(C);
-  free_matrix2(C1);
-  free_matrix2(C2);
-
   return p;
 }
 
@@ -1043,6 +1440,42 @@ double bingham_compose_error(bingham_t *B1, bingham_t *B2)
   for (i = 0; i < T->n; i++)
     d_KL += pmf_true[i] * log(pmf_true[i] / pmf_approx[i]);
 
+  bingham_free(&B_mom);
+
+  return d_KL;
+}
+
+
+/*
+ * Estimate the KL divergence between the true and approximate composed distribution (B1 o B2)
+ * by Monte Carlo, using nsamples samples q1*q2 from the true composed distribution, rather than
+ * a full S^3 tessellation.
+ */
+double bingham_compose_error_sampled(bingham_t *B1, bingham_t *B2, int nsamples)
+{
+  bingham_t B_mom;
+  bingham_alloc(&B_mom, 4);
+  bingham_compose_array(&B_mom, B1, B2, 1);
+
+  double **X1 = new_matrix2(nsamples, 4);
+  double **X2 = new_matrix2(nsamples, 4);
+  bingham_sample(X1, B1, nsamples);
+  bingham_sample(X2, B2, nsamples);
+
+  int i;
+  double d_KL = 0;
+  for (i = 0; i < nsamples; i++) {
+    double x[4];
+    quaternion_mult(x, X1[i], X2[i]);
+    double r = bingham_pdf(x, &B_mom) / bingham_compose_true_pdf(x, B1, B2);
+    d_KL += r - 1 - log(r);  // E[r] = 1, so this has the same mean as -log(r), but is always >= 0
+  }
+  d_KL /= (double)nsamples;
+
+  free_matrix2(X1);
+  free_matrix2(X2);
+  bingham_free(&B_mom);
+
   return d_KL;
 }
 
@@ -1052,16 +1485,42 @@ double bingham_compose_error(bingham_t *B1, bingham_t *B2)
  */
 void bingham_fit(bingham_t *B, double **X, int n, int d)
 {
-  double **Xt = new_matrix2(d, n);
-  transpose(Xt, X, n, d);
+  TRACE_BEGIN("bingham_fit");
+
   double **S = new_matrix2(d, d);
-  matrix_mult(S, Xt, X, d, n, d);
+  matrix_scatter(S, X, NULL, n, d);
   mult(S[0], S[0], 1/(double)n, d*d);
 
   bingham_fit_scatter(B, S, d);
 
   free_matrix2(S);
-  free_matrix2(Xt);
+
+  TRACE_END();
+}
+
+
+/*
+ * Fit a bingham to the scatter matrix (X'*X) of a set of samples
+ * (allocating B in an arena, or on the heap if A is NULL).
+ */
+static void bingham_fit_scatter_internal(bingham_t *B, double **S, int d, bingham_arena_t *A)
+{
+  TRACE_BEGIN("bingham_fit_scatter");
+
+  // use PCA to get B->V
+  double eigenvals[d];
+  double **V = bingham_new_matrix2(d, d, A);
+  eigen_symm(eigenvals, V, S, d);
+
+  B->d = d;
+  B->V = V;
+  B->Z = (double *)bingham_calloc(d-1, sizeof(double), A);
+
+  bingham_MLE_NN(B, S);
+
+  B->stats = NULL;
+
+  TRACE_END();
 }
 
 
@@ -1080,44 +1539,58 @@ void bingham_fit_scatter(bingham_t *B, double **S, int d)
   }
   */
 
-  // use PCA to get B->V
-  double *eigenvals;
-  safe_malloc(eigenvals, d, double);
-  double **V = new_matrix2(d, d);
-  eigen_symm(eigenvals, V, S, d);
-
-  //printf("eigenvals = [%f %f %f %f]\n", eigenvals[0], eigenvals[1], eigenvals[2], eigenvals[3]);
-  //printf("V = [%f %f %f %f ; %f %f %f %f ; %f %f %f %f ; %f %f %f %f]\n",
-  //	 V[0][0], V[0][1], V[0][2], V[0][3],
-  //	 V[1][0], V[1][1], V[1][2], V[1][3],
-  //	 V[2][0], V[2][1], V[2][2], V[2][3],
-  //	 V[3][0], V[3][1], V[3][2], V[3][3]);
-
-  B->d = d;
-  B->V = V;
-  safe_calloc(B->Z, d-1, double);
-
-  // init B->Z
-  //int i;
-  //for (i = 0; i < d-1; i++)
-  //  B->Z[i] = -1;
-
   //double t0, t1, L;
   //t0 = get_time_ms();
-  bingham_MLE_NN(B, S);
+  bingham_fit_scatter_internal(B, S, d, NULL);
   //t1 = get_time_ms();
   //L = bingham_L(B, X, n);
   //printf("Computed MLE (NN) in %.2f ms:  Z = (%f, %f, %f)  --> L = %f\n", t1-t0, B->Z[0], B->Z[1], B->Z[2], L);
+}
 
-  //t0 = get_time_ms();
-  //bingham_MLE_grad_desc(B, X, n);
-  //t1 = get_time_ms();
-  //L = bingham_L(B, X, n);
-  //printf("Computed MLE (grad) in %.2f ms:  Z = (%f, %f, %f) --> L = %f\n", t1-t0, B->Z[0], B->Z[1], B->Z[2], L);
 
-  free(eigenvals);
+/*
+ * Fit a bingham to the scatter matrix (X'*X) of a set of samples, allocating B in an arena.
+ */
+void bingham_fit_scatter_arena(bingham_t *B, double **S, int d, bingham_arena_t *A)
+{
+  bingham_fit_scatter_internal(B, S, d, A);
+}
 
-  B->stats = NULL;
+
+typedef struct {
+  bingham_pmf_t *pmf;
+  bingham_t *B;
+} bingham_pmf_mass_data_t;
+
+
+static void bingham_pmf_mass(int i0, int i1, void *total, void *ptr)
+{
+  bingham_pmf_mass_data_t *data = (bingham_pmf_mass_data_t *)ptr;
+  hypersphere_tessellation_t *T = data->pmf->tessellation;
+  double *mass = data->pmf->mass;
+  int i;
+  for (i = i0; i < i1; i++)
+    mass[i] = T->volumes[i] * bingham_pdf(T->centroids[i], data->B);
+  *(double *)total += sum(mass + i0, i1 - i0);
+}
+
+
+static void bingham_pmf_mass_combine(void *total, const void *partial, void *ptr)
+{
+  *(double *)total += *(const double *)partial;
+}
+
+
+/*
+ * Compute the (normalized) probability mass of each cell in a pmf's tessellation.
+ */
+static void bingham_pmf_compute_mass(bingham_pmf_t *pmf, bingham_t *B)
+{
+  safe_malloc(pmf->mass, pmf->n, double);
+  bingham_pmf_mass_data_t data = {pmf, B};
+  double total = 0;
+  parallel_reduce(pmf->n, bingham_pmf_mass, bingham_pmf_mass_combine, &total, sizeof(double), &data);
+  mult(pmf->mass, pmf->mass, 1/total, pmf->n);
 }
 
 
@@ -1126,57 +1599,110 @@ void bingham_fit_scatter(bingham_t *B, double **S, int d)
  */
 void bingham_discretize(bingham_pmf_t *pmf, bingham_t *B, int ncells)
 {
-  int i, d = B->d;
+  int d = B->d;
 
   pmf->d = d;
   pmf->resolution = 1/(double)ncells;
+  pmf->free_tessellation = 0;
 
   if (d == 4) {
+    TRACE_BEGIN("bingham_discretize");
 
     // mesh
+    TRACE_BEGIN("tessellate_S3");
     pmf->tessellation = tessellate_S3(ncells);
     pmf->n = pmf->tessellation->n;
-
-    double t0 = get_time_ms();  //dbug
+    TRACE_END();
 
     // probability mass
-    safe_malloc(pmf->mass, pmf->n, double);
-    double tot_mass = 0;
-    //double tot_volume = 0;
-    for (i = 0; i < pmf->n; i++) {
-      pmf->mass[i] = pmf->tessellation->volumes[i] * bingham_pdf(pmf->tessellation->centroids[i], B);
-      tot_mass += pmf->mass[i];
-      //tot_volume += pmf->tessellation->volumes[i];
-    }
+    TRACE_BEGIN("bingham_pmf_compute_mass");
+    bingham_pmf_compute_mass(pmf, B);
+    TRACE_END();
+
+    TRACE_END();
+  }
+  else {
+    fprintf(stderr, "Warning: bingham_discretize() doesn't know how to discretize distributions in %d dimensions.\n", d);
+    return;
+  }
+}
+
+
+/*
+ * Function pointer to bingham_pdf (for tessellate_S3_mres()).
+ */
+static double bingham_pdf_callback(double *x, void *B)
+{
+  return bingham_pdf(x, (bingham_t *)B);
+}
 
-    //printf("tot_mass = %f, tot_volume = %f\n", tot_mass, tot_volume); //dbug
 
-    mult(pmf->mass, pmf->mass, 1/tot_mass, pmf->n);
+/*
+ * Discretize a Bingham distribution into a multi-resolution grid, where only the cells whose
+ * probability mass is greater than max_mass, or whose mass variation, volume*(max(pdf) - min(pdf)),
+ * is greater than max_variation, are subdivided (see tessellate_S3_mres()).  The pmf owns its
+ * tessellation; free it with bingham_pmf_free().
+ */
+void bingham_discretize_mres(bingham_pmf_t *pmf, bingham_t *B, double max_mass, double max_variation)
+{
+  int d = B->d;
 
-    fprintf(stderr, "Computed probabilities in %.0f ms\n", get_time_ms() - t0);  //dbug
+  memset(pmf, 0, sizeof(bingham_pmf_t));  // so bingham_pmf_free() is safe even if we fail
+  pmf->d = d;
+  pmf->resolution = max_variation;
 
+  if (d == 4) {
+    TRACE_BEGIN("bingham_discretize_mres");
+    pmf->tessellation = tessellate_S3_mres(bingham_pdf_callback, (void *)B, max_mass, max_variation, MRES_MAX_LEVEL);
+    pmf->free_tessellation = 1;
+    pmf->n = pmf->tessellation->n;
+    bingham_pmf_compute_mass(pmf, B);
+    TRACE_COUNT("bingham_discretize_mres.cells", pmf->n);
+    TRACE_END();
   }
   else {
-    fprintf(stderr, "Warning: bingham_discretize() doesn't know how to discretize distributions in %d dimensions.\n", d);
+    fprintf(stderr, "Warning: bingham_discretize_mres() doesn't know how to discretize distributions in %d dimensions.\n", d);
     return;
   }
 }
 
 
+/*
+ * Free the contents of a pmf.
+ */
+void bingham_pmf_free(bingham_pmf_t *pmf)
+{
+  free(pmf->mass);
+  if (pmf->free_tessellation)
+    hypersphere_tessellation_free(pmf->tessellation);
+  pmf->mass = NULL;
+  pmf->tessellation = NULL;
+}
+
+
 /*
  * Bingham mixture sampler
  */
 void bingham_mixture_sample(double **X, bingham_mix_t *BM, int n)
+{
+  bingham_mixture_sample_rng(X, BM, n, rng_default());
+}
+
+
+/*
+ * Bingham mixture sampler, with a given random number generator.
+ */
+void bingham_mixture_sample_rng(double **X, bingham_mix_t *BM, int n, rng_t *rng)
 {
   int i, j;
 
   if (n == 1) {
-    i = pmfrand(BM->w, BM->n);
-    bingham_sample(X, &BM->B[i], 1);
+    i = rng_pmf(rng, BM->w, BM->n);
+    bingham_sample_rng(X, &BM->B[i], 1, rng);
   }
   else if (n < 100) {
     for (i = 0; i < n; i++)
-      bingham_mixture_sample(&X[i], BM, 1);
+      bingham_mixture_sample_rng(&X[i], BM, 1, rng);
   }
   else {
     // apportion samples to each mixture component
@@ -1192,13 +1718,13 @@ void bingham_mixture_sample(double **X, bingham_mix_t *BM, int n)
 
     if (ntot < n) {  // too few samples
       for (i = ntot; i < n; i++) {
-	j = pmfrand(BM->w, BM->n);
+	j = rng_pmf(rng, BM->w, BM->n);
 	ni[j]++;
       }
     }
     else {
       while (ntot > n) {  // too many samples
-	j = pmfrand(BM->w, BM->n);
+	j = rng_pmf(rng, BM->w, BM->n);
 	if (ni[j] > 0) {
 	  ni[j]--;
 	  ntot--;
@@ -1209,7 +1735,7 @@ void bingham_mixture_sample(double **X, bingham_mix_t *BM, int n)
     // get ni[i] samples from each component, BM->B[i]
     ntot = 0;
     for (i = 0; i < BM->n; i++) {
-      bingham_sample(&X[ntot], &BM->B[i], ni[i]);
+      bingham_sample_rng(&X[ntot], &BM->B[i], ni[i], rng);
       ntot += ni[i];
     }
   }
@@ -1221,10 +1747,18 @@ void bingham_mixture_sample(double **X, bingham_mix_t *BM, int n)
  */
 void bingham_sample_uniform(double **X, int d, int n)
 {
-  int i, j;
+  bingham_sample_uniform_rng(X, d, n, rng_default());
+}
+
+
+/*
+ * Sample n points uniformly from S^{d-1}, with a given random number generator.
+ */
+void bingham_sample_uniform_rng(double **X, int d, int n, rng_t *rng)
+{
+  int i;
   for (i = 0; i < n; i++) {
-    for (j = 0; j < d; j++)
-      X[i][j] = normrand(0,1);
+    rng_normal_batch(rng, X[i], d);
     normalize(X[i], X[i], d);
   }
 }
@@ -1234,12 +1768,23 @@ void bingham_sample_uniform(double **X, int d, int n)
  * Metroplis-Hastings sampler for the Bingham distribution.
  */
 void bingham_sample(double **X, bingham_t *B, int n)
+{
+  bingham_sample_rng(X, B, n, rng_default());
+}
+
+
+/*
+ * Metroplis-Hastings sampler for the Bingham distribution, with a given random number generator.
+ */
+void bingham_sample_rng(double **X, bingham_t *B, int n, rng_t *rng)
 {
   if (bingham_is_uniform(B)) {
-    bingham_sample_uniform(X, B->d, n);
+    bingham_sample_uniform_rng(X, B->d, n, rng);
     return;
   }
 
+  TRACE_BEGIN("bingham_sample");
+
   bingham_stats(B);
 
   int burn_in = 10;
@@ -1268,7 +1813,7 @@ void bingham_sample(double **X, bingham_t *B, int n)
 
   int num_accepts = 0;
   for (i = 0; i < n*sample_rate + burn_in; i++) {
-    acgrand_pcs(x2, pcs, V, d);
+    acgrand_pcs_rng(x2, pcs, V, d, rng);
     //double x2_norm = norm(x2, d);
 
     //if (x2_norm > .9 && x2_norm < 1.1) {
@@ -1278,7 +1823,7 @@ void bingham_sample(double **X, bingham_t *B, int n)
       double a1 = t2 / t;
       double a2 = p / p2;
       double a = a1*a2;
-      if (a > frand()) {
+      if (a > rng_uniform(rng)) {
 	memcpy(x, x2, d*sizeof(double));
 	p = p2;
 	t = t2;
@@ -1292,8 +1837,11 @@ void bingham_sample(double **X, bingham_t *B, int n)
   }
 
   //printf("accept_rate = %f\n", num_accepts / (double)(n*sample_rate + burn_in));
+  TRACE_COUNT("bingham_sample.samples", n);
 
   free_matrix2(V);
+
+  TRACE_END();
 }
 
 
@@ -1301,6 +1849,15 @@ void bingham_sample(double **X, bingham_t *B, int n)
  * Simulate samples from a discrete Bingham distribution.
  */
 void bingham_sample_pmf(double **X, bingham_pmf_t *pmf, int n)
+{
+  bingham_sample_pmf_rng(X, pmf, n, rng_default());
+}
+
+
+/*
+ * Simulate samples from a discrete Bingham distribution, with a given random number generator.
+ */
+void bingham_sample_pmf_rng(double **X, bingham_pmf_t *pmf, int n, rng_t *rng)
 {
   int i;
 
@@ -1314,7 +1871,7 @@ void bingham_sample_pmf(double **X, bingham_pmf_t *pmf, int n)
 
   // sample from the inverse CDF
   for (i = 0; i < n; i++) {
-    double u = frand();
+    double u = rng_uniform(rng);
     int cell = binary_search(u, cdf, pmf->n);
 
     if (pmf->d == 4) {
@@ -1330,7 +1887,7 @@ void bingham_sample_pmf(double **X, bingham_pmf_t *pmf, int n)
       //avg(x2, v2, v3, 4);
       //avg(X[i], x1, x2, 4);
 
-      sample_simplex(X[i], S, pmf->d, pmf->d);
+      sample_simplex_rng(X[i], S, pmf->d, pmf->d, rng);
     }
     else {
       fprintf(stderr, "Warning: bingham_discretize() doesn't know how to discretize distributions in %d dimensions.\n", pmf->d);
@@ -1562,76 +2119,107 @@ void bingham_mixture_sample_ridge(double **X, bingham_mix_t *BM, int n, double p
  */
 int bingham_fit_mlesac(bingham_t *B, int *outliers, double **X, int n, int d)
 {
-  //fprintf(stderr, "bingham_fit_mlesac()\n");
+  return bingham_fit_mlesac_rng(B, outliers, X, n, d, rng_default());
+}
 
-  int i, j, r[d], iter = 100;
-  double p0 = 1 / surface_area_sphere(d-1);
-  double logp0 = log(p0);
-  double pmax = 0;
-  int first = 1;
 
-  //fprintf(stderr, "p0 = %f, logp0 = %f\n", p0, logp0);
+typedef struct {
+  double **X;
+  int n;
+  int d;
+  int **R;          // the d random points of each hypothesis
+  bingham_t *B;     // the Bingham fit to each hypothesis
+  double *logp;     // data log likelihood of each hypothesis
+  double p0;        // uniform (outlier) density
+  int *L;           // inlier labels
+} bingham_mlesac_data_t;
 
-  double **Xi = new_matrix2(d, d);
 
-  bingham_t Bi;
+static void bingham_mlesac_hypotheses(int i0, int i1, void *ptr)
+{
+  bingham_mlesac_data_t *data = (bingham_mlesac_data_t *)ptr;
+  int i, j, n = data->n, d = data->d;
+  double p0 = data->p0, logp0 = log(p0);
+  double **X = data->X;
+  double **Xi = new_matrix2(d, d);
 
-  for (i = 0; i < iter; i++) {
+  for (i = i0; i < i1; i++) {
 
-    // pick d points at random from X (no replacement)
-    randperm(r, n, d);
     for (j = 0; j < d; j++)
-      memcpy(Xi[j], X[r[j]], d*sizeof(double));
+      memcpy(Xi[j], X[data->R[i][j]], d*sizeof(double));
+
+    // fit a Bingham to the d points
+    bingham_t *Bi = &data->B[i];
+    bingham_fit(Bi, Xi, d, d);
+
+    // compute data log likelihood
+    double logp = 0;
+    for (j = 0; j < n; j++) {
+      double p = bingham_pdf(X[j], Bi);
+      if (p > p0)
+	logp += log(p);
+      else
+	logp += logp0;
+    }
+    data->logp[i] = logp;
+  }
+
+  free_matrix2(Xi);
+}
 
-    //fprintf(stderr, "r = [%d %d %d %d]\n", r[0], r[1], r[2], r[3]);
 
-    // fit a Bingham to the d points
-    bingham_fit(&Bi, Xi, d, d);
+static void bingham_mlesac_inliers(int i0, int i1, void *ptr)
+{
+  bingham_mlesac_data_t *data = (bingham_mlesac_data_t *)ptr;
+  int i;
+  for (i = i0; i < i1; i++)
+    data->L[i] = (bingham_pdf(data->X[i], data->B) > data->p0);
+}
+
 
-    // compute data log likelihood
-    double logp = 0;
-    for (j = 0; j < n; j++) {
-      double p = bingham_pdf(X[j], &Bi);
-      if (p > p0) {
-	logp += log(p);
-	//fprintf(stderr, "+");
-	//fflush(stderr);
-      }
-      else {
-	logp += logp0;
-	//fprintf(stderr, ".");
-	//fflush(stderr);
-      }
-    }
-    //fprintf(stderr, "\n");
+/*
+ * Fits a Bingham distribution to the rows of X with MLESAC, with a given random number generator.
+ * The hypotheses are drawn up front, and then fit and scored in parallel.
+ */
+int bingham_fit_mlesac_rng(bingham_t *B, int *outliers, double **X, int n, int d, rng_t *rng)
+{
+  TRACE_BEGIN("bingham_fit_mlesac");
+  //fprintf(stderr, "bingham_fit_mlesac()\n");
 
-    //fprintf(stderr, "logp = %f\n", logp);
+  int i, j, iter = 100;
+  double p0 = 1 / surface_area_sphere(d-1);
+  double pmax = 0;
+  int best = 0;
 
-    if (first || (logp > pmax)) {
+  // pick d points at random from X (no replacement) for each hypothesis
+  int **R = new_matrix2i(iter, d);
+  for (i = 0; i < iter; i++)
+    rng_randperm(rng, R[i], n, d);
 
-      //fprintf(stderr, " *** new best, logp = %f ***\n", logp);
+  bingham_t *Bh;
+  double logp[iter];
+  safe_calloc(Bh, iter, bingham_t);
+  bingham_mlesac_data_t data = {X, n, d, R, Bh, logp, p0, NULL};
+  parallel_for_grain(iter, 1, bingham_mlesac_hypotheses, &data);
 
-      pmax = logp;
-      if (first)
-	first = 0;
-      else
-	bingham_free(B);
-      memcpy(B, &Bi, sizeof(bingham_t));  // copy pointers from Bi to B
+  for (i = 0; i < iter; i++) {
+    if (i == 0 || logp[i] > pmax) {
+      pmax = logp[i];
+      best = i;
     }
-    else
-      bingham_free(&Bi);
   }
-  free_matrix2(Xi);
+  memcpy(B, &Bh[best], sizeof(bingham_t));  // copy pointers from Bh[best] to B
+  for (i = 0; i < iter; i++)
+    if (i != best)
+      bingham_free(&Bh[i]);
+  free(Bh);
+  free_matrix2i(R);
 
   // find inliers/outliers
   int L[n];
-  for (i = 0; i < n; i++) {
-    double p = bingham_pdf(X[i], B);
-    if (p > p0)
-      L[i] = 1;
-    else
-      L[i] = 0;
-  }
+  data.B = B;
+  data.L = L;
+  parallel_for(n, bingham_mlesac_inliers, &data);
   int num_inliers = count(L, n);
   int num_outliers = n - num_inliers;
   int inliers[num_inliers];
@@ -1651,12 +2239,14 @@ int bingham_fit_mlesac(bingham_t *B, int *outliers, double **X, int n, int d)
 
   // fit B to all the inliers
   bingham_free(B);
-  Xi = new_matrix2(num_inliers, d);
+  double **Xi = new_matrix2(num_inliers, d);
   for (j = 0; j < num_inliers; j++)
     memcpy(Xi[j], X[inliers[j]], d*sizeof(double));
   bingham_fit(B, Xi, num_inliers, d);
   free_matrix2(Xi);
 
+  TRACE_END();
+
   return num_outliers;
 }
 
@@ -1667,6 +2257,8 @@ int bingham_fit_mlesac(bingham_t *B, int *outliers, double **X, int n, int d)
  */
 void bingham_cluster(bingham_mix_t *BM, double **X, int n, int d)
 {
+  TRACE_BEGIN("bingham_cluster");
+
   const int min_points = 20;  // TODO: make this a parameter
   const int iter = 100;
   int outliers[n];
@@ -1721,13 +2313,13 @@ void bingham_cluster(bingham_mix_t *BM, double **X, int n, int d)
   mult(BM->w, BM->w, 1/sum(BM->w, BM->n), BM->n);
 
   free_matrix2(X_left);
+
+  TRACE_END();
 }
 
 
 /*
  * Multiplies two bingham distributions, B1 and B2.  Assumes B is already allocated.
- *
- * TODO: Make this faster.
  */
 void bingham_mult(bingham_t *B, bingham_t *B1, bingham_t *B2)
 {
@@ -1745,147 +2337,94 @@ void bingham_mult(bingham_t *B, bingham_t *B1, bingham_t *B2)
     return;
   }
 
-  int i, j;
   int d = B1->d;
 
-  B->d = d;
-
-  double **C1 = new_matrix2(d, d);
-  double **C2 = new_matrix2(d, d);
-  double **C = new_matrix2(d, d);
-
-  //double **Z = new_matrix2(d-1, d-1);
-  //double **ZV = new_matrix2(d-1, d);
-  //double **Vt = new_matrix2(d, d-1);
-  
-  double **v;
-  double *vt[d];
-  
-
-  // compute C1
-  for (i = 0; i < d-1; i++) {
-    v = &B1->V[i];
-    for (j = 0; j < d; j++)
-      vt[j] = &v[0][j];
-    matrix_mult(C, vt, v, d, 1, d);
-    mult(C[0], C[0], B1->Z[i], d*d);
-    matrix_add(C1, C1, C, d, d);
-  }
-	
-  // compute C2
-  for (i = 0; i < d-1; i++) {
-    v = &B2->V[i];
-    for (j = 0; j < d; j++)
-      vt[j] = &v[0][j];
-    matrix_mult(C, vt, v, d, 1, d);
-    mult(C[0], C[0], B2->Z[i], d*d);
-    matrix_add(C2, C2, C, d, d);
-  }
-
-
-  //for (i = 0; i < d-1; i++)
-  //  Z[i][i] = B1->Z[i];
-  //transpose(Vt, B1->V, d-1, d);
-  //matrix_mult(ZV, Z, B1->V, d-1, d-1, d);
-  //matrix_mult(C1, Vt, ZV, d, d-1, d);
-
-  //for (i = 0; i < d-1; i++)
-  //  Z[i][i] = B2->Z[i];
-  //transpose(Vt, B2->V, d-1, d);
-  //matrix_mult(ZV, Z, B2->V, d-1, d-1, d);
-  //matrix_mult(C2, Vt, ZV, d, d-1, d);
-
-
-  // compute the principal components of C = C1 + C2
-  matrix_add(C, C1, C2, d, d);
-  double z[d];
-  double **V = C1;  // save an alloc
-  eigen_symm(z, V, C, d);
-  //matrix_copy(B->V, V, d-1, d);
-  for (i = 0; i < d-1; i++)
-    for (j = 0; j < d; j++)
-      B->V[i][j] = V[d-1-i][j];  //V[j][d-1-i];
+  double scratch[bingham_mult_array_scratch_size(d)];
+  bingham_t B_array[2] = {*B1, *B2};
+  bingham_mult_array_scratch(B, B_array, 2, 1, scratch);
+}
 
-  //printf("z = [ %f %f %f %f ]\n\n", z[0], z[1], z[2], z[3]);
-  //printf("V[0] = [%f %f %f %f]\n", V[0][0], V[0][1], V[0][2], V[0][3]);
-  //printf("V[1] = [%f %f %f %f]\n", V[1][0], V[1][1], V[1][2], V[1][3]);
-  //printf("V[2] = [%f %f %f %f]\n", V[2][0], V[2][1], V[2][2], V[2][3]);
-  //printf("V[3] = [%f %f %f %f]\n", V[3][0], V[3][1], V[3][2], V[3][3]);
 
-  // set the smallest z[i] (in magnitude) to zero
-  for (i = 0; i < d-1; i++)
-    B->Z[i] = MAX(z[d-1-i] - z[0], BINGHAM_MIN_CONCENTRATION);
+/*
+ * Multiplies two bingham distributions, B1 and B2, allocating B in an arena.
+ */
+void bingham_mult_arena(bingham_t *B, bingham_t *B1, bingham_t *B2, bingham_arena_t *A)
+{
+  bingham_alloc_internal(B, B1->d, A);
+  bingham_mult(B, B1, B2);
+}
 
-  // lookup F
-  if (d == 4)
-    B->F = bingham_F_lookup_3d(B->Z);
-  else if (d == 3)
-    B->F = bingham_F_2d(B->Z[0], B->Z[1]);
-  else if (d == 2)
-    B->F = bingham_F_1d(B->Z[0]);
-  else {
-    fprintf(stderr, "Error: bingham_mult() only supports 1D, 2D, and 3D binghams.\n");
-    B->F = 0;
-  }
 
-  //free_matrix2(Vt);
-  //free_matrix2(Z);
-  //free_matrix2(ZV);
-  free_matrix2(C1);
-  free_matrix2(C2);
-  free_matrix2(C);
+/*
+ * Returns the number of doubles of scratch space needed by bingham_mult_array_scratch().
+ */
+int bingham_mult_array_scratch_size(int d)
+{
+  return 2*d*d + d;
 }
 
 
 /*
- * Multiplies an array of bingham distributions.  Assumes B is already allocated.
+ * Multiplies an array of bingham distributions without allocating any memory.
+ * Assumes B is already allocated; B may also point to one of the binghams in
+ * B_array (in-place multiplication).  The scratch buffer must hold at least
+ * bingham_mult_array_scratch_size(d) doubles.  B is output-only, so B->stats
+ * is left alone (it may be uninitialized); free any old stats of B first.
  */
-void bingham_mult_array(bingham_t *B, bingham_t *B_array, int n, int compute_F)
+void bingham_mult_array_scratch(bingham_t *B, bingham_t *B_array, int n, int compute_F, double *scratch)
 {
-  int i, j, k;
+  int i, j, k, l;
   int d = B_array[0].d;
-  B->d = d;
 
   // check which binghams in B_array are uniform
-  int not_uniform[n], num_not_uniform=0;
+  int num_not_uniform = 0, last_not_uniform = 0;
   for (i = 0; i < n; i++) {
-    not_uniform[i] = !bingham_is_uniform(&B_array[i]);
-    if (not_uniform[i])
+    if (!bingham_is_uniform(&B_array[i])) {
       num_not_uniform++;
+      last_not_uniform = i;
+    }
   }
   if (num_not_uniform == 0) {
+    B->d = d;
     bingham_set_uniform(B);
     return;
   }
   else if (num_not_uniform == 1) {
-    find(&i, not_uniform, n);
-    bingham_copy(B, &B_array[i]);
+    if (B != &B_array[last_not_uniform])
+      bingham_copy(B, &B_array[last_not_uniform]);
     return;
   }
 
-  double **C = new_matrix2(d, d);   // C = 0
-  double **C2 = new_matrix2(d, d);
-
-  double **v;
-  double *vt[d];
+  double *C[d], *V[d];
+  for (i = 0; i < d; i++) {
+    C[i] = scratch + d*i;
+    V[i] = scratch + d*(d+i);
+  }
+  double *z = scratch + 2*d*d;
 
-  // compute C
+  // compute C = sum{Z[j]*V[j]'*V[j]} with symmetric rank-1 updates on the upper triangle
+  for (k = 0; k < d; k++)
+    for (l = k; l < d; l++)
+      C[k][l] = 0;
   for (i = 0; i < n; i++) {
     for (j = 0; j < d-1; j++) {
-      v = &B_array[i].V[j];
-      for (k = 0; k < d; k++)
-        vt[k] = &v[0][k];
-      matrix_mult(C2, vt, v, d, 1, d);
-      mult(C2[0], C2[0], B_array[i].Z[j], d*d);
-      matrix_add(C, C, C2, d, d);
+      double *v = B_array[i].V[j];
+      double zj = B_array[i].Z[j];
+      for (k = 0; k < d; k++) {
+	double zv = zj*v[k];
+	for (l = k; l < d; l++)
+	  C[k][l] += zv*v[l];
+      }
     }
   }
+  for (k = 0; k < d; k++)
+    for (l = 0; l < k; l++)
+      C[k][l] = C[l][k];
 
   // compute the principal components of C
-  double z[d];
-  double **V = C2;  // save an alloc
-  eigen_symm(z, V, C, d);
-  //matrix_copy(B->V, V, d-1, d);
+  eigen_symm_inplace(z, V, C, d);
+
+  B->d = d;
   for (i = 0; i < d-1; i++)
     for (j = 0; j < d; j++)
       B->V[i][j] = V[d-1-i][j];  //V[j][d-1-i];
@@ -1907,29 +2446,59 @@ void bingham_mult_array(bingham_t *B, bingham_t *B_array, int n, int compute_F)
       B->F = 0;
     }
   }
+}
 
-  free_matrix2(C);
-  free_matrix2(C2);
+
+/*
+ * Like bingham_mult_array_scratch(), for a B that was allocated in an arena:  B's old
+ * (arena) stats are unlinked, since they no longer match B.
+ */
+void bingham_mult_array_scratch_arena(bingham_t *B, bingham_t *B_array, int n, int compute_F, double *scratch,
+				      bingham_arena_t *A)
+{
+  bingham_clear_stats(B, A);
+  bingham_mult_array_scratch(B, B_array, n, compute_F, scratch);
+}
+
+
+/*
+ * Multiplies an array of bingham distributions.  Assumes B is already allocated;
+ * B may also point to one of the binghams in B_array.
+ */
+void bingham_mult_array(bingham_t *B, bingham_t *B_array, int n, int compute_F)
+{
+  double scratch[bingham_mult_array_scratch_size(B_array[0].d)];
+  bingham_mult_array_scratch(B, B_array, n, compute_F, scratch);
 }
 
 
 
 /*
- * Add two bingham mixtures (dst += src)
+ * Add two bingham mixtures (dst += src), allocating the result in an arena (or on the heap if A is NULL).
  */
-void bingham_mixture_add(bingham_mix_t *dst, bingham_mix_t *src)
+static void bingham_mixture_add_internal(bingham_mix_t *dst, bingham_mix_t *src, bingham_arena_t *A)
 {
   int n = dst->n;
 
   // make space for src
-  safe_realloc(dst->w, dst->n + src->n, double);
-  safe_realloc(dst->B, dst->n + src->n, bingham_t);
+  if (A) {
+    double *w = (double *)bingham_arena_alloc(A, (dst->n + src->n)*sizeof(double));
+    bingham_t *B = (bingham_t *)bingham_arena_alloc(A, (dst->n + src->n)*sizeof(bingham_t));
+    memcpy(w, dst->w, n*sizeof(double));
+    memcpy(B, dst->B, n*sizeof(bingham_t));
+    dst->w = w;
+    dst->B = B;
+  }
+  else {
+    safe_realloc(dst->w, dst->n + src->n, double);
+    safe_realloc(dst->B, dst->n + src->n, bingham_t);
+  }
   dst->n += src->n;
 
   int i;
   for (i = 0; i < src->n; i++) {
     dst->w[n+i] = src->w[i];
-    bingham_alloc(&dst->B[n+i], src->B[i].d);
+    bingham_alloc_internal(&dst->B[n+i], src->B[i].d, A);
     bingham_copy(&dst->B[n+i], &src->B[i]);
   }
 
@@ -1943,24 +2512,61 @@ void bingham_mixture_add(bingham_mix_t *dst, bingham_mix_t *src)
 
 
 /*
- * Copy the contents of one bingham mixture into another.
- *
- * Note: allocates new space in 'dst' blindly.
+ * Add two bingham mixtures (dst += src)
  */
-void bingham_mixture_copy(bingham_mix_t *dst, bingham_mix_t *src)
+void bingham_mixture_add(bingham_mix_t *dst, bingham_mix_t *src)
+{
+  bingham_mixture_add_internal(dst, src, NULL);
+}
+
+
+/*
+ * Add two bingham mixtures (dst += src) in an arena.  The old contents of dst are left in place
+ * (i.e. dst->w and dst->B are re-pointed into A), so dst should not own any heap memory.
+ */
+void bingham_mixture_add_arena(bingham_mix_t *dst, bingham_mix_t *src, bingham_arena_t *A)
+{
+  bingham_mixture_add_internal(dst, src, A);
+}
+
+
+/*
+ * Copy the contents of one bingham mixture into another (in an arena, or on the heap if A is NULL).
+ */
+static void bingham_mixture_copy_internal(bingham_mix_t *dst, bingham_mix_t *src, bingham_arena_t *A)
 {
   int i, n = src->n;
   dst->n = n;
-  safe_malloc(dst->w, n, double);
-  safe_malloc(dst->B, n, bingham_t);
+  dst->w = (double *)bingham_calloc(n, sizeof(double), A);
+  dst->B = (bingham_t *)bingham_calloc(n, sizeof(bingham_t), A);
   for (i = 0; i < n; i++) {
     dst->w[i] = src->w[i];
-    bingham_alloc(&dst->B[i], src->B[i].d);
+    bingham_alloc_internal(&dst->B[i], src->B[i].d, A);
     bingham_copy(&dst->B[i], &src->B[i]);
   }
 }
 
 
+/*
+ * Copy the contents of one bingham mixture into another.
+ *
+ * Note: allocates new space in 'dst' blindly.
+ */
+void bingham_mixture_copy(bingham_mix_t *dst, bingham_mix_t *src)
+{
+  bingham_mixture_copy_internal(dst, src, NULL);
+}
+
+
+/*
+ * Copy the contents of one bingham mixture into another, allocating 'dst' in an arena.
+ */
+void bingham_mixture_copy_arena(bingham_mix_t *dst, bingham_mix_t *src, bingham_arena_t *A)
+{
+  bingham_mixture_copy_internal(dst, src, A);
+}
+
+
 /*
  * Free the contents of a bingham mixture.
  */
@@ -1973,10 +2579,11 @@ void bingham_mixture_free(bingham_mix_t *BM)
   free(BM->B);
 }
 
+
 /*
- * Multiply two bingham mixtures, BM = BM1 * BM2.
+ * Multiply two bingham mixtures, BM = BM1 * BM2 (in an arena, or on the heap if A is NULL).
  */
-void bingham_mixture_mult(bingham_mix_t *BM, bingham_mix_t *BM1, bingham_mix_t *BM2)
+static void bingham_mixture_mult_internal(bingham_mix_t *BM, bingham_mix_t *BM1, bingham_mix_t *BM2, bingham_arena_t *A)
 {
   int n1 = BM1->n;
   int n2 = BM2->n;
@@ -1984,14 +2591,14 @@ void bingham_mixture_mult(bingham_mix_t *BM, bingham_mix_t *BM1, bingham_mix_t *
   int i, j;
 
   BM->n = n1*n2;
-  safe_calloc(BM->w, BM->n, double);
-  safe_calloc(BM->B, BM->n, bingham_t);
+  BM->w = (double *)bingham_calloc(BM->n, sizeof(double), A);
+  BM->B = (bingham_t *)bingham_calloc(BM->n, sizeof(bingham_t), A);
 
   // multiply bingham mixtures
   int n = 0;
   for (i = 0; i < n1; i++) {
     for (j = 0; j < n2; j++) {
-      bingham_alloc(&BM->B[n], d);
+      bingham_alloc_internal(&BM->B[n], d, A);
       bingham_mult(&BM->B[n], &BM1->B[i], &BM2->B[j]);
       BM->w[n] = BM1->w[i] * BM2->w[j];
       n++;
@@ -2016,6 +2623,28 @@ void bingham_mixture_mult(bingham_mix_t *BM, bingham_mix_t *BM1, bingham_mix_t *
 }
 
 
+/*
+ * Multiply two bingham mixtures, BM = BM1 * BM2.
+ */
+void bingham_mixture_mult(bingham_mix_t *BM, bingham_mix_t *BM1, bingham_mix_t *BM2)
+{
+  TRACE_BEGIN("bingham_mixture_mult");
+  bingham_mixture_mult_internal(BM, BM1, BM2, NULL);
+  TRACE_END();
+}
+
+
+/*
+ * Multiply two bingham mixtures, BM = BM1 * BM2, allocating BM in an arena.
+ */
+void bingham_mixture_mult_arena(bingham_mix_t *BM, bingham_mix_t *BM1, bingham_mix_t *BM2, bingham_arena_t *A)
+{
+  TRACE_BEGIN("bingham_mixture_mult");
+  bingham_mixture_mult_internal(BM, BM1, BM2, A);
+  TRACE_END();
+}
+
+
 /*
  * Find the highest peak in a mixture.
  */
@@ -2280,7 +2909,10 @@ void bingham_invert_3d(bingham_t *B_inv, bingham_t *B)
   quaternion_inverse(B_inv->V[2], B->V[2]);
 }
 
-void bingham_mixture_collapse_uniforms(bingham_mix_t *dst, bingham_mix_t *src)
+/*
+ * Pack all the uniform components of a mixture into one (in an arena, or on the heap if A is NULL).
+ */
+static void bingham_mixture_collapse_uniforms_internal(bingham_mix_t *dst, bingham_mix_t *src, bingham_arena_t *A)
 {
   // first check if multiple uniform distributions can be packed into one
   double total_uniform_weight = 0.0;
@@ -2302,15 +2934,15 @@ void bingham_mixture_collapse_uniforms(bingham_mix_t *dst, bingham_mix_t *src)
     
     unsigned int n = src->n - n_uniforms + 1; // only one uniform remains
     dst->n = n;
-    safe_malloc(dst->w, n, double);
-    safe_malloc(dst->B, n, bingham_t);
+    dst->w = (double *)bingham_calloc(n, sizeof(double), A);
+    dst->B = (bingham_t *)bingham_calloc(n, sizeof(bingham_t), A);
 
     unsigned int dst_i = 0;
     for (i = 0; i < src->n; i++) {
       if(!bingham_is_uniform(&src->B[i]))
       {
         dst->w[dst_i] = src->w[i];
-        bingham_alloc(&dst->B[dst_i], src->B[i].d);
+        bingham_alloc_internal(&dst->B[dst_i], src->B[i].d, A);
         bingham_copy(&dst->B[dst_i], &src->B[i]);
         dst_i++;        
       }
@@ -2322,29 +2954,87 @@ void bingham_mixture_collapse_uniforms(bingham_mix_t *dst, bingham_mix_t *src)
       exit(-1);
     }
 
-    bingham_t b_uniform;
-    bingham_new_uniform(&b_uniform, d);
     dst->w[dst_i] = total_uniform_weight;
-    bingham_alloc(&dst->B[dst_i], d);
-    bingham_copy(&dst->B[dst_i], &b_uniform);
-    bingham_free(&b_uniform);
+    bingham_alloc_internal(&dst->B[dst_i], d, A);
+    bingham_set_uniform(&dst->B[dst_i]);
 
     // printf("Collapsed %d uniform binghams.\n", n_uniforms);
   }
   else
   {
-    bingham_mixture_copy(dst, src);
+    bingham_mixture_copy_internal(dst, src, A);
   }
 }
 
-void bingham_mixture_reduce(bingham_mix_t *BM, unsigned int reduced_n_components)
+void bingham_mixture_collapse_uniforms(bingham_mix_t *dst, bingham_mix_t *src)
+{
+  bingham_mixture_collapse_uniforms_internal(dst, src, NULL);
+}
+
+
+typedef struct {
+  bingham_t **B;     // mixture components
+  double *w;         // component weights
+  int *I, *J;        // pairs of components to merge
+  bingham_t **M;     // merged binghams, from bingham_merge_alloc()
+  double *scores;    // merge costs
+} bingham_merge_pairs_data_t;
+
+
+static void bingham_merge_pairs_block(int k0, int k1, void *ptr)
+{
+  bingham_merge_pairs_data_t *data = (bingham_merge_pairs_data_t *)ptr;
+  int k;
+  for (k = k0; k < k1; k++) {
+    bingham_t *B_i = data->B[data->I[k]];
+    bingham_t *B_j = data->B[data->J[k]];
+    double w_i = data->w[data->I[k]];
+    double w_j = data->w[data->J[k]];
+
+    // calc relative merge alpha for bingham_merged = a*B_i + (1-a)*B_j
+    double alpha = (1.0 / (w_i + w_j)) * w_i;
+    bingham_merge_fill(data->M[k], B_i, B_j, alpha);
+
+    double kl_i_ij = bingham_KL_divergence(B_i, data->M[k]);
+    double kl_j_ij = bingham_KL_divergence(B_j, data->M[k]);
+    data->scores[k] = w_i * kl_i_ij + w_j * kl_j_ij;
+  }
+}
+
+
+/*
+ * Merge pairs (I[k],J[k]) of mixture components B (with weights w) into M[k], and compute their
+ * merge costs (in parallel).  All allocation (in an arena, or on the heap if A is NULL) is done up front.
+ */
+static void bingham_merge_pairs(bingham_t **M, double *scores, bingham_t **B, double *w, int *I, int *J, int num_pairs, bingham_arena_t *A)
+{
+  int k;
+  for (k = 0; k < num_pairs; k++) {
+    bingham_stats_internal(B[I[k]], A);
+    bingham_stats_internal(B[J[k]], A);
+    M[k] = bingham_merge_alloc(B[I[k]]->d, A);
+  }
+
+  bingham_merge_pairs_data_t data = {B, w, I, J, M, scores};
+  parallel_for_grain(num_pairs, 4, bingham_merge_pairs_block, &data);
+
+  TRACE_COUNT("bingham_mixture_reduce.merges", num_pairs);
+}
+
+
+/*
+ * Reduce a bingham mixture to reduced_n_components by greedily merging the pair of components
+ * with the smallest (weighted KL) merge cost.  All intermediate and final binghams are allocated
+ * in an arena (or on the heap if A is NULL).
+ */
+static void bingham_mixture_reduce_internal(bingham_mix_t *BM, unsigned int reduced_n_components, bingham_arena_t *A)
 {
   bingham_mix_t BM_collapsed;
-  bingham_mixture_collapse_uniforms(&BM_collapsed, BM);
+  bingham_mixture_collapse_uniforms_internal(&BM_collapsed, BM, A);
 
-  bingham_mixture_free(BM);
-  bingham_mixture_copy(BM, &BM_collapsed);
-  bingham_mixture_free(&BM_collapsed);
+  if (A == NULL)
+    bingham_mixture_free(BM);
+  *BM = BM_collapsed;
 
   if(BM->n <= reduced_n_components)
   {
@@ -2368,7 +3058,7 @@ void bingham_mixture_reduce(bingham_mix_t *BM, unsigned int reduced_n_components
   * holds the computed discrimination score between the mixture before the merge 
   * of components i and j and after the merge of components ij
   **/
-  double **B_ij = new_matrix2(BM->n, BM->n);
+  double **B_ij = bingham_new_matrix2(BM->n, BM->n, A);
   unsigned int i_min = 0;
   unsigned int j_min = 0;
   double b_ij_min_value = DBL_MAX-1.0;
@@ -2388,9 +3078,8 @@ void bingham_mixture_reduce(bingham_mix_t *BM, unsigned int reduced_n_components
   for(i = 0; i < BM->n; ++i)
   {
     // store bingham into idx map
-    bingham_t *b_i;
-    safe_malloc(b_i, 1, bingham_t);
-    bingham_alloc(b_i, 4);
+    bingham_t *b_i = (bingham_t *)bingham_calloc(1, sizeof(bingham_t), A);
+    bingham_alloc_internal(b_i, 4, A);
     bingham_copy(b_i, &BM->B[i]);
     idx2bingham_map[i] = b_i;
     idx2weight_map[i] = BM->w[i];
@@ -2398,67 +3087,58 @@ void bingham_mixture_reduce(bingham_mix_t *BM, unsigned int reduced_n_components
     //printf("Weight: %f\n", idx2weight_map[i]);
   }
 
+  // merge all pairs of components (in parallel)
+  int k = 0, num_pairs = BM->n * (BM->n - 1) / 2;
+  int *pair_i, *pair_j;  // on the heap, since there are O(n^2) pairs
+  bingham_t **pair_merged;
+  double *pair_score;
+  safe_malloc(pair_i, num_pairs+1, int);
+  safe_malloc(pair_j, num_pairs+1, int);
+  safe_malloc(pair_merged, num_pairs+1, bingham_t *);
+  safe_malloc(pair_score, num_pairs+1, double);
   for(i = 0; i < BM->n; ++i)
   {
-    // calc and store merged bingham and merge score
-    for(j = i; j < BM->n; ++j)
+    B_ij[i][i] = DBL_MAX;
+    merged_ij[i][i] = NULL;
+    for(j = i+1; j < BM->n; ++j, ++k)
     {
-      if(i == j)
-      {
-        B_ij[i][j] = DBL_MAX;
-        B_ij[j][i] = DBL_MAX;
-        merged_ij[i][j] = NULL;
-        merged_ij[j][i] = NULL; 
-      }
-      else
-      {
-        double w_i = idx2weight_map[i];
-        double w_j = idx2weight_map[j];
-
-        // calc relative merge alpha for bingham_merged = a*B_i + (1-a)*B_j
-        double alpha = (1.0 / (w_i + w_j)) * w_i;
-        
-
-        // calc and store merged bingham
-        bingham_t *m_ij;
-        safe_malloc(m_ij, 1, bingham_t);
-        m_ij->d = 4;
-
-        //printf("alpha %f\n", alpha);
-        //print_bingham(idx2bingham_map[i]);
-        //print_bingham(idx2bingham_map[j]);
-        bingham_merge(m_ij, idx2bingham_map[i], idx2bingham_map[j], alpha);
-        merged_ij[i][j] = m_ij;
-        merged_ij[j][i] = m_ij;
-
-        //printf("Allocated merged_ij[%d][%d]\n", i, j);
-
-        // calc and store merge score
-        double kl_i_ij = bingham_KL_divergence(idx2bingham_map[i], m_ij);
-        double kl_j_ij = bingham_KL_divergence(idx2bingham_map[j], m_ij);
-        double score = w_i * kl_i_ij + w_j * kl_j_ij;
-        B_ij[i][j] = score;
-        B_ij[j][i] = score;
-
-        if(score < b_ij_min_value)
-        {
-          // shift current min to 2nd best min
-          b_ij_2nd_min_value = b_ij_min_value;
-          i_2nd_min = i_min;
-          j_2nd_min = j_min;
-
-          // replace current min
-          b_ij_min_value = score;
-          i_min = i;
-          j_min = j;
-        }
-        else if(score < b_ij_2nd_min_value)
-        {
-          b_ij_2nd_min_value = score;
-          i_2nd_min = i;
-          j_2nd_min = j;
-        }
-      }
+      pair_i[k] = i;
+      pair_j[k] = j;
+    }
+  }
+  bingham_merge_pairs(pair_merged, pair_score, idx2bingham_map, idx2weight_map, pair_i, pair_j, num_pairs, A);
+
+  // calc and store merged bingham and merge score
+  for(k = 0; k < num_pairs; ++k)
+  {
+    i = pair_i[k];
+    j = pair_j[k];
+    merged_ij[i][j] = pair_merged[k];
+    merged_ij[j][i] = pair_merged[k];
+
+    //printf("Allocated merged_ij[%d][%d]\n", i, j);
+
+    double score = pair_score[k];
+    B_ij[i][j] = score;
+    B_ij[j][i] = score;
+
+    if(score < b_ij_min_value)
+    {
+      // shift current min to 2nd best min
+      b_ij_2nd_min_value = b_ij_min_value;
+      i_2nd_min = i_min;
+      j_2nd_min = j_min;
+
+      // replace current min
+      b_ij_min_value = score;
+      i_min = i;
+      j_min = j;
+    }
+    else if(score < b_ij_2nd_min_value)
+    {
+      b_ij_2nd_min_value = score;
+      i_2nd_min = i;
+      j_2nd_min = j;
     }
   }
 
@@ -2475,8 +3155,10 @@ void bingham_mixture_reduce(bingham_mix_t *BM, unsigned int reduced_n_components
     //printf("Merging components %d and %d\n", i_min, j_min);
     //print_matrix(B_ij, BM->n, BM->n);
     bingham_copy(idx2bingham_map[i_min], merged_ij[i_min][j_min]); // copy merged bingham to i_min
-    bingham_free(idx2bingham_map[j_min]);                          // free j_min bingham
-    free(idx2bingham_map[j_min]);
+    bingham_clear_stats(idx2bingham_map[i_min], A);                // (its old stats are stale now)
+    bingham_free_internal(idx2bingham_map[j_min], A);              // free j_min bingham
+    if (A == NULL)
+      free(idx2bingham_map[j_min]);
     idx2bingham_map[j_min] = NULL;
     //printf("Freed idx2bingham_map[%d]\n", j_min);
 
@@ -2491,8 +3173,9 @@ void bingham_mixture_reduce(bingham_mix_t *BM, unsigned int reduced_n_components
     {
       if(merged_ij[i][j_min] != NULL)
       {
-        bingham_free(merged_ij[i][j_min]);
-        free(merged_ij[i][j_min]);
+        bingham_free_internal(merged_ij[i][j_min], A);
+        if (A == NULL)
+          free(merged_ij[i][j_min]);
         merged_ij[i][j_min] = NULL;
         merged_ij[j_min][i] = NULL;
         //printf("Freed merged_ij[%d][%d]\n", i,j_min);
@@ -2508,8 +3191,9 @@ void bingham_mixture_reduce(bingham_mix_t *BM, unsigned int reduced_n_components
     {
       if(merged_ij[i_min][j] != NULL)
       {
-        bingham_free(merged_ij[i_min][j]);
-        free(merged_ij[i_min][j]);
+        bingham_free_internal(merged_ij[i_min][j], A);
+        if (A == NULL)
+          free(merged_ij[i_min][j]);
         merged_ij[i_min][j] = NULL;
         merged_ij[j][i_min] = NULL;
         //printf("Freed merged_ij[%d][%d]\n", i_min,j);
@@ -2569,52 +3253,50 @@ void bingham_mixture_reduce(bingham_mix_t *BM, unsigned int reduced_n_components
     }
 
     // compute new merged binghams and new merged score for remaining components 
-    // with newly accepted merge
+    // with newly accepted merge (in parallel)
+    num_pairs = 0;
     for(j = 0; j < BM->n; ++j)
     {
       if(idx2bingham_map[j] != NULL && j != was_i_min) // component exists
       {
-        double w_i = idx2weight_map[was_i_min];
-        double w_j = idx2weight_map[j];
-
-        // calc relative merge alpha for bingham_merged = a*B_i + (1-a)*B_j
-        double alpha = (1.0 / (w_i + w_j)) * w_i;
-
-        // calc and store merged bingham
-        bingham_t *m_ij;
-        safe_malloc(m_ij, 1, bingham_t);
-        m_ij->d = 4;
-        bingham_merge(m_ij, idx2bingham_map[was_i_min], idx2bingham_map[j], alpha);
-        merged_ij[was_i_min][j] = m_ij;
-        merged_ij[j][was_i_min] = m_ij;
-
-        //printf("Allocated merged_ij[%d][%d]\n", was_i_min,j);
-
-        // calc and store merge score
-        double kl_i_ij = bingham_KL_divergence(idx2bingham_map[was_i_min], m_ij);
-        double kl_j_ij = bingham_KL_divergence(idx2bingham_map[j], m_ij);
-        double score = w_i * kl_i_ij + w_j * kl_j_ij;
-        B_ij[was_i_min][j] = score;
-        B_ij[j][was_i_min] = score;
-
-        if(score < b_ij_min_value)
-        {
-          // shift current min to 2nd best min
-          b_ij_2nd_min_value = b_ij_min_value;
-          i_2nd_min = i_min;
-          j_2nd_min = j_min;
-
-          // replace current min
-          b_ij_min_value = score;
-          i_min = was_i_min;
-          j_min = j;
-        }
-        else if(score < b_ij_2nd_min_value)
-        {
-          b_ij_2nd_min_value = score;
-          i_2nd_min = was_i_min;
-          j_2nd_min = j;
-        }
+        pair_i[num_pairs] = was_i_min;
+        pair_j[num_pairs] = j;
+        num_pairs++;
+      }
+    }
+    bingham_merge_pairs(pair_merged, pair_score, idx2bingham_map, idx2weight_map, pair_i, pair_j, num_pairs, A);
+
+    for(k = 0; k < num_pairs; ++k)
+    {
+      j = pair_j[k];
+      bingham_t *m_ij = pair_merged[k];
+      merged_ij[was_i_min][j] = m_ij;
+      merged_ij[j][was_i_min] = m_ij;
+
+      //printf("Allocated merged_ij[%d][%d]\n", was_i_min,j);
+
+      // calc and store merge score
+      double score = pair_score[k];
+      B_ij[was_i_min][j] = score;
+      B_ij[j][was_i_min] = score;
+
+      if(score < b_ij_min_value)
+      {
+        // shift current min to 2nd best min
+        b_ij_2nd_min_value = b_ij_min_value;
+        i_2nd_min = i_min;
+        j_2nd_min = j_min;
+
+        // replace current min
+        b_ij_min_value = score;
+        i_min = was_i_min;
+        j_min = j;
+      }
+      else if(score < b_ij_2nd_min_value)
+      {
+        b_ij_2nd_min_value = score;
+        i_2nd_min = was_i_min;
+        j_2nd_min = j;
       }
     }
   }
@@ -2622,11 +3304,12 @@ void bingham_mixture_reduce(bingham_mix_t *BM, unsigned int reduced_n_components
   // #######################################
   // build the final reduced bmm
   unsigned int bm_n = BM->n;
-  bingham_mixture_free(BM);
+  if (A == NULL)
+    bingham_mixture_free(BM);
   BM->n = reduced_n_components;
   //printf("Freed initial BMM\n");
-  safe_malloc(BM->B, reduced_n_components, bingham_t);
-  safe_malloc(BM->w, reduced_n_components, double);
+  BM->B = (bingham_t *)bingham_calloc(reduced_n_components, sizeof(bingham_t), A);
+  BM->w = (double *)bingham_calloc(reduced_n_components, sizeof(double), A);
   //printf("Allocated reduced BMM\n");
 
   unsigned int added_components = 0;
@@ -2634,14 +3317,15 @@ void bingham_mixture_reduce(bingham_mix_t *BM, unsigned int reduced_n_components
   {
     if(idx2bingham_map[i] != NULL)
     {
-      bingham_alloc(&BM->B[added_components], 4);
+      bingham_alloc_internal(&BM->B[added_components], 4, A);
       bingham_copy(&BM->B[added_components], idx2bingham_map[i]);
       BM->w[added_components] = idx2weight_map[i];
       //printf("Copied reduced component %d <-- i==%d\n", added_components+1, i);
 
       // delete used bingham
-      bingham_free(idx2bingham_map[i]);
-      free(idx2bingham_map[i]);
+      bingham_free_internal(idx2bingham_map[i], A);
+      if (A == NULL)
+        free(idx2bingham_map[i]);
       //printf("Freed idx2bingham_map[%d]\n", i);
 
       added_components++;
@@ -2661,8 +3345,9 @@ void bingham_mixture_reduce(bingham_mix_t *BM, unsigned int reduced_n_components
     {
       if(merged_ij[i][j] != NULL)
       {
-        bingham_free(merged_ij[i][j]);
-        free(merged_ij[i][j]);
+        bingham_free_internal(merged_ij[i][j], A);
+        if (A == NULL)
+          free(merged_ij[i][j]);
         merged_ij[i][j] = NULL;
         merged_ij[j][i] = NULL;        
         //printf("Freed merged_ij[%d][%d]\n", i, j);
@@ -2670,9 +3355,40 @@ void bingham_mixture_reduce(bingham_mix_t *BM, unsigned int reduced_n_components
     }
   }
 
-  free_matrix2(B_ij);
+  if (A == NULL)
+    free_matrix2(B_ij);
+  free(pair_i);
+  free(pair_j);
+  free(pair_merged);
+  free(pair_score);
+}
+
+
+/*
+ * Reduce a bingham mixture to reduced_n_components.
+ */
+void bingham_mixture_reduce(bingham_mix_t *BM, unsigned int reduced_n_components)
+{
+  TRACE_BEGIN("bingham_mixture_reduce");
+  TRACE_COUNT("bingham_mixture_reduce.components_in", BM->n);
+  bingham_mixture_reduce_internal(BM, reduced_n_components, NULL);
+  TRACE_END();
+}
+
+
+/*
+ * Reduce a bingham mixture to reduced_n_components, with all the intermediate merges
+ * and the resulting mixture allocated in an arena.  The old contents of BM are not freed.
+ */
+void bingham_mixture_reduce_arena(bingham_mix_t *BM, unsigned int reduced_n_components, bingham_arena_t *A)
+{
+  TRACE_BEGIN("bingham_mixture_reduce");
+  TRACE_COUNT("bingham_mixture_reduce.components_in", BM->n);
+  bingham_mixture_reduce_internal(BM, reduced_n_components, A);
+  TRACE_END();
 }
 
+
 void bingham_new_random(bingham_t *B, int min_z_value)
 {
   double Z[3];
@@ -2804,61 +3520,3 @@ void bingham_mixture_new_random(bingham_mix_t *B, unsigned int n_components, int
   free_matrix2(m1);
   free_matrix2(m2);
   }*/
-
-//------------ DEPRECATED ------------//
-
-
-/*
- * Function pointer to bingham_pdf.
- *
-static double bingham_pdf_callback(double *x, void *B)
-{
-  int d = ((bingham_t *)B)->d;
-  double y[d];
-  mult(y, x, 1/norm(x, d), d);
-
-  return bingham_pdf(y, (bingham_t *)B);
-}
-*/
-
-/*
- * Discretize a Bingham distribution into a multi-resolution grid.
- *
-void bingham_discretize_mres(bingham_pmf_t *pmf, bingham_t *B, double resolution)
-{
-  int i, d = B->d;
-
-  pmf->d = d;
-  pmf->resolution = resolution;
-
-  if (d == 4) {
-
-    // mesh
-    octetramesh_t *oct = hypersphere_tessellation_octetra_mres(bingham_pdf_callback, (void *)B, resolution);
-    pmf->tetramesh = octetramesh_to_tetramesh(oct);
-    octetramesh_free(oct);
-    free(oct);
-
-    // points and volumes
-    int n = pmf->tetramesh->nt;
-    pmf->n = n;
-    pmf->points = new_matrix2(n, d);
-    safe_malloc(pmf->volumes, n, double);
-    tetramesh_centroids(pmf->points, pmf->volumes, pmf->tetramesh);
-
-    // probability mass
-    safe_malloc(pmf->mass, n, double);
-    double tot_mass = 0;
-    for (i = 0; i < n; i++) {
-      pmf->mass[i] = pmf->volumes[i] * exp(bingham_L(B, &pmf->points[i], 1));
-      tot_mass += pmf->mass[i];
-    }
-    //mult(pmf->mass, pmf->mass, 1/tot_mass, n);
-  }
-  else {
-    printf("Warning: bingham_discretize() doesn't know how to discretize distributions in %d dimensions.\n", d);
-    return;
-  }    
-}
-*/
-
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <math.h>
 #include <float.h>
+#include <pthread.h>
 #include "bingham/util.h"
 #include "bingham/bingham_constants.h"
 #include "bingham/bingham_constant_tables.h"
@@ -20,18 +21,13 @@ const double BINGHAM_MIN_CONCENTRATION = -900;
 
 
 
-static kdtree_t *dY_tree_3d = NULL;  // dY = d(logF) = dF/F
+static kdtree_flat_t *dY_tree_3d = NULL;  // dY = d(logF) = dF/F
 static int **dY_indices_3d = NULL;  // map from the indices of dY to indices (i,j,k) of F, dF*, etc.
+static pthread_once_t bingham_constants_once = PTHREAD_ONCE_INIT;
 
 
-/*
- * Initialize the KD-trees for fast constant lookups.
- */
-void bingham_constants_init()
+static void bingham_constants_build()
 {
-  if (dY_tree_3d)  // already initialized
-    return;
-
   double t0 = get_time_ms();
 
   int i, j, k;
@@ -60,7 +56,7 @@ void bingham_constants_init()
   }
 
   // create a KD-tree from the vectors in dY3d
-  dY_tree_3d = kdtree(dY3d, cnt, 3);
+  dY_tree_3d = kdtree_flat(dY3d, cnt, 3, 0);
 
   free_matrix2(dY3d);
 
@@ -68,6 +64,16 @@ void bingham_constants_init()
 }
 
 
+/*
+ * Initialize the KD-trees for fast constant lookups.  Thread-safe (the dY lookups call this
+ * lazily, possibly from several worker threads at once), and only does any work the first time.
+ */
+void bingham_constants_init()
+{
+  pthread_once(&bingham_constants_once, bingham_constants_build);
+}
+
+
 static double bingham_dY_params_3d_slow_eval(double *err, double *Z, double *dY)
 {
   double F = bingham_F_lookup_3d(Z);
@@ -85,10 +91,9 @@ static double bingham_dY_params_3d_slow_eval(double *err, double *Z, double *dY)
 //dbug: improve this later!!!!
 static void bingham_dY_params_3d_slow(double *Z, double *F, double *dY)
 {
-  if (dY_tree_3d == NULL)
-    bingham_constants_init();
+  bingham_constants_init();
 
-  int nn_index = kdtree_NN(dY_tree_3d, dY);
+  int nn_index = kdtree_flat_NN(dY_tree_3d, dY, NULL);
 
   int i = dY_indices_3d[nn_index][0];
   int j = dY_indices_3d[nn_index][1];
@@ -163,7 +168,87 @@ static void bingham_dY_params_3d_slow(double *Z, double *F, double *dY)
 
 
 /*
- * Look up concentration params Z and normalization constant F given dY.
+ * Look up concentration params Z and normalization constant F given dY, using Newton's
+ * method (with a finite-difference Jacobian and a backtracking line search) starting from
+ * the nearest table entry.  Converges in a handful of iterations, vs. tens of iterations
+ * of gradient descent in bingham_dY_params_3d().
+ */
+void bingham_dY_params_3d_fast(double *Z, double *F, double *dY)
+{
+  bingham_constants_init();
+
+  int nn_index = kdtree_flat_NN(dY_tree_3d, dY, NULL);
+
+  int i = dY_indices_3d[nn_index][0];
+  int j = dY_indices_3d[nn_index][1];
+  int k = dY_indices_3d[nn_index][2];
+
+  double r0 = bingham_table_range[i];
+  double r1 = bingham_table_range[j];
+  double r2 = bingham_table_range[k];
+
+  Z[0] = -r0*r0;
+  Z[1] = -r1*r1;
+  Z[2] = -r2*r2;
+
+  double dz = .01;
+  double tolerance = 1e-16;
+  double err[3], err2[3], J[3][3], Z2[3];
+  int iter, max_iter = 20;
+  for (iter = 0; iter < max_iter; iter++) {
+    double g = bingham_dY_params_3d_slow_eval(err, Z, dY);
+    if (g < tolerance)
+      break;
+
+    // finite-difference Jacobian, J[a][b] = d(err[a])/d(Z[b]) (stepping towards -inf, since Z <= 0)
+    int a, b;
+    for (b = 0; b < 3; b++) {
+      Z[b] -= dz;
+      bingham_dY_params_3d_slow_eval(err2, Z, dY);
+      Z[b] += dz;
+      for (a = 0; a < 3; a++)
+	J[a][b] = (err[a] - err2[a])/dz;
+    }
+
+    // solve J*step = err with Cramer's rule
+    double det_J = J[0][0]*(J[1][1]*J[2][2] - J[1][2]*J[2][1])
+      - J[0][1]*(J[1][0]*J[2][2] - J[1][2]*J[2][0])
+      + J[0][2]*(J[1][0]*J[2][1] - J[1][1]*J[2][0]);
+    if (fabs(det_J) < 1e-300)
+      break;
+    double step[3];
+    step[0] = (err[0]*(J[1][1]*J[2][2] - J[1][2]*J[2][1])
+	       - J[0][1]*(err[1]*J[2][2] - J[1][2]*err[2])
+	       + J[0][2]*(err[1]*J[2][1] - J[1][1]*err[2])) / det_J;
+    step[1] = (J[0][0]*(err[1]*J[2][2] - J[1][2]*err[2])
+	       - err[0]*(J[1][0]*J[2][2] - J[1][2]*J[2][0])
+	       + J[0][2]*(J[1][0]*err[2] - err[1]*J[2][0])) / det_J;
+    step[2] = (J[0][0]*(J[1][1]*err[2] - err[1]*J[2][1])
+	       - J[0][1]*(J[1][0]*err[2] - err[1]*J[2][0])
+	       + err[0]*(J[1][0]*J[2][1] - J[1][1]*J[2][0])) / det_J;
+
+    // backtracking line search (keeping Z <= 0)
+    double t = 1;
+    while (t > 1e-3) {
+      for (a = 0; a < 3; a++)
+	Z2[a] = MIN(Z[a] - t*step[a], 0);
+      if (bingham_dY_params_3d_slow_eval(err2, Z2, dY) < g)
+	break;
+      t /= 2;
+    }
+    if (t <= 1e-3)
+      break;
+    for (a = 0; a < 3; a++)
+      Z[a] = Z2[a];
+  }
+
+  *F = bingham_F_lookup_3d(Z);
+}
+
+
+/*
+ * Look up concentration params Z and normalization constant F given dY.  (Callers that want
+ * Newton's method instead of the lookup + local search must call bingham_dY_params_3d_fast().)
  */
 void bingham_dY_params_3d(double *Z, double *F, double *dY)
 {
@@ -174,7 +259,7 @@ void bingham_dY_params_3d(double *Z, double *F, double *dY)
   if (dY_tree_3d == NULL)
     bingham_constants_init();
 
-  int nn_index = kdtree_NN(dY_tree_3d, dY);
+  int nn_index = kdtree_flat_NN(dY_tree_3d, dY, NULL);
 
   int i = dY_indices_3d[nn_index][0];
   int j = dY_indices_3d[nn_index][1];
@@ -285,9 +370,19 @@ double bingham_dF3_table_get(int i, int j, int k)
 }
 
 
+/*
+ * Get the partial derivative of F w.r.t. Z[a] at table indices (i,j,k).  The dF tables are only
+ * stored for sorted indices, so we need the rank of index a in (i,j,k) (ties broken by position).
+ */
 double bingham_dF_table_get(int a, int i, int j, int k)
 {
-  switch (a) {
+  int idx[3] = {i, j, k};
+  int b, rank = 0;
+  for (b = 0; b < 3; b++)
+    if (idx[b] > idx[a] || (idx[b] == idx[a] && b < a))
+      rank++;
+
+  switch (rank) {
   case 0:
     return bingham_dF1_table_get(i, j, k);
   case 1:
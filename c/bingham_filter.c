@@ -0,0 +1,361 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include "bingham.h"
+#include "bingham/util.h"
+#include "bingham/bingham_filter.h"
+
+
+
+
+/*
+ * Log of a bingham pdf.
+ */
+static double bingham_log_pdf(double x[], bingham_t *B)
+{
+  int i, d = B->d;
+  double logf = -log(B->F);
+  for (i = 0; i < d-1; i++) {
+    double dvx = dot(B->V[i], x, d);
+    logf += B->Z[i]*dvx*dvx;
+  }
+
+  return logf;
+}
+
+
+/*
+ * Log of a bingham mixture pdf (computed with the log-sum-exp trick).
+ */
+static double bingham_mixture_log_pdf(double x[], bingham_mix_t *BM)
+{
+  int i, n = BM->n;
+  double logp[n], logp_max = -DBL_MAX;
+  for (i = 0; i < n; i++) {
+    logp[i] = (BM->w[i] > 0 ? log(BM->w[i]) + bingham_log_pdf(x, &BM->B[i]) : -DBL_MAX);
+    logp_max = MAX(logp_max, logp[i]);
+  }
+  if (logp_max == -DBL_MAX)
+    return -DBL_MAX;
+
+  double p = 0;
+  for (i = 0; i < n; i++)
+    p += exp(logp[i] - logp_max);
+
+  return logp_max + log(p);
+}
+
+
+/*
+ * Allocate a mixture with room for n binghams.
+ */
+static void bingham_filter_alloc_mixture(bingham_mix_t *BM, int n, int d)
+{
+  int i;
+  safe_calloc(BM->w, n, double);
+  safe_calloc(BM->B, n, bingham_t);
+  for (i = 0; i < n; i++)
+    bingham_alloc(&BM->B[i], d);
+  BM->n = 0;
+}
+
+
+/*
+ * Free a mixture allocated with bingham_filter_alloc_mixture().
+ */
+static void bingham_filter_free_mixture(bingham_mix_t *BM, int n)
+{
+  BM->n = n;
+  bingham_mixture_free(BM);
+}
+
+
+/*
+ * Overwrite a (heap-allocated) component of the filter's belief, freeing its old stats.
+ */
+static void bingham_filter_set_component(bingham_t *dst, bingham_t *src)
+{
+  bingham_free_stats(dst);
+  bingham_copy(dst, src);
+}
+
+
+/*
+ * Normalize the weights of a mixture.
+ */
+static void bingham_filter_normalize_weights(bingham_mix_t *BM)
+{
+  double wtot = sum(BM->w, BM->n);
+  if (wtot > 0)
+    mult(BM->w, BM->w, 1/wtot, BM->n);
+}
+
+
+/*
+ * Initialize a bingham mixture filter with a prior.  The belief is reduced to at most max_components
+ * components after every update, and measurement likelihoods may have at most max_measurement_components
+ * components.  The particle fallback is disabled by default (see bingham_filter_set_fallback()).
+ */
+void bingham_filter_init(bingham_filter_t *F, bingham_mix_t *prior, int max_components, int max_measurement_components)
+{
+  int i, d = prior->B[0].d;
+
+  memset(F, 0, sizeof(bingham_filter_t));
+
+  F->d = d;
+  F->max_components = max_components;
+  F->max_measurement_components = max_measurement_components;
+  F->capacity = MAX(max_components * max_measurement_components, prior->n);
+
+  bingham_filter_alloc_mixture(&F->belief, F->capacity, d);
+  bingham_filter_alloc_mixture(&F->product, F->capacity, d);
+  safe_calloc(F->scratch, bingham_mult_array_scratch_size(d), double);
+  bingham_arena_init(&F->arena, 0);
+
+  if (prior->n <= max_components) {
+    F->belief.n = prior->n;
+    for (i = 0; i < prior->n; i++) {
+      F->belief.w[i] = prior->w[i];
+      bingham_filter_set_component(&F->belief.B[i], &prior->B[i]);
+    }
+  }
+  else {  // reduce the prior in the arena, then copy it into the belief
+    bingham_mix_t BM;
+    bingham_mixture_copy_arena(&BM, prior, &F->arena);
+    bingham_mixture_reduce_arena(&BM, max_components, &F->arena);
+    F->belief.n = BM.n;
+    for (i = 0; i < BM.n; i++) {
+      F->belief.w[i] = BM.w[i];
+      bingham_filter_set_component(&F->belief.B[i], &BM.B[i]);
+    }
+    bingham_arena_reset(&F->arena);
+  }
+  bingham_filter_normalize_weights(&F->belief);
+}
+
+
+/*
+ * Free a bingham mixture filter.
+ */
+void bingham_filter_free(bingham_filter_t *F)
+{
+  bingham_filter_free_mixture(&F->belief, F->capacity);
+  bingham_filter_free_mixture(&F->product, F->capacity);
+  free(F->scratch);
+  bingham_arena_free(&F->arena);
+  if (F->pmf.mass)
+    bingham_pmf_free(&F->pmf);
+
+  memset(F, 0, sizeof(bingham_filter_t));
+}
+
+
+/*
+ * Enable the particle fallback of a bingham mixture filter: whenever the log evidence of a measurement,
+ * log p(z), is below log_evidence_thresh (i.e. the measurement disagrees with the belief so much that the
+ * mixture product is numerically unreliable), the update is done on a tessellation of S^3 with (at least)
+ * ncells cells, and the belief is replaced by a single bingham fit to the resulting particles.
+ * Set ncells = 0 to disable the fallback.
+ */
+void bingham_filter_set_fallback(bingham_filter_t *F, int ncells, double log_evidence_thresh)
+{
+  if (F->pmf.mass)
+    bingham_pmf_free(&F->pmf);
+
+  F->fallback_ncells = ncells;
+  F->fallback_log_evidence = log_evidence_thresh;
+
+  if (ncells > 0) {
+    if (F->d != 4) {
+      fprintf(stderr, "Warning: bingham_filter_set_fallback() is only implemented for d = 4.\n");
+      F->fallback_ncells = 0;
+      return;
+    }
+    bingham_discretize(&F->pmf, &F->belief.B[0], ncells);  // allocates pmf.mass and fetches the tessellation
+  }
+}
+
+
+/*
+ * Predict step: compose each component of the belief with a process noise bingham,
+ * p(q) <-- p(q) o noise, i.e. q <-- quaternion_mult(q, dq) with dq ~ noise.
+ */
+void bingham_filter_predict(bingham_filter_t *F, bingham_t *noise)
+{
+  if (bingham_is_uniform(noise))
+    return;
+
+  bingham_stats(noise);  // only computed once per noise bingham
+
+  // uniform components stay uniform
+  int i;
+  for (i = 0; i < F->belief.n; i++)
+    if (!bingham_is_uniform(&F->belief.B[i]))
+      bingham_compose_array(&F->belief.B[i], &F->belief.B[i], noise, 1);
+}
+
+
+/*
+ * Particle fallback for a measurement update, p(q) <-- p(q)*L(q) / p(z).
+ */
+static void bingham_filter_update_particles(bingham_filter_t *F, bingham_mix_t *L)
+{
+  int i, j, k, d = F->d;
+  hypersphere_tessellation_t *T = F->pmf.tessellation;
+  int n = F->pmf.n;
+  double *mass = F->pmf.mass;
+
+  // compute log(mass) in place
+  double logm_max = -DBL_MAX;
+  for (i = 0; i < n; i++) {
+    mass[i] = log(T->volumes[i]) + bingham_mixture_log_pdf(T->centroids[i], &F->belief) +
+      bingham_mixture_log_pdf(T->centroids[i], L);
+    logm_max = MAX(logm_max, mass[i]);
+  }
+
+  // normalize
+  double mtot = 0;
+  for (i = 0; i < n; i++) {
+    mass[i] = exp(mass[i] - logm_max);
+    mtot += mass[i];
+  }
+  mult(mass, mass, 1/mtot, n);
+
+  // fit a bingham to the scatter matrix of the particles
+  double S_raw[d*d], *S[d];
+  for (i = 0; i < d; i++)
+    S[i] = S_raw + d*i;
+  memset(S_raw, 0, d*d*sizeof(double));
+  for (i = 0; i < n; i++) {
+    double *x = T->centroids[i];
+    for (j = 0; j < d; j++)
+      for (k = j; k < d; k++)
+	S[j][k] += mass[i]*x[j]*x[k];
+  }
+  for (j = 0; j < d; j++)
+    for (k = 0; k < j; k++)
+      S[j][k] = S[k][j];
+
+  bingham_t B;
+  bingham_fit_scatter_arena(&B, S, d, &F->arena);
+  bingham_filter_set_component(&F->belief.B[0], &B);
+  F->belief.w[0] = 1.0;
+  F->belief.n = 1;
+  bingham_arena_reset(&F->arena);
+
+  F->num_fallbacks++;
+}
+
+
+/*
+ * Update step: multiply the belief by a measurement likelihood (bingham mixture), p(q) <-- p(q)*L(q) / p(z),
+ * then reduce the belief to at most F->max_components components.
+ */
+void bingham_filter_update(bingham_filter_t *F, bingham_mix_t *L)
+{
+  int i, j, d = F->d;
+
+  if (L->n > F->max_measurement_components) {
+    fprintf(stderr, "Error: bingham_filter_update() got a likelihood with %d > %d components!\n",
+	    L->n, F->max_measurement_components);
+    return;
+  }
+
+  F->num_updates++;
+
+  // multiply mixtures; the product of two bingham pdfs is c*p12(q), where c = p1(x)*p2(x)/p12(x) for any x
+  bingham_mix_t *P = &F->product;
+  int n = 0;
+  double logw[F->capacity], logw_max = -DBL_MAX;
+  for (i = 0; i < F->belief.n; i++) {
+    for (j = 0; j < L->n; j++) {
+      if (F->belief.w[i] <= 0 || L->w[j] <= 0)
+	continue;
+      bingham_t B_pair[2] = {F->belief.B[i], L->B[j]};
+      bingham_free_stats(&P->B[n]);  // the product components are heap-allocated (and initialized)
+      bingham_mult_array_scratch(&P->B[n], B_pair, 2, 1, F->scratch);
+      double x[d];
+      bingham_mode(x, &P->B[n]);
+      logw[n] = log(F->belief.w[i]) + log(L->w[j]) + bingham_log_pdf(x, &F->belief.B[i]) +
+	bingham_log_pdf(x, &L->B[j]) - bingham_log_pdf(x, &P->B[n]);
+      if (isfinite(logw[n])) {
+	logw_max = MAX(logw_max, logw[n]);
+	n++;
+      }
+    }
+  }
+  P->n = n;
+
+  // compute the (normalized) weights and the log evidence, log p(z)
+  double wtot = 0;
+  for (i = 0; i < n; i++) {
+    P->w[i] = exp(logw[i] - logw_max);
+    wtot += P->w[i];
+  }
+  F->log_evidence = (n > 0 ? logw_max + log(wtot) : -DBL_MAX);
+
+  if (F->fallback_ncells > 0 && F->log_evidence < F->fallback_log_evidence) {
+    bingham_filter_update_particles(F, L);
+    return;
+  }
+  if (n == 0) {
+    fprintf(stderr, "Warning: bingham_filter_update() got a measurement with zero likelihood--skipping.\n");
+    return;
+  }
+  mult(P->w, P->w, 1/wtot, n);
+
+  if (n <= F->max_components) {  // swap belief and product
+    bingham_mix_t tmp = F->belief;
+    F->belief = F->product;
+    F->product = tmp;
+    return;
+  }
+
+  // reduce the product in the arena, then copy it into the belief
+  bingham_mix_t BM = *P;
+  bingham_mixture_reduce_arena(&BM, F->max_components, &F->arena);
+  F->belief.n = BM.n;
+  for (i = 0; i < BM.n; i++) {
+    F->belief.w[i] = BM.w[i];
+    bingham_filter_set_component(&F->belief.B[i], &BM.B[i]);
+  }
+  bingham_filter_normalize_weights(&F->belief);
+  bingham_arena_reset(&F->arena);
+}
+
+
+/*
+ * Update step with a single bingham measurement likelihood.
+ */
+void bingham_filter_update_bingham(bingham_filter_t *F, bingham_t *L)
+{
+  double w = 1.0;
+  bingham_mix_t BM;
+  BM.n = 1;
+  BM.w = &w;
+  BM.B = L;
+
+  bingham_filter_update(F, &BM);
+}
+
+
+/*
+ * Get the mode of the highest-weight component of the belief.
+ */
+void bingham_filter_mode(double *q, bingham_filter_t *F)
+{
+  int i = find_max(F->belief.w, F->belief.n);
+  bingham_mode(q, &F->belief.B[i]);
+}
+
+
+/*
+ * Sample n orientations from the belief.
+ */
+void bingham_filter_sample(double **Q, bingham_filter_t *F, int n)
+{
+  bingham_mixture_sample(Q, &F->belief, n);
+}
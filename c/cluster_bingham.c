@@ -18,28 +18,11 @@
  * .
  * .
  * <xn1> ... <xnd>
+ *
+ * (or to binary matrix files, see save_matrix_binary()).
  */
 
 
-double **load_data(char *filename, int *n_ptr, int *d_ptr)
-{
-  FILE *f = fopen(filename, "r");
-  int n, d, i, j;
-
-  fscanf(f, "%d %d\n", &n, &d);
-
-  double **X = new_matrix2(n, d);
-
-  for (i = 0; i < n; i++)
-    for (j = 0; j < d; j++)
-      fscanf(f, "%lf", &X[i][j]);
-
-  *n_ptr = n;
-  *d_ptr = d;
-
-  return X;
-}
-
 void usage(int argc, char *argv[])
 {
   printf("usage: %s <filename>\n", argv[0]);
@@ -59,7 +42,9 @@ int main(int argc, char *argv[])
   char *filename = argv[1];
 
   int n, d, i, j, c;
-  double **X = load_data(filename, &n, &d);
+  double **X = load_matrix(filename, &n, &d);
+  if (X == NULL)
+    return 1;
 
   bingham_mix_t BM;
   bingham_cluster(&BM, X, n, d);
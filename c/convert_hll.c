@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bingham/util.h"
+#include "bingham/hll.h"
+
+
+int main(int argc, char *argv[])
+{
+  if (argc < 3) {
+    printf("usage: %s <in.hll> <out.hll> [-float | -text]\n", argv[0]);
+    return 1;
+  }
+
+  int use_float = (argc > 3 && !strcmp(argv[3], "-float"));
+  int use_text = (argc > 3 && !strcmp(argv[3], "-text"));
+
+  // load hlls (in either format)
+  double t0 = get_time_ms();
+  int i, n;
+  hll_t *hlls = load_hlls(argv[1], &n);
+  if (hlls == NULL)
+    return 1;
+  fprintf(stderr, "Loaded %d hlls from %s in %.0f ms\n", n, argv[1], get_time_ms() - t0);
+
+  // save hlls
+  t0 = get_time_ms();
+  if (use_text)
+    save_hlls(argv[2], hlls, n);
+  else if (save_hlls_binary(argv[2], hlls, n, use_float) < 0)
+    return 1;
+  fprintf(stderr, "Wrote %d hlls to %s in %.0f ms\n", n, argv[2], get_time_ms() - t0);
+
+  for (i = 0; i < n; i++)
+    hll_free(&hlls[i]);
+  free(hlls);
+
+  return 0;
+}
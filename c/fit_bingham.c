@@ -26,6 +26,8 @@
  * .
  * .
  * <sd1> ... <sdd>
+ *
+ * (or to binary matrix files, see save_matrix_binary()).
  */
 
 
@@ -82,6 +84,8 @@ int main(int argc, char *argv[])
 
   if (load_scatter) {
     double **S = load_matrix(fin, &n, &d);
+    if (S == NULL)
+      return 1;
     if (n == d) {
       bingham_t B;
       bingham_fit_scatter(&B, S, d);
@@ -105,13 +109,16 @@ int main(int argc, char *argv[])
     }
   }
   else {
-    double **X = load_matrix(fin, &n, &d);
+    double **X = load_matrix_mmap(fin, &n, &d);
+    if (X == NULL)
+      return 1;
     bingham_t B;
     bingham_fit(&B, X, n, d);
     double w = 1.0;
     BM.B = &B;
     BM.w = &w;
     BM.n = 1;
+    free_matrix_mmap(X);
   }
 
   save_bmx(&BM, 1, fout);
@@ -43,29 +43,89 @@ static void gauss_mix_init(gauss_mix_t *gm, double **X, int npoints)
 
 
 // Indicators are indicator functions and will contain the assignments of each data point to
-// the mixture components, as result of the E-step
-static void compute_indicators(double **Indicators, double **X, int npoints, gauss_mix_t *gm)
+// the mixture components, as result of the E-step.  They're stored as log densities,
+// LogIndicators[i][j] = log N(X[j]; means[i], covs[i]), so that responsibilities can
+// be computed robustly with log-sum-exp.
+typedef struct {
+  gauss_mix_t *gm;
+  double **X;
+  double *W;
+  int npoints;
+  double **LogIndicators;
+  double *LogMax;         // LogMax[j] = max_i log(weights[i]*N(X[j]; means[i], covs[i]))
+  double *SumExp;         // LogMax[j] + log(SumExp[j]) = log sum_i weights[i]*N(X[j]; means[i], covs[i])
+  double *P;              // (weighted) responsibilities of component comp
+  mvn_t mvn;              // N(means[comp], covs[comp])
+  int comp;
+} gauss_mix_em_t;
+
+
+static void em_log_sum_block(int i0, int i1, void *data)
 {
-  int i, j, k = gm->n;
-
-  // having the initial means, covariances, and probabilities, we can
-  // initialize the (unnormalized) indicator functions following the standard EM equation
+  gauss_mix_em_t *em = (gauss_mix_em_t *)data;
+  int i, j, k = em->gm->n;
+  double log_weights[k];
   for (i = 0; i < k; i++)
-    for (j = 0; j < npoints; j++)
-      Indicators[i][j] = mvnpdf(X[j], gm->means[i], gm->covs[i], gm->d);
+    log_weights[i] = log(em->gm->weights[i]);
+
+  for (j = i0; j < i1; j++) {
+    double m = -INFINITY;
+    for (i = 0; i < k; i++)
+      m = MAX(m, log_weights[i] + em->LogIndicators[i][j]);
+    em->LogMax[j] = m;
+    if (m == -INFINITY) {
+      em->SumExp[j] = 0;
+      continue;
+    }
+    double s = 0;
+    for (i = 0; i < k; i++) {
+      double x = log_weights[i] + em->LogIndicators[i][j] - m;
+      if (x > -37)  // exp(-37) < DBL_EPSILON/2, so smaller terms can't change s
+	s += exp(x);
+    }
+    em->SumExp[j] = s;
+  }
+}
+
+
+static void em_responsibilities_block(int i0, int i1, void *data)
+{
+  gauss_mix_em_t *em = (gauss_mix_em_t *)data;
+  int j, c = em->comp;
+  double log_weight = log(em->gm->weights[c]);
+  double *LI = em->LogIndicators[c];
+
+  for (j = i0; j < i1; j++)
+    em->P[j] = (em->SumExp[j] == 0 ? 0 : em->W[j] * exp(log_weight + LI[j] - em->LogMax[j]) / em->SumExp[j]);
 }
 
 
-static double compute_log_likelihood(double **Indicators, gauss_mix_t *gm, double *W, int npoints)
+// update LogMax and SumExp with the current weights and indicators
+static void compute_log_sum(gauss_mix_em_t *em)
 {
-  double SumIndicators[npoints];
-  wmean(SumIndicators, Indicators, gm->weights, gm->n, npoints);
+  parallel_for(em->npoints, em_log_sum_block, em);
+}
+
 
+// compute the indicators of component comp (returns -1 if its covariance isn't positive definite)
+static int compute_indicators(gauss_mix_em_t *em, int comp)
+{
+  if (mvn_set(&em->mvn, em->gm->means[comp], em->gm->covs[comp]) < 0)
+    return -1;
+  mvn_logpdf_batch(em->LogIndicators[comp], &em->mvn, em->X, em->npoints);
+  return 0;
+}
+
+
+static double compute_log_likelihood(gauss_mix_em_t *em)
+{
+  double log_epsilon = log(1e-50);
   double loglike = 0.0;
-  double epsilon = 1e-50;
-  int i;
-  for (i = 0; i < npoints; i++)
-    loglike += W[i]*log(SumIndicators[i] + epsilon);
+  int j;
+  for (j = 0; j < em->npoints; j++) {
+    double s = em->LogMax[j] + log(em->SumExp[j]);  // loglike += W*log(exp(s) + epsilon)
+    loglike += em->W[j] * (s > log_epsilon ? s + log1p(exp(log_epsilon - s)) : log_epsilon + log1p(exp(s - log_epsilon)));
+  }
 
   return loglike;
 }
@@ -83,55 +143,54 @@ static double compute_description_length(double loglike, gauss_mix_t *gm, double
 }
 
 
-static void remove_component(gauss_mix_t *gm, double **Indicators, int comp, int npoints)
+static void remove_component(gauss_mix_em_t *em, int comp)
 {
-  int i, k = gm->n, dims = gm->d;
+  gauss_mix_t *gm = em->gm;
+  int i, k = gm->n, dims = gm->d, npoints = em->npoints;
   for (i = comp; i < k-1; i++) {
     memcpy(gm->means[i], gm->means[i+1], dims*sizeof(double));
     matrix_copy(gm->covs[i], gm->covs[i+1], dims, dims);
     gm->weights[i] = gm->weights[i+1];
-    memcpy(Indicators[i], Indicators[i+1], npoints*sizeof(double));
+    memcpy(em->LogIndicators[i], em->LogIndicators[i+1], npoints*sizeof(double));
   }
   free_matrix2(gm->covs[k-1]);
   gm->n--;
   mult(gm->weights, gm->weights, 1.0/sum(gm->weights, gm->n), gm->n);
+
+  compute_log_sum(em);
 }
 
 
-static int update_component(gauss_mix_t *gm, int comp, double **Indicators, double **X, double *W, int npoints, double regularize)
+static int update_component(gauss_mix_em_t *em, int comp, double regularize)
 {
-  int i, k = gm->n, dims = gm->d;
-  double epsilon = 1e-50;
+  gauss_mix_t *gm = em->gm;
+  int i, k = gm->n, dims = gm->d, npoints = em->npoints;
   double npars = dims/2.0 + dims*(dims+1)/4.0;  // actually npars/2
 
-  double SumIndicators[npoints];
-  wmean(SumIndicators, Indicators, gm->weights, gm->n, npoints);
-
-  double P[npoints];
-  for (i = 0; i < npoints; i++)
-    P[i] = W[i] * gm->weights[comp] * Indicators[comp][i] / (epsilon + SumIndicators[i]);
+  em->comp = comp;
+  parallel_for(npoints, em_responsibilities_block, em);
+  double *P = em->P;
 
   // compute weighted mean and covariance
-  wmean(gm->means[comp], X, P, npoints, dims);
-  wcov(gm->covs[comp], X, P, gm->means[comp], npoints, dims);
+  wmean(gm->means[comp], em->X, P, npoints, dims);
+  wcov(gm->covs[comp], em->X, P, gm->means[comp], npoints, dims);
   for (i = 0; i < dims; i++)
     gm->covs[comp][i][i] += regularize;
 
   // this is the special part of the M step that is able to kill components
-  gm->weights[comp] = (sum(P,npoints) - npars) / sum(W, npoints);
+  gm->weights[comp] = (sum(P,npoints) - npars) / sum(em->W, npoints);
   if (gm->weights[comp] < 0)
     gm->weights[comp] = 0;
   mult(gm->weights, gm->weights, 1.0/sum(gm->weights,k), k);
 
-  // we now have to do some book-keeping if the current component was killed
-  if (gm->weights[comp] == 0) {
-    remove_component(gm, Indicators, comp, npoints);
+  // we now have to do some book-keeping if the current component was killed (or degenerate)
+  if (gm->weights[comp] == 0 || compute_indicators(em, comp) < 0) {
+    remove_component(em, comp);
     return 1;
   }
 
-  // if the component was not killed, we update the corresponding indicator variables...
-  for (i = 0; i < npoints; i++)
-    Indicators[comp][i] = mvnpdf(X[i], gm->means[comp], gm->covs[comp], dims);
+  // if the component was not killed, we update the responsibility normalizers
+  compute_log_sum(em);
 
   return 0;
 }
@@ -200,16 +259,32 @@ void free_gauss_mix(gauss_mix_t *gm)
 gauss_mix_t *fit_gauss_mix(double **X, int npoints, int dims, double *w, unsigned int kmin, unsigned int kmax, double regularize, double th)
 {
   int i;
-  double W[npoints];
+  double *W;
+  safe_malloc(W, npoints, double);
   mult(W, w, npoints/sum(w,npoints), npoints);  // normalize data weights
 
   gauss_mix_t *gm = new_gauss_mix(dims, kmax);  // kmax is the initial number of mixture components
   gauss_mix_init(gm, X, npoints);
 
-  double **Indicators = new_matrix2(kmax, npoints);
-  compute_indicators(Indicators, X, npoints, gm);
-
-  double loglike = compute_log_likelihood(Indicators, gm, W, npoints);
+  gauss_mix_em_t em;
+  em.gm = gm;
+  em.X = X;
+  em.W = W;
+  em.npoints = npoints;
+  em.LogIndicators = new_matrix2(kmax, npoints);
+  safe_malloc(em.LogMax, npoints, double);
+  safe_malloc(em.SumExp, npoints, double);
+  safe_malloc(em.P, npoints, double);
+  double **I = new_identity_matrix2(dims);
+  mvn_new(&em.mvn, gm->means[0], I, dims);
+  free_matrix2(I);
+
+  for (i = 0; i < gm->n; i++)
+    if (compute_indicators(&em, i) < 0)
+      remove_component(&em, i--);
+  compute_log_sum(&em);
+
+  double loglike = compute_log_likelihood(&em);
   double dl = compute_description_length(loglike, gm, sum(W,npoints));
 
   // minimum description length seen so far, and corresponding parameter estimates
@@ -222,13 +297,13 @@ gauss_mix_t *fit_gauss_mix(double **X, int npoints, int dims, double *w, unsigne
       int comp = 0;
       // Since k may change during the process, we can not use a for loop
       while (comp < gm->n) {
-	if (update_component(gm, comp, Indicators, X, W, npoints, regularize) == 0)
+	if (update_component(&em, comp, regularize) == 0)
 	  comp++;
 	//printf("gm->n = %d\n", gm->n);
       }
       // compute description length
       double loglikeprev = loglike;
-      loglike = compute_log_likelihood(Indicators, gm, W, npoints);
+      loglike = compute_log_likelihood(&em);
       dl = compute_description_length(loglike, gm, sum(W,npoints));
       // check if new mixture is best
       if (dl < minDL) {
@@ -240,7 +315,7 @@ gauss_mix_t *fit_gauss_mix(double **X, int npoints, int dims, double *w, unsigne
       printf("k = %d, dl = %f, loglike = %f, loglikeprev = %f\n", gm->n, dl, loglike, loglikeprev); //dbug
 
       // check for convergence
-      if (fabs(loglike-loglikeprev) / loglikeprev < th)
+      if (fabs((loglike-loglikeprev) / loglikeprev) < th)
 	break;
     }
 
@@ -252,14 +327,19 @@ gauss_mix_t *fit_gauss_mix(double **X, int npoints, int dims, double *w, unsigne
     for (i = 1; i < gm->n; i++)
       if (gm->weights[i] < gm->weights[comp])
 	comp = i;
-    remove_component(gm, Indicators, comp, npoints);
-    loglike = compute_log_likelihood(Indicators, gm, W, npoints);
+    remove_component(&em, comp);
+    loglike = compute_log_likelihood(&em);
 
     printf("*** killed smallest ***\n"); //dbug
   }
 
   free_gauss_mix(gm);
-  free_matrix2(Indicators);
+  free_matrix2(em.LogIndicators);
+  free(em.LogMax);
+  free(em.SumExp);
+  free(em.P);
+  mvn_free(&em.mvn);
+  free(W);
 
   return bestGM;
 }
@@ -271,11 +351,11 @@ gauss_mix_t *fit_gauss_mix(double **X, int npoints, int dims, double *w, unsigne
 #include "bingham/olf.h"
 
 
-int main(int argc, char *argv[])
+void test_fit_gauss_mix_pcd(int argc, char *argv[])
 {
   if (argc < 3) {
     printf("usage: %s <pcd> <point_index>\n", argv[0]);
-    return 1;
+    return;
   }
 
   pcd_t *pcd = load_pcd(argv[1]);
@@ -286,24 +366,22 @@ int main(int argc, char *argv[])
   int I[pcd->num_points];
   int n = findeq(I, pcd->clusters, c, pcd->num_points);
 
-  double **Q = new_matrix2(2*n, 4);
-  double **X = new_matrix2(2*n, 3);
+  double **Q = new_matrix2(n, 4);
+  double **X = new_matrix2(n, 3);
   int cnt=0;
   for (i = 0; i < pcd->num_points; i++) {
     if (pcd->clusters[i] == c) {
-      memcpy(Q[cnt], pcd->quaternions[0][i], 4*sizeof(double));
-      memcpy(Q[cnt+1], pcd->quaternions[1][i], 4*sizeof(double));
-      X[cnt][0] = X[cnt+1][0] = pcd->points[0][i];
-      X[cnt][1] = X[cnt+1][1] = pcd->points[1][i];
-      X[cnt][2] = X[cnt+1][2] = pcd->points[2][i];
-      cnt += 2;
+      memcpy(Q[cnt], pcd->quaternions[i], 4*sizeof(double));
+      X[cnt][0] = pcd->points[0][i];
+      X[cnt][1] = pcd->points[1][i];
+      X[cnt][2] = pcd->points[2][i];
+      cnt++;
     }
   }
 
 
   // compute weights
-  n *= 2;
-  double *q = pcd->quaternions[0][point_index];
+  double *q = pcd->quaternions[point_index];
   double dq, qdot;
   double w[n];
   double r = .2;
@@ -323,6 +401,51 @@ int main(int argc, char *argv[])
     printf("cov[%d] = [%f, %f, %f;  %f, %f, %f;  %f, %f, %f]\n", i, gm->covs[i][0][0], gm->covs[i][0][1], gm->covs[i][0][2],
 	   gm->covs[i][1][0], gm->covs[i][1][1], gm->covs[i][1][2], gm->covs[i][2][0], gm->covs[i][2][1], gm->covs[i][2][2]);
   }
+}
+
+
+void test_fit_gauss_mix_benchmark(int argc, char *argv[])
+{
+  if (argc < 3) {
+    printf("usage: %s <num_points> <kmax>\n", argv[0]);
+    return;
+  }
+
+  int n = atoi(argv[1]);
+  int kmax = atoi(argv[2]);
+
+  // sample points from a 3-d mixture of 4 gaussians
+  double mu[4][3] = {{0,0,0}, {5,0,0}, {0,5,0}, {0,0,5}};
+  double sigma[4] = {1, .5, 2, .25};
+  double **X = new_matrix2(n, 3);
+  double *w;
+  safe_malloc(w, n, double);
+  int i, j;
+  for (i = 0; i < n; i++) {
+    int c = irand(4);
+    for (j = 0; j < 3; j++)
+      X[i][j] = normrand(mu[c][j], sigma[c]);
+    w[i] = 1;
+  }
+
+  double t = get_time_ms();
+  gauss_mix_t *gm = fit_gauss_mix(X, n, 3, w, 1, kmax, 1e-6, 1e-4);
+  printf("Fit a %d-component gaussian mixture to %d points in %.0f ms (%d threads)\n", gm->n, n, get_time_ms() - t, get_num_threads());
+
+  for (i = 0; i < gm->n; i++)
+    printf("w[%d] = %f, mu[%d] = [%f, %f, %f], var[%d] = %f\n", i, gm->weights[i], i, gm->means[i][0], gm->means[i][1], gm->means[i][2],
+	   i, (gm->covs[i][0][0] + gm->covs[i][1][1] + gm->covs[i][2][2]) / 3);
+
+  free_gauss_mix(gm);
+  free_matrix2(X);
+  free(w);
+}
+
+
+int main(int argc, char *argv[])
+{
+  //test_fit_gauss_mix_pcd(argc, argv);
+  test_fit_gauss_mix_benchmark(argc, argv);
 
   return 0;
 }
@@ -4,11 +4,73 @@
 #include <string.h>
 #include <math.h>
 #include <float.h>
+#include <stdint.h>
+#ifndef HAVE_WINDOWS
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "bingham/util.h"
 #include "bingham/hll.h"
 
 
 
+static int hll_validate = 0;  // check indexed hll_sample() against a full scan?
+
+// min number of samples added by hll_add_samples() before the quaternion index is rebuilt
+#define HLL_MAX_UNINDEXED 256
+
+// binary cache file (see hll_save_cache())
+#define HLL_CACHE_MAGIC "BHHLLCCH"
+#define HLL_CACHE_VERSION 1
+
+typedef struct {
+  char magic[8];
+  int32_t version;
+  int32_t num_hlls;
+} hll_cache_file_header_t;
+
+typedef struct {
+  uint64_t hash;     // hll_hash() of the hll the cache was built for
+  int32_t n;         // number of cached samples
+  int32_t dq;
+  int32_t dx;
+  int32_t pad;
+  int64_t offset;    // file offset of: Q (n*dq doubles), X (n*dx doubles), S (n*dx*dx doubles)
+} hll_cache_file_entry_t;
+
+// binary hll file (see save_hlls_binary())
+#define HLL_FILE_MAGIC "BHHLLBIN"
+#define HLL_FILE_VERSION 1
+#define HLL_FILE_FLOAT 1   // Q, X and cache arrays are stored as floats
+
+typedef struct {
+  char magic[8];
+  int32_t version;
+  int32_t num_hlls;
+  int32_t flags;
+  int32_t pad;
+} hll_file_header_t;
+
+typedef struct {
+  int32_t n;         // number of training samples
+  int32_t ncache;    // number of cached samples
+  int32_t dq;
+  int32_t dx;
+  double r;
+  double w0;
+  int64_t offset;    // file offset of: x0, S0 (doubles), then Q, X, cache Q, cache X, cache S
+} hll_file_entry_t;
+
+// a mapped (or read) cache file, shared by the caches that point into it
+typedef struct {
+  char *data;
+  size_t size;
+  int mapped;        // is data mmapped?
+  int refcount;
+} hll_cache_map_t;
+
 
 
 /*
@@ -54,7 +116,7 @@ static void hll_sample_cache(double **X, double ***S, double **Q, hll_t *hll, in
 {
   int i;
   for (i = 0; i < n; i++) {
-    int j = kdtree_NN(hll->cache.Q_kdtree, Q[i]);
+    int j = quaternion_index_NN(hll->cache.Q_index, Q[i], NULL);
     memcpy(X[i], hll->cache.X[j], hll->dx * sizeof(double));
     matrix_copy(S[i], hll->cache.S[j], hll->dx, hll->dx);
   }
@@ -62,6 +124,384 @@ static void hll_sample_cache(double **X, double ***S, double **Q, hll_t *hll, in
 
 
 
+/*
+ * Write the n rows of matrix X (n*m) to a file, as doubles or floats.  Returns 1 on success.
+ */
+static int hll_fwrite_rows(double **X, int n, int m, int use_float, FILE *f)
+{
+  int i, j;
+  float xf[m];
+  for (i = 0; i < n; i++) {
+    if (use_float) {
+      for (j = 0; j < m; j++)
+	xf[j] = (float)X[i][j];
+      if (fwrite(xf, sizeof(float), m, f) != m)
+	return 0;
+    }
+    else if (fwrite(X[i], sizeof(double), m, f) != m)
+      return 0;
+  }
+  return 1;
+}
+
+
+/*
+ * Read n doubles (stored as doubles or floats) from a file.  Returns 1 on success.
+ */
+static int hll_fread_array(double *x, size_t n, int use_float, FILE *f)
+{
+  if (n == 0)
+    return 1;
+  if (!use_float)
+    return (fread(x, sizeof(double), n, f) == n);
+
+  float xf[1024];
+  size_t i, j, m;
+  for (i = 0; i < n; i += m) {
+    m = MIN(n - i, 1024);
+    if (fread(xf, sizeof(float), m, f) != m)
+      return 0;
+    for (j = 0; j < m; j++)
+      x[i+j] = xf[j];
+  }
+  return 1;
+}
+
+
+/*
+ * Point the cache's row pointers into contiguous Q (n*dq), X (n*dx) and S (n*dx*dx) arrays.
+ */
+static void hll_cache_set_arrays(hll_cache_t *cache, double *Q, double *X, double *S, int n, int dq, int dx)
+{
+  int i;
+  safe_malloc(cache->Q, n, double*);
+  safe_malloc(cache->X, n, double*);
+  safe_malloc(cache->S, n, double**);
+  double **S_rows;
+  safe_malloc(S_rows, n*dx, double*);
+  for (i = 0; i < n; i++) {
+    cache->Q[i] = Q + i*dq;
+    cache->X[i] = X + i*dx;
+    cache->S[i] = S_rows + i*dx;
+  }
+  for (i = 0; i < n*dx; i++)
+    S_rows[i] = S + i*dx;
+  cache->n = n;
+}
+
+
+/*
+ * Allocate (zeroed) space for an n-sample cache.
+ */
+static void hll_cache_alloc(hll_cache_t *cache, int n, int dq, int dx)
+{
+  double *Q, *X, *S;
+  safe_calloc(Q, n*dq, double);
+  safe_calloc(X, n*dx, double);
+  safe_calloc(S, n*dx*dx, double);
+  hll_cache_set_arrays(cache, Q, X, S, n, dq, dx);
+  cache->map = NULL;
+}
+
+
+static void hll_cache_map_release(hll_cache_map_t *map)
+{
+  if (--map->refcount > 0)
+    return;
+#ifndef HAVE_WINDOWS
+  if (map->mapped)
+    munmap(map->data, map->size);
+  else
+#endif
+    free(map->data);
+  free(map);
+}
+
+
+/*
+ * FNV-1a hash of an array of bytes.
+ */
+static uint64_t hll_hash_bytes(uint64_t h, const void *data, size_t n)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  size_t i;
+  for (i = 0; i < n; i++) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+
+typedef struct {
+  double **X;
+  double ***S;
+  double **Q;
+  hll_t *hll;
+  int use_index;
+} hll_sample_args_t;
+
+static void hll_sample_block(int i0, int i1, void *data);
+
+
+
+/*
+ * Compute the local likelihood distribution (posterior mean x and covariance S) from
+ * the training samples idx[0..cnt-1] with kernel weights w[0..cnt-1] (which must be
+ * sorted by index, so that sums are accumulated in the same order as a full scan).
+ */
+static void hll_sample_weighted(double *x, double **S, hll_t *hll, int *idx, double *w, int cnt, double **WS)
+{
+  int j, nx = hll->dx;
+
+  double wtot = hll->w0 + sum(w, cnt);
+
+  // compute posterior mean
+  mult(x, hll->x0, hll->w0, nx);  // x = w0*x0
+  for (j = 0; j < cnt; j++) {
+    double wx[nx];
+    mult(wx, hll->X[idx[j]], w[j], nx);
+    add(x, x, wx, nx);       // x += wx
+  }
+  mult(x, x, 1/wtot, nx);  // x /= wtot
+
+  // compute posterior covariance matrix
+  mult(S[0], hll->S0[0], hll->w0, nx*nx);  // S = w0*S0
+  for (j = 0; j < cnt; j++) {
+    double wdx[nx];
+    sub(wdx, hll->X[idx[j]], x, nx);
+    mult(wdx, wdx, w[j], nx);
+    outer_prod(WS, wdx, wdx, nx, nx);    // WS = wdx'*wdx
+    matrix_add(S, S, WS, nx, nx);        // S += WS
+  }
+  mult(S[0], S[0], 1/wtot, nx*nx);  // S /= wtot
+}
+
+
+/*
+ * Kernel weight of training sample j at query q.
+ */
+static inline double hll_kernel_weight(hll_t *hll, double *q, int j)
+{
+  double qdot = fabs(dot(q, hll->Q[j], hll->dq));
+  double dq = acos(MIN(qdot, 1.0));
+  return exp(-(dq/hll->r)*(dq/hll->r));
+}
+
+
+static int hll_compare_int(const void *a, const void *b)
+{
+  int i = *(const int *)a, j = *(const int *)b;
+  return (i > j) - (i < j);
+}
+
+
+/*
+ * Sample from an hll by kernel regression over all of its training samples.
+ */
+static void hll_sample_scan_block(double **X, double ***S, double **Q, hll_t *hll, int i0, int i1)
+{
+  int i, j, cnt, *idx;
+  double *w;
+  safe_malloc(idx, MAX(hll->n, 1), int);
+  safe_malloc(w, MAX(hll->n, 1), double);
+  double **WS = new_matrix2(hll->dx, hll->dx);
+
+  for (i = i0; i < i1; i++) {
+
+    // compute weights
+    for (j = 0; j < hll->n; j++)
+      w[j] = hll_kernel_weight(hll, Q[i], j);
+
+    // threshold weights
+    double wmax = arr_max(w, hll->n);
+    double wthresh = wmax/50;  //dbug: make this a parameter?
+    for (j = cnt = 0; j < hll->n; j++) {
+      if (w[j] >= wthresh && w[j] > 0) {
+	idx[cnt] = j;
+	w[cnt++] = w[j];
+      }
+    }
+
+    hll_sample_weighted(X[i], S[i], hll, idx, w, cnt, WS);
+  }
+
+  free_matrix2(WS);
+  free(idx);
+  free(w);
+}
+
+
+/*
+ * Max kernel weight of hll's training samples at q.  Samples that were added
+ * after hll->Q_index was built are searched linearly.
+ */
+static double hll_max_weight(hll_t *hll, double *q)
+{
+  int j = quaternion_index_NN(hll->Q_index, q, NULL);
+  double wmax = (j >= 0 ? hll_kernel_weight(hll, q, j) : 0);
+  for (j = hll->Q_index_n; j < hll->n; j++)
+    wmax = MAX(wmax, hll_kernel_weight(hll, q, j));
+  return wmax;
+}
+
+
+/*
+ * Sample from an hll using radius searches in its quaternion index.
+ *
+ * Weights below wmax/50 are thresholded away, so with the nearest neighbor
+ * at angle dq_min, only the training samples within an angle of
+ * r*sqrt((dq_min/r)^2 + log(50)) of q can contribute.
+ */
+static void hll_sample_index_block(double **X, double ***S, double **Q, hll_t *hll, int i0, int i1)
+{
+  int i, j, cnt, *idx;
+  double *w;
+  safe_malloc(idx, MAX(hll->n, 1), int);
+  safe_malloc(w, MAX(hll->n, 1), double);
+  double **WS = new_matrix2(hll->dx, hll->dx);
+  double r = hll->r;
+
+  for (i = i0; i < i1; i++) {
+    cnt = 0;
+    double wmax = hll_max_weight(hll, Q[i]);
+    if (wmax > 0) {
+      double wthresh = wmax/50;
+      double dq_min = r*sqrt(-log(wmax));
+      double max_dq = r*sqrt((dq_min/r)*(dq_min/r) + log(50.0)) + 1e-6;
+
+      cnt = quaternion_index_radius(idx, w, hll->Q_index, Q[i], max_dq, hll->n);
+      qsort(idx, cnt, sizeof(int), hll_compare_int);
+
+      // recompute weights exactly as in a full scan, and threshold them
+      int cnt2 = 0;
+      for (j = 0; j < cnt; j++) {
+	double wj = hll_kernel_weight(hll, Q[i], idx[j]);
+	if (wj >= wthresh && wj > 0) {
+	  idx[cnt2] = idx[j];
+	  w[cnt2++] = wj;
+	}
+      }
+
+      // unindexed samples (their indices all come after the indexed ones)
+      for (j = hll->Q_index_n; j < hll->n; j++) {
+	double wj = hll_kernel_weight(hll, Q[i], j);
+	if (wj >= wthresh && wj > 0) {
+	  idx[cnt2] = j;
+	  w[cnt2++] = wj;
+	}
+      }
+      cnt = cnt2;
+    }
+
+    hll_sample_weighted(X[i], S[i], hll, idx, w, cnt, WS);
+  }
+
+  free_matrix2(WS);
+  free(idx);
+  free(w);
+}
+
+
+static void hll_sample_block(int i0, int i1, void *data)
+{
+  hll_sample_args_t *args = (hll_sample_args_t *)data;
+  if (args->use_index)
+    hll_sample_index_block(args->X, args->S, args->Q, args->hll, i0, i1);
+  else
+    hll_sample_scan_block(args->X, args->S, args->Q, args->hll, i0, i1);
+}
+
+
+/*
+ * Compare the indexed hll samples (X,S) against a full scan, and print any mismatches.
+ */
+static void hll_sample_validate(double **X, double ***S, double **Q, hll_t *hll, int n)
+{
+  int i, nx = hll->dx, num_errors = 0;
+  double **X2 = new_matrix2(n, nx);
+  double ***S2;
+  safe_calloc(S2, n, double**);
+  for (i = 0; i < n; i++)
+    S2[i] = new_matrix2(nx, nx);
+
+  hll_sample_scan(X2, S2, Q, hll, n);
+
+  for (i = 0; i < n; i++) {
+    double dx = dist(X[i], X2[i], nx);
+    double dS = dist(S[i][0], S2[i][0], nx*nx);
+    double tol = 1e-9 * (1 + norm(X2[i], nx) + norm(S2[i][0], nx*nx));
+    if (dx > tol || dS > tol) {
+      if (num_errors++ < 10)
+	fprintf(stderr, "Warning: hll_sample() index mismatch at q[%d]: |dx| = %g, |dS| = %g\n", i, dx, dS);
+    }
+  }
+  if (num_errors > 0)
+    fprintf(stderr, "Warning: hll_sample() index mismatch on %d of %d queries\n", num_errors, n);
+
+  for (i = 0; i < n; i++)
+    free_matrix2(S2[i]);
+  free(S2);
+  free_matrix2(X2);
+}
+
+
+
+typedef struct {
+  hll_t *hll;
+  quaternion_index_t *new_index;
+  double **Q_new;
+  int *affected;
+} hll_cache_affected_args_t;
+
+/*
+ * Mark the cache entries whose LL distributions change when the samples in
+ * new_index are added to hll.  A new sample contributes to an entry (and changes
+ * it) iff its kernel weight is at least 1/50 of the entry's current max weight.
+ */
+static void hll_cache_affected_block(int i0, int i1, void *data)
+{
+  hll_cache_affected_args_t *args = (hll_cache_affected_args_t *)data;
+  hll_t *hll = args->hll;
+  int i;
+
+  for (i = i0; i < i1; i++) {
+    double *q = hll->cache.Q[i];
+    int j = quaternion_index_NN(args->new_index, q, NULL);
+    if (j < 0)
+      continue;
+    double qdot = fabs(dot(q, args->Q_new[j], hll->dq));
+    double dq = acos(MIN(qdot, 1.0));
+    double w_new = exp(-(dq/hll->r)*(dq/hll->r));
+    args->affected[i] = (w_new > 0 && w_new >= hll_max_weight(hll, q)/50);
+  }
+}
+
+
+/*
+ * Copy a mapped cache into memory owned by the cache (so it can be modified).
+ */
+static void hll_cache_detach(hll_t *hll)
+{
+  hll_cache_t *cache = &hll->cache;
+  if (cache->map == NULL)
+    return;
+
+  int n = cache->n, dq = hll->dq, dx = hll->dx;
+  hll_cache_t cache2;
+  hll_cache_alloc(&cache2, n, dq, dx);
+  memcpy(cache2.Q[0], cache->Q[0], n*dq*sizeof(double));
+  memcpy(cache2.X[0], cache->X[0], n*dx*sizeof(double));
+  memcpy(cache2.S[0][0], cache->S[0][0], n*dx*dx*sizeof(double));
+  cache2.Q_index = cache->Q_index;
+  cache->Q_index = NULL;
+
+  hll_free_cache(hll);
+  hll->cache = cache2;
+}
+
+
+
 //-----------------------------  EXTERNAL API  -------------------------------//
 
 
@@ -71,6 +511,8 @@ static void hll_sample_cache(double **X, double ***S, double **Q, hll_t *hll, in
  */
 void hll_new(hll_t *hll, double **Q, double **X, int n, int dq, int dx)
 {
+  memset(hll, 0, sizeof(hll_t));
+
   hll->Q = Q;
   hll->X = X;
   hll->n = n;
@@ -80,6 +522,9 @@ void hll_new(hll_t *hll, double **Q, double **X, int n, int dq, int dx)
   hll->r = .2;  //dbug: is there a more principled way of setting this?
 
   hll_default_prior(hll);
+
+  hll->Q_index = quaternion_index(Q, n, dq);
+  hll->Q_index_n = n;
 }
 
 
@@ -88,22 +533,33 @@ void hll_new(hll_t *hll, double **Q, double **X, int n, int dq, int dx)
  */
 void hll_free_cache(hll_t *hll)
 {
-  if (hll->cache.n > 0) {
-    if (hll->cache.Q_kdtree)
-      kdtree_free(hll->cache.Q_kdtree);
-    if (hll->cache.Q)
-      free_matrix2(hll->cache.Q);
-    if (hll->cache.X)
-      free_matrix2(hll->cache.X);
-    int i;
-    if (hll->cache.S) {
-      for (i = 0; i < hll->cache.n; i++)
-	if (hll->cache.S[i])
-	  free_matrix2(hll->cache.S[i]);
-      free(hll->cache.S);
-    }
-    hll->cache.n = 0;
+  hll_cache_t *cache = &hll->cache;
+
+  if (cache->Q_index)
+    quaternion_index_free(cache->Q_index);
+
+  // the arrays are either owned by the cache, or part of a mapped cache file
+  if (cache->map == NULL) {
+    if (cache->Q)
+      free(cache->Q[0]);
+    if (cache->X)
+      free(cache->X[0]);
+    if (cache->S)
+      free(cache->S[0][0]);
+  }
+  else
+    hll_cache_map_release((hll_cache_map_t *)cache->map);
+
+  if (cache->Q)
+    free(cache->Q);
+  if (cache->X)
+    free(cache->X);
+  if (cache->S) {
+    free(cache->S[0]);
+    free(cache->S);
   }
+
+  memset(cache, 0, sizeof(hll_cache_t));
 }
 
 
@@ -112,6 +568,8 @@ void hll_free_cache(hll_t *hll)
  */
 void hll_free(hll_t *hll)
 {
+  if (hll->Q_index)
+    quaternion_index_free(hll->Q_index);
   if (hll->Q)
     free_matrix2(hll->Q);
   if (hll->X)
@@ -119,122 +577,363 @@ void hll_free(hll_t *hll)
   if (hll->x0)
     free(hll->x0);
   if (hll->S0)
-    free(hll->S0);
+    free_matrix2(hll->S0);
 
   hll_free_cache(hll);
 }
 
 
 /*
- * Cache the Local Likelihood distributions for Q
+ * Cache the Local Likelihood distributions for Q.  The cache is built in
+ * parallel (see hll_sample()).
  */
 void hll_cache(hll_t *hll, double **Q, int n)
 {
-  int i;
+  hll_free_cache(hll);
+  if (n <= 0)
+    return;
 
-  // allocate space, build kdtree
-  double **X = new_matrix2(n, hll->dx);
-  double ***S;
-  safe_calloc(S, n, double**);
+  TRACE_BEGIN("hll_cache");
+  TRACE_COUNT("hll_cache.entries", n);
+
+  int i;
+  hll_cache_t cache;
+  hll_cache_alloc(&cache, n, hll->dq, hll->dx);
   for (i = 0; i < n; i++)
-    S[i] = new_matrix2(hll->dx, hll->dx);
-  kdtree_t *Q_kdtree = kdtree(Q, n, hll->dq);
+    memcpy(cache.Q[i], Q[i], hll->dq * sizeof(double));
+  cache.Q_index = quaternion_index(cache.Q, n, hll->dq);
 
   // precompute LL distributions
-  hll_sample(X, S, Q, hll, n);
+  hll_sample_args_t args = {cache.X, cache.S, cache.Q, hll, hll->Q_index != NULL};
+  parallel_for(n, hll_sample_block, &args);
+
+  hll->cache = cache;
+
+  TRACE_END();
+}
+
+
+/*
+ * Add n training samples (Q->X) to an HLL, leaving its prior unchanged.
+ *
+ * New samples are searched linearly until there are enough of them to make
+ * rebuilding the quaternion index worthwhile.  Only the cache entries that
+ * the new samples contribute to are recomputed.  Returns the number of
+ * recomputed cache entries.
+ */
+int hll_add_samples(hll_t *hll, double **Q, double **X, int n)
+{
+  if (n <= 0)
+    return 0;
+
+  TRACE_BEGIN("hll_add_samples");
+  TRACE_COUNT("hll_add_samples.samples", n);
+
+  int i, n0 = hll->n, dq = hll->dq, dx = hll->dx;
+  hll_cache_t *cache = &hll->cache;
+
+  // find the cache entries that will change (before adding the new samples)
+  int *affected = NULL;
+  if (cache->n > 0) {
+    safe_calloc(affected, cache->n, int);
+    hll_cache_affected_args_t args = {hll, quaternion_index(Q, n, dq), Q, affected};
+    parallel_for(cache->n, hll_cache_affected_block, &args);
+    quaternion_index_free(args.new_index);
+  }
+
+  // append the new samples
+  if (n0 == 0) {
+    if (hll->Q)
+      free_matrix2(hll->Q);
+    if (hll->X)
+      free_matrix2(hll->X);
+    hll->Q = new_matrix2(n, dq);
+    hll->X = new_matrix2(n, dx);
+  }
+  else {
+    add_rows_matrix2(&hll->Q, n0, dq, n0 + n);
+    add_rows_matrix2(&hll->X, n0, dx, n0 + n);
+  }
+  for (i = 0; i < n; i++) {
+    memcpy(hll->Q[n0+i], Q[i], dq*sizeof(double));
+    memcpy(hll->X[n0+i], X[i], dx*sizeof(double));
+  }
+  hll->n = n0 + n;
+
+  // rebuild the index once the unindexed samples are a large fraction of the total
+  if (hll->n - hll->Q_index_n > MAX(HLL_MAX_UNINDEXED, hll->Q_index_n / 16)) {
+    TRACE_BEGIN("quaternion_index");
+    if (hll->Q_index)
+      quaternion_index_free(hll->Q_index);
+    hll->Q_index = quaternion_index(hll->Q, hll->n, dq);
+    hll->Q_index_n = hll->n;
+    TRACE_END();
+  }
+
+  // recompute the affected cache entries
+  int num_affected = 0;
+  if (cache->n > 0) {
+    hll_cache_detach(hll);
+    double **QA, **XA, ***SA;
+    safe_malloc(QA, cache->n, double*);
+    safe_malloc(XA, cache->n, double*);
+    safe_malloc(SA, cache->n, double**);
+    for (i = 0; i < cache->n; i++) {
+      if (affected[i]) {
+	QA[num_affected] = cache->Q[i];
+	XA[num_affected] = cache->X[i];
+	SA[num_affected++] = cache->S[i];
+      }
+    }
+    hll_sample_args_t args = {XA, SA, QA, hll, hll->Q_index != NULL};
+    parallel_for(num_affected, hll_sample_block, &args);
+
+    free(QA);
+    free(XA);
+    free(SA);
+    free(affected);
+  }
+  TRACE_COUNT("hll_add_samples.recomputed_cache_entries", num_affected);
 
-  // cache in hll
-  hll->cache.Q_kdtree = Q_kdtree;
-  hll->cache.Q = matrix_clone(Q, n, hll->dq);
-  hll->cache.X = X;
-  hll->cache.S = S;
-  hll->cache.n = n;
+  TRACE_END();
+
+  return num_affected;
 }
 
 
 /*
  * Sample n Gaussians (with means X and covariances S) from HLL at sample points Q.
+ *
+ * Uses the cache if there is one; otherwise each sample is a kernel regression
+ * over the training samples within the kernel's support, found with radius
+ * searches in hll->Q_index.  Large batches of queries are split across threads.
  */
 void hll_sample(double **X, double ***S, double **Q, hll_t *hll, int n)
 {
-  int i, j;
-  if (hll->cache.n > 0) {
-    for (i = 0; i < n; i++) {
-      j = kdtree_NN(hll->cache.Q_kdtree, Q[i]);
-      memcpy(X[i], hll->cache.X[j], hll->dx * sizeof(double));
-      matrix_copy(S[i], hll->cache.S[j], hll->dx, hll->dx);
-    }
-    return;
+  TRACE_BEGIN("hll_sample");
+  TRACE_COUNT("hll_sample.queries", n);
+
+  if (hll->cache.n > 0)
+    hll_sample_cache(X, S, Q, hll, n);
+  else {
+    hll_sample_args_t args = {X, S, Q, hll, hll->Q_index != NULL};
+    parallel_for(n, hll_sample_block, &args);
+
+    if (hll_validate && args.use_index)
+      hll_sample_validate(X, S, Q, hll, n);
   }
 
-  double r = hll->r;
-  int nx = hll->dx;
-  int nq = hll->dq;
+  TRACE_END();
+}
 
-  double **WS = new_matrix2(nx, nx);
 
+/*
+ * Sample from an HLL by a full scan over its training samples (ignoring the cache
+ * and the quaternion index).  This is the reference implementation of hll_sample().
+ */
+void hll_sample_scan(double **X, double ***S, double **Q, hll_t *hll, int n)
+{
+  hll_sample_args_t args = {X, S, Q, hll, 0};
+  parallel_for(n, hll_sample_block, &args);
+}
+
+
+/*
+ * Turn validation of hll_sample() on or off.  When it's on, every (uncached)
+ * call to hll_sample() is checked against hll_sample_scan(), and mismatches
+ * are printed to stderr.
+ */
+void hll_set_validation(int validate)
+{
+  hll_validate = validate;
+}
+
+
+/*
+ * Hash of an HLL's training data and kernel parameters (everything its local
+ * likelihood distributions depend on).  Used to reject stale cache files.
+ */
+uint64_t hll_hash(hll_t *hll)
+{
+  int i, dims[3] = {hll->n, hll->dq, hll->dx};
+  uint64_t h = 14695981039346656037ULL;
+
+  h = hll_hash_bytes(h, dims, sizeof(dims));
+  h = hll_hash_bytes(h, &hll->r, sizeof(double));
+  h = hll_hash_bytes(h, &hll->w0, sizeof(double));
+  h = hll_hash_bytes(h, hll->x0, hll->dx * sizeof(double));
+  for (i = 0; i < hll->dx; i++)
+    h = hll_hash_bytes(h, hll->S0[i], hll->dx * sizeof(double));
+  for (i = 0; i < hll->n; i++) {
+    h = hll_hash_bytes(h, hll->Q[i], hll->dq * sizeof(double));
+    h = hll_hash_bytes(h, hll->X[i], hll->dx * sizeof(double));
+  }
+
+  return h;
+}
+
+
+/*
+ * Save the caches of n hlls to a binary file.  Returns 0 on success, -1 on failure.
+ *
+ * The file is a header, a table of (hash, n, dq, dx, offset) entries, and then
+ * the contiguous Q, X, and S arrays of each cache (at 8-byte aligned offsets),
+ * so that hll_load_cache() can map it directly into memory.
+ */
+int hll_save_cache(const char *fname, hll_t *hlls, int n)
+{
+  FILE *f = fopen(fname, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Error: Can't open %s for writing\n", fname);
+    return -1;
+  }
+
+  hll_cache_file_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, HLL_CACHE_MAGIC, 8);
+  header.version = HLL_CACHE_VERSION;
+  header.num_hlls = n;
+
+  int i, j;
+  hll_cache_file_entry_t *entries;
+  safe_calloc(entries, MAX(n, 1), hll_cache_file_entry_t);
+  int64_t offset = sizeof(header) + n*sizeof(hll_cache_file_entry_t);
   for (i = 0; i < n; i++) {
+    hll_cache_t *cache = &hlls[i].cache;
+    entries[i].hash = hll_hash(&hlls[i]);
+    entries[i].n = cache->n;
+    entries[i].dq = hlls[i].dq;
+    entries[i].dx = hlls[i].dx;
+    entries[i].offset = offset;
+    offset += (int64_t)cache->n * (hlls[i].dq + hlls[i].dx + hlls[i].dx*hlls[i].dx) * sizeof(double);
+  }
 
-    //printf("q = [%.2f %.2f %.2f %.2f]\n", Q[0][0], Q[0][1], Q[0][2], Q[0][3]);
+  int ok = (fwrite(&header, sizeof(header), 1, f) == 1);
+  ok = ok && (fwrite(entries, sizeof(hll_cache_file_entry_t), n, f) == n);
+
+  for (i = 0; ok && i < n; i++) {
+    hll_cache_t *cache = &hlls[i].cache;
+    int dq = hlls[i].dq, dx = hlls[i].dx;
+    for (j = 0; ok && j < cache->n; j++)
+      ok = (fwrite(cache->Q[j], sizeof(double), dq, f) == dq);
+    for (j = 0; ok && j < cache->n; j++)
+      ok = (fwrite(cache->X[j], sizeof(double), dx, f) == dx);
+    for (j = 0; ok && j < cache->n*dx; j++)
+      ok = (fwrite(cache->S[j/dx][j%dx], sizeof(double), dx, f) == dx);
+  }
 
-    //for (j = 0; j < hll->n; j++)
-    //  printf("hll->Q[%d] = [%.2f %.2f %.2f %.2f]\n", j, hll->Q[j][0], hll->Q[j][1], hll->Q[j][2], hll->Q[j][3]);
+  free(entries);
 
-    // compute weights
-    double dq, qdot;
-    double w[hll->n];
-    //printf("w = [");
-    for (j = 0; j < hll->n; j++) {
-      qdot = fabs(dot(Q[i], hll->Q[j], nq));
-      dq = acos(MIN(qdot, 1.0));
-      w[j] = exp(-(dq/r)*(dq/r));
-      //printf("%.2f ", w[j]);
-    }
-    //printf("]\n");
+  if (fclose(f) != 0 || !ok) {
+    fprintf(stderr, "Error: couldn't write hll cache file %s\n", fname);
+    return -1;
+  }
 
-    // threshold weights
-    double wmax = arr_max(w, hll->n);
-    double wthresh = wmax/50;  //dbug: make this a parameter?
-    for (j = 0; j < hll->n; j++)
-      if (w[j] < wthresh)
-	w[j] = 0;
-    double wtot = hll->w0 + sum(w, hll->n);
-
-    // compute posterior mean
-    mult(X[i], hll->x0, hll->w0, nx);  // X[i] = w0*x0
-    for (j = 0; j < hll->n; j++) {
-      if (w[j] > 0) {
-	double wx[nx];
-	mult(wx, hll->X[j], w[j], nx);
-	add(X[i], X[i], wx, nx);       // X[i] += wx
-      }
-    }
-    mult(X[i], X[i], 1/wtot, nx);  // X[i] /= wtot
-
-    // compute posterior covariance matrix
-    mult(S[i][0], hll->S0[0], hll->w0, nx*nx);  // S[i] = w0*S0
-
-    for (j = 0; j < hll->n; j++) {
-      if (w[j] > 0) {
-	double wdx[nx];
-	sub(wdx, hll->X[j], X[i], nx);
-	mult(wdx, wdx, w[j], nx);
-	outer_prod(WS, wdx, wdx, nx, nx);    // WS = wdx'*wdx
-	matrix_add(S[i], S[i], WS, nx, nx);  // S[i] += WS
-      }
+  return 0;
+}
+
+
+/*
+ * Load the caches of n hlls from a binary file written by hll_save_cache().  The file
+ * is mmapped (where possible), and the caches point directly into it.  Caches whose
+ * hash doesn't match the hll's current training data (see hll_hash()) are rejected.
+ * Returns the number of caches loaded, or -1 if the file couldn't be read.
+ */
+int hll_load_cache(const char *fname, hll_t *hlls, int n)
+{
+  char *data = NULL;
+  size_t size = 0;
+  int mapped = 0;
+
+#ifndef HAVE_WINDOWS
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    size = st.st_size;
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+      data = NULL;
+    else
+      mapped = 1;
+  }
+  close(fd);
+#else
+  FILE *f = fopen(fname, "rb");
+  if (f == NULL)
+    return -1;
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  safe_malloc(data, size, char);
+  if (fread(data, 1, size, f) != size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+#endif
+
+  if (data == NULL) {
+    fprintf(stderr, "Warning: couldn't read hll cache file %s\n", fname);
+    return -1;
+  }
+
+  hll_cache_map_t *map;
+  safe_calloc(map, 1, hll_cache_map_t);
+  map->data = data;
+  map->size = size;
+  map->mapped = mapped;
+  map->refcount = 1;
+
+  // check the header
+  hll_cache_file_header_t *header = (hll_cache_file_header_t *)data;
+  hll_cache_file_entry_t *entries = (hll_cache_file_entry_t *)(data + sizeof(hll_cache_file_header_t));
+  if (size < sizeof(hll_cache_file_header_t) ||
+      memcmp(header->magic, HLL_CACHE_MAGIC, 8) != 0 ||
+      header->version != HLL_CACHE_VERSION ||
+      header->num_hlls < 0 ||
+      size < sizeof(hll_cache_file_header_t) + header->num_hlls*sizeof(hll_cache_file_entry_t)) {
+    fprintf(stderr, "Warning: %s is not a valid hll cache file\n", fname);
+    hll_cache_map_release(map);
+    return -1;
+  }
+
+  int i, cnt = 0;
+  for (i = 0; i < MIN(n, header->num_hlls); i++) {
+    hll_cache_file_entry_t *e = &entries[i];
+    size_t entry_size = (size_t)e->n * (e->dq + e->dx + e->dx*e->dx) * sizeof(double);
+    if (e->n <= 0 || e->dq != hlls[i].dq || e->dx != hlls[i].dx ||
+	e->offset < 0 || e->offset % sizeof(double) != 0 || e->offset + entry_size > size)
+      continue;
+    if (e->hash != hll_hash(&hlls[i])) {
+      fprintf(stderr, "Warning: ignoring stale cache for hll %d in %s\n", i, fname);
+      continue;
     }
 
-    mult(S[i][0], S[i][0], 1/wtot, nx*nx);  // S[i] /= wtot
+    double *Q = (double *)(data + e->offset);
+    double *X = Q + e->n * e->dq;
+    double *S = X + e->n * e->dx;
+
+    hll_free_cache(&hlls[i]);
+    hll_cache_set_arrays(&hlls[i].cache, Q, X, S, e->n, e->dq, e->dx);
+    hlls[i].cache.Q_index = quaternion_index(hlls[i].cache.Q, e->n, e->dq);
+    hlls[i].cache.map = map;
+    map->refcount++;
+    cnt++;
   }
 
-  free_matrix2(WS);
+  hll_cache_map_release(map);
+
+  return cnt;
 }
 
 
 /*
- * Load hlls from a file.
+ * Load hlls from a file (in either the binary format of save_hlls_binary(),
+ * or the text format below).
  *
- * .HLL format:
+ * .HLL text format:
  *
  *    num_hlls
  *    <hll> <n> <ncache> <dq> <dx> <r> <w0> <x0> <S0>
@@ -252,6 +951,16 @@ hll_t *load_hlls(char *fname, int *n)
     return NULL;
   }
 
+  // check for a binary hll file
+  char magic[8];
+  if (fread(magic, 1, 8, f) == 8 && memcmp(magic, HLL_FILE_MAGIC, 8) == 0) {
+    fclose(f);
+    return load_hlls_binary(fname, n);
+  }
+  rewind(f);
+
+  TRACE_BEGIN("load_hlls");
+
   int i, i2, j, j2, k, l;
   hll_t *hlls = NULL;
 
@@ -277,13 +986,8 @@ hll_t *load_hlls(char *fname, int *n)
     hlls[i].S0 = new_matrix2(hlls[i].dx, hlls[i].dx);
 
     // alloc cache
-    if (hlls[i].cache.n > 0) {
-      hlls[i].cache.Q = new_matrix2(hlls[i].cache.n, hlls[i].dq);
-      hlls[i].cache.X = new_matrix2(hlls[i].cache.n, hlls[i].dx);
-      safe_calloc(hlls[i].cache.S, hlls[i].cache.n, double**);
-      for (j = 0; j < hlls[i].cache.n; j++)
-	hlls[i].cache.S[j] = new_matrix2(hlls[i].dx, hlls[i].dx);
-    }
+    if (hlls[i].cache.n > 0)
+      hll_cache_alloc(&hlls[i].cache, hlls[i].cache.n, hlls[i].dq, hlls[i].dx);
 
     //fprintf(stderr, "break 1.2\n"); //dbug
 
@@ -333,14 +1037,19 @@ hll_t *load_hlls(char *fname, int *n)
 
   //fprintf(stderr, "break 4\n"); //dbug
 
-  // create cache kdtrees
-  for (i = 0; i < *n; i++)
-    hlls[i].cache.Q_kdtree = kdtree(hlls[i].cache.Q, hlls[i].cache.n, hlls[i].dq);
+  // create quaternion indices
+  for (i = 0; i < *n; i++) {
+    hlls[i].Q_index = quaternion_index(hlls[i].Q, hlls[i].n, hlls[i].dq);
+    hlls[i].Q_index_n = hlls[i].n;
+    hlls[i].cache.Q_index = quaternion_index(hlls[i].cache.Q, hlls[i].cache.n, hlls[i].dq);
+  }
 
   fclose(f);
 
   //save_hlls("test.hll", hlls, *n); //dbug
 
+  TRACE_END();
+
   return hlls;
 
  ERROR:
@@ -349,6 +1058,7 @@ hll_t *load_hlls(char *fname, int *n)
       hll_free(&hlls[i]);
     free(hlls);
   }
+  TRACE_END();
   return NULL;
 }
 
@@ -408,3 +1118,181 @@ void save_hlls(char *fname, hll_t *hlls, int n)
 
   fclose(f);
 }
+
+
+/*
+ * Load hlls from a binary file written by save_hlls_binary().
+ */
+hll_t *load_hlls_binary(char *fname, int *n)
+{
+  FILE *f = fopen(fname, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Error: Can't open %s for reading\n", fname);
+    return NULL;
+  }
+
+  TRACE_BEGIN("load_hlls_binary");
+
+  fseek(f, 0, SEEK_END);
+  int64_t size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  hll_t *hlls = NULL;
+  hll_file_entry_t *entries = NULL;
+  int i;
+  *n = 0;
+
+  // read the header and the entry table
+  hll_file_header_t header;
+  if (fread(&header, sizeof(header), 1, f) < 1 ||
+      memcmp(header.magic, HLL_FILE_MAGIC, 8) != 0 ||
+      header.version != HLL_FILE_VERSION ||
+      header.num_hlls < 0 ||
+      size < sizeof(header) + (int64_t)header.num_hlls * sizeof(hll_file_entry_t))
+    goto ERROR;
+  int num_hlls = header.num_hlls;
+  int use_float = (header.flags & HLL_FILE_FLOAT) != 0;
+  safe_malloc(entries, MAX(num_hlls, 1), hll_file_entry_t);
+  if (fread(entries, sizeof(hll_file_entry_t), num_hlls, f) < num_hlls) goto ERROR;
+
+  // create hlls
+  safe_calloc(hlls, MAX(num_hlls, 1), hll_t);
+  *n = num_hlls;
+
+  for (i = 0; i < num_hlls; i++) {
+    hll_file_entry_t *e = &entries[i];
+    hll_t *hll = &hlls[i];
+    size_t real_size = (use_float ? sizeof(float) : sizeof(double));
+    if (e->n < 0 || e->ncache < 0 || e->dq <= 0 || e->dx <= 0 ||
+	e->offset < 0 || e->offset + (int64_t)(e->dx + e->dx*e->dx) * sizeof(double) +
+	((int64_t)e->n * (e->dq + e->dx) + (int64_t)e->ncache * (e->dq + e->dx + e->dx*e->dx)) * real_size > size)
+      goto ERROR;
+
+    hll->n = e->n;
+    hll->dq = e->dq;
+    hll->dx = e->dx;
+    hll->r = e->r;
+    hll->w0 = e->w0;
+
+    // read x0, S0, Q, X
+    safe_calloc(hll->x0, hll->dx, double);
+    hll->S0 = new_matrix2(hll->dx, hll->dx);
+    fseek(f, e->offset, SEEK_SET);
+    if (!hll_fread_array(hll->x0, hll->dx, 0, f)) goto ERROR;
+    if (!hll_fread_array(hll->S0[0], hll->dx*hll->dx, 0, f)) goto ERROR;
+    if (hll->n > 0) {
+      hll->Q = new_matrix2(hll->n, hll->dq);
+      hll->X = new_matrix2(hll->n, hll->dx);
+      if (!hll_fread_array(hll->Q[0], (size_t)hll->n*hll->dq, use_float, f)) goto ERROR;
+      if (!hll_fread_array(hll->X[0], (size_t)hll->n*hll->dx, use_float, f)) goto ERROR;
+    }
+    hll->Q_index = quaternion_index(hll->Q, hll->n, hll->dq);
+    hll->Q_index_n = hll->n;
+
+    // read cache
+    if (e->ncache > 0) {
+      hll_cache_t *cache = &hll->cache;
+      hll_cache_alloc(cache, e->ncache, hll->dq, hll->dx);
+      if (!hll_fread_array(cache->Q[0], (size_t)cache->n*hll->dq, use_float, f)) goto ERROR;
+      if (!hll_fread_array(cache->X[0], (size_t)cache->n*hll->dx, use_float, f)) goto ERROR;
+      if (!hll_fread_array(cache->S[0][0], (size_t)cache->n*hll->dx*hll->dx, use_float, f)) goto ERROR;
+      cache->Q_index = quaternion_index(cache->Q, cache->n, hll->dq);
+    }
+  }
+
+  free(entries);
+  fclose(f);
+
+  TRACE_END();
+
+  return hlls;
+
+ ERROR:
+  fprintf(stderr, "Error: %s is not a valid binary hll file\n", fname);
+  if (hlls) {
+    for (i = 0; i < *n; i++)
+      hll_free(&hlls[i]);
+    free(hlls);
+  }
+  if (entries)
+    free(entries);
+  *n = 0;
+  fclose(f);
+  TRACE_END();
+  return NULL;
+}
+
+
+/*
+ * Save hlls to a binary file.  The training data (Q,X) and caches are stored
+ * as floats if use_float is non-zero (halving the file size); the priors are
+ * always stored as doubles.  Returns 0 on success, -1 on failure.
+ *
+ * .HLL binary format:
+ *
+ *    header:  "BHHLLBIN" <version> <num_hlls> <flags> <pad>
+ *    entries: <n> <ncache> <dq> <dx> <r> <w0> <offset>
+ *               ...
+ *    data:    <x0> <S0> <Q> <X> <cache Q> <cache X> <cache S>   (at each entry's offset)
+ *               ...
+ */
+int save_hlls_binary(char *fname, hll_t *hlls, int n, int use_float)
+{
+  FILE *f = fopen(fname, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Error: Can't open %s for writing\n", fname);
+    return -1;
+  }
+
+  hll_file_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, HLL_FILE_MAGIC, 8);
+  header.version = HLL_FILE_VERSION;
+  header.num_hlls = n;
+  header.flags = (use_float ? HLL_FILE_FLOAT : 0);
+
+  int i, j;
+  size_t real_size = (use_float ? sizeof(float) : sizeof(double));
+  hll_file_entry_t *entries;
+  safe_calloc(entries, MAX(n, 1), hll_file_entry_t);
+  int64_t offset = sizeof(header) + n*sizeof(hll_file_entry_t);
+  for (i = 0; i < n; i++) {
+    hll_t *hll = &hlls[i];
+    entries[i].n = hll->n;
+    entries[i].ncache = hll->cache.n;
+    entries[i].dq = hll->dq;
+    entries[i].dx = hll->dx;
+    entries[i].r = hll->r;
+    entries[i].w0 = hll->w0;
+    entries[i].offset = offset;
+    offset += (int64_t)(hll->dx + hll->dx*hll->dx) * sizeof(double) +
+      ((int64_t)hll->n * (hll->dq + hll->dx) + (int64_t)hll->cache.n * (hll->dq + hll->dx + hll->dx*hll->dx)) * real_size;
+    offset = (offset + sizeof(double) - 1) / sizeof(double) * sizeof(double);
+  }
+
+  int ok = (fwrite(&header, sizeof(header), 1, f) == 1);
+  ok = ok && (fwrite(entries, sizeof(hll_file_entry_t), n, f) == n);
+
+  for (i = 0; ok && i < n; i++) {
+    hll_t *hll = &hlls[i];
+    hll_cache_t *cache = &hll->cache;
+    fseek(f, entries[i].offset, SEEK_SET);
+    ok = (fwrite(hll->x0, sizeof(double), hll->dx, f) == hll->dx);
+    ok = ok && hll_fwrite_rows(hll->S0, hll->dx, hll->dx, 0, f);
+    ok = ok && hll_fwrite_rows(hll->Q, hll->n, hll->dq, use_float, f);
+    ok = ok && hll_fwrite_rows(hll->X, hll->n, hll->dx, use_float, f);
+    ok = ok && hll_fwrite_rows(cache->Q, cache->n, hll->dq, use_float, f);
+    ok = ok && hll_fwrite_rows(cache->X, cache->n, hll->dx, use_float, f);
+    for (j = 0; ok && j < cache->n; j++)
+      ok = hll_fwrite_rows(cache->S[j], hll->dx, hll->dx, use_float, f);
+  }
+
+  free(entries);
+
+  if (fclose(f) != 0 || !ok) {
+    fprintf(stderr, "Error: couldn't write hll file %s\n", fname);
+    return -1;
+  }
+
+  return 0;
+}
@@ -4,14 +4,50 @@
 #include <string.h>
 #include <math.h>
 #include <float.h>
+#include <stdint.h>
+#include <pthread.h>
+#ifndef HAVE_WINDOWS
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "bingham/util.h"
 #include "bingham/hypersphere.h"
 
 
 
-// cached tessellations of S^3
+// cached tessellations of S^3 (built or loaded lazily, see tessellate_S3())
 #define MAX_LEVELS 20
 hypersphere_tessellation_t tessellations[MAX_LEVELS];
+static int tessellation_ready[MAX_LEVELS];
+static pthread_mutex_t tessellation_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// tessellation cache file
+#define TESSELLATION_CACHE_MAGIC "BHS3TESS"
+#define TESSELLATION_CACHE_VERSION 1
+
+typedef struct {
+  char magic[8];
+  int32_t version;
+  int32_t num_levels;
+} tessellation_cache_header_t;
+
+typedef struct {
+  int32_t n;         // number of cells
+  int32_t nv;        // number of vertices
+  int32_t d;         // dimension
+  int32_t pad;
+  int64_t offset;    // file offset of: vertices (nv*d doubles), centroids (n*d doubles), volumes (n doubles), tetrahedra (n*4 ints)
+} tessellation_cache_level_t;
+
+static struct {
+  char *data;                          // mapped (or read) cache file
+  size_t size;
+  int mapped;                          // is data mmapped?
+  int num_levels;
+  tessellation_cache_level_t *levels;  // level table (points into data)
+} tessellation_cache;
 
 #define PROXIMITY_QUEUE_SIZE 100
 #define PROXIMITY_QUEUE_MEMORY_LIMIT 1e6
@@ -32,6 +68,16 @@ static void reproject_vertices(double **vertices, int nv, int dim)
 }
 
 
+// initial (level 0) mesh of S3
+static const double S3_vertices[8][4] = {{1,0,0,0}, {0,1,0,0}, {0,0,1,0}, {0,0,0,1},
+					 {-1,0,0,0}, {0,-1,0,0}, {0,0,-1,0}, {0,0,0,-1}};
+
+static const int S3_tetrahedra[16][4] = {{0,1,2,3}, {0,1,2,7}, {0,1,6,3}, {0,5,2,3},
+					 {0,1,6,7}, {0,5,2,7}, {0,5,6,3}, {0,5,6,7},
+					 {4,1,2,3}, {4,1,2,7}, {4,1,6,3}, {4,5,2,3},
+					 {4,1,6,7}, {4,5,2,7}, {4,5,6,3}, {4,5,6,7}};
+
+
 /*
  * Create the initial (low-res) mesh of S3 (in R4).
  */
@@ -41,16 +87,8 @@ static octetramesh_t *init_mesh_S3_octetra()
   safe_calloc(mesh, 1, octetramesh_t);
   octetramesh_new(mesh, 8, 16, 0, 4);
 
-  double vertices[8][4] = {{1,0,0,0}, {0,1,0,0}, {0,0,1,0}, {0,0,0,1},
-			   {-1,0,0,0}, {0,-1,0,0}, {0,0,-1,0}, {0,0,0,-1}};
-
-  int tetrahedra[16][4] = {{0,1,2,3}, {0,1,2,7}, {0,1,6,3}, {0,5,2,3},
-			   {0,1,6,7}, {0,5,2,7}, {0,5,6,3}, {0,5,6,7},
-			   {4,1,2,3}, {4,1,2,7}, {4,1,6,3}, {4,5,2,3},
-			   {4,1,6,7}, {4,5,2,7}, {4,5,6,3}, {4,5,6,7}};
-
-  memcpy(mesh->vertices[0], vertices, 8*4*sizeof(double));
-  memcpy(mesh->tetrahedra[0], tetrahedra, 16*4*sizeof(int));
+  memcpy(mesh->vertices[0], S3_vertices, 8*4*sizeof(double));
+  memcpy(mesh->tetrahedra[0], S3_tetrahedra, 16*4*sizeof(int));
 
   return mesh;
 }
@@ -68,9 +106,7 @@ static octetramesh_t *build_octetra(int level)
   for (i = 0; i < level; i++) {
     octetramesh_subdivide(&tmp, mesh);
     octetramesh_free(mesh);
-    free(mesh);
-    mesh = octetramesh_clone(&tmp);
-    octetramesh_free(&tmp);
+    *mesh = tmp;  // move (rather than clone) the subdivided mesh into place
   }
 
   reproject_vertices(mesh->vertices, mesh->nv, mesh->d);
@@ -152,39 +188,278 @@ static void octetramesh_to_tessellation(hypersphere_tessellation_t *T, octetrame
 
 
 /*
- * Pre-cache some tessellations of hyperspheres.
+ * Create a matrix of row pointers into a contiguous (n*m) block of data.
  */
-void hypersphere_init()
+static double **matrix2_view(double *data, int n, int m)
 {
-  double t0 = get_time_ms();
+  double **X;
+  safe_malloc(X, n, double *);
+  int i;
+  for (i = 0; i < n; i++)
+    X[i] = data + i*m;
+  return X;
+}
+
 
+/*
+ * Create a matrix of row pointers into a contiguous (n*m) block of ints.
+ */
+static int **matrix2i_view(int *data, int n, int m)
+{
+  int **X;
+  safe_malloc(X, n, int *);
   int i;
-  const int levels = 5; //7;
+  for (i = 0; i < n; i++)
+    X[i] = data + i*m;
+  return X;
+}
 
-  memset(tessellations, 0, MAX_LEVELS*sizeof(hypersphere_tessellation_t));
 
-  for (i = 0; i < levels; i++) {
-    octetramesh_t *mesh = build_octetra(i);
-    octetramesh_to_tessellation(&tessellations[i], mesh);
+/*
+ * Fill in the fields of a hypersphere_tessellation from a level of the tessellation cache
+ * (without copying the vertices, centroids, volumes, or tetrahedra).  The mesh and centroid
+ * matrices are views into the (private, writable) cache mapping, so in-place mesh operations
+ * work on them, but they must never be freed (e.g. with tetramesh_free()).
+ */
+static void cache_level_to_tessellation(hypersphere_tessellation_t *T, int level)
+{
+  tessellation_cache_level_t *L = &tessellation_cache.levels[level];
+  int n = L->n, nv = L->nv, d = L->d;
+
+  double *vertices = (double *)(tessellation_cache.data + L->offset);
+  double *centroids = vertices + nv*d;
+  double *volumes = centroids + n*d;
+  int *tetrahedra = (int *)(volumes + n);
+
+  safe_calloc(T->tetramesh, 1, tetramesh_t);
+  T->tetramesh->nv = nv;
+  T->tetramesh->nt = n;
+  T->tetramesh->d = d;
+  T->tetramesh->vertices = matrix2_view(vertices, nv, d);
+  T->tetramesh->tetrahedra = matrix2i_view(tetrahedra, n, 4);
+
+  T->n = n;
+  T->d = d;
+  T->centroids = matrix2_view(centroids, n, d);
+  T->volumes = volumes;
+}
+
+
+/*
+ * Build (or load from the cache) the tessellation at a given level, if it isn't already built.
+ * Thread-safe.
+ */
+static void tessellation_build_level(int level)
+{
+  if (__atomic_load_n(&tessellation_ready[level], __ATOMIC_ACQUIRE))
+    return;
+
+  pthread_mutex_lock(&tessellation_mutex);
+
+  if (!tessellation_ready[level]) {
+    if (level < tessellation_cache.num_levels)
+      cache_level_to_tessellation(&tessellations[level], level);
+    else {
+      octetramesh_t *mesh = build_octetra(level);
+      octetramesh_to_tessellation(&tessellations[level], mesh);
+      octetramesh_free(mesh);
+      free(mesh);
+    }
+    __atomic_store_n(&tessellation_ready[level], 1, __ATOMIC_RELEASE);
   }
 
-  fprintf(stderr, "Initialized %d hypersphere tessellations (up to %d cells) in %.0f ms\n",
-	  levels, tessellations[levels-1].n, get_time_ms() - t0);
+  pthread_mutex_unlock(&tessellation_mutex);
 }
 
 
 /*
- * Returns a tesselation of the 3-sphere (in R4) with at least n cells.
+ * Load a tessellation cache file (written by hypersphere_save_cache()).  Cached levels are
+ * mapped into memory (privately, so changes to them never reach the file), and only unpacked into
+ * tessellations the first time they're requested.  Must be called before any tessellations are requested.  Returns 0 on success, -1 on failure.
+ */
+int hypersphere_load_cache(const char *filename)
+{
+  char *data = NULL;
+  size_t size = 0;
+  int mapped = 0;
+
+#ifndef HAVE_WINDOWS
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Warning: couldn't open tessellation cache file %s\n", filename);
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    size = st.st_size;
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);  // copy-on-write, for in-place mesh ops
+    if (data == MAP_FAILED)
+      data = NULL;
+    else
+      mapped = 1;
+  }
+  close(fd);
+#else
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Warning: couldn't open tessellation cache file %s\n", filename);
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  safe_malloc(data, size, char);
+  if (fread(data, 1, size, f) != size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+#endif
+
+  if (data == NULL) {
+    fprintf(stderr, "Warning: couldn't read tessellation cache file %s\n", filename);
+    return -1;
+  }
+
+  // check the header and the level table
+  tessellation_cache_header_t *header = (tessellation_cache_header_t *)data;
+  tessellation_cache_level_t *levels = (tessellation_cache_level_t *)(data + sizeof(tessellation_cache_header_t));
+  int i, ok = (size >= sizeof(tessellation_cache_header_t) &&
+	       memcmp(header->magic, TESSELLATION_CACHE_MAGIC, 8) == 0 &&
+	       header->version == TESSELLATION_CACHE_VERSION &&
+	       header->num_levels >= 0 && header->num_levels <= MAX_LEVELS &&
+	       size >= sizeof(tessellation_cache_header_t) + header->num_levels*sizeof(tessellation_cache_level_t));
+  for (i = 0; ok && i < header->num_levels; i++) {
+    tessellation_cache_level_t *L = &levels[i];
+    size_t level_size = ((size_t)L->nv*L->d + (size_t)L->n*L->d + L->n)*sizeof(double) + (size_t)L->n*4*sizeof(int);
+    ok = (L->n > 0 && L->nv > 0 && L->d == 4 && L->offset >= 0 && L->offset % sizeof(double) == 0 &&
+	  L->offset + level_size <= size);
+    if (ok) {  // every tetrahedron must index into the level's vertices
+      int *tetrahedra = (int *)(data + L->offset + level_size - (size_t)L->n*4*sizeof(int));
+      size_t j;
+      for (j = 0; ok && j < (size_t)L->n*4; j++)
+	ok = (tetrahedra[j] >= 0 && tetrahedra[j] < L->nv);
+    }
+  }
+  if (!ok) {
+    fprintf(stderr, "Warning: %s is not a valid tessellation cache file\n", filename);
+#ifndef HAVE_WINDOWS
+    munmap(data, size);
+#else
+    free(data);
+#endif
+    return -1;
+  }
+
+  pthread_mutex_lock(&tessellation_mutex);
+
+  // only levels that haven't been built yet can come from the cache
+  int num_levels = 0;
+  while (num_levels < header->num_levels && !tessellation_ready[num_levels])
+    num_levels++;
+
+  tessellation_cache.data = data;
+  tessellation_cache.size = size;
+  tessellation_cache.mapped = mapped;
+  tessellation_cache.levels = levels;
+  tessellation_cache.num_levels = num_levels;
+
+  pthread_mutex_unlock(&tessellation_mutex);
+
+  return 0;
+}
+
+
+/*
+ * Write tessellations of S^3 at levels 0 through num_levels-1 to a cache file
+ * (building them if necessary).  Returns 0 on success, -1 on failure.
+ */
+int hypersphere_save_cache(const char *filename, int num_levels)
+{
+  if (num_levels > MAX_LEVELS)
+    num_levels = MAX_LEVELS;
+
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Error: couldn't open %s for writing\n", filename);
+    return -1;
+  }
+
+  tessellation_cache_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TESSELLATION_CACHE_MAGIC, 8);
+  header.version = TESSELLATION_CACHE_VERSION;
+  header.num_levels = num_levels;
+
+  tessellation_cache_level_t levels[num_levels];
+  memset(levels, 0, num_levels*sizeof(tessellation_cache_level_t));
+  int64_t offset = sizeof(header) + num_levels*sizeof(tessellation_cache_level_t);
+  int i, j;
+  for (i = 0; i < num_levels; i++) {
+    tessellation_build_level(i);
+    hypersphere_tessellation_t *T = &tessellations[i];
+    levels[i].n = T->n;
+    levels[i].nv = T->tetramesh->nv;
+    levels[i].d = T->d;
+    levels[i].offset = offset;
+    offset += ((int64_t)levels[i].nv*T->d + (int64_t)T->n*T->d + T->n)*sizeof(double) + (int64_t)T->n*4*sizeof(int);
+    offset = (offset + sizeof(double) - 1) / sizeof(double) * sizeof(double);
+  }
+
+  int ok = (fwrite(&header, sizeof(header), 1, f) == 1);
+  ok = ok && (fwrite(levels, sizeof(tessellation_cache_level_t), num_levels, f) == num_levels);
+
+  for (i = 0; ok && i < num_levels; i++) {
+    hypersphere_tessellation_t *T = &tessellations[i];
+    tetramesh_t *mesh = T->tetramesh;
+    int n = T->n, d = T->d;
+
+    fseek(f, levels[i].offset, SEEK_SET);
+    for (j = 0; ok && j < mesh->nv; j++)
+      ok = (fwrite(mesh->vertices[j], sizeof(double), d, f) == d);
+    for (j = 0; ok && j < n; j++)
+      ok = (fwrite(T->centroids[j], sizeof(double), d, f) == d);
+    ok = ok && (fwrite(T->volumes, sizeof(double), n, f) == n);
+    for (j = 0; ok && j < n; j++)
+      ok = (fwrite(mesh->tetrahedra[j], sizeof(int), 4, f) == 4);
+  }
+
+  if (fclose(f) != 0 || !ok) {
+    fprintf(stderr, "Error: couldn't write tessellation cache file %s\n", filename);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Initialize the hypersphere tessellations.  Tessellations are built lazily (the first time
+ * they're requested by tessellate_S3()), or mapped from a cache file if the environment variable
+ * BINGHAM_TESSELLATION_CACHE is set (see hypersphere_load_cache()).
+ */
+void hypersphere_init()
+{
+  const char *cache_file = getenv("BINGHAM_TESSELLATION_CACHE");
+
+  if (cache_file && tessellation_cache.data == NULL) {
+    double t0 = get_time_ms();
+    if (hypersphere_load_cache(cache_file) == 0)
+      fprintf(stderr, "Loaded %d hypersphere tessellations from %s in %.0f ms\n",
+	      tessellation_cache.num_levels, cache_file, get_time_ms() - t0);
+  }
+}
+
+
+/*
+ * Returns a tesselation of the 3-sphere (in R4) with at least n cells.  Thread-safe.
  */
 hypersphere_tessellation_t *tessellate_S3(int n)
 {
   int i;
   for (i = 0; i < MAX_LEVELS; i++) {
-    if (tessellations[i].tetramesh == NULL) {
-      octetramesh_t *mesh = build_octetra(i);
-      octetramesh_to_tessellation(&tessellations[i], mesh);
-    }
-    if (tessellations[i].tetramesh->nt >= n)
+    tessellation_build_level(i);
+    if (tessellations[i].n >= n)
       return &tessellations[i];
   }
 
@@ -197,6 +472,844 @@ hypersphere_tessellation_t *tessellate_S3(int n)
 
 
 
+/*
+ * Returns the tesselation of the 3-sphere (in R4) at a given level (# of subdivisions),
+ * which has 16*8^level cells.  Thread-safe.
+ */
+hypersphere_tessellation_t *tessellate_S3_level(int level)
+{
+  level = MAX(0, MIN(level, MAX_LEVELS-1));
+  tessellation_build_level(level);
+
+  return &tessellations[level];
+}
+
+
+/*
+ * Volume of the radial projection of a (flat) tetrahedron in R4 onto the unit 3-sphere, i.e. the integral
+ * of h/|y|^4 over the tetrahedron (where h is the distance from the origin to its hyperplane), which is
+ * |det([v0 v1 v2 v3])|/6 times the average of 1/|y|^4.  The average is computed with a 4-point (degree 2)
+ * rule on each of the 8 children of the tetrahedron (see tetramesh_subdivide()).
+ */
+static double projected_tetrahedron_volume(double *v0, double *v1, double *v2, double *v3)
+{
+  static const int children[8][4] = {{0,4,5,6}, {1,4,7,8}, {2,5,7,9}, {3,6,8,9},
+				     {5,4,7,9}, {5,4,6,9}, {8,4,7,9}, {8,4,6,9}};
+  const double a = 0.5854101966249685, b = 0.1381966011250105;
+
+  double *v[4] = {v0, v1, v2, v3};
+  double nodes[10][4];
+  int i, j, k, n = 4;
+  for (i = 0; i < 4; i++)
+    memcpy(nodes[i], v[i], 4*sizeof(double));
+  for (i = 0; i < 4; i++)
+    for (j = i+1; j < 4; j++, n++)
+      avg(nodes[n], v[i], v[j], 4);
+
+  double s = 0;
+  for (i = 0; i < 8; i++) {
+    double c[4] = {0,0,0,0}, y[4];
+    for (k = 0; k < 4; k++)
+      add(c, c, nodes[children[i][k]], 4);
+    for (k = 0; k < 4; k++) {
+      for (j = 0; j < 4; j++)
+	y[j] = b*c[j] + (a-b)*nodes[children[i][k]][j];
+      double y2 = dot(y, y, 4);
+      s += 1/(y2*y2);
+    }
+  }
+
+  double *X[4] = {v0, v1, v2, v3};
+
+  return fabs(det(X, 4))/6.0 * s/32.0;
+}
+
+
+typedef struct {
+  octetramesh_t *mesh;
+  double (*f)(double *, void *);
+  void *fdata;
+  double *fv;            // f at each (projected) vertex
+  int nv0;               // f has already been evaluated at vertices 0..nv0-1
+  double max_mass;
+  double max_variation;
+  int *tetmask;
+  int *octmask;
+} tessellation_mres_data_t;
+
+
+static void tessellation_mres_eval_vertices(int i0, int i1, void *ptr)
+{
+  tessellation_mres_data_t *data = (tessellation_mres_data_t *)ptr;
+  int i;
+  double x[4];
+  for (i = data->nv0 + i0; i < data->nv0 + i1; i++) {
+    normalize(x, data->mesh->vertices[i], 4);
+    data->fv[i] = data->f(x, data->fdata);
+  }
+}
+
+
+/*
+ * Decide whether to split a cell with n (projected) vertices X, total volume V, and f values fv.
+ */
+static int tessellation_mres_split(tessellation_mres_data_t *data, double **X, double *fv, int n, double V)
+{
+  double c[4];
+  int j;
+
+  memset(c, 0, 4*sizeof(double));
+  for (j = 0; j < n; j++)
+    add(c, c, X[j], 4);
+  normalize(c, c, 4);
+
+  double fc = data->f(c, data->fdata);
+  double fmax = MAX(fc, arr_max(fv, n));
+  double fmin = MIN(fc, arr_min(fv, n));
+
+  return (V*fmax > data->max_mass || V*(fmax - fmin) > data->max_variation);
+}
+
+
+static void tessellation_mres_select_tetrahedra(int i0, int i1, void *ptr)
+{
+  tessellation_mres_data_t *data = (tessellation_mres_data_t *)ptr;
+  octetramesh_t *mesh = data->mesh;
+  double X_raw[16], *X[4] = {X_raw, X_raw+4, X_raw+8, X_raw+12}, fv[4];
+  int i, j;
+
+  for (i = i0; i < i1; i++) {
+    double **P = mesh->vertices;
+    int *t = mesh->tetrahedra[i];
+    for (j = 0; j < 4; j++) {
+      normalize(X[j], P[t[j]], 4);
+      fv[j] = data->fv[t[j]];
+    }
+    double V = projected_tetrahedron_volume(P[t[0]], P[t[1]], P[t[2]], P[t[3]]);
+    data->tetmask[i] = tessellation_mres_split(data, X, fv, 4, V);
+  }
+}
+
+
+static void tessellation_mres_select_octahedra(int i0, int i1, void *ptr)
+{
+  tessellation_mres_data_t *data = (tessellation_mres_data_t *)ptr;
+  octetramesh_t *mesh = data->mesh;
+  double X_raw[24], *X[6], fv[6];
+  int i, j;
+
+  for (j = 0; j < 6; j++)
+    X[j] = X_raw + 4*j;
+
+  for (i = i0; i < i1; i++) {
+    double **P = mesh->vertices;
+    int *o = mesh->octahedra[i];
+    for (j = 0; j < 6; j++) {
+      normalize(X[j], P[o[j]], 4);
+      fv[j] = data->fv[o[j]];
+    }
+    // an octahedron is 4 tetrahedra around its (0,5) axis
+    double V = 0;
+    for (j = 1; j < 5; j++)
+      V += projected_tetrahedron_volume(P[o[0]], P[o[5]], P[o[j]], P[o[j%4+1]]);
+    data->octmask[i] = tessellation_mres_split(data, X, fv, 6, V);
+  }
+}
+
+
+static void tessellation_mres_cells(int i0, int i1, void *ptr)
+{
+  hypersphere_tessellation_t *T = (hypersphere_tessellation_t *)ptr;
+  double **P = T->tetramesh->vertices;
+  int i;
+
+  for (i = i0; i < i1; i++) {
+    int *t = T->tetramesh->tetrahedra[i];
+    avg3(T->centroids[i], P[t[1]], P[t[2]], P[t[3]], 4);
+    wavg(T->centroids[i], P[t[0]], T->centroids[i], .25, 4);
+    normalize(T->centroids[i], T->centroids[i], 4);
+    T->volumes[i] = projected_tetrahedron_volume(P[t[0]], P[t[1]], P[t[2]], P[t[3]]);
+  }
+}
+
+
+/*
+ * Create an adaptive (multi-resolution) tesselation of the 3-sphere for a non-negative function f:S3->R
+ * (e.g. a pdf).  Starting from the level 0 octa-tetrahedral mesh, every cell whose approximate integral
+ * of f, V*max(f), is greater than max_mass, or whose variation, V*(max(f) - min(f)), is greater than
+ * max_variation, is subdivided, up to max_level subdivisions (f is evaluated at the vertices and the
+ * center of each cell).  Cell volumes are the volumes of the (curved) cells on S3, so cells at different
+ * levels are weighted consistently.  f must be thread-safe.  Free the result with hypersphere_tessellation_free().
+ */
+hypersphere_tessellation_t *tessellate_S3_mres(double (*f)(double *, void *), void *fdata,
+					       double max_mass, double max_variation, int max_level)
+{
+  int i;
+  octetramesh_t *mesh = init_mesh_S3_octetra();
+  octetramesh_t tmp;
+
+  tessellation_mres_data_t data;
+  memset(&data, 0, sizeof(data));
+  data.mesh = mesh;
+  data.f = f;
+  data.fdata = fdata;
+  data.max_mass = max_mass;
+  data.max_variation = max_variation;
+
+  for (i = 0; i < max_level; i++) {
+
+    // evaluate f at the new vertices
+    safe_realloc(data.fv, mesh->nv, double);
+    parallel_for(mesh->nv - data.nv0, tessellation_mres_eval_vertices, &data);
+    data.nv0 = mesh->nv;
+
+    // select cells to subdivide
+    safe_realloc(data.tetmask, mesh->nt + 1, int);
+    safe_realloc(data.octmask, mesh->no + 1, int);
+    parallel_for(mesh->nt, tessellation_mres_select_tetrahedra, &data);
+    parallel_for(mesh->no, tessellation_mres_select_octahedra, &data);
+
+    if (count(data.tetmask, mesh->nt) == 0 && count(data.octmask, mesh->no) == 0)
+      break;
+
+    octetramesh_subdivide_select(&tmp, mesh, data.tetmask, data.octmask);
+    octetramesh_free(mesh);
+    *mesh = tmp;  // old vertices keep their indices, so data.fv is still valid
+  }
+
+  free(data.fv);
+  free(data.tetmask);
+  free(data.octmask);
+
+  // compute cell centroids and volumes before projecting the vertices onto S3
+  hypersphere_tessellation_t *T;
+  safe_calloc(T, 1, hypersphere_tessellation_t);
+  T->tetramesh = octetramesh_to_tetramesh(mesh);
+  T->d = 4;
+  T->n = T->tetramesh->nt;
+  T->centroids = new_matrix2(T->n, T->d);
+  safe_calloc(T->volumes, T->n, double);
+  parallel_for(T->n, tessellation_mres_cells, T);
+  reproject_vertices(T->tetramesh->vertices, T->tetramesh->nv, T->d);
+
+  octetramesh_free(mesh);
+  free(mesh);
+
+  return T;
+}
+
+
+/*
+ * Free a tessellation returned by tessellate_S3_mres().  (Don't call this on the cached tessellations
+ * returned by tessellate_S3() and tessellate_S3_level().)
+ */
+void hypersphere_tessellation_free(hypersphere_tessellation_t *T)
+{
+  tetramesh_free(T->tetramesh);
+  free(T->tetramesh);
+  free_matrix2(T->centroids);
+  free(T->volumes);
+  if (T->radii)
+    free(T->radii);
+  if (T->proximity_queues) {
+    free_matrix2i(T->proximity_queues);
+    free_matrix2(T->proximity_queue_dists);
+  }
+  free(T);
+}
+
+
+/*
+ * Locate the octetramesh cell containing x in the subdivisions of a tetrahedron with (normalized)
+ * barycentric coordinates lambda.  The children of tetrahedron i at level L are tetrahedra 4i..4i+3
+ * (one at each corner) and octahedron i at level L+1 (see octetramesh_subdivide()).  Octahedra are
+ * parameterized by u = (u1,u2,u3) s.t. x = c + u1*e1 + u2*e2 + u3*e3, where c is the center of the
+ * octahedron and (c-e1, c-e2, c-e3, c+e2, c+e3, c+e1) are its vertices, so that the octahedron is |u|_1 <= 1.
+ */
+static int locate_tetrahedron_child(double *lambda, double *u)
+{
+  int i, imax = 0;
+  for (i = 1; i < 4; i++)
+    if (lambda[i] > lambda[imax])
+      imax = i;
+
+  if (lambda[imax] < .5) {  // central octahedron
+    u[0] = -lambda[0] - lambda[1] + lambda[2] + lambda[3];
+    u[1] = -lambda[0] + lambda[1] - lambda[2] + lambda[3];
+    u[2] = -lambda[0] + lambda[1] + lambda[2] - lambda[3];
+    return -1;
+  }
+
+  // corner tetrahedron imax:  (p[imax], midpoints of the edges from p[imax] to the other vertices, in order)
+  double l[4];
+  int j = 1;
+  l[0] = 2*lambda[imax] - 1;
+  for (i = 0; i < 4; i++)
+    if (i != imax)
+      l[j++] = 2*lambda[i];
+  memcpy(lambda, l, 4*sizeof(double));
+
+  return imax;
+}
+
+
+/*
+ * Locate the octetramesh cell containing x in the subdivisions of an octahedron with coordinates u
+ * (see locate_tetrahedron_child()).  The children of octahedron j at level L are octahedra
+ * nt+6j..nt+6j+5 (one at each vertex) and tetrahedra 4nt+8j..4nt+8j+7 (one in each octant), where nt
+ * is the number of tetrahedra at level L.  Returns the child octahedron (0-5), or 6 + the child tetrahedron (0-7).
+ */
+static int locate_octahedron_child(double *u, double *lambda)
+{
+  double u1 = u[0], u2 = u[1], u3 = u[2];
+
+  // coordinates in each child octahedron (which has half the size and is centered halfway to a vertex)
+  double U[6][3] = {{2*u1+1, 2*u2, 2*u3},
+		    {2*u1, 2*u2+1, 2*u3},
+		    {2*u1, 2*u3+1, -2*u2},
+		    {2*u1, 1-2*u2, -2*u3},
+		    {2*u1, 1-2*u3, 2*u2},
+		    {1-2*u1, 2*u2, 2*u3}};
+
+  int i, imin = 0;
+  double n1[6];
+  for (i = 0; i < 6; i++) {
+    n1[i] = fabs(U[i][0]) + fabs(U[i][1]) + fabs(U[i][2]);
+    if (n1[i] < n1[imin])
+      imin = i;
+  }
+  if (n1[imin] <= 1) {
+    memcpy(u, U[imin], 3*sizeof(double));
+    return imin;
+  }
+
+  // the child tetrahedron in u's octant has vertices (center, and the midpoints (1/2,1/2,0), (1/2,0,1/2), (0,1/2,1/2) up to sign)
+  static const int octant_tetrahedra[8] = {0, 3, 1, 2, 4, 7, 5, 6};  // indexed by (u1>0, u2>0, u3>0)
+  int t = octant_tetrahedra[4*(u1 > 0) + 2*(u2 > 0) + (u3 > 0)];
+  double w1 = fabs(u1), w2 = fabs(u2), w3 = fabs(u3);
+  double l12 = w1 + w2 - w3, l13 = w1 + w3 - w2, l23 = w2 + w3 - w1;
+  lambda[0] = 1 - (w1 + w2 + w3);
+  lambda[1] = (t % 2 ? l13 : l12);
+  lambda[2] = (t % 2 ? l12 : l13);
+  lambda[3] = l23;
+
+  return 6 + t;
+}
+
+
+/*
+ * Find the cells of the tessellation at a given level (see tessellate_S3_level()) which contain
+ * each of the n points (quaternions) in Q (stored as a contiguous n-by-4 array).  This descends
+ * the octetramesh subdivision hierarchy in O(level) time per point, without building the tessellation.
+ */
+void tessellation_locate(const double *Q, int n, int level, int *cells)
+{
+  int i, j, l;
+
+  // number of tetrahedra and octahedra at each level
+  int nt[level+1], no[level+1];
+  nt[0] = 16;
+  no[0] = 0;
+  for (l = 0; l < level; l++) {
+    nt[l+1] = 4*nt[l] + 8*no[l];
+    no[l+1] = nt[l] + 6*no[l];
+  }
+
+  for (i = 0; i < n; i++) {
+    const double *q = Q + 4*i;
+
+    // find the level 0 tetrahedron (with the largest min barycentric coordinate)
+    double lambda[4], u[3], best = -DBL_MAX;
+    int cell = 0;
+    for (j = 0; j < 16; j++) {
+      double lmin = DBL_MAX;
+      for (l = 0; l < 4; l++) {
+	int v = S3_tetrahedra[j][l];
+	lmin = MIN(lmin, (v < 4 ? q[v] : -q[v-4]));
+      }
+      if (lmin > best) {
+	best = lmin;
+	cell = j;
+      }
+    }
+    double lambda_tot = 0;
+    for (l = 0; l < 4; l++) {
+      int v = S3_tetrahedra[cell][l];
+      lambda[l] = MAX(0, (v < 4 ? q[v] : -q[v-4]));
+      lambda_tot += lambda[l];
+    }
+    for (l = 0; l < 4; l++)
+      lambda[l] /= lambda_tot;
+
+    // descend the subdivision hierarchy
+    int is_octahedron = 0;
+    for (l = 0; l < level; l++) {
+      if (is_octahedron) {
+	int c = locate_octahedron_child(u, lambda);
+	if (c < 6)
+	  cell = nt[l] + 6*cell + c;
+	else {
+	  cell = 4*nt[l] + 8*cell + c - 6;
+	  is_octahedron = 0;
+	}
+      }
+      else {
+	int c = locate_tetrahedron_child(lambda, u);
+	if (c >= 0)
+	  cell = 4*cell + c;
+	else
+	  is_octahedron = 1;  // the octahedron has the same index as its parent tetrahedron
+      }
+    }
+
+    // octahedra are split into 4 tetrahedra in the tessellation (see octetramesh_to_tetramesh())
+    if (is_octahedron)
+      cell = nt[level] + 4*cell + (u[0] <= 0 ? (u[2] <= 0 ? 0 : 1) : (u[1] <= 0 ? 2 : 3));
+
+    cells[i] = cell;
+  }
+}
+
+
+//-------------------- POINT SETS ------------------//
+
+
+/*
+ * Angle between antipodal point pairs {x,-x} and {y,-y} on S3.
+ */
+static inline double antipodal_angle(double *x, double *y)
+{
+  double c = fabs(x[0]*y[0] + x[1]*y[1] + x[2]*y[2] + x[3]*y[3]);
+  return acos(MIN(c, 1.0));
+}
+
+
+/*
+ * Find the centroid (out of cells[0..n-1], or 0..n-1 if cells is NULL) closest to x (up to sign).
+ */
+static int nearest_centroid(double *x, double **centroids, int *cells, int n)
+{
+  int i, imax = 0;
+  double cmax = -1;
+  for (i = 0; i < n; i++) {
+    double *c = centroids[cells ? cells[i] : i];
+    double dc = fabs(x[0]*c[0] + x[1]*c[1] + x[2]*c[2] + x[3]*c[3]);
+    if (dc > cmax) {
+      cmax = dc;
+      imax = i;
+    }
+  }
+
+  return (cells ? cells[imax] : imax);
+}
+
+
+typedef struct {
+  hypersphere_pointset_t *P;
+  int level;            // tessellation level (or -1 if P->tessellation isn't one of the cached tessellations)
+  int coarse_level;     // coarse tessellation level
+  int *cell_coarse;     // coarse cell of each cell
+  int **coarse_cells;   // all cells in each coarse cell
+  int *coarse_ncells;
+  int *point_cells;     // cell of each point
+} pointset_build_data_t;
+
+static void pointset_assign_cells(int i0, int i1, void *ptr)
+{
+  pointset_build_data_t *data = (pointset_build_data_t *)ptr;
+  hypersphere_pointset_t *P = data->P;
+  int i;
+  for (i = i0; i < i1; i++) {
+    if (data->level >= 0)  // cells are nested in the subdivision hierarchy, so we can locate their centroids
+      tessellation_locate(P->tessellation->centroids[i], 1, data->coarse_level, &data->cell_coarse[i]);
+    else
+      data->cell_coarse[i] = nearest_centroid(P->tessellation->centroids[i], P->coarse_tessellation->centroids,
+					      NULL, P->coarse_tessellation->n);
+  }
+}
+
+static void pointset_assign_points(int i0, int i1, void *ptr)
+{
+  pointset_build_data_t *data = (pointset_build_data_t *)ptr;
+  hypersphere_pointset_t *P = data->P;
+  int i;
+  for (i = i0; i < i1; i++) {
+    int c = nearest_centroid(P->points[i], P->coarse_tessellation->centroids, NULL, P->coarse_tessellation->n);
+    data->point_cells[i] = nearest_centroid(P->points[i], P->tessellation->centroids, data->coarse_cells[c],
+					    data->coarse_ncells[c]);
+  }
+}
+
+static void pointset_cell_radii(int i0, int i1, void *ptr)
+{
+  pointset_build_data_t *data = (pointset_build_data_t *)ptr;
+  hypersphere_pointset_t *P = data->P;
+  int i, j;
+  for (i = i0; i < i1; i++) {
+    double *c = P->tessellation->centroids[i];
+    double *x = P->cell_points + 4*(P->cell_members[i] - P->cell_members[0]);
+    double r = 0;
+    for (j = 0; j < P->cell_counts[i]; j++)
+      r = MAX(r, antipodal_angle(c, x + 4*j));
+    P->cell_radii[i] = r;
+  }
+}
+
+static void pointset_coarse_radii(int i0, int i1, void *ptr)
+{
+  pointset_build_data_t *data = (pointset_build_data_t *)ptr;
+  hypersphere_pointset_t *P = data->P;
+  int i, j, k;
+  for (i = i0; i < i1; i++) {
+    double *c = P->coarse_tessellation->centroids[i];
+    double r = 0;
+    for (j = 0; j < P->coarse_counts[i]; j++) {
+      int cell = P->coarse_members[i][j];
+      double *x = P->cell_points + 4*(P->cell_members[cell] - P->cell_members[0]);
+      for (k = 0; k < P->cell_counts[cell]; k++)
+	r = MAX(r, antipodal_angle(c, x + 4*k));
+    }
+    P->coarse_radii[i] = r;
+  }
+}
+
+
+/*
+ * Create a point set on S3 (in R4) for fast K-NN and radius searches, where q and -q are
+ * considered the same point.  The points are not copied, so they must stay valid while the
+ * point set is in use.  If tessellation is NULL, one is chosen based on the number of points.
+ */
+hypersphere_pointset_t *new_hypersphere_pointset(hypersphere_tessellation_t *tessellation, double **points, int n)
+{
+  int i, j;
+
+  if (tessellation == NULL)
+    tessellation = tessellate_S3(MIN(MAX(n/8, 1024), 65536));
+
+  hypersphere_pointset_t *P;
+  safe_calloc(P, 1, hypersphere_pointset_t);
+  P->tessellation = tessellation;
+  P->coarse_tessellation = tessellate_S3(MIN(128, tessellation->n / 8));
+  P->points = points;
+  P->num_points = n;
+
+  int nc = tessellation->n;
+  int ncc = P->coarse_tessellation->n;
+
+  pointset_build_data_t data;
+  data.P = P;
+  data.level = data.coarse_level = -1;
+  for (i = 0; i < MAX_LEVELS; i++) {
+    if (tessellation == &tessellations[i])
+      data.level = i;
+    if (P->coarse_tessellation == &tessellations[i])
+      data.coarse_level = i;
+  }
+  safe_malloc(data.cell_coarse, nc, int);
+  safe_malloc(data.point_cells, MAX(n, 1), int);
+  safe_calloc(data.coarse_ncells, ncc, int);
+  safe_malloc(data.coarse_cells, ncc, int *);
+
+  // group the cells into coarse cells
+  parallel_for(nc, pointset_assign_cells, &data);
+  int *coarse_cells_raw;
+  safe_malloc(coarse_cells_raw, nc, int);
+  for (i = 0; i < nc; i++)
+    data.coarse_ncells[data.cell_coarse[i]]++;
+  for (i = 0, j = 0; i < ncc; i++) {
+    data.coarse_cells[i] = coarse_cells_raw + j;
+    j += data.coarse_ncells[i];
+    data.coarse_ncells[i] = 0;
+  }
+  for (i = 0; i < nc; i++) {
+    int c = data.cell_coarse[i];
+    data.coarse_cells[c][ data.coarse_ncells[c]++ ] = i;
+  }
+
+  // put each point in the cell with the nearest centroid (which gives tighter cells than the cell containing it)
+  parallel_for(n, pointset_assign_points, &data);
+
+  // build the cell member lists (sorted by cell)
+  int *cell_members_raw;
+  safe_calloc(P->cell_counts, nc, int);
+  safe_malloc(P->cell_members, nc, int *);
+  safe_malloc(cell_members_raw, MAX(n, 1), int);
+  safe_malloc(P->cell_points, 4*MAX(n, 1), double);
+  for (i = 0; i < n; i++)
+    P->cell_counts[data.point_cells[i]]++;
+  for (i = 0, j = 0; i < nc; i++) {
+    P->cell_members[i] = cell_members_raw + j;
+    j += P->cell_counts[i];
+    P->cell_counts[i] = 0;
+  }
+  for (i = 0; i < n; i++) {
+    int c = data.point_cells[i];
+    int k = P->cell_members[c] - cell_members_raw + P->cell_counts[c]++;
+    cell_members_raw[k] = i;
+    memcpy(P->cell_points + 4*k, points[i], 4*sizeof(double));
+  }
+
+  // build the lists of non-empty cells in each coarse cell
+  int *coarse_members_raw;
+  safe_calloc(P->coarse_counts, ncc, int);
+  safe_malloc(P->coarse_members, ncc, int *);
+  safe_malloc(coarse_members_raw, nc, int);
+  for (i = 0, j = 0; i < ncc; i++) {
+    P->coarse_members[i] = coarse_members_raw + j;
+    int k;
+    for (k = 0; k < data.coarse_ncells[i]; k++) {
+      int c = data.coarse_cells[i][k];
+      if (P->cell_counts[c] > 0)
+	P->coarse_members[i][ P->coarse_counts[i]++ ] = c;
+    }
+    j += P->coarse_counts[i];
+  }
+
+  // compute (coarse) cell radii
+  safe_malloc(P->cell_radii, nc, double);
+  safe_malloc(P->coarse_radii, ncc, double);
+  parallel_for(nc, pointset_cell_radii, &data);
+  parallel_for(ncc, pointset_coarse_radii, &data);
+
+  free(data.cell_coarse);
+  free(data.point_cells);
+  free(data.coarse_ncells);
+  free(data.coarse_cells);
+  free(coarse_cells_raw);
+
+  return P;
+}
+
+
+/*
+ * Free a point set (but not its points or its tessellation).
+ */
+void hypersphere_pointset_free(hypersphere_pointset_t *P)
+{
+  free(P->cell_members[0]);
+  free(P->cell_members);
+  free(P->cell_counts);
+  free(P->cell_radii);
+  free(P->cell_points);
+  free(P->coarse_members[0]);
+  free(P->coarse_members);
+  free(P->coarse_counts);
+  free(P->coarse_radii);
+  free(P);
+}
+
+
+/*
+ * Replace the root of a min-heap of |q'x| values and restore the heap.
+ */
+static void knn_heap_replace_root(double *heap_dots, int *heap_idx, int k, double dot, int idx)
+{
+  int i = 0;
+  while (1) {
+    int child = 2*i+1;
+    if (child >= k)
+      break;
+    if (child+1 < k && heap_dots[child+1] < heap_dots[child])
+      child++;
+    if (heap_dots[child] >= dot)
+      break;
+    heap_dots[i] = heap_dots[child];
+    heap_idx[i] = heap_idx[child];
+    i = child;
+  }
+  heap_dots[i] = dot;
+  heap_idx[i] = idx;
+}
+
+
+/*
+ * Push a |q'x| value onto a min-heap of size n.
+ */
+static void knn_heap_push(double *heap_dots, int *heap_idx, int n, double dot, int idx)
+{
+  int i = n;
+  while (i > 0) {
+    int parent = (i-1)/2;
+    if (heap_dots[parent] <= dot)
+      break;
+    heap_dots[i] = heap_dots[parent];
+    heap_idx[i] = heap_idx[parent];
+    i = parent;
+  }
+  heap_dots[i] = dot;
+  heap_idx[i] = idx;
+}
+
+
+/*
+ * Find the k nearest neighbors of q (or -q) in a point set.  Fills in idx with the indices of the
+ * neighbors (sorted by distance) and dists (if not NULL) with their angles, acos(|q'x|).
+ * Returns the number of neighbors found, min(k, num_points).
+ */
+int hypersphere_pointset_knn(int *idx, double *dists, hypersphere_pointset_t *P, double *q, int k)
+{
+  k = MIN(k, P->num_points);
+  if (k <= 0)
+    return 0;
+
+  int i, j, l, ncc = P->coarse_tessellation->n;
+  double **coarse_centroids = P->coarse_tessellation->centroids;
+  double **centroids = P->tessellation->centroids;
+
+  // sort the coarse cells by their lower bound distance to q
+  double lb[ncc];
+  int order[ncc];
+  for (i = 0; i < ncc; i++)
+    lb[i] = (P->coarse_counts[i] > 0 ? antipodal_angle(q, coarse_centroids[i]) - P->coarse_radii[i] : DBL_MAX);
+  sort_indices(lb, order, ncc);
+
+  double heap_dots[k];
+  int heap_idx[k];
+  int heap_size = 0;
+  double max_dist = M_PI;  // distance of the k-th nearest neighbor so far
+
+  for (i = 0; i < ncc; i++) {
+    int c = order[i];
+    if (lb[c] >= max_dist)
+      break;
+    for (j = 0; j < P->coarse_counts[c]; j++) {
+      int cell = P->coarse_members[c][j];
+      if (antipodal_angle(q, centroids[cell]) - P->cell_radii[cell] >= max_dist)
+	continue;
+      int offset = P->cell_members[cell] - P->cell_members[0];
+      double *x = P->cell_points + 4*offset;
+      int changed = 0;
+      for (l = 0; l < P->cell_counts[cell]; l++, x += 4) {
+	double dot = fabs(q[0]*x[0] + q[1]*x[1] + q[2]*x[2] + q[3]*x[3]);
+	if (heap_size < k) {
+	  knn_heap_push(heap_dots, heap_idx, heap_size++, dot, offset + l);
+	  changed = 1;
+	}
+	else if (dot > heap_dots[0]) {
+	  knn_heap_replace_root(heap_dots, heap_idx, k, dot, offset + l);
+	  changed = 1;
+	}
+      }
+      if (changed && heap_size == k)
+	max_dist = acos(MIN(heap_dots[0], 1.0));
+    }
+  }
+
+  // sort the neighbors by distance (by popping the min-heap into the back of the output)
+  int *members = P->cell_members[0];
+  for (i = k-1; i >= 0; i--) {
+    idx[i] = members[heap_idx[0]];
+    if (dists)
+      dists[i] = acos(MIN(heap_dots[0], 1.0));
+    if (i > 0)
+      knn_heap_replace_root(heap_dots, heap_idx, i, heap_dots[i], heap_idx[i]);
+  }
+
+  return k;
+}
+
+
+/*
+ * Find up to max_results points within angle r of q (or -q) in a point set.  Returns the number of
+ * points found, in idx (and dists, if not NULL), in no particular order -- like kdtree_flat_radius().
+ * If total is not NULL, it's set to the total number of points within angle r (which may be more
+ * than max_results).
+ */
+int hypersphere_pointset_radius(int *idx, double *dists, int *total, hypersphere_pointset_t *P, double *q, double r, int max_results)
+{
+  int i, j, l, cnt = 0, ncc = P->coarse_tessellation->n;
+  double **coarse_centroids = P->coarse_tessellation->centroids;
+  double **centroids = P->tessellation->centroids;
+  double min_dot = cos(MIN(r, M_PI/2));
+  int *members = P->cell_members[0];
+
+  for (i = 0; i < ncc; i++) {
+    if (P->coarse_counts[i] == 0 || antipodal_angle(q, coarse_centroids[i]) - P->coarse_radii[i] > r)
+      continue;
+    for (j = 0; j < P->coarse_counts[i]; j++) {
+      int cell = P->coarse_members[i][j];
+      if (antipodal_angle(q, centroids[cell]) - P->cell_radii[cell] > r)
+	continue;
+      int offset = P->cell_members[cell] - members;
+      double *x = P->cell_points + 4*offset;
+      for (l = 0; l < P->cell_counts[cell]; l++, x += 4) {
+	double dot = fabs(q[0]*x[0] + q[1]*x[1] + q[2]*x[2] + q[3]*x[3]);
+	if (dot >= min_dot) {
+	  if (cnt < max_results) {
+	    idx[cnt] = members[offset + l];
+	    if (dists)
+	      dists[cnt] = acos(MIN(dot, 1.0));
+	  }
+	  cnt++;
+	}
+      }
+    }
+  }
+
+  if (total)
+    *total = cnt;
+
+  return MIN(cnt, max_results);
+}
+
+
+typedef struct {
+  hypersphere_pointset_t *P;
+  int **idx;
+  double **dists;
+  int *counts;
+  double **Q;
+  int k;
+  double r;
+} pointset_query_data_t;
+
+static void pointset_knn_batch(int i0, int i1, void *ptr)
+{
+  pointset_query_data_t *data = (pointset_query_data_t *)ptr;
+  int i;
+  for (i = i0; i < i1; i++)
+    hypersphere_pointset_knn(data->idx[i], (data->dists ? data->dists[i] : NULL), data->P, data->Q[i], data->k);
+}
+
+static void pointset_radius_batch(int i0, int i1, void *ptr)
+{
+  pointset_query_data_t *data = (pointset_query_data_t *)ptr;
+  int i;
+  for (i = i0; i < i1; i++)
+    data->counts[i] = hypersphere_pointset_radius(data->idx[i], (data->dists ? data->dists[i] : NULL), NULL, data->P,
+						  data->Q[i], data->r, data->k);
+}
+
+
+/*
+ * Find the k nearest neighbors of each of the nq query points in Q (in parallel).
+ * idx and dists (which may be NULL) are nq-by-k.
+ */
+void hypersphere_pointset_knn_batch(int **idx, double **dists, hypersphere_pointset_t *P, double **Q, int nq, int k)
+{
+  pointset_query_data_t data = {P, idx, dists, NULL, Q, k, 0};
+  parallel_for(nq, pointset_knn_batch, &data);
+}
+
+
+/*
+ * Find the points within angle r of each of the nq query points in Q (in parallel).
+ * idx and dists (which may be NULL) are nq-by-max_results, and counts[i] is set to the number of
+ * points found for Q[i] (at most max_results, see hypersphere_pointset_radius()).
+ */
+void hypersphere_pointset_radius_batch(int **idx, double **dists, int *counts, hypersphere_pointset_t *P,
+				       double **Q, int nq, double r, int max_results)
+{
+  pointset_query_data_t data = {P, idx, dists, counts, Q, max_results, r};
+  parallel_for(nq, pointset_radius_batch, &data);
+}
+
+
+
+
+
+
+
 //-------------------- DEPRECATED ------------------//
 
 
@@ -289,38 +1402,4 @@ octetramesh_t *hypersphere_tessellation_octetra(int n)
 }
 */
 
-/* Multi-resolution tessellation of the 3-sphere based on approximating
- * a scalar function f:S3->R to a given resolution.
- *
-octetramesh_t *hypersphere_tessellation_octetra_mres(double(*f)(double *, void *), void *fdata, double resolution)
-{
-  int i;
-  octetramesh_t *mesh = init_mesh_S3_octetra();
-  octetramesh_t tmp;
-
-  for (i = 0; i < 100000; i++) {
-
-    octetramesh_subdivide_mres(&tmp, mesh, f, fdata, resolution);
-
-    int nv = mesh->nv;
-    int nv2 = tmp.nv;
-
-    if (nv == nv2)  // no subdivision performed
-      break;
-
-    printf("\nSubdivision %d;  nv: %d -> %d\n", i+1, nv, nv2);
-
-    octetramesh_free(mesh);
-    free(mesh);
-    mesh = octetramesh_clone(&tmp);
-    octetramesh_free(&tmp);
-  }
-
-  reproject_vertices(mesh->vertices, mesh->nv, mesh->d);
-  printf("\nProjection...\n");
-  octetramesh_print_stats(octetramesh_stats(mesh));
-
-  return mesh;
-}
-*/
 
@@ -34,6 +34,7 @@ typedef struct {
   double resolution;                         /* grid resolution */
   hypersphere_tessellation_t *tessellation;  /* hypersphere tessellation */
   double *mass;                              /* cell probability mass */
+  int free_tessellation;                     /* whether bingham_pmf_free() frees the tessellation */
 } bingham_pmf_t;
 
 typedef struct {
@@ -42,6 +43,32 @@ typedef struct {
   int n;                /* number of binghams */
 } bingham_mix_t;
 
+typedef struct bingham_arena_block {
+  char *data;                         /* block memory */
+  size_t size;                        /* block capacity (in bytes) */
+  size_t used;                        /* bytes handed out so far */
+  struct bingham_arena_block *next;   /* previously filled block */
+} bingham_arena_block_t;
+
+typedef struct {
+  bingham_arena_block_t *blocks;  /* current block (head of the block list) */
+  size_t block_size;              /* minimum capacity of a new block */
+} bingham_arena_t;
+
+/*
+ * Thread safety:  call bingham_init() once before using the library from multiple threads.  After
+ * that, functions that only read their binghams, mixtures and pmfs (bingham_pdf(), bingham_L(),
+ * bingham_mode(), bingham_mixture_pdf(), ...) may be called concurrently on shared objects, and any
+ * function may be called concurrently on distinct objects.  Functions that write to a bingham
+ * (including its lazily computed stats, which bingham_stats(), bingham_cross_entropy(),
+ * bingham_KL_divergence() and bingham_merge() fill in), a mixture, or an arena need external locking
+ * if the object is shared.  Samplers draw from the calling thread's default random stream (see
+ * rng_default()), or from the given rng_t, which must not be shared between threads.
+ *
+ * bingham_discretize(), bingham_discretize_mres(), bingham_fit_mlesac() and bingham_mixture_reduce()
+ * are multi-threaded themselves; see set_num_threads() and set_parallel_executor() in bingham/util.h.
+ */
+
 void bingham_init();
 void bingham_new(bingham_t *B, int d, double **V, double *Z);
 void bingham_new_uniform(bingham_t *B, int d);
@@ -66,18 +93,30 @@ double bingham_cross_entropy(bingham_t *B1, bingham_t *B2);
 double bingham_KL_divergence(bingham_t *B1, bingham_t *B2);
 void bingham_merge(bingham_t *B, bingham_t *B1, bingham_t *B2, double alpha);
 void bingham_compose(bingham_t *B, bingham_t *B1, bingham_t *B2);
+void bingham_compose_array(bingham_t *B, bingham_t *B1, bingham_t *B2, int n);
+void bingham_compose_scatter(double **S, double **S1, double **S2);
 double bingham_compose_true_pdf(double *x, bingham_t *B1, bingham_t *B2);
 double bingham_compose_error(bingham_t *B1, bingham_t *B2);
+double bingham_compose_error_sampled(bingham_t *B1, bingham_t *B2, int nsamples);
 void bingham_fit(bingham_t *B, double **X, int n, int d);
 void bingham_fit_scatter(bingham_t *B, double **S, int d);
+int bingham_fit_mlesac(bingham_t *B, int *outliers, double **X, int n, int d);
+int bingham_fit_mlesac_rng(bingham_t *B, int *outliers, double **X, int n, int d, rng_t *rng);
 void bingham_discretize(bingham_pmf_t *pmf, bingham_t *B, int ncells);
+void bingham_discretize_mres(bingham_pmf_t *pmf, bingham_t *B, double max_mass, double max_variation);
+void bingham_pmf_free(bingham_pmf_t *pmf);
 void bingham_sample_uniform(double **X, int d, int n);
 void bingham_sample(double **X, bingham_t *B, int n);
 void bingham_sample_pmf(double **X, bingham_pmf_t *pmf, int n);
 void bingham_sample_ridge(double **X, bingham_t *B, int n, double pthresh);
+void bingham_sample_uniform_rng(double **X, int d, int n, rng_t *rng);
+void bingham_sample_rng(double **X, bingham_t *B, int n, rng_t *rng);
+void bingham_sample_pmf_rng(double **X, bingham_pmf_t *pmf, int n, rng_t *rng);
 void bingham_cluster(bingham_mix_t *BM, double **X, int n, int d);
 void bingham_mult(bingham_t *B, bingham_t *B1, bingham_t *B2);
 void bingham_mult_array(bingham_t *B, bingham_t *B_array, int n, int compute_F);
+int bingham_mult_array_scratch_size(int d);
+void bingham_mult_array_scratch(bingham_t *B, bingham_t *B_array, int n, int compute_F, double *scratch);
 void print_bingham(bingham_t *B);
 
 void bingham_pre_rotate_3d(bingham_t *B_rot, bingham_t *B, double *q); 
@@ -91,6 +130,7 @@ void bingham_mixture_mult(bingham_mix_t *BM, bingham_mix_t *BM1, bingham_mix_t *
 void bingham_mixture_copy(bingham_mix_t *dst, bingham_mix_t *src);
 void bingham_mixture_free(bingham_mix_t *BM);
 void bingham_mixture_sample(double **X, bingham_mix_t *BM, int n);
+void bingham_mixture_sample_rng(double **X, bingham_mix_t *BM, int n, rng_t *rng);
 void bingham_mixture_sample_ridge(double **X, bingham_mix_t *BM, int n, double pthresh);
 double bingham_mixture_pdf(double x[], bingham_mix_t *BM);
 void bingham_mixture_add(bingham_mix_t *dst, bingham_mix_t *src);
@@ -102,6 +142,23 @@ void bingham_mixture_collapse_uniforms(bingham_mix_t *dst, bingham_mix_t *src);
 bingham_mix_t *load_bmx(char *f_bmx, int *k);
 void save_bmx(bingham_mix_t *BM, int num_clusters, char *fout);
 
+/* Arena (bump) allocation -- never bingham_free() a bingham allocated in an arena */
+void bingham_arena_init(bingham_arena_t *A, size_t block_size);
+void *bingham_arena_alloc(bingham_arena_t *A, size_t size);
+void bingham_arena_reset(bingham_arena_t *A);
+void bingham_arena_free(bingham_arena_t *A);
+void bingham_alloc_arena(bingham_t *B, int d, bingham_arena_t *A);
+void bingham_copy_arena(bingham_t *dst, bingham_t *src, bingham_arena_t *A);
+void bingham_stats_arena(bingham_t *B, bingham_arena_t *A);
+void bingham_fit_scatter_arena(bingham_t *B, double **S, int d, bingham_arena_t *A);
+void bingham_mult_arena(bingham_t *B, bingham_t *B1, bingham_t *B2, bingham_arena_t *A);
+void bingham_mult_array_scratch_arena(bingham_t *B, bingham_t *B_array, int n, int compute_F, double *scratch, bingham_arena_t *A);
+void bingham_compose_array_arena(bingham_t *B, bingham_t *B1, bingham_t *B2, int n, bingham_arena_t *A);
+void bingham_mixture_copy_arena(bingham_mix_t *dst, bingham_mix_t *src, bingham_arena_t *A);
+void bingham_mixture_add_arena(bingham_mix_t *dst, bingham_mix_t *src, bingham_arena_t *A);
+void bingham_mixture_mult_arena(bingham_mix_t *BM, bingham_mix_t *BM1, bingham_mix_t *BM2, bingham_arena_t *A);
+void bingham_mixture_reduce_arena(bingham_mix_t *BM, unsigned int reduced_n_components, bingham_arena_t *A);
+
 
 
 
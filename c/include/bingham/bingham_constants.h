@@ -7,6 +7,7 @@ extern const double BINGHAM_MIN_CONCENTRATION;
 
 void bingham_constants_init();
 void bingham_dY_params_3d(double *Z, double *F, double *dY);
+void bingham_dY_params_3d_fast(double *Z, double *F, double *dY);
 double bingham_F_lookup_3d(double *Z);
 void bingham_dF_lookup_3d(double *dF, double *Z);
 
@@ -0,0 +1,60 @@
+#ifndef BINGHAM_FILTER_H
+#define BINGHAM_FILTER_H
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include "bingham.h"
+
+
+  /*
+   * Bingham mixture filter for tracking a (quaternion) orientation.
+   *
+   * The filter's mixtures and scratch buffers are allocated in bingham_filter_init(),
+   * and mixture reduction works in an arena that is reset after every update, so the
+   * predict and update steps only do small, temporary heap allocations (e.g. in the
+   * KL divergences computed during reduction).  Stats computed on the belief's
+   * components (e.g. by bingham_filter_sample()) are freed whenever those components
+   * are overwritten.
+   */
+  typedef struct {
+    int d;                        /* dimension of the binghams (4 for quaternions) */
+    int max_components;           /* number of mixture components kept after each update */
+    int max_measurement_components;  /* max number of components in a measurement likelihood */
+    int capacity;                 /* number of preallocated components in belief and product */
+
+    bingham_mix_t belief;         /* current belief, p(q) */
+    bingham_mix_t product;        /* scratch mixture for measurement updates */
+    double *scratch;              /* scratch buffer for bingham_mult_array_scratch() */
+    bingham_arena_t arena;        /* scratch memory for mixture reduction */
+
+    int fallback_ncells;          /* number of cells in the particle fallback (0 = disabled) */
+    double fallback_log_evidence; /* use the particle fallback when log p(z) is below this */
+    bingham_pmf_t pmf;            /* particle (tessellation) representation for the fallback */
+
+    double log_evidence;          /* log p(z) of the last measurement update */
+    int num_updates;              /* number of measurement updates */
+    int num_fallbacks;            /* number of measurement updates that used the particle fallback */
+  } bingham_filter_t;
+
+
+  void bingham_filter_init(bingham_filter_t *F, bingham_mix_t *prior, int max_components, int max_measurement_components);
+  void bingham_filter_free(bingham_filter_t *F);
+  void bingham_filter_set_fallback(bingham_filter_t *F, int ncells, double log_evidence_thresh);
+  void bingham_filter_predict(bingham_filter_t *F, bingham_t *noise);
+  void bingham_filter_update(bingham_filter_t *F, bingham_mix_t *L);
+  void bingham_filter_update_bingham(bingham_filter_t *F, bingham_t *L);
+  void bingham_filter_mode(double *q, bingham_filter_t *F);
+  void bingham_filter_sample(double **Q, bingham_filter_t *F, int n);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
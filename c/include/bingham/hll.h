@@ -8,19 +8,13 @@ extern "C" {
 #endif 
 
 
-  /*
-   * Optimizations:
-   *  - Fast NN-radius searches
-   *  - Precompute local likelihood samples (should store them on disk--probably too slow at runtime)
-   */
-
-
   typedef struct {
-    kdtree_t *Q_kdtree;
+    quaternion_index_t *Q_index;
     double **Q;
     double **X;
     double ***S;
     int n;
+    void *map;     /* cache file that Q,X,S point into (or NULL if they're owned by the cache) */
   } hll_cache_t;
 
   typedef struct {
@@ -33,6 +27,8 @@ extern "C" {
     double *x0;    /* prior mean */
     double **S0;   /* prior covariance */
     double w0;     /* prior weight */
+    quaternion_index_t *Q_index;  /* index on Q (for kernel radius searches) */
+    int Q_index_n;                /* number of samples in Q_index (the rest are searched linearly) */
 
     hll_cache_t cache;
   } hll_t;
@@ -42,9 +38,17 @@ extern "C" {
   void hll_free(hll_t *hll);
   void hll_free_cache(hll_t *hll);
   void hll_cache(hll_t *hll, double **Q, int n);
+  int hll_add_samples(hll_t *hll, double **Q, double **X, int n);
   void hll_sample(double **X, double ***S, double **Q, hll_t *hll, int n);
+  void hll_sample_scan(double **X, double ***S, double **Q, hll_t *hll, int n);
+  void hll_set_validation(int validate);
+  uint64_t hll_hash(hll_t *hll);
+  int hll_save_cache(const char *fname, hll_t *hlls, int n);
+  int hll_load_cache(const char *fname, hll_t *hlls, int n);
   hll_t *load_hlls(char *fname, int *n);
   void save_hlls(char *fname, hll_t *hlls, int n);
+  hll_t *load_hlls_binary(char *fname, int *n);
+  int save_hlls_binary(char *fname, hll_t *hlls, int n, int use_float);
 
 
 
@@ -10,13 +10,15 @@
 
 
 /*
- * Fast NN-radius and K-NN searches:
- *  - Add a cell-based data structure based on the tetramesh tessellation,
- *    where for each cell we store an ordered list of the min distances to all the other cells.
- *  - When we create a new point set on the hypersphere, add the points to a data structure
- *    containing an array of point lists per cell.
- *  - On lookup (NN-radius query), lookup the query point's cell with a kdtree NN lookup, then iterate through the
- *    points in cells with min distance < radius.
+ * Fast NN-radius and K-NN searches (see new_hypersphere_pointset()):
+ *  - Points are stored in per-cell lists over a tessellation of S3, and the cells are grouped
+ *    into the cells of a coarser tessellation.  Each (coarse) cell stores the max distance from
+ *    its centroid to its points.
+ *  - On lookup, (coarse) cells are visited in order of their lower bound distance to the query
+ *    point, and the search stops when no remaining cell can contain a closer point.
+ *  - Distances are angles between antipodal point pairs, acos(|q'x|), so q and -q are the same point.
+ *  - Radius searches return the number of points found (at most max_results), like kdtree_flat_radius(),
+ *    and can also report the total number of points in range.
  */
 
 
@@ -42,12 +44,31 @@ typedef struct {
   int num_points;
   int **cell_members;                        // list of point indices in each cell
   int *cell_counts;                          // number of points in each cell
+  double *cell_radii;                        // max (antipodal) angle from each cell's centroid to its members
+  double *cell_points;                       // copy of the points in cell order (4 per member), for locality
+  hypersphere_tessellation_t *coarse_tessellation;
+  int **coarse_members;                      // list of non-empty cells in each coarse cell
+  int *coarse_counts;                        // number of non-empty cells in each coarse cell
+  double *coarse_radii;                      // max (antipodal) angle from each coarse cell's centroid to its points
 } hypersphere_pointset_t;
 
 
 void hypersphere_init();
+int hypersphere_load_cache(const char *filename);
+int hypersphere_save_cache(const char *filename, int num_levels);
 hypersphere_tessellation_t *tessellate_S3(int n);
+hypersphere_tessellation_t *tessellate_S3_level(int level);
+hypersphere_tessellation_t *tessellate_S3_mres(double (*f)(double *, void *), void *fdata,
+					       double max_mass, double max_variation, int max_level);
+void hypersphere_tessellation_free(hypersphere_tessellation_t *T);
+void tessellation_locate(const double *Q, int n, int level, int *cells);
 hypersphere_pointset_t *new_hypersphere_pointset(hypersphere_tessellation_t *tessellation, double **points, int n);
+void hypersphere_pointset_free(hypersphere_pointset_t *pointset);
+int hypersphere_pointset_knn(int *idx, double *dists, hypersphere_pointset_t *pointset, double *q, int k);
+int hypersphere_pointset_radius(int *idx, double *dists, int *total, hypersphere_pointset_t *pointset, double *q, double r, int max_results);
+void hypersphere_pointset_knn_batch(int **idx, double **dists, hypersphere_pointset_t *pointset, double **Q, int nq, int k);
+void hypersphere_pointset_radius_batch(int **idx, double **dists, int *counts, hypersphere_pointset_t *pointset,
+				       double **Q, int nq, double r, int max_results);
 
 
 
@@ -67,9 +88,6 @@ hypersphere_pointset_t *new_hypersphere_pointset(hypersphere_tessellation_t *tes
 //tetramesh_t *hypersphere_tessellation_tetra(int n);
 //octetramesh_t *hypersphere_tessellation_octetra(int n);
 
-// Multi-resolution tessellation of the 3-sphere based on approximating a scalar function f:S3->R to a given resolution.
-//octetramesh_t *hypersphere_tessellation_octetra_mres(double(*f)(double *, void *), void *fdata, double resolution);
-
 
 
 
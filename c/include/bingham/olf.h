@@ -208,6 +208,7 @@ extern "C" {
 
     // GENERAL PARAMS
     int verbose;
+    int seed;  // random seed (0 = use the default streams)
     int use_true_pose;
     int add_true_pose_x_noise;
     int add_true_pose_q_noise;
@@ -408,6 +409,7 @@ extern "C" {
     dist_grid_t *model_dist_grid;
     double *fpfh_model_cmf;
     double *shot_model_cmf;
+    kdtree_flat_t *model_xyz_tree;      // kd-tree on pcd_model->points
   } scope_model_data_t;
 
 
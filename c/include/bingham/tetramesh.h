@@ -34,6 +34,18 @@ typedef struct {
   double std_volume;
 } tetramesh_stats_t;
 
+/* compressed sparse row (CSR) adjacency of a tetramesh */
+typedef struct {
+  int nv;                  /* number of vertices */
+  int ne;                  /* number of (undirected) edges */
+  int nt;                  /* number of tetrahedra */
+  int *neighbor_offsets;   /* vertex i's neighbors are neighbors[neighbor_offsets[i]] ... neighbors[neighbor_offsets[i+1]-1] */
+  int *neighbors;          /* vertex -> {vertices}, sorted */
+  int *neighbor_counts;    /* number of tetrahedra shared by each (vertex, neighbor) pair */
+  int *cell_offsets;       /* vertex i's cells are cells[cell_offsets[i]] ... cells[cell_offsets[i+1]-1] */
+  int *cells;              /* vertex -> {tetrahedra}, sorted */
+} tetramesh_adjacency_t;
+
 
 /* Convert a tetramesh to a set of centroids and volumes. */
 void tetramesh_centroids(double **centroids, double *volumes, tetramesh_t *mesh);
@@ -43,6 +55,7 @@ void tetramesh_subdivide(tetramesh_t *dst, tetramesh_t *src);
 
 /* Smooth the tetrahedral mesh */
 void tetramesh_smooth(tetramesh_t *dst, tetramesh_t *src, double w);
+void tetramesh_smooth_adjacency(tetramesh_t *dst, tetramesh_t *src, tetramesh_adjacency_t *adj, double w);
 void tetramesh_smooth2(tetramesh_t *dst, tetramesh_t *src, double w);
 void tetramesh_smooth_edges(tetramesh_t *dst, tetramesh_t *src, double w);
 
@@ -66,6 +79,14 @@ meshgraph_t *tetramesh_meshgraph(tetramesh_t *mesh);
 /* Get the graph of a tetramesh. */
 graph_t *tetramesh_graph(tetramesh_t *mesh);
 
+/* Get the CSR adjacency of a tetramesh. */
+tetramesh_adjacency_t *tetramesh_adjacency(tetramesh_t *mesh);
+void tetramesh_adjacency_free(tetramesh_adjacency_t *adj);
+
+/* Reorder the vertices of a mesh (for cache locality). */
+void tetramesh_rcm_order(int *order, tetramesh_adjacency_t *adj);
+void tetramesh_reorder_vertices(tetramesh_t *mesh, int *order);
+
 /* Save a tetrahedral mesh to PLY file. */
 void tetramesh_save_PLY(tetramesh_t *mesh, meshgraph_t *graph, char *filename);
 void tetramesh_save_PLY_colors(tetramesh_t *mesh, meshgraph_t *graph, char *filename, int *colors);
@@ -3,6 +3,7 @@
 #define BINGHAM_UTIL_H
 
 #include <stdlib.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -36,14 +37,54 @@ typedef struct {
   void *data;
 } sortable_t;
 
-void sort_data(sortable_t *x, size_t n);        /* sort an array of weighted data using qsort */
-void sort_indices(double *x, int *idx, int n);  /* sort the indices of x (leaving x unchanged) */
-int qselect(double *x, int n, int k);           /* fast select algorithm */
-void mink(double *x, int *idx, int n, int k);   /* fills idx with the indices of the k min entries of x */
+void sort_data(sortable_t *x, size_t n);        /* sort an array of weighted data by value (stable) */
+void sort_indices(double *x, int *idx, int n);  /* sort the indices of x, leaving x unchanged (stable, multi-threaded radix sort) */
+int qselect(double *x, int n, int k);           /* fast select algorithm (returns the index of the k-th smallest entry of x) */
+void mink(double *x, int *idx, int n, int k);   /* fills idx with the indices of the k min entries of x, in sorted order */
 
 short double_is_equal(double a, double b); /* Checks if two doubles are equal using eps as threshold */
 
 double get_time_ms();  /* get the current system time in millis */
+/*
+ * Parallel runtime:  parallel_for() and parallel_reduce() split [0,n) into (at most) one block per
+ * thread, and run the blocks on a persistent thread pool (or on an executor given to
+ * set_parallel_executor()).  The calling thread runs blocks too, and parallel calls may be nested.
+ */
+typedef void (*parallel_executor_t)(int num_tasks, void (*task)(int i, void *arg), void *arg, void *executor_data);
+int get_num_threads();  /* get the number of threads to use for parallel_for() */
+void set_num_threads(int n);  /* set the number of threads (n <= 0 for $BINGHAM_NUM_THREADS, or the number of cores) */
+void set_parallel_executor(parallel_executor_t executor, void *executor_data);  /* run parallel work on an executor (NULL for the thread pool) */
+void parallel_for(int n, void (*f)(int i0, int i1, void *data), void *data);  /* call f(i0,i1,data) on blocks of [0,n) in parallel */
+void parallel_for_grain(int n, int grain, void (*f)(int i0, int i1, void *data), void *data);  /* parallel_for() with blocks of >= grain items */
+void parallel_reduce(int n, void (*f)(int i0, int i1, void *partial, void *data),
+		     void (*combine)(void *result, const void *partial, void *data),
+		     void *result, size_t result_size, void *data);  /* deterministic parallel reduction of blocks of [0,n) into *result */
+
+/*
+ * Tracing:  nested, per-thread scope timers and counters, enabled at run time with trace_enable() or
+ * with the environment variables BINGHAM_TRACE=<file> (scope timings and counters, as JSON) and
+ * BINGHAM_TRACE_EVENTS=<file> (Chrome trace events), which are written at exit.  The TRACE_*()
+ * macros cost one branch when tracing is off, and compile to nothing with -DBINGHAM_NO_TRACE.
+ */
+extern int trace_state;  /* -1 = uninitialized, 0 = off, 1 = on */
+void trace_enable(int events);                   /* turn on tracing (and trace event recording, if events is set) */
+void trace_disable();
+void trace_begin(const char *name);              /* begin a trace scope (name must outlive the trace, e.g. a string literal) */
+void trace_end();                                /* end the current trace scope */
+void trace_count(const char *name, double value);  /* add value to a trace counter */
+int trace_save_json(const char *fname);          /* save the scope timings and counters of all threads as JSON */
+int trace_save_chrome(const char *fname);        /* save the trace events of all threads in the Chrome trace event format */
+void trace_reset();                              /* clear the traces of all threads */
+
+#ifdef BINGHAM_NO_TRACE
+#define TRACE_BEGIN(name) do {} while (0)
+#define TRACE_END() do {} while (0)
+#define TRACE_COUNT(name, value) do {} while (0)
+#else
+#define TRACE_BEGIN(name) do { if (trace_state) trace_begin(name); } while (0)
+#define TRACE_END() do { if (trace_state) trace_end(); } while (0)
+#define TRACE_COUNT(name, value) do { if (trace_state) trace_count(name, value); } while (0)
+#endif
 
 char *sword(char *s, const char *delim, int n);      /* returns a pointer to the nth word (starting from 0) in string s */
 char **split(char *s, const char *delim, int *k);    /* splits a string into k words */
@@ -56,8 +97,27 @@ int solve_quadratic(double *x, double a, double b, double c);
 double fact(int x);                                     /* computes the factorial of x */
 double lfact(int x);                                    /* computes the log factorial of x */
 double surface_area_sphere(int d);                      /* computes the surface area of a unit sphere with dimension d */
+typedef struct {
+  uint64_t s[4];
+} rng_t;                                                /* random number generator state (xoshiro256**) */
+
+void rng_seed(rng_t *rng, uint64_t seed);               /* seed a random number generator */
+void rng_jump(rng_t *rng);                              /* advance a random number generator by 2^128 steps */
+void rng_split(rng_t *streams, rng_t *rng, int n);      /* make n non-overlapping streams, starting with rng */
+void rng_set_seed(uint64_t seed);                       /* set the seed of the (per-thread) default streams */
+rng_t *rng_default();                                   /* get the calling thread's default stream */
+uint64_t rng_next(rng_t *rng);                          /* returns 64 random bits */
+double rng_uniform(rng_t *rng);                         /* returns a random double in [0,1) */
+int rng_int(rng_t *rng, int n);                         /* returns a random int between 0 and n-1 */
+double rng_normal(rng_t *rng);                          /* returns a standard normal random variable */
+void rng_uniform_batch(rng_t *rng, double *x, int n);   /* fill x with random doubles in [0,1) */
+void rng_normal_batch(rng_t *rng, double *x, int n);    /* fill x with standard normal random variables */
+void rng_randperm(rng_t *rng, int *x, int n, int d);    /* samples d integers from 0:n-1 uniformly without replacement */
+int rng_pmf(rng_t *rng, double *w, int n);              /* samples from the probability mass function w with n elements */
+int rng_cmf(rng_t *rng, double *w, int n);              /* samples from the cumulative mass function w with n elements */
+
 int irand(int n);                                       /* returns a random int between 0 and n-1 */
-double frand();                                         /* returns a random double in [0,1] */
+double frand();                                         /* returns a random double in [0,1) */
 void randperm(int *x, int n, int d);                    /* samples d integers from 0:n-1 uniformly without replacement */
 double erfinv(double x);                                /* approximation to the inverse error function */
 double normrand(double mu, double sigma);               /* generate a random sample from a normal distribution */
@@ -67,14 +127,39 @@ int cmfrand(double *w, int n);                          /* samples from the cumu
 
 void mvnrand(double *x, double *mu, double **S, int d);   /* sample from a multivariate normal */
 double mvnpdf(double *x, double *mu, double **S, int d);  /* compute a multivariate normal pdf */
+void mvnpdf_log_chol_batch(double *logp, double **X, int n, double *mu, double **L, int d);  /* log mvn pdfs of the rows of X, given the cholesky factor L of the covariance */
 void mvnrand_pcs(double *x, double *mu, double *z, double **V, int d);   /* sample from a multivariate normal in principal components form */
 double mvnpdf_pcs(double *x, double *mu, double *z, double **V, int d);  /* compute a multivariate normal pdf in principal components form */
 void acgrand_pcs(double *x, double *z, double **V, int d);   /* sample from an angular central gaussian in principal components form */
+void mvnrand_pcs_rng(double *x, double *mu, double *z, double **V, int d, rng_t *rng);
+void acgrand_pcs_rng(double *x, double *z, double **V, int d, rng_t *rng);
 double acgpdf_pcs(double *x, double *z, double **V, int d);  /* compute an angular central gaussian pdf in principal components form */
 
+/*
+ * Multivariate normal distribution, with a cached factorization of its covariance.
+ */
+typedef struct {
+  int d;                   /* dimension */
+  double *mu;              /* mean */
+  double **S;              /* covariance */
+  double **L;              /* lower-triangular cholesky factor of S (S = L*L') */
+  double **S_inv;          /* inverse covariance */
+  double logdet;           /* log(det(S)) */
+} mvn_t;
+
+int mvn_new(mvn_t *mvn, double *mu, double **S, int d);      /* returns -1 if S isn't positive definite */
+int mvn_set(mvn_t *mvn, double *mu, double **S);             /* change the mean and covariance (returns -1 if S isn't positive definite) */
+void mvn_free(mvn_t *mvn);
+double mvn_logpdf(mvn_t *mvn, double *x);
+double mvn_pdf(mvn_t *mvn, double *x);
+void mvn_logpdf_batch(double *logp, mvn_t *mvn, double **X, int n);   /* log pdfs of the rows of X (multi-threaded) */
+void mvn_sample(double *x, mvn_t *mvn, rng_t *rng);                    /* rng may be NULL for the default stream */
+void mvn_sample_batch(double **X, mvn_t *mvn, int n, rng_t *rng);
+
 double triangle_area(double x[], double y[], double z[], int n);                    /* calculate the area of a triangle */
 double tetrahedron_volume(double x[], double y[], double z[], double w[], int n);   /* calculate the volume of a tetrahedron */
 void sample_simplex(double x[], double **S, int n, int d);                          /* sample uniformly from a simplex */
+void sample_simplex_rng(double x[], double **S, int n, int d, rng_t *rng);
 
 void vnot(int y[], int x[], int n);                                   /* logical not of a binary array */
 int count(int x[], int n);                                            /* count the non-zero elements of x */
@@ -122,6 +207,11 @@ void quaternion_mult(double z[4], double x[4], double y[4]);          /* quatern
 void quaternion_inverse(double q_inv[4], double q[4]);                /* invert a quaternion */
 void rotation_matrix_to_quaternion(double *q, double **R);            /* convert a rotation matrix to a unit quaternion */
 void quaternion_to_rotation_matrix(double **R, double *q);            /* convert a unit quaternion to a rotation matrix */
+void quaternion_mult_batch(double **Z, double **X, double **Y, int n);                /* batch quaternion multiplication (4-by-n SoA arrays) */
+void quaternion_inverse_batch(double **Q_inv, double **Q, int n);                     /* batch quaternion inverse (4-by-n SoA arrays) */
+void quaternion_to_rotation_matrix_batch(double **R, double **Q, int n);              /* batch quaternion (4-by-n) to rotation matrix (9-by-n) conversion */
+void rotation_matrix_to_quaternion_batch(double **Q, double **R, int n);              /* batch rotation matrix (9-by-n) to quaternion (4-by-n) conversion */
+void quaternion_rotate_points_batch(double **Y, double **X, double *q, int n);        /* rotate an n-by-3 array of points by a quaternion */
 int ismemberi(int x, int *y, int n);                                  /* checks if y contains x */
 void reverse(double *y, double *x, int n);                            /* reverses an array of doubles */
 void reversei(int *y, int *x, int n);                                 /* reverses an array of ints */
@@ -148,18 +238,23 @@ int **new_diag_matrix2i(int *diag, int n);
 void free_matrix2(double **X);                                                  /* free a 2d matrix of doubles */
 void free_matrix2f(float **X);                                                  /* free a 2d matrix of floats */
 void free_matrix2i(int **X);                                                    /* free a 2d matrix of ints */
-void save_matrix(char *fout, double **X, int n, int m);                         /* save a matrix to a file */
+void save_matrix(char *fout, double **X, int n, int m);                         /* save a matrix to a file (binary if fout ends in ".bmat") */
 void save_matrixi(char *fout, int **X, int n, int m);                           /* save a matrix to a file */
-double **load_matrix(char *fin, int *n, int *m);                                /* load a matrix from a file */
+double **load_matrix(char *fin, int *n, int *m);                                /* load a matrix from a file (text or binary); NULL on error or if empty */
+int save_matrix_binary(char *fout, double **X, int n, int m, int use_float);    /* save a matrix to a binary file (returns -1 on error) */
+double **load_matrix_mmap(char *fin, int *n, int *m);                           /* load a read-only matrix by memory-mapping a binary matrix file */
+void free_matrix_mmap(double **X);                                              /* free a matrix from load_matrix_mmap() */
 void transpose(double **Y, double **X, int n, int m);                           /* transpose a matrix */
 void solve(double *x, double **A, double *b, int n);                            /* solve the equation Ax = b, where A is a square n-by-n matrix */
 double det(double **X, int n);                                                  /* compute the determinant of the n-by-n matrix X */
 void inv(double **Y, double **X, int n);                                        /* compute the inverse (Y) of the n-by-n matrix X*/
+int cholesky(double **L, double **A, int n);                                    /* Cholesky decomposition A = L*L' (returns -1 if A isn't positive definite) */
 void matrix_copy(double **Y, double **X, int n, int m);                         /* matrix copy, Y = X */
 double **matrix_clone(double **X, int n, int m);                                /* matrix clone, Y = new(X) */
 void matrix_add(double **Z, double **X, double **Y, int n, int m);              /* matrix addition, Z = X+Y */
 void matrix_sub(double **Z, double **X, double **Y, int n, int m);              /* matrix subtaction, Z = X-Y */
 void matrix_mult(double **Z, double **X, double **Y, int n, int p, int m);      /* matrix multiplication, Z = X*Y */
+void matrix_mult_work(double **Z, double **X, double **Y, int n, int p, int m, double *work);  /* matrix_mult() with an n*m workspace */
 void matrix_vec_mult(double *y, double **A, double *x, int n, int m);           /* matrix-vector multiplication, y = A*x */
 void vec_matrix_mult(double *y, double *x, double **A, int n, int m);           /* vector-matrix multiplication, y = x*A */
 void matrix_elt_mult(double **Z, double **X, double **Y, int n, int m);         /* element-wise multiplication, Z[i][j] = X[i][j] * Y[i][j] */
@@ -171,7 +266,9 @@ void variance(double *vars, double **X, int n, int m);
 void cov(double **S, double **X, double *mu, int n, int m);                     /* compute the covariance of the rows of X, given mean mu */
 void wmean(double *mu, double **X, double *w, int n, int m);                    /* weighted row vector mean */
 void wcov(double **S, double **X, double *w, double *mu, int n, int m);         /* compute the weighted covariance of the rows of X, given mean mu */
+void matrix_scatter(double **S, double **X, double *w, int n, int m);          /* weighted scatter matrix of the rows of X, S = X'*diag(w)*X */
 void eigen_symm(double z[], double **V, double **X, int n);                     /* get evals. z and evecs. V of a real symm. n-by-n matrix X */
+void eigen_symm_inplace(double z[], double **V, double **A, int n);             /* eigen_symm() without allocation; destroys A */
 void reorder_rows(double **Y, double **X, int *idx, int n, int m);              /* reorder the rows of X, Y = X(idx,:) */
 void reorder_rowsi(int **Y, int **X, int *idx, int n, int m);                   /* reorder the rows of X, Y = X(idx,:) */
 void repmat(double **B, double **A, int rep_n, int rep_m, int n, int m);        /* replicates and tiles a 2D matrix of ints */
@@ -179,6 +276,20 @@ void repmati(int **B, int **A, int rep_n, int rep_m, int n, int m);
 void blur_matrix(double **dst, double **src, int n, int m);                     /* blur matrix with a 3x3 gaussian filter with sigma=.5 */
 void blur_matrix_masked(double **dst, double **src, int **mask, int n, int m);  /* blur masked matrix with a 3x3 gaussian filter with sigma=.5 */
 
+
+typedef struct {
+  double *data;            /* element (i,j) is data[i*stride + j] */
+  int n;                   /* number of rows */
+  int m;                   /* number of columns */
+  int stride;              /* row stride (>= m) */
+} mat_t;                   /* strided matrix view (doesn't own its data) */
+
+int mat_view(mat_t *A, double **X, int n, int m);                     /* view of a double** matrix (returns 0 if its rows aren't evenly spaced) */
+mat_t mat_block(mat_t A, int i0, int j0, int n, int m);               /* view of the n-by-m block of A at (i0,j0) */
+void mat_gemm(mat_t C, double alpha, mat_t A, int transA, mat_t B, int transB, double beta);  /* C = alpha*op(A)*op(B) + beta*C */
+void mat_syrk(mat_t C, double alpha, mat_t A, double *w, double beta);           /* C = alpha*A'*diag(w)*A + beta*C */
+void mat_gemv(double *y, double alpha, mat_t A, int transA, double *x, double beta);  /* y = alpha*op(A)*x + beta*y */
+
 void linear_regression(double *b, double **X, double *y, int n, int d);     /* perform linear regression: dot(b,x[i]) = y[i], i=1..n */
 void polynomial_regression(double *b, double *x, double *y, int n, int d);  /* fit a polynomial: \sum{b[i]*x[j]^i} = y[j], i=1..n, j=1..d */
 
@@ -257,6 +368,22 @@ int meshgraph_add_edge(meshgraph_t *g, int i, int j);
 int meshgraph_add_face(meshgraph_t *g, int i, int j, int k);
 
 
+/* hash map from (undirected) edges to edge indices */
+typedef struct {
+  int ne;                  /* # edges */
+  edge_t *edges;           /* edges, in the order they were added */
+  /* internal vars */
+  int _ecap;
+  int _hcap;               /* hash table capacity (power of 2) */
+  int *_table;             /* hash table of edge indices (or -1) */
+} edge_map_t;
+
+void edge_map_new(edge_map_t *map, int edge_capacity);         /* create an edge map with room for edge_capacity edges */
+void edge_map_free(edge_map_t *map);                           /* free the contents of an edge map */
+int edge_map_add(edge_map_t *map, int i, int j);               /* add an edge (if it's not already there) and return its index */
+int edge_map_find(edge_map_t *map, int i, int j);              /* find the index of an edge (or -1); thread-safe */
+
+
 typedef struct {
   unsigned char r;
   unsigned char g;
@@ -282,6 +409,60 @@ void kdtree_free(kdtree_t *tree);
 int kdtree_NN(kdtree_t *tree, double *x);
 
 
+/*
+ * Implicit (array-based) kd-tree.  Node k has children 2k+1 and 2k+2, and owns the permuted
+ * points [begin,end).  The points are copied into one contiguous n*d buffer (of doubles or
+ * floats) in tree order, so leaf scans are sequential.  Queries are read-only and thread-safe.
+ */
+typedef struct {
+  double split;            /* split value (internal nodes) */
+  int axis;                /* split dimension (-1 for leaves) */
+  int begin;               /* first point in the node */
+  int end;                 /* one past the last point in the node */
+} kdtree_flat_node_t;
+
+typedef struct {
+  int n;                   /* number of points */
+  int d;                   /* dimension of the points */
+  int num_nodes;           /* number of nodes (internal + leaves) */
+  kdtree_flat_node_t *nodes;
+  double *X;               /* permuted points (double trees), or NULL */
+  float *Xf;               /* permuted points (float trees), or NULL */
+  int *idx;                /* idx[i] = original index of the i-th permuted point */
+} kdtree_flat_t;
+
+kdtree_flat_t *kdtree_flat(double **X, int n, int d, int leaf_size);         /* build a kd-tree (leaf_size <= 0 for the default) */
+kdtree_flat_t *kdtree_flat_float(float **X, int n, int d, int leaf_size);   /* build a kd-tree with float storage */
+void kdtree_flat_free(kdtree_flat_t *tree);
+int kdtree_flat_NN(kdtree_flat_t *tree, double *q, double *d2);             /* nearest neighbor (d2 may be NULL) */
+int kdtree_flat_knn(int *nn_idx, double *nn_d2, kdtree_flat_t *tree, double *q, int k);  /* k nearest neighbors, sorted by distance */
+int kdtree_flat_knn_approx(int *nn_idx, double *nn_d2, kdtree_flat_t *tree, double *q, int k, double eps);  /* (1+eps)-approximate kNN */
+int kdtree_flat_knn_float(int *nn_idx, double *nn_d2, kdtree_flat_t *tree, float *q, int k);  /* kNN with a float query */
+int kdtree_flat_radius(int *idx, double *d2, kdtree_flat_t *tree, double *q, double r, int max_results);  /* points within r of q (returns the number found, at most max_results) */
+void kdtree_flat_knn_batch(int **nn_idx, double **nn_d2, kdtree_flat_t *tree, double **Q, int nq, int k, double eps);  /* multi-threaded kNN */
+void kdtree_flat_radius_batch(int *cnt, int **idx, double **d2, kdtree_flat_t *tree, double **Q, int nq, double r, int max_results);
+
+
+/*
+ * Nearest-neighbor index for unit quaternions (or any unit d-vectors) with antipodal symmetry, q == -q.
+ * The points are stored on the x[0] >= 0 hemisphere, and queries search around both q and -q when the
+ * search ball crosses the hemisphere boundary.  Distances are angles, acos(|dot(q,p)|), in [0, pi/2].
+ */
+typedef struct {
+  int n;                   /* number of points */
+  int d;                   /* dimension of the points (4 for quaternions) */
+  kdtree_flat_t *tree;     /* kd-tree on the canonicalized points */
+} quaternion_index_t;
+
+quaternion_index_t *quaternion_index(double **Q, int n, int d);
+void quaternion_index_free(quaternion_index_t *index);
+int quaternion_index_NN(quaternion_index_t *index, double *q, double *dq);  /* nearest neighbor (dq may be NULL) */
+int quaternion_index_knn(int *nn_idx, double *nn_dq, quaternion_index_t *index, double *q, int k);  /* k nearest neighbors, sorted by angle */
+int quaternion_index_radius(int *idx, double *dq, quaternion_index_t *index, double *q, double max_dq, int max_results);
+void quaternion_index_knn_batch(int **nn_idx, double **nn_dq, quaternion_index_t *index, double **Q, int nq, int k);
+void quaternion_index_radius_batch(int *cnt, int **idx, double **dq, quaternion_index_t *index, double **Q, int nq, double max_dq, int max_results);
+
+
 
 #ifdef __cplusplus
 }
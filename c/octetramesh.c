@@ -176,434 +176,325 @@ graph_t *octetramesh_graph(octetramesh_t *mesh)
 }
 
 
+typedef struct {
+  octetramesh_t *dst;
+  octetramesh_t *src;
+  edge_map_t *edges;
+  int *tetmask;    /* cells to subdivide (NULL = all) */
+  int *octmask;
+  int *tetrank;    /* index of each tetrahedron among the (un)selected tetrahedra */
+  int *octrank;    /* index of each octahedron among the (un)selected octahedra */
+  int tdiv;        /* # of tetrahedra to subdivide */
+  int odiv;        /* # of octahedra to subdivide */
+} octetramesh_subdivide_data_t;
+
+
 /*
- * Compute the midpoints of all the edges in a mesh.
+ * Compute the midpoints of edges e0..e1-1 (for octetramesh_subdivide()).
  */
-static void octetramesh_midpoints(double **dst, octetramesh_t *mesh, graph_t *graph)
+static void octetramesh_subdivide_midpoints(int e0, int e1, void *ptr)
 {
-  int i, j, e;
-  for (e = 0; e < graph->ne; e++) {   // for each edge, compute the midpoint
-    i = graph->edges[e].i;
-    j = graph->edges[e].j;
-    avg(dst[e], mesh->vertices[i], mesh->vertices[j], mesh->d);
-  }
+  octetramesh_subdivide_data_t *data = (octetramesh_subdivide_data_t *)ptr;
+  octetramesh_t *src = data->src;
+  double **midpoints = data->dst->vertices + src->nv;
+  edge_t *edges = data->edges->edges;
+  int e;
+  for (e = e0; e < e1; e++)
+    avg(midpoints[e], src->vertices[edges[e].i], src->vertices[edges[e].j], src->d);
 }
 
 
 /*
- * Compute the midpoints of the selected edges in a mesh.
+ * Split tetrahedron i of src into 4 tetrahedra (dst->tetrahedra[t..t+3]) and an octahedron (dst->octahedra[o]).
  */
-static void octetramesh_midpoints_select(double **dst, octetramesh_t *mesh, graph_t *graph, int *edgemask)
+static void octetramesh_split_tetrahedron(octetramesh_t *dst, octetramesh_t *src, edge_map_t *E, int i, int t, int o)
 {
-  int i, j, e, cnt = 0;
-  for (e = 0; e < graph->ne; e++) {   // for each selected edge, compute the midpoint
-    if (edgemask[e]) {
-      i = graph->edges[e].i;
-      j = graph->edges[e].j;
-      avg(dst[cnt], mesh->vertices[i], mesh->vertices[j], mesh->d);
-      cnt++;
-    }
-  }
+  int nv = src->nv;
+  int p0, p1, p2, p3;
+  int q01, q02, q03, q12, q13, q23;
+
+  // original point indices
+  p0 = src->tetrahedra[i][0];
+  p1 = src->tetrahedra[i][1];
+  p2 = src->tetrahedra[i][2];
+  p3 = src->tetrahedra[i][3];
+
+  // new point indices
+  q01 = nv + edge_map_find(E, p0, p1);
+  q02 = nv + edge_map_find(E, p0, p2);
+  q03 = nv + edge_map_find(E, p0, p3);
+  q12 = nv + edge_map_find(E, p1, p2);
+  q13 = nv + edge_map_find(E, p1, p3);
+  q23 = nv + edge_map_find(E, p2, p3);
+
+  // new tetrahedra
+  int *t0 = dst->tetrahedra[t];
+  int *t1 = dst->tetrahedra[t+1];
+  int *t2 = dst->tetrahedra[t+2];
+  int *t3 = dst->tetrahedra[t+3];
+
+  t0[0] = p0;  t0[1] = q01;  t0[2] = q02;  t0[3] = q03;
+  t1[0] = p1;  t1[1] = q01;  t1[2] = q12;  t1[3] = q13;
+  t2[0] = p2;  t2[1] = q02;  t2[2] = q12;  t2[3] = q23;
+  t3[0] = p3;  t3[1] = q03;  t3[2] = q13;  t3[3] = q23;
+
+  // new octahedron
+  int *oct = dst->octahedra[o];
+
+  oct[0] = q01;  oct[1] = q02;  oct[2] = q03;  oct[3] = q13;  oct[4] = q12;  oct[5] = q23;
 }
 
 
 /*
- * Compute the centers of all the octahedra in a mesh.
+ * Split octahedron i of src into 8 tetrahedra (dst->tetrahedra[t..t+7]) and 6 octahedra (dst->octahedra[o..o+5]),
+ * with the octahedral center at dst->vertices[v].
  */
-static void octetramesh_octa_centers(double **dst, octetramesh_t *mesh)
+static void octetramesh_split_octahedron(octetramesh_t *dst, octetramesh_t *src, edge_map_t *E, int i, int v, int t, int o)
 {
-  int i, j, v, d = mesh->d;
-  double x[d];
-
-  for (i = 0; i < mesh->no; i++) {   // for each octahedra, compute the center
-    memset(x, 0, d*sizeof(double));
-    for (j = 1; j < 5; j++) {
-      v = mesh->octahedra[i][j];
-      add(x, x, mesh->vertices[v], d);
-    }
-    mult(dst[i], x, 1/4.0, d);
-  }
+  int j, nv = src->nv, d = src->d;
+  int p0, p1, p2, p3, p4, p5;
+  int q0, q01, q02, q03, q04, q12, q23, q34, q41, q51, q52, q53, q54;
+
+  // original point indices
+  p0 = src->octahedra[i][0];
+  p1 = src->octahedra[i][1];
+  p2 = src->octahedra[i][2];
+  p3 = src->octahedra[i][3];
+  p4 = src->octahedra[i][4];
+  p5 = src->octahedra[i][5];
+
+  // new point indices
+  q0 = v;
+  q01 = nv + edge_map_find(E, p0, p1);
+  q02 = nv + edge_map_find(E, p0, p2);
+  q03 = nv + edge_map_find(E, p0, p3);
+  q04 = nv + edge_map_find(E, p0, p4);
+  q12 = nv + edge_map_find(E, p1, p2);
+  q23 = nv + edge_map_find(E, p2, p3);
+  q34 = nv + edge_map_find(E, p3, p4);
+  q41 = nv + edge_map_find(E, p4, p1);
+  q51 = nv + edge_map_find(E, p5, p1);
+  q52 = nv + edge_map_find(E, p5, p2);
+  q53 = nv + edge_map_find(E, p5, p3);
+  q54 = nv + edge_map_find(E, p5, p4);
+
+  // octahedral center
+  double *c = dst->vertices[q0];
+  memset(c, 0, d*sizeof(double));
+  for (j = 1; j < 5; j++)
+    add(c, c, src->vertices[ src->octahedra[i][j] ], d);
+  mult(c, c, 1/4.0, d);
+
+  // new tetrahedra
+  int *t0 = dst->tetrahedra[t];
+  int *t1 = dst->tetrahedra[t+1];
+  int *t2 = dst->tetrahedra[t+2];
+  int *t3 = dst->tetrahedra[t+3];
+  int *t4 = dst->tetrahedra[t+4];
+  int *t5 = dst->tetrahedra[t+5];
+  int *t6 = dst->tetrahedra[t+6];
+  int *t7 = dst->tetrahedra[t+7];
+
+  t0[0] = q0;  t0[1] = q01;  t0[2] = q02;  t0[3] = q12;
+  t1[0] = q0;  t1[1] = q02;  t1[2] = q03;  t1[3] = q23;
+  t2[0] = q0;  t2[1] = q03;  t2[2] = q04;  t2[3] = q34;
+  t3[0] = q0;  t3[1] = q04;  t3[2] = q01;  t3[3] = q41;
+  t4[0] = q0;  t4[1] = q51;  t4[2] = q52;  t4[3] = q12;
+  t5[0] = q0;  t5[1] = q52;  t5[2] = q53;  t5[3] = q23;
+  t6[0] = q0;  t6[1] = q53;  t6[2] = q54;  t6[3] = q34;
+  t7[0] = q0;  t7[1] = q54;  t7[2] = q51;  t7[3] = q41;
+
+  // new octahedra
+  int *oct0 = dst->octahedra[o];
+  int *oct1 = dst->octahedra[o+1];
+  int *oct2 = dst->octahedra[o+2];
+  int *oct3 = dst->octahedra[o+3];
+  int *oct4 = dst->octahedra[o+4];
+  int *oct5 = dst->octahedra[o+5];
+
+  oct0[0] = p0;  oct0[1] = q01;  oct0[2] = q02;  oct0[3] = q03;  oct0[4] = q04;  oct0[5] = q0;
+  oct1[0] = q01;  oct1[1] = p1;  oct1[2] = q12;  oct1[3] = q0;  oct1[4] = q41;  oct1[5] = q51;
+  oct2[0] = q02;  oct2[1] = p2;  oct2[2] = q23;  oct2[3] = q0;  oct2[4] = q12;  oct2[5] = q52;
+  oct3[0] = q03;  oct3[1] = p3;  oct3[2] = q34;  oct3[3] = q0;  oct3[4] = q23;  oct3[5] = q53;
+  oct4[0] = q04;  oct4[1] = p4;  oct4[2] = q41;  oct4[3] = q0;  oct4[4] = q34;  oct4[5] = q54;
+  oct5[0] = p5;  oct5[1] = q51;  oct5[2] = q52;  oct5[3] = q53;  oct5[4] = q54;  oct5[5] = q0;
 }
 
 
 /*
- * Compute the centers of the selected octahedra in a mesh.
+ * Subdivide (or copy) tetrahedra i0..i1-1.  Unselected tetrahedra are copied to the front of dst->tetrahedra,
+ * followed by the children of the selected tetrahedra, and then the children of the selected octahedra.
+ * The octahedral children of the selected tetrahedra follow the unselected octahedra in dst->octahedra.
  */
-static void octetramesh_octa_centers_select(double **dst, octetramesh_t *mesh, int *octmask)
+static void octetramesh_subdivide_tetrahedra(int i0, int i1, void *ptr)
 {
-  int i, j, v, cnt, d = mesh->d;
-  double x[d];
-
-  cnt = 0;
-  for (i = 0; i < mesh->no; i++) {   // for each octahedra, compute the center
-    if (octmask[i]) {
-      memset(x, 0, d*sizeof(double));
-      for (j = 1; j < 5; j++) {
-	v = mesh->octahedra[i][j];
-	add(x, x, mesh->vertices[v], d);
-      }
-      mult(dst[cnt++], x, 1/4.0, d);
+  octetramesh_subdivide_data_t *data = (octetramesh_subdivide_data_t *)ptr;
+  octetramesh_t *src = data->src;
+  int nt = src->nt, no = src->no;
+  int i;
+
+  for (i = i0; i < i1; i++) {
+    if (data->tetmask == NULL)
+      octetramesh_split_tetrahedron(data->dst, src, data->edges, i, 4*i, i);
+    else if (data->tetmask[i]) {
+      int r = data->tetrank[i];
+      octetramesh_split_tetrahedron(data->dst, src, data->edges, i, nt - data->tdiv + 4*r, no - data->odiv + r);
     }
+    else
+      memcpy(data->dst->tetrahedra[ data->tetrank[i] ], src->tetrahedra[i], 4*sizeof(int));
   }
 }
 
 
 /*
- * Mark the edges of a subset of tetrahedra and octahedra.
+ * Subdivide (or copy) octahedra i0..i1-1 (see octetramesh_subdivide_tetrahedra()).
  */
-static void select_edges(int *edgemask, octetramesh_t *src, graph_t *graph, int *tetmask, int *octmask)
+static void octetramesh_subdivide_octahedra(int i0, int i1, void *ptr)
 {
-  int i, p0, p1, p2, p3, p4, p5;
-  int ne = graph->ne;
-  int nt = src->nt;
-  int no = src->no;
+  octetramesh_subdivide_data_t *data = (octetramesh_subdivide_data_t *)ptr;
+  octetramesh_t *src = data->src;
+  int nv = src->nv, nt = src->nt, no = src->no, ne = data->edges->ne;
+  int tdiv = data->tdiv, odiv = data->odiv;
+  int i;
 
-  memset(edgemask, 0, ne*sizeof(int));
-
-  for (i = 0; i < nt; i++) {
-    if (tetmask[i]) {
-      p0 = src->tetrahedra[i][0];
-      p1 = src->tetrahedra[i][1];
-      p2 = src->tetrahedra[i][2];
-      p3 = src->tetrahedra[i][3];
-      edgemask[ graph_find_edge(graph, p0, p1) ] = 1;
-      edgemask[ graph_find_edge(graph, p0, p2) ] = 1;
-      edgemask[ graph_find_edge(graph, p0, p3) ] = 1;
-      edgemask[ graph_find_edge(graph, p1, p2) ] = 1;
-      edgemask[ graph_find_edge(graph, p1, p3) ] = 1;
-      edgemask[ graph_find_edge(graph, p2, p3) ] = 1;
+  for (i = i0; i < i1; i++) {
+    if (data->octmask == NULL)
+      octetramesh_split_octahedron(data->dst, src, data->edges, i, nv + ne + i, 4*nt + 8*i, nt + 6*i);
+    else if (data->octmask[i]) {
+      int r = data->octrank[i];
+      octetramesh_split_octahedron(data->dst, src, data->edges, i, nv + ne + r, nt + 3*tdiv + 8*r, no - odiv + tdiv + 6*r);
     }
+    else
+      memcpy(data->dst->octahedra[ data->octrank[i] ], src->octahedra[i], 6*sizeof(int));
   }
+}
 
-  for (i = 0; i < no; i++) {
-    if (octmask[i]) {
-      p0 = src->octahedra[i][0];
-      p1 = src->octahedra[i][1];
-      p2 = src->octahedra[i][2];
-      p3 = src->octahedra[i][3];
-      p4 = src->octahedra[i][4];
-      p5 = src->octahedra[i][5];
-      edgemask[ graph_find_edge(graph, p0, p1) ] = 1;
-      edgemask[ graph_find_edge(graph, p0, p2) ] = 1;
-      edgemask[ graph_find_edge(graph, p0, p3) ] = 1;
-      edgemask[ graph_find_edge(graph, p0, p4) ] = 1;
-      edgemask[ graph_find_edge(graph, p1, p2) ] = 1;
-      edgemask[ graph_find_edge(graph, p2, p3) ] = 1;
-      edgemask[ graph_find_edge(graph, p3, p4) ] = 1;
-      edgemask[ graph_find_edge(graph, p4, p1) ] = 1;
-      edgemask[ graph_find_edge(graph, p5, p1) ] = 1;
-      edgemask[ graph_find_edge(graph, p5, p2) ] = 1;
-      edgemask[ graph_find_edge(graph, p5, p3) ] = 1;
-      edgemask[ graph_find_edge(graph, p5, p4) ] = 1;
-    }
+
+/*
+ * Add the edges of a tetrahedron to an edge map.
+ */
+static void add_tetrahedron_edges(edge_map_t *E, int *t)
+{
+  int j, k;
+  for (j = 0; j < 3; j++)
+    for (k = j+1; k < 4; k++)
+      edge_map_add(E, t[j], t[k]);
+}
+
+
+/*
+ * Add the edges of an octahedron to an edge map.
+ */
+static void add_octahedron_edges(edge_map_t *E, int *o)
+{
+  int j;
+  for (j = 1; j < 5; j++) {
+    edge_map_add(E, o[0], o[j]);
+    edge_map_add(E, o[j], o[j%4+1]);
+    edge_map_add(E, o[5], o[j]);
   }
 }
 
 
+/*
+ * Rank each cell among the selected (mask[i] != 0) or unselected cells.  Returns the number of selected cells.
+ */
+static int rank_mask(int *rank, int *mask, int n)
+{
+  int i, num_selected = 0, num_unselected = 0;
+  for (i = 0; i < n; i++)
+    rank[i] = (mask[i] ? num_selected++ : num_unselected++);
+
+  return num_selected;
+}
+
+
 /**
  * Subdivide each specificied octahedron into 6 octahedra and 8 tetrahedra,
  * and subdivide each specified tetrahedron into 4 tetrahedra and an octahedron.
+ * Unselected cells are copied into dst (before the new cells).
  */
 void octetramesh_subdivide_select(octetramesh_t *dst, octetramesh_t *src, int *tetmask, int *octmask)
 {
-  int i, tcnt, ocnt;
-  int p0, p1, p2, p3, p4, p5;
-  int q0, q01, q02, q03, q04, q12, q23, q34, q41, q51, q52, q53, q54, q13;
-
-  //printf("break 1\n");
-
-  graph_t *graph = octetramesh_graph(src);
-
-  //printf("break 2\n");
+  int i;
 
-  int ne = graph->ne;
   int nv = src->nv;
   int nt = src->nt;
   int no = src->no;
   int d = src->d;
 
-  //printf("break 3\n");
-
-  //printf("ne = %d\n", ne);
-
-  // mark edges for subdivision
-  int edgemask[ne];
-
-  //printf("break 3.1\n");
-
-  select_edges(edgemask, src, graph, tetmask, octmask);
-
-  //printf("break 4\n");
-
-  // create an edge map from the full edge list to the selected edge list
-  int edgemap[ne];
-  findinv(edgemap, edgemask, ne);
-
-  //printf("break 5\n");
-
-  // create an oct map from the full octahedron list to the selected octahedron list
-  int octmap[no];
-  findinv(octmap, octmask, no);
-
-  //printf("break 6\n");
-
-  int tdiv = count(tetmask, nt);   // # of tetrahedra to subdivide
-  int odiv = count(octmask, no);   // # of octahedra to subdivide
-  int ediv = count(edgemask, ne);  // # of edges to subdivide
+  // find the edges of the selected cells (in a fixed order, so that the vertex numbering is deterministic)
+  edge_map_t E;
+  edge_map_new(&E, 16);
+  for (i = 0; i < nt; i++)
+    if (tetmask[i])
+      add_tetrahedron_edges(&E, src->tetrahedra[i]);
+  for (i = 0; i < no; i++)
+    if (octmask[i])
+      add_octahedron_edges(&E, src->octahedra[i]);
 
-  //printf("break 7\n");
+  int *tetrank, *octrank;
+  safe_malloc(tetrank, nt, int);
+  safe_malloc(octrank, no+1, int);
+  int tdiv = rank_mask(tetrank, tetmask, nt);   // # of tetrahedra to subdivide
+  int odiv = rank_mask(octrank, octmask, no);   // # of octahedra to subdivide
 
-  int nv2 = nv + ediv + odiv;  // old vertices + midpoints + octahedral centers
+  int nv2 = nv + E.ne + odiv;  // old vertices + midpoints + octahedral centers
   int nt2 = (nt - tdiv) + 4*tdiv + 8*odiv;
   int no2 = (no - odiv) + tdiv + 6*odiv;
 
-  //printf("nv2 = %d, nt2 = %d, no2 = %d\n", nv2, nt2, no2);
-
-  // allocate space for the new mesh and copy old vertices, midpoints, and octahedral centers into dst
+  // allocate space for the new mesh and copy old vertices into dst
   octetramesh_new(dst, nv2, nt2, no2, d);
   memcpy(dst->vertices[0], src->vertices[0], nv*d*sizeof(double));
-  octetramesh_midpoints_select(dst->vertices + nv, src, graph, edgemask);
-  octetramesh_octa_centers_select(dst->vertices + nv + ediv, src, octmask);
-
-  // copy unchanged tetrahedra into dst
-  tcnt = 0;
-  for (i = 0; i < nt; i++)
-    if (tetmask[i] == 0)
-      memcpy(dst->tetrahedra[tcnt++], src->tetrahedra[i], 4*sizeof(int));
-
-  // copy unchanged octahedra into dst
-  ocnt = 0;
-  for (i = 0; i < no; i++)
-    if (octmask[i] == 0)
-      memcpy(dst->octahedra[ocnt++], src->octahedra[i], 6*sizeof(int));
-
-  for (i = 0; i < nt; i++) {    // subdivide selected tetrahedra in the original mesh
-
-    if (tetmask[i]) {
-
-      // original point indices
-      p0 = src->tetrahedra[i][0];
-      p1 = src->tetrahedra[i][1];
-      p2 = src->tetrahedra[i][2];
-      p3 = src->tetrahedra[i][3];
-
-      // new point indices
-      q01 = nv + edgemap[ graph_find_edge(graph, p0, p1) ];
-      q02 = nv + edgemap[ graph_find_edge(graph, p0, p2) ];
-      q03 = nv + edgemap[ graph_find_edge(graph, p0, p3) ];
-      q12 = nv + edgemap[ graph_find_edge(graph, p1, p2) ];
-      q13 = nv + edgemap[ graph_find_edge(graph, p1, p3) ];
-      q23 = nv + edgemap[ graph_find_edge(graph, p2, p3) ];
-
-      // new tetrahedra
-      int *t0 = dst->tetrahedra[tcnt++];
-      int *t1 = dst->tetrahedra[tcnt++];
-      int *t2 = dst->tetrahedra[tcnt++];
-      int *t3 = dst->tetrahedra[tcnt++];
-
-      t0[0] = p0;  t0[1] = q01;  t0[2] = q02;  t0[3] = q03;
-      t1[0] = p1;  t1[1] = q01;  t1[2] = q12;  t1[3] = q13;
-      t2[0] = p2;  t2[1] = q02;  t2[2] = q12;  t2[3] = q23;
-      t3[0] = p3;  t3[1] = q03;  t3[2] = q13;  t3[3] = q23;
-
-      // new octahedron
-      int *oct = dst->octahedra[ocnt++];
-
-      oct[0] = q01;  oct[1] = q02;  oct[2] = q03;  oct[3] = q13;  oct[4] = q12;  oct[5] = q23;
-    }
-  }
-
-  for (i = 0; i < no; i++) {    // subdivide selected octahedra in the original mesh
-
-    if (octmask[i]) {
-
-      // original point indices
-      p0 = src->octahedra[i][0];
-      p1 = src->octahedra[i][1];
-      p2 = src->octahedra[i][2];
-      p3 = src->octahedra[i][3];
-      p4 = src->octahedra[i][4];
-      p5 = src->octahedra[i][5];
-
-      // new point indices
-      q0 = nv + ediv + octmap[i];
-      q01 = nv + edgemap[ graph_find_edge(graph, p0, p1) ];
-      q02 = nv + edgemap[ graph_find_edge(graph, p0, p2) ];
-      q03 = nv + edgemap[ graph_find_edge(graph, p0, p3) ];
-      q04 = nv + edgemap[ graph_find_edge(graph, p0, p4) ];
-      q12 = nv + edgemap[ graph_find_edge(graph, p1, p2) ];
-      q23 = nv + edgemap[ graph_find_edge(graph, p2, p3) ];
-      q34 = nv + edgemap[ graph_find_edge(graph, p3, p4) ];
-      q41 = nv + edgemap[ graph_find_edge(graph, p4, p1) ];
-      q51 = nv + edgemap[ graph_find_edge(graph, p5, p1) ];
-      q52 = nv + edgemap[ graph_find_edge(graph, p5, p2) ];
-      q53 = nv + edgemap[ graph_find_edge(graph, p5, p3) ];
-      q54 = nv + edgemap[ graph_find_edge(graph, p5, p4) ];
-
-      // new tetrahedra
-      int *t0 = dst->tetrahedra[tcnt++];
-      int *t1 = dst->tetrahedra[tcnt++];
-      int *t2 = dst->tetrahedra[tcnt++];
-      int *t3 = dst->tetrahedra[tcnt++];
-      int *t4 = dst->tetrahedra[tcnt++];
-      int *t5 = dst->tetrahedra[tcnt++];
-      int *t6 = dst->tetrahedra[tcnt++];
-      int *t7 = dst->tetrahedra[tcnt++];
-
-      t0[0] = q0;  t0[1] = q01;  t0[2] = q02;  t0[3] = q12;
-      t1[0] = q0;  t1[1] = q02;  t1[2] = q03;  t1[3] = q23;
-      t2[0] = q0;  t2[1] = q03;  t2[2] = q04;  t2[3] = q34;
-      t3[0] = q0;  t3[1] = q04;  t3[2] = q01;  t3[3] = q41;
-      t4[0] = q0;  t4[1] = q51;  t4[2] = q52;  t4[3] = q12;
-      t5[0] = q0;  t5[1] = q52;  t5[2] = q53;  t5[3] = q23;
-      t6[0] = q0;  t6[1] = q53;  t6[2] = q54;  t6[3] = q34;
-      t7[0] = q0;  t7[1] = q54;  t7[2] = q51;  t7[3] = q41;
-
-      // new octahedra
-      int *oct0 = dst->octahedra[ocnt++];
-      int *oct1 = dst->octahedra[ocnt++];
-      int *oct2 = dst->octahedra[ocnt++];
-      int *oct3 = dst->octahedra[ocnt++];
-      int *oct4 = dst->octahedra[ocnt++];
-      int *oct5 = dst->octahedra[ocnt++];
-
-      oct0[0] = p0;  oct0[1] = q01;  oct0[2] = q02;  oct0[3] = q03;  oct0[4] = q04;  oct0[5] = q0;
-      oct1[0] = q01;  oct1[1] = p1;  oct1[2] = q12;  oct1[3] = q0;  oct1[4] = q41;  oct1[5] = q51;
-      oct2[0] = q02;  oct2[1] = p2;  oct2[2] = q23;  oct2[3] = q0;  oct2[4] = q12;  oct2[5] = q52;
-      oct3[0] = q03;  oct3[1] = p3;  oct3[2] = q34;  oct3[3] = q0;  oct3[4] = q23;  oct3[5] = q53;
-      oct4[0] = q04;  oct4[1] = p4;  oct4[2] = q41;  oct4[3] = q0;  oct4[4] = q34;  oct4[5] = q54;
-      oct5[0] = p5;  oct5[1] = q51;  oct5[2] = q52;  oct5[3] = q53;  oct5[4] = q54;  oct5[5] = q0;
-    }
-  }
 
-  //printf("tcnt = %d, ocnt = %d\n", tcnt, ocnt);
+  octetramesh_subdivide_data_t data = {dst, src, &E, tetmask, octmask, tetrank, octrank, tdiv, odiv};
+  parallel_for(E.ne, octetramesh_subdivide_midpoints, &data);
+  parallel_for(nt, octetramesh_subdivide_tetrahedra, &data);
+  parallel_for(no, octetramesh_subdivide_octahedra, &data);
 
-  graph_free(graph);
+  edge_map_free(&E);
+  free(tetrank);
+  free(octrank);
 }
 
 
-/**
- * Subdivide each octahedron into 6 octahedra and 8 tetrahedra,
- * and subdivide each tetrahedron into 4 tetrahedra and an octahedron.
+/*
+ * Subdivide each tetrahedron in a mesh into 4 tetrahedra and an octahedron, and each octahedron
+ * into 8 tetrahedra and 6 octahedra.  The edges are deduplicated with a hash map in a first
+ * (serial) pass, and then the new vertices and cells are filled in in parallel.
  */
 void octetramesh_subdivide(octetramesh_t *dst, octetramesh_t *src)
 {
   int i;
-  int p0, p1, p2, p3, p4, p5;
-  int q0, q01, q02, q03, q04, q12, q23, q34, q41, q51, q52, q53, q54, q13;
-
-  graph_t *graph = octetramesh_graph(src);
 
-  int ne = graph->ne;
   int nv = src->nv;
   int nt = src->nt;
   int no = src->no;
   int d = src->d;
 
+  // find the edges (in a fixed order, so that the vertex numbering is deterministic)
+  edge_map_t E;
+  edge_map_new(&E, 8*nv);
+  for (i = 0; i < nt; i++)
+    add_tetrahedron_edges(&E, src->tetrahedra[i]);
+  for (i = 0; i < no; i++)
+    add_octahedron_edges(&E, src->octahedra[i]);
+
+  int ne = E.ne;
   int nv2 = nv + ne + no;  // old vertices + midpoints + octahedral centers
   int nt2 = 4*nt + 8*no;
   int no2 = nt + 6*no;
 
-  // allocate space for the new mesh and copy old vertices, midpoints, and octahedral centers into dst
+  // allocate space for the new mesh and copy old vertices into dst
   octetramesh_new(dst, nv2, nt2, no2, d);
   memcpy(dst->vertices[0], src->vertices[0], nv*d*sizeof(double));
-  octetramesh_midpoints(dst->vertices + nv, src, graph);
-  octetramesh_octa_centers(dst->vertices + nv + ne, src);
-
-  for (i = 0; i < nt; i++) {    // subdivide each tetrahedron in the original mesh
 
-    // original point indices
-    p0 = src->tetrahedra[i][0];
-    p1 = src->tetrahedra[i][1];
-    p2 = src->tetrahedra[i][2];
-    p3 = src->tetrahedra[i][3];
+  octetramesh_subdivide_data_t data = {dst, src, &E, NULL, NULL, NULL, NULL, nt, no};
+  parallel_for(ne, octetramesh_subdivide_midpoints, &data);
+  parallel_for(nt, octetramesh_subdivide_tetrahedra, &data);
+  parallel_for(no, octetramesh_subdivide_octahedra, &data);
 
-    // new point indices
-    q01 = nv + graph_find_edge(graph, p0, p1);
-    q02 = nv + graph_find_edge(graph, p0, p2);
-    q03 = nv + graph_find_edge(graph, p0, p3);
-    q12 = nv + graph_find_edge(graph, p1, p2);
-    q13 = nv + graph_find_edge(graph, p1, p3);
-    q23 = nv + graph_find_edge(graph, p2, p3);
-
-    // new tetrahedra
-    int *t0 = dst->tetrahedra[4*i];
-    int *t1 = dst->tetrahedra[4*i+1];
-    int *t2 = dst->tetrahedra[4*i+2];
-    int *t3 = dst->tetrahedra[4*i+3];
-
-    t0[0] = p0;  t0[1] = q01;  t0[2] = q02;  t0[3] = q03;
-    t1[0] = p1;  t1[1] = q01;  t1[2] = q12;  t1[3] = q13;
-    t2[0] = p2;  t2[1] = q02;  t2[2] = q12;  t2[3] = q23;
-    t3[0] = p3;  t3[1] = q03;  t3[2] = q13;  t3[3] = q23;
-
-    // new octahedron
-    int *oct = dst->octahedra[i];
-
-    oct[0] = q01;  oct[1] = q02;  oct[2] = q03;  oct[3] = q13;  oct[4] = q12;  oct[5] = q23;
-  }
-
-  for (i = 0; i < no; i++) {    // subdivide each octahedron in the original mesh
-
-    // original point indices
-    p0 = src->octahedra[i][0];
-    p1 = src->octahedra[i][1];
-    p2 = src->octahedra[i][2];
-    p3 = src->octahedra[i][3];
-    p4 = src->octahedra[i][4];
-    p5 = src->octahedra[i][5];
-
-    // new point indices
-    q0 = nv + ne + i;
-    q01 = nv + graph_find_edge(graph, p0, p1);
-    q02 = nv + graph_find_edge(graph, p0, p2);
-    q03 = nv + graph_find_edge(graph, p0, p3);
-    q04 = nv + graph_find_edge(graph, p0, p4);
-    q12 = nv + graph_find_edge(graph, p1, p2);
-    q23 = nv + graph_find_edge(graph, p2, p3);
-    q34 = nv + graph_find_edge(graph, p3, p4);
-    q41 = nv + graph_find_edge(graph, p4, p1);
-    q51 = nv + graph_find_edge(graph, p5, p1);
-    q52 = nv + graph_find_edge(graph, p5, p2);
-    q53 = nv + graph_find_edge(graph, p5, p3);
-    q54 = nv + graph_find_edge(graph, p5, p4);
-
-    // new tetrahedra
-    int *t0 = dst->tetrahedra[4*nt+8*i];
-    int *t1 = dst->tetrahedra[4*nt+8*i+1];
-    int *t2 = dst->tetrahedra[4*nt+8*i+2];
-    int *t3 = dst->tetrahedra[4*nt+8*i+3];
-    int *t4 = dst->tetrahedra[4*nt+8*i+4];
-    int *t5 = dst->tetrahedra[4*nt+8*i+5];
-    int *t6 = dst->tetrahedra[4*nt+8*i+6];
-    int *t7 = dst->tetrahedra[4*nt+8*i+7];
-
-    t0[0] = q0;  t0[1] = q01;  t0[2] = q02;  t0[3] = q12;
-    t1[0] = q0;  t1[1] = q02;  t1[2] = q03;  t1[3] = q23;
-    t2[0] = q0;  t2[1] = q03;  t2[2] = q04;  t2[3] = q34;
-    t3[0] = q0;  t3[1] = q04;  t3[2] = q01;  t3[3] = q41;
-    t4[0] = q0;  t4[1] = q51;  t4[2] = q52;  t4[3] = q12;
-    t5[0] = q0;  t5[1] = q52;  t5[2] = q53;  t5[3] = q23;
-    t6[0] = q0;  t6[1] = q53;  t6[2] = q54;  t6[3] = q34;
-    t7[0] = q0;  t7[1] = q54;  t7[2] = q51;  t7[3] = q41;
-
-    // new octahedra
-    int *oct0 = dst->octahedra[nt+6*i];
-    int *oct1 = dst->octahedra[nt+6*i+1];
-    int *oct2 = dst->octahedra[nt+6*i+2];
-    int *oct3 = dst->octahedra[nt+6*i+3];
-    int *oct4 = dst->octahedra[nt+6*i+4];
-    int *oct5 = dst->octahedra[nt+6*i+5];
-
-    oct0[0] = p0;  oct0[1] = q01;  oct0[2] = q02;  oct0[3] = q03;  oct0[4] = q04;  oct0[5] = q0;
-    oct1[0] = q01;  oct1[1] = p1;  oct1[2] = q12;  oct1[3] = q0;  oct1[4] = q41;  oct1[5] = q51;
-    oct2[0] = q02;  oct2[1] = p2;  oct2[2] = q23;  oct2[3] = q0;  oct2[4] = q12;  oct2[5] = q52;
-    oct3[0] = q03;  oct3[1] = p3;  oct3[2] = q34;  oct3[3] = q0;  oct3[4] = q23;  oct3[5] = q53;
-    oct4[0] = q04;  oct4[1] = p4;  oct4[2] = q41;  oct4[3] = q0;  oct4[4] = q34;  oct4[5] = q54;
-    oct5[0] = p5;  oct5[1] = q51;  oct5[2] = q52;  oct5[3] = q53;  oct5[4] = q54;  oct5[5] = q0;
-  }
-
-  graph_free(graph);
+  edge_map_free(&E);
 }
 
 
@@ -735,7 +735,9 @@ void load_scope_params(scope_params_t *params, char *param_file)
       char *name = s;
       char *value = sword(s, " \t", 1);
 
-      if (!wordcmp(name, "num_samples_round1", " \t\n"))
+      if (!wordcmp(name, "seed", " \t\n"))
+	sscanf(value, "%d", &params->seed);
+      else if (!wordcmp(name, "num_samples_round1", " \t\n"))
 	sscanf(value, "%d", &params->num_samples_round1);
       else if (!wordcmp(name, "num_samples_round2", " \t\n"))
 	sscanf(value, "%d", &params->num_samples_round2);
@@ -2282,29 +2284,23 @@ double compute_visibility_prob(double *point, double *normal, range_image_t *obs
 
 void transform_cloud(double **cloud2, double **cloud, int n, double *x, double *q)
 {
-  double **R = new_matrix2(3,3);
-  quaternion_to_rotation_matrix(R,q);
-  int i;
-  for (i = 0; i < n; i++) {
-    matrix_vec_mult(cloud2[i], R, cloud[i], 3, 3);
-    if (x != NULL)
+  quaternion_rotate_points_batch(cloud2, cloud, q, n);
+  if (x != NULL) {
+    int i;
+    for (i = 0; i < n; i++)
       add(cloud2[i], cloud2[i], x, 3);
   }
-  free_matrix2(R);
 }
 
 double **get_sub_cloud_at_pose(pcd_t *pcd, int *idx, int n, double *x, double *q)
 {
   double **cloud = new_matrix2(n,3);
-  double **R = new_matrix2(3,3);
-  quaternion_to_rotation_matrix(R,q);
   int i;
-  for (i = 0; i < n; i++) {
+  for (i = 0; i < n; i++)
     memcpy(cloud[i], pcd->points[idx[i]], 3*sizeof(double));
-    matrix_vec_mult(cloud[i], R, cloud[i], 3, 3);
+  quaternion_rotate_points_batch(cloud, cloud, q, n);
+  for (i = 0; i < n; i++)
     add(cloud[i], cloud[i], x, 3);
-  }
-  free_matrix2(R);
 
   return cloud;
 }
@@ -2312,14 +2308,10 @@ double **get_sub_cloud_at_pose(pcd_t *pcd, int *idx, int n, double *x, double *q
 double **get_sub_cloud_normals_rotated(pcd_t *pcd, int *idx, int n, double *q)
 {
   double **normals = new_matrix2(n,3);
-  double **R = new_matrix2(3,3);
-  quaternion_to_rotation_matrix(R,q);
   int i;
-  for (i = 0; i < n; i++) {
+  for (i = 0; i < n; i++)
     memcpy(normals[i], pcd->normals[idx[i]], 3*sizeof(double));
-    matrix_vec_mult(normals[i], R, normals[i], 3, 3);
-  }
-  free_matrix2(R);
+  quaternion_rotate_points_batch(normals, normals, q, n);
 
   return normals;
 }
@@ -2642,6 +2634,7 @@ void sample_model_pose_given_correspondences(scope_sample_t *sample, scope_model
  */
 void get_superpixel_segmentation(scope_obs_data_t *obs_data, scope_params_t *params)
 {
+  TRACE_BEGIN("get_superpixel_segmentation");
   double t0 = get_time_ms();  //dbug
 
   int segment_resolution = params->segment_resolution; //7;  // in units of range image pixels
@@ -3020,6 +3013,8 @@ void get_superpixel_segmentation(scope_obs_data_t *obs_data, scope_params_t *par
   free_matrix2(cluster_points);
   free_matrix2(cluster_normals);
   free_matrix2(cluster_colors);
+
+  TRACE_END();
 }
 
 
@@ -3469,6 +3464,9 @@ void get_scope_model_data(scope_model_data_t *data, olf_model_t *model, scope_pa
   for (i = 0; i < data->range_edges_model->pcd->num_points; i++)
     get_olf(&data->range_edges_model_olfs[i], data->range_edges_model->pcd, i, 0);
 
+  // build kd-trees
+  data->model_xyz_tree = kdtree_flat(data->pcd_model->points, data->pcd_model->num_points, 3, 0);
+
   /*
   // get combined feature matrices for FLANN
   double **model_xyzn = get_xyzn_features(data->pcd_model, params);
@@ -3649,6 +3647,7 @@ void free_scope_model_data(scope_model_data_t *data)
 
   //free_pcd_color_model(data->color_model);
   free_multiview_pcd(data->range_edges_model);
+  kdtree_flat_free(data->model_xyz_tree);
   /*flann_free_index(data->model_xyz_index, &data->model_xyz_params);
     flann_free_index(data->model_xyzn_index, &data->model_xyzn_params);*/
 
@@ -3893,30 +3892,43 @@ void cluster_pose_samples(scope_samples_t *S, scope_params_t *params)
   double dq_thresh = params->q_cluster_thresh;
   int cluster_idx[S->num_samples], cluster[S->num_samples], cluster_cnts[S->num_samples];
   cluster_idx[0] = 0;
+  cluster[0] = 0;
   cluster_cnts[0] = S->samples[0].nc;
   int num_clusters = 1;
   int i, j;
 
-  // agglomerative clustering by pose
+  // index the sample orientations (q == -q)
+  double *Q[S->num_samples];
+  for (i = 0; i < S->num_samples; i++)
+    Q[i] = S->samples[i].q;
+  quaternion_index_t *q_index = quaternion_index(Q, S->num_samples, 4);
+  int is_center[S->num_samples], nn_idx[S->num_samples];
+  double nn_dq[S->num_samples];
+  is_center[0] = 1;
+
+  // agglomerative clustering by pose:  add each sample to the first cluster whose center is close enough
   for (i = 1; i < S->num_samples; i++) {
-    int unique = 1;
-    for (j = 0; j < num_clusters; j++) {
-      int c = cluster_idx[j];
-      double dx2 = dist2(S->samples[i].x, S->samples[c].x, 3);
-      double dq = acos(fabs(dot(S->samples[i].q, S->samples[c].q, 4)));
-      if (dx2 < dx2_thresh && dq < dq_thresh) {
-	unique = 0;
-	cluster[i] = j;
-	cluster_cnts[j] += S->samples[i].nc;
-	break;
-      }
+    is_center[i] = 0;
+    int best = num_clusters;
+    int n = quaternion_index_radius(nn_idx, nn_dq, q_index, S->samples[i].q, dq_thresh, S->num_samples);
+    for (j = 0; j < n; j++) {
+      int c = nn_idx[j];
+      if (c < i && is_center[c] && cluster[c] < best && nn_dq[j] < dq_thresh &&
+	  dist2(S->samples[i].x, S->samples[c].x, 3) < dx2_thresh)
+	best = cluster[c];
     }
-    if (unique) {
+    if (best < num_clusters) {
+      cluster[i] = best;
+      cluster_cnts[best] += S->samples[i].nc;
+    }
+    else {
+      is_center[i] = 1;
       cluster[i] = num_clusters;
       cluster_cnts[num_clusters] = S->samples[i].nc;
       cluster_idx[num_clusters++] = i;
     }
   }
+  quaternion_index_free(q_index);
 
   // allocate space for the merged cluster correspondences (one correspondence per sample)
   for (i = 0; i < num_clusters; i++) {
@@ -4828,10 +4840,9 @@ double compute_random_walk_score(double *x, double *q, double **cloud, scope_mod
 	matrix_vec_mult(p, R_inv, p, 3, 3);
 
 	// find the xyz-distance to the closest model point
-	int nn_idx;
 	double nn_d2;
 	//flann_find_nearest_neighbors_index_double(model_xyz_index, p, 1, &nn_idx, &nn_d2, 1, model_xyz_params);
-	knn_brute_force(&nn_d2, &nn_idx, p, model_data->pcd_model->points, model_data->pcd_model->num_points, 3, 1);
+	kdtree_flat_NN(model_data->model_xyz_tree, p, &nn_d2);
 
 	// add score
 	double d = MIN(sqrt(nn_d2), dmax);
@@ -4942,7 +4953,13 @@ double compute_table_score(double **cloud, int n, double *table_plane, scope_par
 }
 
 
-double model_placement_score(scope_sample_t *sample, scope_model_data_t *model_data, scope_obs_data_t *obs_data, scope_params_t *params, int score_round)
+/*
+ * Score a sample pose.  If validation_idx isn't NULL, it holds the (pcd) model validation points
+ * to use, so that the caller can draw them up front (e.g. to score samples in parallel without
+ * touching the random streams); otherwise they're drawn here.
+ */
+static double model_placement_score_idx(scope_sample_t *sample, scope_model_data_t *model_data, scope_obs_data_t *obs_data, scope_params_t *params,
+					int score_round, int *validation_idx)
 {
   int num_validation_points_orig = params->num_validation_points;
   if (score_round == 3)
@@ -4956,8 +4973,12 @@ double model_placement_score(scope_sample_t *sample, scope_model_data_t *model_d
   // get model validation points
   int i;
   int num_validation_points = (params->num_validation_points > 0 ? params->num_validation_points : model_data->pcd_model->num_points);
-  int idx[num_validation_points];
-  get_validation_points(idx, model_data->pcd_model, num_validation_points);
+  int idx_buf[validation_idx ? 1 : num_validation_points];
+  int *idx = validation_idx;
+  if (idx == NULL) {
+    get_validation_points(idx_buf, model_data->pcd_model, num_validation_points);
+    idx = idx_buf;
+  }
 
   if (params->verbose)
     memcpy(mps_idx_, idx, num_validation_points*sizeof(int));
@@ -5161,6 +5182,12 @@ double model_placement_score(scope_sample_t *sample, scope_model_data_t *model_d
 }
 
 
+double model_placement_score(scope_sample_t *sample, scope_model_data_t *model_data, scope_obs_data_t *obs_data, scope_params_t *params, int score_round)
+{
+  return model_placement_score_idx(sample, model_data, obs_data, params, score_round, NULL);
+}
+
+
 
 
 
@@ -6066,6 +6093,24 @@ void align_model_gradient(scope_sample_t *sample, scope_model_data_t *model_data
 //==============================================================================================//
 
 
+typedef struct {
+  scope_samples_t *S;
+  scope_model_data_t *model_data;
+  scope_obs_data_t *obs_data;
+  scope_params_t *params;
+  int score_round;
+  int **validation_idx;  // model validation points of each sample (NULL to use all the points)
+} scope_score_samples_data_t;
+
+static void scope_score_samples_block(int i0, int i1, void *ptr)
+{
+  scope_score_samples_data_t *data = (scope_score_samples_data_t *)ptr;
+  int i;
+  for (i = i0; i < i1; i++)
+    data->S->W[i] = model_placement_score_idx(&data->S->samples[i], data->model_data, data->obs_data, data->params, data->score_round,
+					      data->validation_idx ? data->validation_idx[i] : NULL);
+}
+
 scope_samples_t *scope_round1(scope_model_data_t *model_data, scope_obs_data_t *obs_data, scope_params_t *params,
 			      cu_model_data_t *cu_model, cu_obs_data_t *cu_obs, scope_params_t *cu_params)
 {
@@ -6175,20 +6220,41 @@ scope_samples_t *scope_round1(scope_model_data_t *model_data, scope_obs_data_t *
 
   // score hypotheses
   t0 = get_time_ms();
+  TRACE_BEGIN("score_samples");
+  TRACE_COUNT("scope_round1.samples", S->num_samples);
   if (params->use_cuda) {
     int num_validation_points = (params->num_validation_points > 0 ? params->num_validation_points : model_data->pcd_model->num_points);
     //cu_score_samples(S->W, S->samples, S->num_samples, cu_model, cu_obs, params, 1, num_validation_points, obs_data->num_obs_segments);
     score_samples(S->W, S->samples, S->num_samples, cu_model, cu_obs, cu_params, params, num_validation_points, model_data->pcd_model->num_points, obs_data->num_obs_segments, 0, 1);
   }
+  else if (!params->verbose) {
+    // round 1 scores only read the model, observations and params once their validation points are
+    // drawn, so draw those up front (in sample order, from this thread's stream, to keep runs
+    // reproducible from params->seed) and score the samples in parallel
+    int num_validation_points = (params->num_validation_points > 0 ? params->num_validation_points : model_data->pcd_model->num_points);
+    int **validation_idx = NULL;
+    if (num_validation_points != model_data->pcd_model->num_points) {  // see get_validation_points()
+      validation_idx = new_matrix2i(S->num_samples, num_validation_points);
+      for (i = 0; i < S->num_samples; i++)
+	get_validation_points(validation_idx[i], model_data->pcd_model, num_validation_points);
+    }
+    scope_score_samples_data_t data = {S, model_data, obs_data, params, 1, validation_idx};
+    parallel_for_grain(S->num_samples, 16, scope_score_samples_block, &data);
+    if (validation_idx)
+      free_matrix2i(validation_idx);
+  }
   else
     for (i = 0; i < S->num_samples; i++)
       S->W[i] = model_placement_score(&S->samples[i], model_data, obs_data, params, 1);
+  TRACE_END();
 
   t[0] = get_time_ms() - t0;
   t[0] /= S->num_samples;
 
   // sort hypotheses
+  TRACE_BEGIN("sort_pose_samples");
   sort_pose_samples(S);
+  TRACE_END();
   
   double round1_score_thresh = params->round1_score_thresh;  //-.2;
   S->num_samples = find_first_lt(S->W, round1_score_thresh, S->num_samples);
@@ -6320,6 +6386,8 @@ void scope_round3(scope_samples_t *S, scope_model_data_t *model_data, scope_obs_
   double t0 = get_time_ms();
 
   // align with gradients
+  TRACE_BEGIN("align_model_gradient");
+  TRACE_COUNT("scope_round3.samples", S->num_samples);
   int iter;
   for (iter = 0; iter < params->final_alignment_iter; iter++) {
     if (params->use_cuda) {
@@ -6365,11 +6433,13 @@ void scope_round3(scope_samples_t *S, scope_model_data_t *model_data, scope_obs_
     
     }
   }
+  TRACE_END();
   t_align = get_time_ms() - t0;
   t_align /= S->num_samples;
 
   printf("Finished round 3 alignments in %.3f seconds\n", (get_time_ms() - t0) / 1000.0);  //dbug
   t0 = get_time_ms();
+  TRACE_BEGIN("score_samples");
 
   for (i = 0; i < S->num_samples; ++i)
     sample_segments_given_model_pose(&S->samples[i], model_data, obs_data, params, 1, segment_blacklist);  
@@ -6438,7 +6508,10 @@ void scope_round3(scope_samples_t *S, scope_model_data_t *model_data, scope_obs_
   t[3] = get_time_ms() - t[3];
   t[3] /= S->num_samples;
 
+  TRACE_END();
+  TRACE_BEGIN("sort_pose_samples");
   sort_pose_samples(S);
+  TRACE_END();
   
   //while (S->W[S->num_samples - 1] == min_score)
   //  S->num_samples -= 1;
@@ -6609,16 +6682,27 @@ scope_samples_t *scope(scope_model_data_t *model_data, scope_obs_data_t *obs_dat
     q_true_ = true_pose->Q;
   }
 
+  // make runs reproducible
+  if (params->seed)
+    rng_set_seed(params->seed);
+
   double t0 = get_time_ms();  //dbug
+  TRACE_BEGIN("scope");
 
   // step 1: sample initial poses given single correspondences
+  TRACE_BEGIN("scope_round1");
   scope_samples_t *S = scope_round1(model_data, obs_data, params, cu_model, cu_obs, cu_params);
-  if (S->num_samples == 0)
+  TRACE_END();
+  if (S->num_samples == 0) {
+    TRACE_END();
     return S;
+  }
 
   // step 2: align with BPA
   //scope_round2(S, model_data, obs_data, params);
+  TRACE_BEGIN("scope_round2");
   scope_round2_super(S, model_data, obs_data, params, cu_model, cu_obs, cu_params, segment_blacklist);
+  TRACE_END();
 
   //dbug: add true pose
   if (have_true_pose_ && params->use_true_pose) {
@@ -6641,10 +6725,13 @@ scope_samples_t *scope(scope_model_data_t *model_data, scope_obs_data_t *obs_dat
     //S->num_samples = 1;
   }
 
+  TRACE_BEGIN("scope_round3");
   scope_round3(S, model_data, obs_data, params, cu_model, cu_obs, cu_params, segment_blacklist);
+  TRACE_END();
 
   //scope_round4(S, model_data, obs_data, params, cu_model, cu_obs, cu_params);
 
+  TRACE_END();
   t_scope = get_time_ms() - t0;
   printf("Ran scope in %.3f seconds\n", (get_time_ms() - t0) / 1000.0);  //dbug
 
@@ -9823,11 +9910,20 @@ olf_t *load_olf(char *fname)
 	}
       }
       hll_new(&olf->hll[c], Q, X, 2*n, 4, 3);
-      hll_cache(&olf->hll[c], Q, 2*n);
     }
 
+    // load hll caches (or build them, and save them for next time)
+    char fc[1024];
+    sprintf(fc, "%s.hllc", fname);
+    int num_cached = hll_load_cache(fc, olf->hll, num_clusters);
+    for (c = 0; c < num_clusters; c++)
+      if (olf->hll[c].cache.n == 0)
+	hll_cache(&olf->hll[c], olf->hll[c].Q, olf->hll[c].n);
+    if (num_cached < num_clusters)
+      hll_save_cache(fc, olf->hll, num_clusters);
+
     // save hll models
-    save_hlls(f, olf->hll, num_clusters);
+    save_hlls_binary(f, olf->hll, num_clusters, 0);
   }
 
   //dbug
@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "bingham/hypersphere.h"
 #include "bingham/util.h"
 
@@ -7,9 +9,27 @@ int main(int argc, char *argv[])
 {
   if (argc < 2) {
     printf("usage: %s <num points>\n", argv[0]);
+    printf("       %s -cache <cache_file> <num_levels>\n", argv[0]);
     return 1;
   }
 
+  // write a tessellation cache file (see hypersphere_load_cache())
+  if (!strcmp(argv[1], "-cache")) {
+    if (argc < 4) {
+      printf("usage: %s -cache <cache_file> <num_levels>\n", argv[0]);
+      return 1;
+    }
+    double t0 = get_time_ms();
+    if (hypersphere_save_cache(argv[2], atoi(argv[3])) < 0)
+      return 1;
+    fprintf(stderr, "Wrote %d hypersphere tessellations to %s in %.0f ms\n", atoi(argv[3]), argv[2], get_time_ms() - t0);
+    return 0;
+  }
+
+  // map cached tessellations (if BINGHAM_TESSELLATION_CACHE is set) -- not in -cache mode
+  // above, which builds every level from scratch and may be overwriting that very file
+  hypersphere_init();
+
   hypersphere_tessellation_t *T = tessellate_S3(atoi(argv[1]));
 
   int i,j;
@@ -413,17 +413,41 @@ void test_bingham_discretize(int argc, char *argv[])
 }
 
 /*
+ * Frobenius norm of the difference between the scatter matrix of a pmf and the scatter matrix of B.
+ */
+static double bingham_pmf_scatter_error(bingham_pmf_t *pmf, bingham_t *B)
+{
+  int i, j, k, d = B->d;
+  double S[d][d];
+  memset(S, 0, d*d*sizeof(double));
+  for (i = 0; i < pmf->n; i++) {
+    double *x = pmf->tessellation->centroids[i];
+    for (j = 0; j < d; j++)
+      for (k = 0; k < d; k++)
+	S[j][k] += pmf->mass[i]*x[j]*x[k];
+  }
+
+  double err = 0;
+  for (j = 0; j < d; j++)
+    for (k = 0; k < d; k++)
+      err += (S[j][k] - B->stats->scatter[j][k]) * (S[j][k] - B->stats->scatter[j][k]);
+
+  return sqrt(err);
+}
+
+
 void test_bingham_mres(int argc, char *argv[])
 {
-  if (argc < 5) {
-    printf("usage: %s <z1> <z2> <z3> <resolution>\n", argv[0]);
+  if (argc < 6) {
+    printf("usage: %s <z1> <z2> <z3> <max_mass> <max_variation>\n", argv[0]);
     exit(1);
   }
 
   double z1 = atof(argv[1]);
   double z2 = atof(argv[2]);
   double z3 = atof(argv[3]);
-  double resolution = atof(argv[4]);
+  double max_mass = atof(argv[4]);
+  double max_variation = atof(argv[5]);
 
   double Z[3] = {z1, z2, z3};
   double V[3][4] = {{0,0,0,1}, {0,1,0,0}, {0,0,1,0}};
@@ -431,25 +455,35 @@ void test_bingham_mres(int argc, char *argv[])
 
   bingham_t B;
   bingham_new(&B, 4, Vp, Z);
+  bingham_stats(&B);
 
+  double t0 = get_time_ms();
   bingham_pmf_t pmf;
-  bingham_discretize_mres(&pmf, &B, resolution);
-
-  // check if pmf sums to 1
-  double tot_mass = sum(pmf.mass, pmf.n);
-  printf("tot_mass = %f\n", tot_mass);
-
-  int i;
-  int colors[pmf.n];
-  double max_mass = max(pmf.mass, pmf.n);
-  for (i = 0; i < pmf.n; i++)
-    colors[i] = (int)(255*(pmf.mass[i] / max_mass));
+  bingham_discretize_mres(&pmf, &B, max_mass, max_variation);
+  double t1 = get_time_ms();
 
-  meshgraph_t *graph = tetramesh_meshgraph(pmf.tessellation->tetramesh);
+  double mres_err = bingham_pmf_scatter_error(&pmf, &B);
+  printf("mres:  %d cells in %.0f ms, scatter error = %e\n", pmf.n, t1-t0, mres_err);
+
+  // uniform grids
+  int level;
+  for (level = 0; level < 7; level++) {
+    bingham_pmf_t pmf2;
+    t0 = get_time_ms();
+    bingham_discretize(&pmf2, &B, 16 << (3*level));
+    t1 = get_time_ms();
+    double err = bingham_pmf_scatter_error(&pmf2, &B);
+    printf("level %d:  %d cells in %.0f ms, scatter error = %e\n", level, pmf2.n, t1-t0, err);
+    bingham_pmf_free(&pmf2);
+    if (err <= mres_err) {
+      printf("--> matched accuracy with %.1fx fewer cells\n", pmf2.n / (double)pmf.n);
+      break;
+    }
+  }
 
-  tetramesh_save_PLY_colors(pmf.tessellation->tetramesh, graph, "mres.ply", colors);
+  bingham_pmf_free(&pmf);
+  bingham_free(&B);
 }
-*/
 
 
 void test_bingham_pdf(int argc, char *argv[])
@@ -670,6 +704,21 @@ void test_bingham_compose(int argc, char *argv[])
     bingham_compose(&B_mom, &B1, &B2);
   printf("Composed %d Bingham pairs with Method-of-Moments in %.0f ms\n", nsamples, get_time_ms() - t0);
 
+  // compose with batched method of moments
+  bingham_t B1_array[nsamples], B2_array[nsamples], B_array[nsamples];
+  for (i = 0; i < nsamples; i++) {
+    B1_array[i] = B1;
+    B2_array[i] = B2;
+    bingham_alloc(&B_array[i], 4);
+  }
+  t0 = get_time_ms();
+  bingham_compose_array(B_array, B1_array, B2_array, nsamples);
+  printf("Composed %d Bingham pairs with batched Method-of-Moments in %.0f ms\n", nsamples, get_time_ms() - t0);
+  printf("B_mom.Z = [%f %f %f], B_array[0].Z = [%f %f %f]\n", B_mom.Z[0], B_mom.Z[1], B_mom.Z[2],
+	 B_array[0].Z[0], B_array[0].Z[1], B_array[0].Z[2]);
+  for (i = 0; i < nsamples; i++)
+    bingham_free(&B_array[i]);
+
   // compose with sampling
   t0 = get_time_ms();
   double **X1 = new_matrix2(nsamples, 4);
@@ -725,7 +774,12 @@ void test_bingham_compose(int argc, char *argv[])
   printf("mean sample err = %.2f%%\n", 100*tot_err/nsamples);
 
   // compute KL divergence
-  printf("KL divergence = %f\n", bingham_compose_error(&B1, &B2));
+  t0 = get_time_ms();
+  printf("KL divergence = %f", bingham_compose_error(&B1, &B2));
+  printf(" (in %.0f ms)\n", get_time_ms() - t0);
+  t0 = get_time_ms();
+  printf("KL divergence (sampled) = %f", bingham_compose_error_sampled(&B1, &B2, nsamples));
+  printf(" (in %.0f ms)\n", get_time_ms() - t0);
 }
 
 
@@ -834,6 +888,73 @@ void test_bingham_mult(int argc, char *argv[])
 }
 
 
+void test_bingham_mult_array(int argc, char *argv[])
+{
+  if (argc < 3) {
+    printf("usage: %s <n> <num_trials>\n", argv[0]);
+    exit(1);
+  }
+
+  int n = atoi(argv[1]);
+  int num_trials = atoi(argv[2]);
+
+  // fit n random binghams
+  int i, j, k, num_samples = 20;
+  bingham_t B_array[n];
+  double **X = new_matrix2(num_samples, 4);
+  for (i = 0; i < n; i++) {
+    bingham_sample_uniform(X, 4, num_samples);
+    for (j = 0; j < num_samples; j++) {
+      X[j][0] += 2;
+      normalize(X[j], X[j], 4);
+    }
+    bingham_fit(&B_array[i], X, num_samples, 4);
+  }
+  free_matrix2(X);
+
+  bingham_t B;
+  bingham_alloc(&B, 4);
+  double scratch[bingham_mult_array_scratch_size(4)];
+
+  double t0 = get_time_ms();
+  for (i = 0; i < num_trials; i++)
+    bingham_mult_array_scratch(&B, B_array, n, 1, scratch);
+  double t1 = get_time_ms();
+  printf("Performed %d multiplications of %d binghams in %.0f ms\n", num_trials, n, t1-t0);
+
+  // compare with sequential pairwise multiplication
+  bingham_t B2;
+  bingham_alloc(&B2, 4);
+  bingham_copy(&B2, &B_array[0]);
+  for (i = 1; i < n; i++)
+    bingham_mult(&B2, &B2, &B_array[i]);
+
+  double dz = 0, dv = 0;
+  for (i = 0; i < 3; i++) {
+    dz = MAX(dz, fabs(B.Z[i] - B2.Z[i]));
+    dv = MAX(dv, 1 - fabs(dot(B.V[i], B2.V[i], 4)));
+  }
+  printf("max |Z - Z2| = %e, max (1 - |V[i]'*V2[i]|) = %e, F = %f, F2 = %f\n", dz, dv, B.F, B2.F);
+
+  // in-place multiplication (into the first element of the array)
+  bingham_t B0;
+  bingham_alloc(&B0, 4);
+  bingham_copy(&B0, &B_array[0]);
+  bingham_mult_array(&B_array[0], B_array, n, 1);
+  double dz2 = 0;
+  for (k = 0; k < 3; k++)
+    dz2 = MAX(dz2, fabs(B.Z[k] - B_array[0].Z[k]));
+  printf("in-place max |Z - Z2| = %e\n", dz2);
+
+  bingham_copy(&B_array[0], &B0);
+  for (i = 0; i < n; i++)
+    bingham_free(&B_array[i]);
+  bingham_free(&B);
+  bingham_free(&B2);
+  bingham_free(&B0);
+}
+
+
 void test_bingham_mixture_mult(int argc, char *argv[])
 {
   bingham_t B0[2];
@@ -1204,6 +1325,146 @@ void test_bingham_KL_divergence(int argc, char *argv[])
 }
 
 
+static double bingham_max_diff(bingham_t *B1, bingham_t *B2)
+{
+  int i, j;
+  double dmax = fabs(B1->F - B2->F);
+  for (i = 0; i < B1->d - 1; i++) {
+    dmax = MAX(dmax, fabs(B1->Z[i] - B2->Z[i]));
+    for (j = 0; j < B1->d; j++)
+      dmax = MAX(dmax, fabs(B1->V[i][j] - B2->V[i][j]));
+  }
+
+  return dmax;
+}
+
+
+static double bingham_mixture_max_diff(bingham_mix_t *BM1, bingham_mix_t *BM2)
+{
+  if (BM1->n != BM2->n)
+    return INFINITY;
+
+  int i;
+  double dmax = 0;
+  for (i = 0; i < BM1->n; i++) {
+    dmax = MAX(dmax, fabs(BM1->w[i] - BM2->w[i]));
+    dmax = MAX(dmax, bingham_max_diff(&BM1->B[i], &BM2->B[i]));
+  }
+
+  return dmax;
+}
+
+
+void test_bingham_arena(int argc, char *argv[])
+{
+  int i, j, n = 5, num_samples = 20;
+  int errors = 0;
+
+  // fit n random binghams (on the heap)
+  bingham_t B_in[n];
+  double **X = new_matrix2(num_samples, 4);
+  for (i = 0; i < n; i++) {
+    bingham_sample_uniform(X, 4, num_samples);
+    for (j = 0; j < num_samples; j++) {
+      X[j][0] += 2;
+      normalize(X[j], X[j], 4);
+    }
+    bingham_fit(&B_in[i], X, num_samples, 4);
+  }
+  double **S = new_matrix2(4, 4);
+  matrix_scatter(S, X, NULL, num_samples, 4);
+  free_matrix2(X);
+
+  double w1[3] = {.5, .3, .2};
+  double w2[2] = {.6, .4};
+  bingham_mix_t BM1 = {B_in, w1, 3};
+  bingham_mix_t BM2 = {B_in + 3, w2, 2};
+
+  // heap results
+  bingham_t B_mult, B_fit;
+  bingham_alloc(&B_mult, 4);
+  bingham_mult(&B_mult, &B_in[0], &B_in[1]);
+  bingham_fit_scatter(&B_fit, S, 4);
+  bingham_mix_t BM;
+  bingham_mixture_mult(&BM, &BM1, &BM2);
+  bingham_mixture_reduce(&BM, 3);
+
+  bingham_arena_t A;
+  bingham_arena_init(&A, 0);
+
+  // arena results (twice, with a reset in between)
+  int trial;
+  bingham_arena_block_t *block = NULL;
+  for (trial = 0; trial < 2; trial++) {
+    bingham_t B_mult_arena, B_fit_arena;
+    bingham_mult_arena(&B_mult_arena, &B_in[0], &B_in[1], &A);
+    bingham_fit_scatter_arena(&B_fit_arena, S, 4, &A);
+    bingham_mix_t BM_arena;
+    bingham_mixture_mult_arena(&BM_arena, &BM1, &BM2, &A);
+    bingham_mixture_reduce_arena(&BM_arena, 3, &A);
+
+    double dmult = bingham_max_diff(&B_mult, &B_mult_arena);
+    double dfit = bingham_max_diff(&B_fit, &B_fit_arena);
+    double dmix = bingham_mixture_max_diff(&BM, &BM_arena);
+    printf("trial %d: arena vs. heap max diff: mult %e, fit %e, mixture %e\n", trial, dmult, dfit, dmix);
+    if (dmult != 0 || dfit != 0 || dmix != 0)
+      errors++;
+
+    // after the first reset, the same work should fit in the (coalesced) first block
+    if (trial == 1 && (A.blocks != block || block->next != NULL)) {
+      printf("arena grew after reset\n");
+      errors++;
+    }
+
+    bingham_arena_reset(&A);
+    block = A.blocks;
+    if (block->next != NULL || block->used != 0) {
+      printf("arena reset didn't coalesce into one empty block\n");
+      errors++;
+    }
+  }
+
+  // reset reuses memory from the start of the block
+  char *p = (char *)bingham_arena_alloc(&A, 100);
+  if (p != block->data) {
+    printf("arena didn't reuse its memory after reset\n");
+    errors++;
+  }
+
+  // large allocation after a reset
+  bingham_arena_reset(&A);
+  size_t big = 4*A.block_size + 1;
+  char *p_big = (char *)bingham_arena_alloc(&A, big);
+  memset(p_big, 0xab, big);
+  size_t big_block_size = A.blocks->size;
+  char *p_small = (char *)bingham_arena_alloc(&A, 100);
+  memset(p_small, 0, 100);
+  size_t k;
+  for (k = 0; k < big; k++)
+    if ((unsigned char)p_big[k] != 0xab)
+      break;
+  if (k < big || big_block_size < big) {
+    printf("large arena allocation after reset was clobbered\n");
+    errors++;
+  }
+  bingham_arena_reset(&A);
+  if (A.blocks->next != NULL || A.block_size < big) {
+    printf("arena reset didn't coalesce the large allocation\n");
+    errors++;
+  }
+
+  printf("%d errors\n", errors);
+
+  bingham_arena_free(&A);
+  bingham_mixture_free(&BM);
+  bingham_free(&B_mult);
+  bingham_free(&B_fit);
+  for (i = 0; i < n; i++)
+    bingham_free(&B_in[i]);
+  free_matrix2(S);
+}
+
+
 void test_bingham_init()
 {
   double t0 = get_time_ms();
@@ -1228,6 +1489,8 @@ int main(int argc, char *argv[])
   //test_bingham_mixture_mult(argc, argv);
   //test_bingham_mixture_thresh_peaks(argc, argv);
   //test_bingham_mult(argc, argv);
+  //test_bingham_mult_array(argc, argv);
+  //test_bingham_arena(argc, argv);
   //test_bingham_F_lookup_3d(argc, argv);
 
   //test_bingham_mixture_sample(argc, argv);
@@ -1237,6 +1500,7 @@ int main(int argc, char *argv[])
 
   //test_fit_quaternions(argc, argv);
   //test_bingham_discretize(argc, argv);
+  //test_bingham_mres(argc, argv);
   //test_bingham(argc, argv);
   //compute_bingham_constants(argc, argv);
   //test_bingham_pdf(argc, argv);
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "bingham.h"
+#include "bingham/util.h"
+#include "bingham/bingham_filter.h"
+
+
+
+/*
+ * Make a bingham with mode q and concentrations (z,z,z).
+ */
+static void new_bingham_at(bingham_t *B, double *q, double z)
+{
+  double Z[3] = {z, z, z};
+  double V[3][4] = {{0,1,0,0}, {0,0,1,0}, {0,0,0,1}};
+  double *Vp[3] = {V[0], V[1], V[2]};
+  bingham_new(B, 4, Vp, Z);
+  bingham_post_rotate_3d(B, B, q);
+}
+
+
+/*
+ * Angle (in radians) between two orientations.
+ */
+static double quaternion_angle(double *q1, double *q2)
+{
+  double c = fabs(dot(q1, q2, 4));
+  return 2*acos(MIN(c, 1.0));
+}
+
+
+void test_bingham_filter_benchmark(int argc, char *argv[])
+{
+  if (argc < 5) {
+    printf("usage: %s <num_steps> <max_components> <p_outlier> <fallback_ncells>\n", argv[0]);
+    exit(1);
+  }
+
+  int num_steps = atoi(argv[1]);
+  int max_components = atoi(argv[2]);
+  double p_outlier = atof(argv[3]);
+  int fallback_ncells = atoi(argv[4]);
+
+  double z_noise = -400;      // process noise concentration
+  double z_meas = -100;       // measurement noise concentration
+  double dtheta = .01;        // true rotation per step (radians)
+
+  // prior: uniform
+  double q_id[4] = {1,0,0,0};
+  bingham_t B0;
+  new_bingham_at(&B0, q_id, 0);
+  bingham_set_uniform(&B0);
+  double w0 = 1.0;
+  bingham_mix_t prior;
+  prior.n = 1;
+  prior.w = &w0;
+  prior.B = &B0;
+
+  bingham_filter_t F;
+  bingham_filter_init(&F, &prior, max_components, 2);
+  if (fallback_ncells > 0)
+    bingham_filter_set_fallback(&F, fallback_ncells, -20);
+
+  // process noise
+  bingham_t noise;
+  new_bingham_at(&noise, q_id, z_noise);
+
+  // measurement likelihood:  (1-p_outlier)*Bingham(q_meas) + p_outlier*Uniform
+  bingham_t L0, L_B[2];
+  new_bingham_at(&L0, q_id, z_meas);
+  new_bingham_at(&L_B[0], q_id, z_meas);
+  new_bingham_at(&L_B[1], q_id, 0);
+  bingham_set_uniform(&L_B[1]);
+  double L_w[2] = {1 - p_outlier, p_outlier};
+  bingham_mix_t L;
+  L.n = (p_outlier > 0 ? 2 : 1);
+  L.w = L_w;
+  L.B = L_B;
+
+  // true orientation rotates about a fixed axis
+  double axis[3] = {1/sqrt(3), 1/sqrt(3), 1/sqrt(3)};
+  double dq[4] = {cos(dtheta/2), sin(dtheta/2)*axis[0], sin(dtheta/2)*axis[1], sin(dtheta/2)*axis[2]};
+  double q_true[4] = {1,0,0,0};
+
+  // pre-generate noisy measurements, so that only the filter is timed
+  double **Q_meas = new_matrix2(num_steps, 4);
+  double q[4], eps[4];
+  int i;
+  for (i = 0; i < num_steps; i++) {
+    quaternion_mult(q, q_true, dq);
+    memcpy(q_true, q, 4*sizeof(double));
+    if (frand() < p_outlier) {
+      bingham_sample_uniform(&Q_meas[i], 4, 1);
+    }
+    else {
+      eps[0] = 1;
+      eps[1] = normrand(0, .05);
+      eps[2] = normrand(0, .05);
+      eps[3] = normrand(0, .05);
+      normalize(eps, eps, 4);
+      quaternion_mult(Q_meas[i], q_true, eps);
+    }
+  }
+
+  double t0 = get_time_ms();
+  for (i = 0; i < num_steps; i++) {
+    bingham_filter_predict(&F, &noise);
+    bingham_post_rotate_3d(&L_B[0], &L0, Q_meas[i]);
+    bingham_filter_update(&F, &L);
+  }
+  double t1 = get_time_ms();
+
+  bingham_filter_mode(q, &F);
+
+  printf("Performed %d filter steps (predict + update) in %.0f ms (%.0f updates/sec)\n",
+	 num_steps, t1-t0, 1000*num_steps/(t1-t0));
+  printf("final error = %.2f degrees, num components = %d, num fallbacks = %d\n",
+	 quaternion_angle(q, q_true)*180/M_PI, F.belief.n, F.num_fallbacks);
+
+  bingham_filter_free(&F);
+  free_matrix2(Q_meas);
+  bingham_free(&B0);
+  bingham_free(&noise);
+  bingham_free(&L0);
+  bingham_free(&L_B[0]);
+  bingham_free(&L_B[1]);
+}
+
+
+/*
+ * Fraction of the rows of Q within max_angle (radians) of q.
+ */
+static double fraction_near(double **Q, int n, double *q, double max_angle)
+{
+  int i, cnt = 0;
+  for (i = 0; i < n; i++)
+    if (quaternion_angle(Q[i], q) < max_angle)
+      cnt++;
+
+  return cnt / (double)n;
+}
+
+
+void test_bingham_filter_checks()
+{
+  int num_errors = 0;
+  double q_id[4] = {1,0,0,0};
+  double q_meas[4] = {0,1,0,0};
+  double q[4];
+  int num_samples = 1000;
+  double **Q = new_matrix2(num_samples, 4);
+
+  // sampling the belief (which computes its stats) must not leave stale stats behind after an update
+  bingham_t B0, L, noise;
+  new_bingham_at(&B0, q_id, -10);
+  double w0 = 1.0;
+  bingham_mix_t prior;
+  prior.n = 1;
+  prior.w = &w0;
+  prior.B = &B0;
+  bingham_filter_t F;
+  bingham_filter_init(&F, &prior, 4, 2);
+  bingham_filter_sample(Q, &F, num_samples);
+  new_bingham_at(&L, q_meas, -100);
+  bingham_filter_update_bingham(&F, &L);
+  bingham_filter_update_bingham(&F, &L);
+  bingham_filter_sample(Q, &F, num_samples);
+  double f = fraction_near(Q, num_samples, q_meas, M_PI/4);
+  printf("samples after update: %.0f%% near the measurement (%s)\n", 100*f, (f > .9 ? "OK" : "FAILED"));
+  num_errors += (f <= .9);
+
+  // ...nor after a predict
+  new_bingham_at(&noise, q_id, -400);
+  bingham_filter_predict(&F, &noise);
+  bingham_filter_sample(Q, &F, num_samples);
+  f = fraction_near(Q, num_samples, q_meas, M_PI/4);
+  printf("samples after predict: %.0f%% near the measurement (%s)\n", 100*f, (f > .9 ? "OK" : "FAILED"));
+  num_errors += (f <= .9);
+  bingham_filter_free(&F);
+
+  // starting from a uniform prior, the mode converges to the measured orientation
+  bingham_set_uniform(&B0);
+  bingham_filter_init(&F, &prior, 4, 2);
+  double axis[3] = {1/sqrt(3), 1/sqrt(3), 1/sqrt(3)};
+  double q_true[4] = {cos(1.0), sin(1.0)*axis[0], sin(1.0)*axis[1], sin(1.0)*axis[2]};
+  int i;
+  bingham_free(&L);
+  new_bingham_at(&L, q_true, -100);
+  for (i = 0; i < 10; i++) {
+    bingham_filter_predict(&F, &noise);
+    bingham_filter_update_bingham(&F, &L);
+  }
+  bingham_filter_mode(q, &F);
+  double err = quaternion_angle(q, q_true)*180/M_PI;
+  printf("mode error = %.2f degrees (%s)\n", err, (err < 1 ? "OK" : "FAILED"));
+  num_errors += (err >= 1);
+
+  // the log evidence is much lower for an outlier measurement than for an inlier
+  bingham_filter_update_bingham(&F, &L);
+  double log_evidence_inlier = F.log_evidence;
+  bingham_free(&L);
+  new_bingham_at(&L, q_meas, -100);
+  bingham_filter_update_bingham(&F, &L);
+  double log_evidence_outlier = F.log_evidence;
+  printf("log evidence: inlier = %.2f, outlier = %.2f (%s)\n", log_evidence_inlier, log_evidence_outlier,
+	 (log_evidence_outlier < log_evidence_inlier - 10 ? "OK" : "FAILED"));
+  num_errors += (log_evidence_outlier >= log_evidence_inlier - 10);
+  bingham_filter_free(&F);
+
+  printf("%d errors\n", num_errors);
+
+  bingham_free(&B0);
+  bingham_free(&L);
+  bingham_free(&noise);
+  free_matrix2(Q);
+}
+
+
+void test_bingham_init()
+{
+  double t0 = get_time_ms();
+
+  bingham_init();
+
+  double t1 = get_time_ms();
+
+  fprintf(stderr, "Initialized bingham library in %.0f ms\n", t1-t0);
+}
+
+
+int main(int argc, char *argv[])
+{
+  test_bingham_init();
+
+  if (argc < 2)
+    test_bingham_filter_checks();
+  else
+    test_bingham_filter_benchmark(argc, argv);
+
+  return 0;
+}
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 #include "bingham.h"
 #include "bingham/util.h"
 #include "bingham/hll.h"
@@ -69,9 +70,331 @@ void test_hll_sample(int argc, char *argv[])
 }
 
 
+void test_hll_sample_index(int argc, char *argv[])
+{
+  if (argc < 3) {
+    printf("usage: %s <n_train> <n_query>\n", argv[0]);
+    return;
+  }
+
+  int n = atoi(argv[1]);
+  int nq = atoi(argv[2]);
+
+  // random training samples, with outputs that vary smoothly with q
+  double **Q = new_matrix2(n,4);
+  double **X = new_matrix2(n,3);
+  int i;
+  for (i = 0; i < n; i++) {
+    bingham_sample_uniform(&Q[i], 4, 1);
+    double s = (Q[i][0] < 0 ? -1 : 1);
+    X[i][0] = 10*s*Q[i][1] + normrand(0,1);
+    X[i][1] = 10*s*Q[i][2] + normrand(0,1);
+    X[i][2] = 10*s*Q[i][3] + normrand(0,1);
+  }
+  hll_t hll;
+  hll_new(&hll, Q, X, n, 4, 3);
+
+  double **Q2 = new_matrix2(nq,4);
+  bingham_sample_uniform(Q2, 4, nq);
+
+  double **X1 = new_matrix2(nq,3), **X2 = new_matrix2(nq,3);
+  double ***S1, ***S2;
+  safe_calloc(S1, nq, double**);
+  safe_calloc(S2, nq, double**);
+  for (i = 0; i < nq; i++) {
+    S1[i] = new_matrix2(3,3);
+    S2[i] = new_matrix2(3,3);
+  }
+
+  double t = get_time_ms();
+  hll_sample_scan(X1, S1, Q2, &hll, nq);
+  printf("Got %d samples from p(x|q) with a full scan in %.2f ms\n", nq, get_time_ms() - t);
+
+  t = get_time_ms();
+  hll_sample(X2, S2, Q2, &hll, nq);
+  printf("Got %d samples from p(x|q) with the quaternion index in %.2f ms\n", nq, get_time_ms() - t);
+
+  double max_err = 0;
+  for (i = 0; i < nq; i++) {
+    max_err = MAX(max_err, dist(X1[i], X2[i], 3));
+    max_err = MAX(max_err, dist(S1[i][0], S2[i][0], 9));
+  }
+  printf("max error = %g\n", max_err);
+
+  hll_set_validation(1);
+  hll_sample(X2, S2, Q2, &hll, nq);  // prints mismatches (if any) to stderr
+  hll_set_validation(0);
+
+  for (i = 0; i < nq; i++) {
+    free_matrix2(S1[i]);
+    free_matrix2(S2[i]);
+  }
+  free(S1);
+  free(S2);
+  free_matrix2(X1);
+  free_matrix2(X2);
+  free_matrix2(Q2);
+  hll_free(&hll);
+}
+
+
+void test_hll_cache(int argc, char *argv[])
+{
+  if (argc < 4) {
+    printf("usage: %s <n_train> <n_cache> <cache_file>\n", argv[0]);
+    return;
+  }
+
+  int n = atoi(argv[1]);
+  int nc = atoi(argv[2]);
+  char *fname = argv[3];
+
+  // random training samples
+  double **Q = new_matrix2(n,4);
+  double **X = new_matrix2(n,3);
+  int i;
+  bingham_sample_uniform(Q, 4, n);
+  for (i = 0; i < n; i++) {
+    X[i][0] = 10*Q[i][1] + normrand(0,1);
+    X[i][1] = 10*Q[i][2] + normrand(0,1);
+    X[i][2] = 10*Q[i][3] + normrand(0,1);
+  }
+  hll_t hll;
+  hll_new(&hll, matrix_clone(Q,n,4), matrix_clone(X,n,3), n, 4, 3);
+
+  double **QC = new_matrix2(nc,4);
+  bingham_sample_uniform(QC, 4, nc);
+
+  double t = get_time_ms();
+  hll_cache(&hll, QC, nc);
+  printf("Built an hll cache with %d samples in %.2f ms\n", nc, get_time_ms() - t);
+
+  t = get_time_ms();
+  hll_save_cache(fname, &hll, 1);
+  printf("Saved hll cache in %.2f ms\n", get_time_ms() - t);
+
+  // load the cache into an identical hll
+  hll_t hll2;
+  hll_new(&hll2, matrix_clone(Q,n,4), matrix_clone(X,n,3), n, 4, 3);
+  t = get_time_ms();
+  int cnt = hll_load_cache(fname, &hll2, 1);
+  printf("Loaded %d hll cache(s) in %.2f ms\n", cnt, get_time_ms() - t);
+
+  double max_err = 0;
+  for (i = 0; i < hll2.cache.n; i++) {
+    max_err = MAX(max_err, dist(hll.cache.Q[i], hll2.cache.Q[i], 4));
+    max_err = MAX(max_err, dist(hll.cache.X[i], hll2.cache.X[i], 3));
+    max_err = MAX(max_err, dist(hll.cache.S[i][0], hll2.cache.S[i][0], 9));
+  }
+  printf("max error = %g\n", max_err);
+
+  // a cache for different training data should be rejected
+  hll_t hll3;
+  X[0][0] += 1;
+  hll_new(&hll3, matrix_clone(Q,n,4), matrix_clone(X,n,3), n, 4, 3);
+  cnt = hll_load_cache(fname, &hll3, 1);
+  printf("Loaded %d stale hll cache(s) (should be 0)\n", cnt);
+
+  hll_free(&hll);
+  hll_free(&hll2);
+  hll_free(&hll3);
+  free_matrix2(Q);
+  free_matrix2(X);
+  free_matrix2(QC);
+}
+
+
+/*
+ * Max abs difference between the training data, priors and caches of two hlls
+ * (or DBL_MAX if their dimensions don't match).
+ */
+static double hll_max_diff(hll_t *h1, hll_t *h2)
+{
+  if (h1->n != h2->n || h1->dq != h2->dq || h1->dx != h2->dx || h1->cache.n != h2->cache.n)
+    return DBL_MAX;
+
+  int i, j, dq = h1->dq, dx = h1->dx;
+  double d = MAX(fabs(h1->r - h2->r), fabs(h1->w0 - h2->w0));
+  for (j = 0; j < dx; j++)
+    d = MAX(d, fabs(h1->x0[j] - h2->x0[j]));
+  for (j = 0; j < dx*dx; j++)
+    d = MAX(d, fabs(h1->S0[j/dx][j%dx] - h2->S0[j/dx][j%dx]));
+  for (i = 0; i < h1->n; i++) {
+    for (j = 0; j < dq; j++)
+      d = MAX(d, fabs(h1->Q[i][j] - h2->Q[i][j]));
+    for (j = 0; j < dx; j++)
+      d = MAX(d, fabs(h1->X[i][j] - h2->X[i][j]));
+  }
+  for (i = 0; i < h1->cache.n; i++) {
+    for (j = 0; j < dq; j++)
+      d = MAX(d, fabs(h1->cache.Q[i][j] - h2->cache.Q[i][j]));
+    for (j = 0; j < dx; j++)
+      d = MAX(d, fabs(h1->cache.X[i][j] - h2->cache.X[i][j]));
+    for (j = 0; j < dx*dx; j++)
+      d = MAX(d, fabs(h1->cache.S[i][j/dx][j%dx] - h2->cache.S[i][j/dx][j%dx]));
+  }
+
+  return d;
+}
+
+
+void test_hll_io(int argc, char *argv[])
+{
+  if (argc < 4) {
+    printf("usage: %s <n_train> <n_cache> <file_prefix>\n", argv[0]);
+    return;
+  }
+
+  int n = atoi(argv[1]);
+  int nc = atoi(argv[2]);
+  char *prefix = argv[3];
+
+  // make two hlls (the second one with a cache)
+  hll_t hlls[2];
+  int i, k;
+  for (k = 0; k < 2; k++) {
+    double **Q = new_matrix2(n,4);
+    double **X = new_matrix2(n,3);
+    bingham_sample_uniform(Q, 4, n);
+    for (i = 0; i < n; i++) {
+      X[i][0] = 10*Q[i][1] + normrand(0,1);
+      X[i][1] = 10*Q[i][2] + normrand(0,1);
+      X[i][2] = 10*Q[i][3] + normrand(0,1);
+    }
+    hll_new(&hlls[k], Q, X, n, 4, 3);
+  }
+  double **QC = new_matrix2(nc,4);
+  bingham_sample_uniform(QC, 4, nc);
+  hll_cache(&hlls[1], QC, nc);
+
+  char fname[3][1024];
+  sprintf(fname[0], "%s.txt.hll", prefix);
+  sprintf(fname[1], "%s.bin.hll", prefix);
+  sprintf(fname[2], "%s.float.hll", prefix);
+  char *format[3] = {"text", "binary", "binary (float)"};
+  double tol[3] = {1e-6, 0, 1e-5};  // text is written with %f, floats have ~7 digits
+
+  for (k = 0; k < 3; k++) {
+    double t = get_time_ms();
+    if (k == 0)
+      save_hlls(fname[k], hlls, 2);
+    else
+      save_hlls_binary(fname[k], hlls, 2, k == 2);
+    double t_save = get_time_ms() - t;
+
+    t = get_time_ms();
+    int n2;
+    hll_t *hlls2 = load_hlls(fname[k], &n2);
+    double t_load = get_time_ms() - t;
+
+    if (hlls2 == NULL || n2 != 2) {
+      printf("Error: couldn't load %s hlls from %s\n", format[k], fname[k]);
+      continue;
+    }
+
+    double d = 0;
+    for (i = 0; i < 2; i++)
+      d = MAX(d, hll_max_diff(&hlls[i], &hlls2[i]));
+    printf("%s: saved in %.1f ms, loaded in %.1f ms, max error = %g (%s)\n",
+	   format[k], t_save, t_load, d, (d <= tol[k] ? "OK" : "FAILED"));
+
+    for (i = 0; i < n2; i++)
+      hll_free(&hlls2[i]);
+    free(hlls2);
+  }
+
+  for (k = 0; k < 2; k++)
+    hll_free(&hlls[k]);
+  free_matrix2(QC);
+}
+
+
+void test_hll_add_samples(int argc, char *argv[])
+{
+  if (argc < 5) {
+    printf("usage: %s <n_train> <n_cache> <n_add> <n_batches>\n", argv[0]);
+    return;
+  }
+
+  int n = atoi(argv[1]);
+  int nc = atoi(argv[2]);
+  int m = atoi(argv[3]);
+  int num_batches = atoi(argv[4]);
+
+  // random training samples
+  double **Q = new_matrix2(n,4);
+  double **X = new_matrix2(n,3);
+  int i, b;
+  bingham_sample_uniform(Q, 4, n);
+  for (i = 0; i < n; i++) {
+    X[i][0] = 10*Q[i][1] + normrand(0,1);
+    X[i][1] = 10*Q[i][2] + normrand(0,1);
+    X[i][2] = 10*Q[i][3] + normrand(0,1);
+  }
+  hll_t hll;
+  hll_new(&hll, Q, X, n, 4, 3);
+
+  double **QC = new_matrix2(nc,4);
+  bingham_sample_uniform(QC, 4, nc);
+  double t = get_time_ms();
+  hll_cache(&hll, QC, nc);
+  double t_cache = get_time_ms() - t;
+  printf("Built an hll cache with %d samples in %.2f ms\n", nc, t_cache);
+
+  // add batches of new samples (clustered around a random orientation)
+  double **Q2 = new_matrix2(m,4);
+  double **X2 = new_matrix2(m,3);
+  double q0[4];
+  for (b = 0; b < num_batches; b++) {
+    double *q0p = q0;
+    bingham_sample_uniform(&q0p, 4, 1);
+    for (i = 0; i < m; i++) {
+      double eps[4] = {1, normrand(0,.1), normrand(0,.1), normrand(0,.1)};
+      normalize(eps, eps, 4);
+      quaternion_mult(Q2[i], q0, eps);
+      X2[i][0] = 10*Q2[i][1] + normrand(0,1);
+      X2[i][1] = 10*Q2[i][2] + normrand(0,1);
+      X2[i][2] = 10*Q2[i][3] + normrand(0,1);
+    }
+    t = get_time_ms();
+    int num_updated = hll_add_samples(&hll, Q2, X2, m);
+    printf("Added %d samples in %.2f ms (%d of %d cache entries updated, %d unindexed samples)\n",
+	   m, get_time_ms() - t, num_updated, nc, hll.n - hll.Q_index_n);
+  }
+
+  // compare the cache to a full recomputation
+  double **X3 = new_matrix2(nc,3);
+  double ***S3;
+  safe_calloc(S3, nc, double**);
+  for (i = 0; i < nc; i++)
+    S3[i] = new_matrix2(3,3);
+  hll_sample_scan(X3, S3, hll.cache.Q, &hll, nc);
+
+  double max_err = 0;
+  for (i = 0; i < nc; i++) {
+    max_err = MAX(max_err, dist(X3[i], hll.cache.X[i], 3));
+    max_err = MAX(max_err, dist(S3[i][0], hll.cache.S[i][0], 9));
+  }
+  printf("max error = %g\n", max_err);
+
+  for (i = 0; i < nc; i++)
+    free_matrix2(S3[i]);
+  free(S3);
+  free_matrix2(X3);
+  free_matrix2(Q2);
+  free_matrix2(X2);
+  free_matrix2(QC);
+  hll_free(&hll);
+}
+
+
 int main(int argc, char *argv[])
 {
   test_hll_sample(argc, argv);
+  //test_hll_sample_index(argc, argv);
+  //test_hll_cache(argc, argv);
+  //test_hll_io(argc, argv);
+  //test_hll_add_samples(argc, argv);
 
   return 0;
 }
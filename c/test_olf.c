@@ -136,11 +136,53 @@ void test_range_image(int argc, char *argv[])
 }
 
 
+void test_scope_seed(int argc, char *argv[])
+{
+  if (argc < 5) {
+    printf("usage: %s <param_file> <model_file> <bg_pcd> <fpfh_pcd> [<shot_pcd>]\n", argv[0]);
+    return;
+  }
+
+  scope_params_t params;
+  memset(&params, 0, sizeof(scope_params_t));
+  load_scope_params(&params, argv[1]);
+  if (params.seed == 0)
+    params.seed = 1;
+
+  olf_model_t model;
+  load_olf_model(&model, argv[2], &params);
+  olf_obs_t obs;
+  memset(&obs, 0, sizeof(olf_obs_t));
+  obs.bg_pcd = load_pcd(argv[3]);
+  obs.fpfh_pcd = load_pcd(argv[4]);
+  if (argc > 5)
+    obs.shot_pcd = load_pcd(argv[5]);
+
+  scope_model_data_t model_data;
+  get_scope_model_data(&model_data, &model, &params);
+  scope_obs_data_t obs_data;
+  get_scope_obs_data(&obs_data, &obs, &params);
+
+  // two runs with the same seed must give the same samples, however the work is split between threads
+  set_num_threads(4);
+  scope_samples_t *S1 = scope(&model_data, &obs_data, &params, NULL, NULL, NULL, NULL, NULL);
+  scope_samples_t *S2 = scope(&model_data, &obs_data, &params, NULL, NULL, NULL, NULL, NULL);
+
+  int i, errors = (S1->num_samples != S2->num_samples);
+  for (i = 0; i < MIN(S1->num_samples, S2->num_samples); i++)
+    if (S1->W[i] != S2->W[i] || memcmp(S1->samples[i].x, S2->samples[i].x, 3*sizeof(double)) ||
+	memcmp(S1->samples[i].q, S2->samples[i].q, 4*sizeof(double)))
+      errors++;
+  printf("%d differences between two runs with seed %d (4 threads)\n", errors, params.seed);
+}
+
+
 int main(int argc, char *argv[])
 {
   //test_load_pcd(argc, argv);
   //test_olf_pose_sample(argc, argv);
-  test_range_image(argc, argv);
+  //test_range_image(argc, argv);
+  test_scope_seed(argc, argv);
 
   return 0;
 }
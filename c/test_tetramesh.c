@@ -2,6 +2,8 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
+#include <float.h>
 #include "bingham/tetramesh.h"
 #include "bingham/octetramesh.h"
 #include "bingham/hypersphere.h"
@@ -138,6 +140,252 @@ void test_hypersphere(int argc, char *argv[])
 }
 
 
+void test_hypersphere_pointset(int argc, char *argv[])
+{
+  if (argc < 5) {
+    printf("usage: %s <num_points> <num_queries> <k> <r>\n", argv[0]);
+    exit(1);
+  }
+
+  int n = atoi(argv[1]);
+  int nq = atoi(argv[2]);
+  int k = atoi(argv[3]);
+  double r = atof(argv[4]);
+
+  int i, j;
+  double **X = new_matrix2(n, 4);
+  double **Q = new_matrix2(nq, 4);
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < 4; j++)
+      X[i][j] = normrand(0,1);
+    normalize(X[i], X[i], 4);
+  }
+  for (i = 0; i < nq; i++) {
+    for (j = 0; j < 4; j++)
+      Q[i][j] = normrand(0,1);
+    normalize(Q[i], Q[i], 4);
+  }
+
+  double t0 = get_time_ms();
+  hypersphere_pointset_t *P = new_hypersphere_pointset(NULL, X, n);
+  double t1 = get_time_ms();
+  printf("Built a point set with %d points (%d cells) in %.0f ms\n", n, P->tessellation->n, t1-t0);
+
+  int **idx = new_matrix2i(nq, k);
+  double **dists = new_matrix2(nq, k);
+  int **ridx = new_matrix2i(nq, MAX(n,1));
+  int *counts;
+  safe_calloc(counts, nq, int);
+
+  t0 = get_time_ms();
+  hypersphere_pointset_knn_batch(idx, dists, P, Q, nq, k);
+  t1 = get_time_ms();
+  hypersphere_pointset_radius_batch(ridx, NULL, counts, P, Q, nq, r, n);
+  double t2 = get_time_ms();
+
+  // brute force (kNN queries only return min(k,n) results)
+  int num_knn = MIN(k, n);
+  double d[n];
+  int bf_idx[num_knn];
+  int num_knn_errors = 0, num_radius_errors = 0;
+  for (i = 0; i < nq; i++) {
+    int cnt = 0;
+    for (j = 0; j < n; j++) {
+      d[j] = acos(MIN(fabs(dot(Q[i], X[j], 4)), 1.0));
+      cnt += (d[j] <= r);
+    }
+    mink(d, bf_idx, n, num_knn);
+    for (j = 0; j < num_knn; j++)
+      if (fabs(d[bf_idx[j]] - dists[i][j]) > 1e-12 || fabs(d[idx[i][j]] - dists[i][j]) > 1e-12)
+	num_knn_errors++;
+    if (cnt != counts[i])
+      num_radius_errors++;
+    for (j = 0; j < counts[i]; j++)
+      if (d[ridx[i][j]] > r)
+	num_radius_errors++;
+
+    // capped radius query
+    int total, capped_idx[2];
+    if (hypersphere_pointset_radius(capped_idx, NULL, &total, P, Q[i], r, 2) != MIN(cnt, 2) || total != cnt)
+      num_radius_errors++;
+  }
+  double t3 = get_time_ms();
+
+  printf("%d %d-NN queries in %.0f ms, %d radius queries in %.0f ms, brute force in %.0f ms\n",
+	 nq, k, t1-t0, nq, t2-t1, t3-t2);
+  printf("%d kNN errors, %d radius errors\n", num_knn_errors, num_radius_errors);
+
+  hypersphere_pointset_free(P);
+  free_matrix2(X);
+  free_matrix2(Q);
+  free_matrix2i(idx);
+  free_matrix2(dists);
+  free_matrix2i(ridx);
+  free(counts);
+}
+
+
+/*
+ * Compute the barycentric coordinates of x in the cone of a tetrahedron, normalized to sum to 1.
+ */
+static void tetrahedron_cone_coords(double *lambda, double *x, tetramesh_t *T, int cell)
+{
+  int i, j;
+  double A_raw[16], *A[4] = {A_raw, A_raw+4, A_raw+8, A_raw+12};
+  for (i = 0; i < 4; i++)
+    for (j = 0; j < 4; j++)
+      A[i][j] = T->vertices[ T->tetrahedra[cell][j] ][i];
+  solve(lambda, A, x, 4);
+  mult(lambda, lambda, 1/sum(lambda, 4), 4);
+}
+
+
+void test_tetramesh_adjacency(int argc, char *argv[])
+{
+  if (argc < 3) {
+    printf("usage: %s <level> <num_smoothing_iterations>\n", argv[0]);
+    exit(1);
+  }
+
+  int level = atoi(argv[1]);
+  int iter = atoi(argv[2]);
+
+  int i, j, k;
+  tetramesh_t *T = tetramesh_clone(tessellate_S3_level(level)->tetramesh);
+
+  // shuffle the vertices, to simulate a mesh with poor locality
+  int *order;
+  safe_malloc(order, T->nv, int);
+  for (i = 0; i < T->nv; i++)
+    order[i] = i;
+  for (i = T->nv-1; i > 0; i--) {
+    j = irand(i+1);
+    int tmp = order[i];  order[i] = order[j];  order[j] = tmp;
+  }
+  tetramesh_reorder_vertices(T, order);
+
+  double t0 = get_time_ms();
+  graph_t *graph = tetramesh_graph(T);
+  double t1 = get_time_ms();
+  tetramesh_adjacency_t *adj = tetramesh_adjacency(T);
+  double t2 = get_time_ms();
+
+  printf("Built graph in %.0f ms, CSR adjacency in %.0f ms (nv = %d, ne = %d, nt = %d)\n", t1-t0, t2-t1, T->nv, adj->ne, T->nt);
+
+  // compare the two adjacencies
+  int errors = (graph->ne != adj->ne);
+  for (i = 0; i < T->nv; i++) {
+    int n = adj->neighbor_offsets[i+1] - adj->neighbor_offsets[i];
+    if (graph->vertices[i].neighbors == NULL ? n != 0 : graph->vertices[i].neighbors->len != n)
+      errors++;
+    for (k = adj->neighbor_offsets[i]; k < adj->neighbor_offsets[i+1]; k++)
+      if (!ilist_contains(graph->vertices[i].neighbors, adj->neighbors[k]))
+	errors++;
+  }
+  printf("%d errors\n", errors);
+  graph_free(graph);
+
+  // smoothing, before and after reordering the vertices
+  tetramesh_t *T2 = tetramesh_clone(T);
+  t0 = get_time_ms();
+  for (i = 0; i < iter; i++)
+    tetramesh_smooth_adjacency(T, T, adj, .5);
+  t1 = get_time_ms();
+  printf("Smoothed %d times in %.0f ms (shuffled vertices)\n", iter, t1-t0);
+
+  tetramesh_rcm_order(order, adj);
+  tetramesh_reorder_vertices(T2, order);
+  tetramesh_adjacency_free(adj);
+  adj = tetramesh_adjacency(T2);
+  t0 = get_time_ms();
+  for (i = 0; i < iter; i++)
+    tetramesh_smooth_adjacency(T2, T2, adj, .5);
+  t1 = get_time_ms();
+  printf("Smoothed %d times in %.0f ms (RCM vertex order)\n", iter, t1-t0);
+
+  // results should agree up to the vertex permutation
+  double dmax = 0;
+  for (i = 0; i < T->nv; i++)
+    dmax = MAX(dmax, dist(T->vertices[order[i]], T2->vertices[i], T->d));
+  printf("max vertex difference = %e\n", dmax);
+
+  check_regularity(T2);
+
+  tetramesh_adjacency_free(adj);
+  tetramesh_free(T);
+  free(T);
+  tetramesh_free(T2);
+  free(T2);
+  free(order);
+}
+
+
+void test_tessellation_locate(int argc, char *argv[])
+{
+  if (argc < 3) {
+    printf("usage: %s <num_points> <level>\n", argv[0]);
+    exit(1);
+  }
+
+  int n = atoi(argv[1]);
+  int level = atoi(argv[2]);
+
+  int i, j;
+  double **Q = new_matrix2(n, 4);
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < 4; j++)
+      Q[i][j] = normrand(0,1);
+    normalize(Q[i], Q[i], 4);
+  }
+
+  hypersphere_tessellation_t *T = tessellate_S3_level(level);
+
+  int cells[n];
+  double t0 = get_time_ms();
+  tessellation_locate(Q[0], n, level, cells);
+  double t1 = get_time_ms();
+
+  // brute force oracle:  check that the cell found contains each point, and find a cell that does
+  double lambda[4];
+  int num_errors = 0;
+  for (i = 0; i < n; i++) {
+    tetrahedron_cone_coords(lambda, Q[i], T->tetramesh, cells[i]);
+    if (arr_min(lambda, 4) >= -1e-9)
+      continue;
+    num_errors++;
+    for (j = 0; j < T->n; j++) {
+      tetrahedron_cone_coords(lambda, Q[i], T->tetramesh, j);
+      if (arr_min(lambda, 4) >= -1e-9)
+	break;
+    }
+    printf("Error: point %d located in cell %d, but it's in cell %d\n", i, cells[i], j);
+  }
+  double t2 = get_time_ms();
+
+  // compare with a brute-force nearest centroid search
+  int num_nn = 0;
+  for (i = 0; i < n; i++) {
+    double dmin = DBL_MAX;
+    int jmin = 0;
+    for (j = 0; j < T->n; j++) {
+      double d = dist2(Q[i], T->centroids[j], 4);
+      if (d < dmin) {
+	dmin = d;
+	jmin = j;
+      }
+    }
+    num_nn += (jmin == cells[i]);
+  }
+  double t3 = get_time_ms();
+
+  printf("Located %d points in %d cells in %.2f ms (%.0f ns/point); brute-force nearest centroid took %.0f ms\n",
+	 n, T->n, t1-t0, 1e6*(t1-t0)/n, t3-t2);
+  printf("%d errors, %.1f%% of cells are also the nearest centroid\n", num_errors, 100.0*num_nn/n);
+
+  free_matrix2(Q);
+}
+
+
 void test_solve()
 {
   double A[] = {0, 1, 1,
@@ -160,6 +408,9 @@ int main(int argc, char *argv[])
   //test_smooth();
   test_hypersphere(argc, argv);
   //test_solve();
+  //test_hypersphere_pointset(argc, argv);
+  //test_tessellation_locate(argc, argv);
+  //test_tetramesh_adjacency(argc, argv);
 
   return 0;
 }
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <math.h>
 #include <float.h>
+#include <unistd.h>
 #include "bingham/util.h"
 
 
@@ -100,6 +101,247 @@ void test_kdtree(int argc, char *argv[])
 }
 
 
+void test_kdtree_flat(int argc, char *argv[])
+{
+  if (argc < 5) {
+    printf("usage: %s <n> <d> <num_queries> <k>\n", argv[0]);
+    return;
+  }
+
+  int i, j, l, n = atoi(argv[1]), d = atoi(argv[2]), nq = atoi(argv[3]), k = atoi(argv[4]);
+  double r = 30;  // radius (for random points in [0,100]^d)
+  k = MIN(k, n);
+
+  double **X = new_matrix2(n, d);
+  float **Xf = new_matrix2f(n, d);
+  double **Q = new_matrix2(nq, d);
+  for (i = 0; i < n; i++)
+    for (j = 0; j < d; j++)
+      Xf[i][j] = X[i][j] = 100*frand();
+  for (i = 0; i < nq; i++)
+    for (j = 0; j < d; j++)
+      Q[i][j] = 100*frand();
+
+  double t = get_time_ms();
+  kdtree_flat_t *tree = kdtree_flat(X, n, d, 0);
+  double tree_time = get_time_ms() - t;
+  kdtree_flat_t *tree_f = kdtree_flat_float(Xf, n, d, 0);
+
+  // brute force kNN
+  int **nn_idx = new_matrix2i(nq, MAX(k,1));
+  double **nn_d2 = new_matrix2(nq, MAX(k,1));
+  double dx[MAX(n,1)];
+  int idx[MAX(n,1)];
+  t = get_time_ms();
+  for (i = 0; i < nq; i++) {
+    for (j = 0; j < n; j++)
+      dx[j] = dist2(Q[i], X[j], d);
+    sort_indices(dx, idx, n);
+    for (j = 0; j < k; j++) {
+      nn_idx[i][j] = idx[j];
+      nn_d2[i][j] = dx[idx[j]];
+    }
+  }
+  double brute_time = get_time_ms() - t;
+
+  int **kd_idx = new_matrix2i(nq, MAX(k,1));
+  double **kd_d2 = new_matrix2(nq, MAX(k,1));
+  t = get_time_ms();
+  for (i = 0; i < nq; i++)
+    kdtree_flat_knn(kd_idx[i], kd_d2[i], tree, Q[i], k);
+  double knn_time = get_time_ms() - t;
+
+  int knn_errors = 0;
+  for (i = 0; i < nq; i++)
+    for (j = 0; j < k; j++)
+      if (kd_d2[i][j] != nn_d2[i][j])
+	knn_errors++;
+
+  t = get_time_ms();
+  kdtree_flat_knn_batch(kd_idx, kd_d2, tree, Q, nq, k, 0);
+  double batch_time = get_time_ms() - t;
+  for (i = 0; i < nq; i++)
+    for (j = 0; j < k; j++)
+      if (kd_d2[i][j] != nn_d2[i][j])
+	knn_errors++;
+
+  // float tree, with double and float queries
+  int float_errors = 0;
+  float qf[d];
+  for (i = 0; i < nq; i++) {
+    kdtree_flat_knn(kd_idx[i], kd_d2[i], tree_f, Q[i], k);
+    for (j = 0; j < k; j++)
+      if (fabs(kd_d2[i][j] - nn_d2[i][j]) > 1e-3*(nn_d2[i][j] + 1))
+	float_errors++;
+    for (j = 0; j < d; j++)
+      qf[j] = Q[i][j];
+    if (kdtree_flat_knn_float(kd_idx[i], kd_d2[i], tree_f, qf, k) != k)
+      float_errors++;
+    for (j = 0; j < k; j++)
+      if (fabs(kd_d2[i][j] - nn_d2[i][j]) > 1e-3*(nn_d2[i][j] + 1))
+	float_errors++;
+  }
+
+  // approximate kNN (eps = 1)
+  double eps = 1;
+  int approx_errors = 0;
+  kdtree_flat_knn_batch(kd_idx, kd_d2, tree, Q, nq, k, eps);
+  for (i = 0; i < nq; i++)
+    for (j = 0; j < k; j++)
+      if (kd_d2[i][j] > (1+eps)*(1+eps)*nn_d2[i][j])
+	approx_errors++;
+
+  // radius search
+  int radius_errors = 0;
+  int *r_idx;
+  double *r_d2;
+  safe_malloc(r_idx, MAX(n,1), int);
+  safe_malloc(r_d2, MAX(n,1), double);
+  for (i = 0; i < nq; i++) {
+    int m = kdtree_flat_radius(r_idx, r_d2, tree, Q[i], r, n);
+    int m_true = 0;
+    for (j = 0; j < n; j++)
+      if (dist2(Q[i], X[j], d) <= r*r)
+	m_true++;
+    if (m != m_true)
+      radius_errors++;
+    for (l = 0; l < m; l++)
+      if (dist2(Q[i], X[r_idx[l]], d) != r_d2[l] || r_d2[l] > r*r)
+	radius_errors++;
+    if (kdtree_flat_radius(r_idx, r_d2, tree, Q[i], r, 2) != MIN(m_true, 2))  // capped
+      radius_errors++;
+  }
+
+  // empty trees find nothing
+  int empty_errors = 0, e_idx;
+  double e_d2, q0[d];
+  kdtree_flat_t *empty = kdtree_flat(X, 0, d, 0);
+  kdtree_flat_t *empty_f = kdtree_flat_float(Xf, 0, d, 0);
+  for (j = 0; j < d; j++)
+    q0[j] = qf[j] = 0;
+  empty_errors += (kdtree_flat_knn(&e_idx, &e_d2, empty, q0, 1) != 0);
+  empty_errors += (kdtree_flat_knn_float(&e_idx, &e_d2, empty_f, qf, 1) != 0);
+  empty_errors += (kdtree_flat_NN(empty, q0, NULL) != -1);
+  empty_errors += (kdtree_flat_radius(&e_idx, &e_d2, empty, q0, r, 1) != 0);
+  kdtree_flat_free(empty);
+  kdtree_flat_free(empty_f);
+
+  printf("Built flat kd-tree with %d points (%d nodes) in %.2f ms\n", n, tree->num_nodes, tree_time);
+  printf("kNN: brute force %.2f ms, kd-tree %.2f ms, batched %.2f ms\n", brute_time, knn_time, batch_time);
+  printf("errors: kNN %d, float kNN %d, approx kNN %d, radius %d, empty tree %d\n", knn_errors, float_errors, approx_errors,
+	 radius_errors, empty_errors);
+
+  kdtree_flat_free(tree);
+  kdtree_flat_free(tree_f);
+  free_matrix2(X);
+  free_matrix2f(Xf);
+  free_matrix2(Q);
+  free_matrix2i(nn_idx);
+  free_matrix2(nn_d2);
+  free_matrix2i(kd_idx);
+  free_matrix2(kd_d2);
+  free(r_idx);
+  free(r_d2);
+}
+
+
+void test_quaternion_index(int argc, char *argv[])
+{
+  if (argc < 4) {
+    printf("usage: %s <n> <num_queries> <k>\n", argv[0]);
+    return;
+  }
+
+  int i, j, l, n = atoi(argv[1]), nq = atoi(argv[2]), k = atoi(argv[3]);
+  double max_dq = .3;
+  k = MIN(k, n);
+
+  // random quaternions, with half of the queries near the q[0] = 0 boundary
+  double **Q = new_matrix2(n, 4);
+  double **Q2 = new_matrix2(nq, 4);
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < 4; j++)
+      Q[i][j] = normrand(0,1);
+    normalize(Q[i], Q[i], 4);
+  }
+  for (i = 0; i < nq; i++) {
+    for (j = 0; j < 4; j++)
+      Q2[i][j] = normrand(0,1);
+    if (i % 2)
+      Q2[i][0] = normrand(0, .01);
+    normalize(Q2[i], Q2[i], 4);
+  }
+
+  double t = get_time_ms();
+  quaternion_index_t *index = quaternion_index(Q, n, 4);
+  double index_time = get_time_ms() - t;
+
+  // brute force
+  int **nn_idx = new_matrix2i(nq, k);
+  double **nn_dq = new_matrix2(nq, k);
+  int *r_cnt;
+  safe_calloc(r_cnt, nq, int);
+  double dq[n];
+  int idx[n];
+  t = get_time_ms();
+  for (i = 0; i < nq; i++) {
+    for (j = 0; j < n; j++) {
+      dq[j] = acos(MIN(fabs(dot(Q2[i], Q[j], 4)), 1.0));
+      if (dq[j] <= max_dq)
+	r_cnt[i]++;
+    }
+    sort_indices(dq, idx, n);
+    for (j = 0; j < k; j++) {
+      nn_idx[i][j] = idx[j];
+      nn_dq[i][j] = dq[idx[j]];
+    }
+  }
+  double brute_time = get_time_ms() - t;
+
+  int **kq_idx = new_matrix2i(nq, k);
+  double **kq_dq = new_matrix2(nq, k);
+  t = get_time_ms();
+  quaternion_index_knn_batch(kq_idx, kq_dq, index, Q2, nq, k);
+  double knn_time = get_time_ms() - t;
+
+  int knn_errors = 0;
+  for (i = 0; i < nq; i++)
+    for (j = 0; j < k; j++)
+      if (fabs(kq_dq[i][j] - nn_dq[i][j]) > 1e-6)
+	knn_errors++;
+
+  int radius_errors = 0;
+  int **r_idx = new_matrix2i(nq, n);
+  double **r_dq = new_matrix2(nq, n);
+  int cnt[nq];
+  t = get_time_ms();
+  quaternion_index_radius_batch(cnt, r_idx, r_dq, index, Q2, nq, max_dq, n);
+  double radius_time = get_time_ms() - t;
+  for (i = 0; i < nq; i++) {
+    if (abs(cnt[i] - r_cnt[i]) > 0)
+      radius_errors++;
+    for (l = 0; l < cnt[i]; l++)
+      if (fabs(r_dq[i][l] - acos(MIN(fabs(dot(Q2[i], Q[r_idx[i][l]], 4)), 1.0))) > 1e-6 || r_dq[i][l] > max_dq + 1e-9)
+	radius_errors++;
+  }
+
+  printf("Built quaternion index with %d points in %.2f ms\n", n, index_time);
+  printf("brute force %.2f ms, kNN %.2f ms, radius %.2f ms\n", brute_time, knn_time, radius_time);
+  printf("errors: kNN %d, radius %d\n", knn_errors, radius_errors);
+
+  quaternion_index_free(index);
+  free_matrix2(Q);
+  free_matrix2(Q2);
+  free_matrix2i(nn_idx);
+  free_matrix2(nn_dq);
+  free_matrix2i(kq_idx);
+  free_matrix2(kq_dq);
+  free_matrix2i(r_idx);
+  free_matrix2(r_dq);
+  free(r_cnt);
+}
+
+
 void test_normrand(int argc, char *argv[])
 {
   if (argc < 4) {
@@ -131,6 +373,79 @@ void test_normrand(int argc, char *argv[])
 }
 
 
+void test_rng(int argc, char *argv[])
+{
+  if (argc < 3) {
+    printf("usage: %s <n> <seed>\n", argv[0]);
+    return;
+  }
+
+  int i, j, n = atoi(argv[1]);
+  uint64_t seed = atoll(argv[2]);
+  double *x, *y;
+  safe_malloc(x, n, double);
+  safe_malloc(y, n, double);
+
+  // reproducibility
+  rng_t rng, rng2;
+  rng_seed(&rng, seed);
+  rng_seed(&rng2, seed);
+  rng_uniform_batch(&rng, x, n);
+  for (i = 0; i < n; i++)
+    y[i] = rng_uniform(&rng2);
+  printf("batch == scalar uniforms: %s\n", memcmp(x, y, n*sizeof(double)) ? "no" : "yes");
+
+  rng_set_seed(seed);
+  double a = frand(), b = normrand(0,1);
+  rng_set_seed(seed);
+  printf("default stream is reproducible: %s\n", (a == frand() && b == normrand(0,1)) ? "yes" : "no");
+
+  // parallel streams shouldn't be correlated
+  rng_t streams[4];
+  rng_seed(&rng, seed);
+  rng_split(streams, &rng, 4);
+  double c = 0;
+  for (i = 0; i < n; i++) {
+    double u[4];
+    for (j = 0; j < 4; j++)
+      u[j] = rng_uniform(&streams[j]) - .5;
+    c += u[0]*u[1] + u[1]*u[2] + u[2]*u[3];
+  }
+  printf("stream correlation = %f (expected 0)\n", 12*c/(3*n));
+
+  // uniform moments
+  rng_uniform_batch(&rng, x, n);
+  double mu = sum(x,n)/n, var = 0;
+  for (i = 0; i < n; i++)
+    var += (x[i]-mu)*(x[i]-mu)/n;
+  printf("uniform: mean = %f (expected .5), var = %f (expected %f)\n", mu, var, 1/12.);
+
+  // normal moments
+  double t = get_time_ms();
+  rng_normal_batch(&rng, x, n);
+  double normal_time = get_time_ms() - t;
+  double m[5] = {0,0,0,0,0};
+  for (i = 0; i < n; i++)
+    for (j = 1; j < 5; j++)
+      m[j] += pow(x[i], j)/n;
+  int tail = 0;
+  for (i = 0; i < n; i++)
+    if (fabs(x[i]) > 3.442619855899)
+      tail++;
+  printf("normal: E[x] = %f, E[x^2] = %f, E[x^3] = %f, E[x^4] = %f (expected 0,1,0,3), P(|x| > r) = %f (expected %f)\n",
+	 m[1], m[2], m[3], m[4], tail/(double)n, erfc(3.442619855899/sqrt(2)));
+
+  t = get_time_ms();
+  for (i = 0; i < n; i++)
+    x[i] = sqrt(2.0)*erfinv(2*(rand()/(double)RAND_MAX)-1);
+  double old_time = get_time_ms() - t;
+  printf("%d normals in %.2f ms (rand() + erfinv: %.2f ms)\n", n, normal_time, old_time);
+
+  free(x);
+  free(y);
+}
+
+
 void test_safe_alloc()
 {
   int i;
@@ -189,6 +504,78 @@ void test_mink()
 }
 
 
+static int sortable_index_cmp(const void *x1, const void *x2)
+{
+  const sortable_t *s1 = (const sortable_t *)x1, *s2 = (const sortable_t *)x2;
+  if (s1->value != s2->value)
+    return (s1->value < s2->value ? -1 : 1);
+  int i1 = *(int *)s1->data, i2 = *(int *)s2->data;
+  return (i1 > i2) - (i1 < i2);
+}
+
+void test_sort_benchmark(int argc, char *argv[])
+{
+  if (argc < 3) {
+    printf("usage: %s <n> <k>\n", argv[0]);
+    return;
+  }
+
+  int n = atoi(argv[1]);
+  int k = atoi(argv[2]);
+  int i;
+
+  // random data, with some ties
+  double *x;
+  safe_malloc(x, n, double);
+  for (i = 0; i < n; i++)
+    x[i] = (i % 4 == 0 ? round(normrand(0,10)) : normrand(0,10));
+
+  // reference: a stable qsort on (value, index)
+  sortable_t *s;
+  int *xi, *idx_ref, *idx;
+  safe_malloc(s, n, sortable_t);
+  safe_malloc(xi, n, int);
+  safe_malloc(idx_ref, n, int);
+  safe_malloc(idx, n, int);
+  double t = get_time_ms();
+  for (i = 0; i < n; i++) {
+    xi[i] = i;
+    s[i].value = x[i];
+    s[i].data = (void *)&xi[i];
+  }
+  qsort(s, n, sizeof(sortable_t), sortable_index_cmp);
+  for (i = 0; i < n; i++)
+    idx_ref[i] = *(int *)s[i].data;
+  double t_qsort = get_time_ms() - t;
+
+  t = get_time_ms();
+  sort_indices(x, idx, n);
+  double t_sort = get_time_ms() - t;
+  int sort_errors = 0;
+  for (i = 0; i < n; i++)
+    sort_errors += (idx[i] != idx_ref[i]);
+  printf("sort_indices: sorted %d numbers in %.2f ms (qsort: %.2f ms), %d errors\n", n, t_sort, t_qsort, sort_errors);
+
+  t = get_time_ms();
+  mink(x, idx, n, k);
+  double t_mink = get_time_ms() - t;
+  int mink_errors = 0;
+  for (i = 0; i < MIN(k,n); i++)
+    mink_errors += (idx[i] != idx_ref[i]);
+  printf("mink: got the min %d numbers in %.2f ms, %d errors\n", k, t_mink, mink_errors);
+
+  t = get_time_ms();
+  int j = qselect(x, n, n/2);
+  printf("qselect: found the median in %.2f ms, %s\n", get_time_ms() - t, (x[j] == x[idx_ref[n/2]] ? "correct" : "WRONG"));
+
+  free(x);
+  free(s);
+  free(xi);
+  free(idx_ref);
+  free(idx);
+}
+
+
 void test_pmfrand(int argc, char *argv[])
 {
   if (argc < 3) {
@@ -310,6 +697,176 @@ void test_mvnpdf_pcs(int argc, char *argv[])
 }
 
 
+void test_mvnpdf_log_chol_batch(int argc, char *argv[])
+{
+  if (argc < 3) {
+    printf("usage: %s <n> <d>\n", argv[0]);
+    return;
+  }
+
+  int n = atoi(argv[1]);
+  int d = atoi(argv[2]);
+  int i, j;
+
+  // random covariance, S = A*A' + I
+  double **A = new_matrix2(d,d);
+  for (i = 0; i < d; i++)
+    for (j = 0; j < d; j++)
+      A[i][j] = normrand(0,1);
+  double **S = new_matrix2(d,d);
+  double **At = new_matrix2(d,d);
+  transpose(At, A, d, d);
+  matrix_mult(S, A, At, d, d, d);
+  for (i = 0; i < d; i++)
+    S[i][i] += 1;
+
+  double **L = new_matrix2(d,d);
+  if (cholesky(L, S, d) < 0) {
+    printf("Error: cholesky() failed\n");
+    return;
+  }
+  double **Lt = new_matrix2(d,d), **LLt = new_matrix2(d,d);
+  transpose(Lt, L, d, d);
+  matrix_mult(LLt, L, Lt, d, d, d);
+  double chol_err = 0;
+  for (i = 0; i < d; i++)
+    for (j = 0; j < d; j++)
+      chol_err = MAX(chol_err, fabs(LLt[i][j] - S[i][j]));
+  printf("cholesky: max |L*L' - S| = %g\n", chol_err);
+
+  double mu[d];
+  for (j = 0; j < d; j++)
+    mu[j] = normrand(0,1);
+  double **X = new_matrix2(n,d);
+  for (i = 0; i < n; i++)
+    for (j = 0; j < d; j++)
+      X[i][j] = mu[j] + normrand(0,2);
+
+  double *logp;
+  safe_malloc(logp, n, double);
+  double t = get_time_ms();
+  mvnpdf_log_chol_batch(logp, X, n, mu, L, d);
+  double t_batch = get_time_ms() - t;
+
+  double max_err = 0;
+  t = get_time_ms();
+  for (i = 0; i < n; i++) {
+    double p = mvnpdf(X[i], mu, S, d);
+    max_err = MAX(max_err, fabs(log(p) - logp[i]));
+  }
+  double t_mvnpdf = get_time_ms() - t;
+
+  printf("mvnpdf_log_chol_batch: %d pdfs in %.2f ms (mvnpdf: %.2f ms), max error = %g\n", n, t_batch, t_mvnpdf, max_err);
+
+  free(logp);
+  free_matrix2(X);
+  free_matrix2(A);
+  free_matrix2(At);
+  free_matrix2(S);
+  free_matrix2(L);
+  free_matrix2(Lt);
+  free_matrix2(LLt);
+}
+
+
+void test_mvn(int argc, char *argv[])
+{
+  if (argc < 3) {
+    printf("usage: %s <n> <d>\n", argv[0]);
+    return;
+  }
+
+  int n = atoi(argv[1]);
+  int d = atoi(argv[2]);
+  int i, j, k;
+
+  // random covariance, S = A*A' + I
+  double **A = new_matrix2(d,d);
+  for (i = 0; i < d; i++)
+    for (j = 0; j < d; j++)
+      A[i][j] = normrand(0,1);
+  double **S = new_matrix2(d,d);
+  double **At = new_matrix2(d,d);
+  transpose(At, A, d, d);
+  matrix_mult(S, A, At, d, d, d);
+  for (i = 0; i < d; i++)
+    S[i][i] += 1;
+  double mu[d];
+  for (j = 0; j < d; j++)
+    mu[j] = normrand(0,1);
+
+  mvn_t mvn;
+  if (mvn_new(&mvn, mu, S, d) < 0) {
+    printf("Error: mvn_new() failed\n");
+    return;
+  }
+
+  double **I = new_matrix2(d,d);
+  matrix_mult(I, mvn.S_inv, S, d, d, d);
+  double inv_err = 0;
+  for (i = 0; i < d; i++)
+    for (j = 0; j < d; j++)
+      inv_err = MAX(inv_err, fabs(I[i][j] - (i==j)));
+
+  // compare with the principal components form
+  double z[d], **V = new_matrix2(d,d), logdet = 0;
+  eigen_symm(z, V, S, d);
+  for (j = 0; j < d; j++) {
+    logdet += log(z[j]);
+    z[j] = sqrt(z[j]);
+  }
+  printf("mvn: max |S_inv*S - I| = %g, logdet = %f (sum(log(eigenvalues)) = %f)\n", inv_err, mvn.logdet, logdet);
+
+  double **X = new_matrix2(n,d);
+  double t = get_time_ms();
+  mvn_sample_batch(X, &mvn, n, NULL);
+  double t_sample = get_time_ms() - t;
+
+  double *logp;
+  safe_malloc(logp, n, double);
+  t = get_time_ms();
+  mvn_logpdf_batch(logp, &mvn, X, n);
+  double t_batch = get_time_ms() - t;
+
+  double max_err = 0;
+  t = get_time_ms();
+  for (i = 0; i < n; i++)
+    max_err = MAX(max_err, fabs(mvn_logpdf(&mvn, X[i]) - logp[i]));
+  double t_logpdf = get_time_ms() - t;
+
+  double max_err_pcs = 0;
+  t = get_time_ms();
+  for (i = 0; i < n; i++)
+    max_err_pcs = MAX(max_err_pcs, fabs(log(mvnpdf_pcs(X[i], mu, z, V, d)) - logp[i]));
+  double t_pcs = get_time_ms() - t;
+
+  printf("mvn_logpdf_batch: %d pdfs in %.2f ms (mvn_logpdf: %.2f ms, mvnpdf_pcs: %.2f ms)\n", n, t_batch, t_logpdf, t_pcs);
+  printf("max error = %g (mvn_logpdf), %g (mvnpdf_pcs)\n", max_err, max_err_pcs);
+
+  // sample covariance
+  double m[d], **C = new_matrix2(d,d);
+  mean(m, X, n, d);
+  cov(C, X, m, n, d);
+  double cov_err = 0, mean_err = 0;
+  for (j = 0; j < d; j++) {
+    mean_err = MAX(mean_err, fabs(m[j] - mu[j]));
+    for (k = 0; k < d; k++)
+      cov_err = MAX(cov_err, fabs(C[j][k] - S[j][k]));
+  }
+  printf("mvn_sample_batch: %d samples in %.2f ms, max mean error = %f, max cov error = %f\n", n, t_sample, mean_err, cov_err);
+
+  mvn_free(&mvn);
+  free(logp);
+  free_matrix2(X);
+  free_matrix2(A);
+  free_matrix2(At);
+  free_matrix2(S);
+  free_matrix2(I);
+  free_matrix2(V);
+  free_matrix2(C);
+}
+
+
 void test_regression(int argc, char *argv[])
 {
   if (argc < 2) {
@@ -352,18 +909,489 @@ void test_repmat() {
   print_matrix(B, 4, 9);
 }
 
+
+static double matrix_max_abs_diff(double **X, double **Y, int n, int m)
+{
+  int i, j;
+  double d = 0;
+  for (i = 0; i < n; i++)
+    for (j = 0; j < m; j++)
+      d = MAX(d, fabs(X[i][j] - Y[i][j]));
+  return d;
+}
+
+
+static void test_trace_block(int i0, int i1, void *data)
+{
+  double *x = (double *)data;
+  int i;
+  TRACE_BEGIN("test_trace_block");
+  for (i = i0; i < i1; i++)
+    x[i] = sqrt(i);
+  TRACE_COUNT("test_trace_block.items", i1 - i0);
+  TRACE_END();
+}
+
+void test_trace(int argc, char *argv[])
+{
+  if (argc < 3) {
+    printf("usage: %s <json_file> <chrome_trace_file>\n", argv[0]);
+    return;
+  }
+
+  int i, n = 100000;
+  double *x;
+  safe_malloc(x, n, double);
+
+  // overhead of the trace macros when tracing is off
+  trace_disable();
+  double t = get_time_ms();
+  for (i = 0; i < n; i++) {
+    TRACE_BEGIN("off");
+    TRACE_END();
+  }
+  double t_off = get_time_ms() - t;
+
+  trace_enable(1);
+  t = get_time_ms();
+  for (i = 0; i < n; i++) {
+    TRACE_BEGIN("on");
+    TRACE_END();
+  }
+  double t_on = get_time_ms() - t;
+  printf("%d trace scopes in %.2f ms (tracing off), %.2f ms (tracing on)\n", n, t_off, t_on);
+
+  TRACE_BEGIN("outer");
+  for (i = 0; i < 3; i++) {
+    TRACE_BEGIN("inner");
+    parallel_for(n, test_trace_block, x);
+    TRACE_END();
+  }
+  TRACE_END();
+
+  trace_save_json(argv[1]);
+  trace_save_chrome(argv[2]);
+  printf("saved traces to %s and %s\n", argv[1], argv[2]);
+
+  free(x);
+}
+
+
+static void test_parallel_count_block(int i0, int i1, void *data)
+{
+  int *cnt = (int *)data;
+  int i;
+  for (i = i0; i < i1; i++)
+    cnt[i]++;
+}
+
+static void test_parallel_nested_block(int i0, int i1, void *data)
+{
+  int **cnt = (int **)data;
+  int i;
+  for (i = i0; i < i1; i++)
+    parallel_for_grain(1000, 10, test_parallel_count_block, cnt[i]);
+}
+
+static void test_parallel_sum_block(int i0, int i1, void *partial, void *data)
+{
+  double *x = (double *)data, *s = (double *)partial;
+  int i;
+  for (i = i0; i < i1; i++)
+    *s += x[i];
+}
+
+static void test_parallel_sum_combine(void *result, const void *partial, void *data)
+{
+  *(double *)result += *(const double *)partial;
+}
+
+static void test_parallel_serial_executor(int num_tasks, void (*task)(int i, void *arg), void *arg, void *executor_data)
+{
+  int i;
+  for (i = num_tasks-1; i >= 0; i--)
+    task(i, arg);
+  *(int *)executor_data += num_tasks;
+}
+
+void test_parallel(int argc, char *argv[])
+{
+  if (argc < 3) {
+    printf("usage: %s <num_threads> <n>\n", argv[0]);
+    return;
+  }
+
+  int i, j, n = atoi(argv[2]), iter = 1000;
+  set_num_threads(atoi(argv[1]));
+  printf("num_threads = %d\n", get_num_threads());
+
+  // every index is visited exactly once
+  int *cnt;
+  safe_calloc(cnt, n, int);
+  parallel_for(n, test_parallel_count_block, cnt);
+  int bad = 0;
+  for (i = 0; i < n; i++)
+    bad += (cnt[i] != 1);
+  printf("parallel_for: %d bad counts\n", bad);
+
+  // nested parallel_for()
+  int **cnt2 = new_matrix2i(16, 1000);
+  parallel_for_grain(16, 1, test_parallel_nested_block, cnt2);
+  bad = 0;
+  for (i = 0; i < 16; i++)
+    for (j = 0; j < 1000; j++)
+      bad += (cnt2[i][j] != 1);
+  printf("nested parallel_for: %d bad counts\n", bad);
+  free_matrix2i(cnt2);
+
+  // parallel_reduce() is repeatable
+  double *x;
+  safe_malloc(x, n, double);
+  double s_serial = 0;
+  for (i = 0; i < n; i++) {
+    x[i] = frand();
+    s_serial += x[i];
+  }
+  double s1 = 0, s2 = 0;
+  parallel_reduce(n, test_parallel_sum_block, test_parallel_sum_combine, &s1, sizeof(double), x);
+  parallel_reduce(n, test_parallel_sum_block, test_parallel_sum_combine, &s2, sizeof(double), x);
+  printf("parallel_reduce: sum = %.15f (serial %.15f), repeatable = %d\n", s1, s_serial, s1 == s2);
+
+  // caller-provided executor
+  int num_tasks = 0;
+  double s3 = 0;
+  set_parallel_executor(test_parallel_serial_executor, &num_tasks);
+  memset(cnt, 0, n*sizeof(int));
+  parallel_for(n, test_parallel_count_block, cnt);
+  parallel_reduce(n, test_parallel_sum_block, test_parallel_sum_combine, &s3, sizeof(double), x);
+  set_parallel_executor(NULL, NULL);
+  bad = 0;
+  for (i = 0; i < n; i++)
+    bad += (cnt[i] != 1);
+  printf("executor: ran %d tasks, %d bad counts, same sum = %d\n", num_tasks, bad, s3 == s1);
+
+  // dispatch overhead
+  double t = get_time_ms();
+  for (i = 0; i < iter; i++)
+    parallel_for(n, test_parallel_count_block, cnt);
+  printf("%d calls to parallel_for(%d) in %.2f ms\n", iter, n, get_time_ms() - t);
+
+  free(cnt);
+  free(x);
+}
+
+
+void test_matrix_io(int argc, char *argv[])
+{
+  if (argc < 4) {
+    printf("usage: %s <n> <m> <file_prefix>\n", argv[0]);
+    return;
+  }
+
+  int i, j, n = atoi(argv[1]), m = atoi(argv[2]), n2, m2;
+  char ftext[1024], fbin[1024], ffloat[1024];
+  sprintf(ftext, "%s.txt", argv[3]);
+  sprintf(fbin, "%s.bmat", argv[3]);
+  sprintf(ffloat, "%s_float.bmat", argv[3]);
+
+  // empty matrices are saved, but rejected on load (with their dimensions reported)
+  if (n == 0 || m == 0) {
+    save_matrix(ftext, NULL, n, m);
+    save_matrix(fbin, NULL, n, m);
+    int num_rejected = 0;
+    char *files[2] = {ftext, fbin};
+    for (i = 0; i < 2; i++) {
+      n2 = m2 = -1;
+      double **Y = load_matrix(files[i], &n2, &m2);
+      num_rejected += (Y == NULL && n2 == n && m2 == m);
+      n2 = m2 = -1;
+      Y = load_matrix_mmap(files[i], &n2, &m2);
+      num_rejected += (Y == NULL && n2 == n && m2 == m);
+    }
+    printf("empty %d x %d matrix files: %d/4 loads rejected with dimensions %s\n", n, m, num_rejected,
+	   (num_rejected == 4 ? "(OK)" : "(FAILED)"));
+    remove(ftext);
+    remove(fbin);
+    return;
+  }
+
+  double **X = new_matrix2(n, m);
+  for (i = 0; i < n; i++)
+    for (j = 0; j < m; j++)
+      X[i][j] = normrand(0,1);
+
+  double t = get_time_ms();
+  save_matrix(ftext, X, n, m);
+  save_matrix(fbin, X, n, m);  // binary, from the extension
+  save_matrix_binary(ffloat, X, n, m, 1);
+  printf("saved matrices in %.2f ms\n", get_time_ms() - t);
+
+  t = get_time_ms();
+  double **Y = load_matrix(ftext, &n2, &m2);
+  double t_text = get_time_ms() - t;
+  printf("load_matrix (text):    %d x %d in %.2f ms, max error = %g\n", n2, m2, t_text, matrix_max_abs_diff(X, Y, n, m));
+  free_matrix2(Y);
+
+  t = get_time_ms();
+  Y = load_matrix(fbin, &n2, &m2);
+  double t_bin = get_time_ms() - t;
+  printf("load_matrix (binary):  %d x %d in %.2f ms, max error = %g\n", n2, m2, t_bin, matrix_max_abs_diff(X, Y, n, m));
+  free_matrix2(Y);
+
+  t = get_time_ms();
+  Y = load_matrix(ffloat, &n2, &m2);
+  double t_float = get_time_ms() - t;
+  printf("load_matrix (float):   %d x %d in %.2f ms, max error = %g\n", n2, m2, t_float, matrix_max_abs_diff(X, Y, n, m));
+  free_matrix2(Y);
+
+  t = get_time_ms();
+  Y = load_matrix_mmap(fbin, &n2, &m2);
+  double t_mmap = get_time_ms() - t;
+  printf("load_matrix_mmap:      %d x %d in %.2f ms, max error = %g\n", n2, m2, t_mmap, matrix_max_abs_diff(X, Y, n, m));
+  free_matrix_mmap(Y);
+
+  Y = load_matrix_mmap(ftext, &n2, &m2);
+  printf("load_matrix_mmap (text): %d x %d, max error = %g\n", n2, m2, matrix_max_abs_diff(X, Y, n, m));
+  free_matrix_mmap(Y);
+
+  // a truncated binary file should be rejected
+  FILE *f = fopen(fbin, "r+");
+  if (f && ftruncate(fileno(f), 32 + (long)n*m*sizeof(double)/2) == 0) {
+    fclose(f);
+    Y = load_matrix(fbin, &n2, &m2);
+    double **Z = load_matrix_mmap(fbin, &n2, &m2);
+    printf("truncated binary file %s\n", (Y == NULL && Z == NULL ? "rejected" : "NOT REJECTED"));
+  }
+
+  remove(ftext);
+  remove(fbin);
+  remove(ffloat);
+  free_matrix2(X);
+}
+
+
+void test_mat(int argc, char *argv[])
+{
+  if (argc < 4) {
+    printf("usage: %s <n> <p> <m>\n", argv[0]);
+    return;
+  }
+
+  int i, j, k, n = atoi(argv[1]), p = atoi(argv[2]), m = atoi(argv[3]);
+
+  double **A = new_matrix2(n, p), **At = new_matrix2(p, n);
+  double **B = new_matrix2(p, m), **Bt = new_matrix2(m, p);
+  for (i = 0; i < n; i++)
+    for (j = 0; j < p; j++)
+      At[j][i] = A[i][j] = normrand(0,1);
+  for (i = 0; i < p; i++)
+    for (j = 0; j < m; j++)
+      Bt[j][i] = B[i][j] = normrand(0,1);
+
+  // naive C = A*B
+  double **C0 = new_matrix2(n, m);
+  double t = get_time_ms();
+  for (i = 0; i < n; i++)
+    for (j = 0; j < m; j++)
+      for (k = 0; k < p; k++)
+	C0[i][j] += A[i][k]*B[k][j];
+  double naive_time = get_time_ms() - t;
+
+  double **C = new_matrix2(n, m);
+  mat_t Av, Atv, Bv, Btv, Cv;
+  mat_view(&Av, A, n, p);
+  mat_view(&Atv, At, p, n);
+  mat_view(&Bv, B, p, m);
+  mat_view(&Btv, Bt, m, p);
+  mat_view(&Cv, C, n, m);
+
+  t = get_time_ms();
+  mat_gemm(Cv, 1.0, Av, 0, Bv, 0, 0.0);
+  double gemm_time = get_time_ms() - t;
+  printf("gemm:  max error %.2e (naive %.2f ms, gemm %.2f ms)\n", matrix_max_abs_diff(C, C0, n, m), naive_time, gemm_time);
+
+  mat_gemm(Cv, 1.0, Atv, 1, Bv, 0, 0.0);
+  printf("gemm (A'):  max error %.2e\n", matrix_max_abs_diff(C, C0, n, m));
+  mat_gemm(Cv, 1.0, Av, 0, Btv, 1, 0.0);
+  printf("gemm (B'):  max error %.2e\n", matrix_max_abs_diff(C, C0, n, m));
+  mat_gemm(Cv, 2.0, Atv, 1, Btv, 1, 0.0);
+  mat_gemm(Cv, -1.0, Av, 0, Bv, 0, 1.0);
+  printf("gemm (A'B', alpha, beta):  max error %.2e\n", matrix_max_abs_diff(C, C0, n, m));
+
+  // gemm on a block
+  if (n > 2 && m > 2) {
+    mat_gemm(mat_block(Cv, 1, 1, n-2, m-2), 1.0, mat_block(Av, 1, 0, n-2, p), 0, mat_block(Bv, 0, 1, p, m-2), 0, 0.0);
+    double err = 0;
+    for (i = 1; i < n-1; i++)
+      for (j = 1; j < m-1; j++)
+	err = MAX(err, fabs(C[i][j] - C0[i][j]));
+    printf("gemm (block):  max error %.2e\n", err);
+  }
+
+  matrix_mult(C, A, B, n, p, m);
+  printf("matrix_mult:  max error %.2e\n", matrix_max_abs_diff(C, C0, n, m));
+
+  // weighted scatter matrix of the rows of A
+  double w[n];
+  for (i = 0; i < n; i++)
+    w[i] = frand();
+  double **S0 = new_matrix2(p, p), **S = new_matrix2(p, p);
+  t = get_time_ms();
+  for (i = 0; i < n; i++)
+    for (j = 0; j < p; j++)
+      for (k = 0; k < p; k++)
+	S0[j][k] += w[i]*A[i][j]*A[i][k];
+  naive_time = get_time_ms() - t;
+  t = get_time_ms();
+  matrix_scatter(S, A, w, n, p);
+  double syrk_time = get_time_ms() - t;
+  printf("syrk:  max error %.2e (naive %.2f ms, syrk %.2f ms)\n", matrix_max_abs_diff(S, S0, p, p), naive_time, syrk_time);
+
+  // gemv
+  double x[p], y[n], y0[n], z[p], z0[p];
+  for (j = 0; j < p; j++)
+    x[j] = normrand(0,1);
+  matrix_vec_mult(y0, A, x, n, p);
+  mat_gemv(y, 1.0, Av, 0, x, 0.0);
+  double err = 0;
+  for (i = 0; i < n; i++)
+    err = MAX(err, fabs(y[i] - y0[i]));
+  vec_matrix_mult(z0, y, A, n, p);
+  mat_gemv(z, 1.0, Av, 1, y, 0.0);
+  for (j = 0; j < p; j++)
+    err = MAX(err, fabs(z[j] - z0[j]));
+  printf("gemv:  max error %.2e\n", err);
+
+  free_matrix2(A);
+  free_matrix2(At);
+  free_matrix2(B);
+  free_matrix2(Bt);
+  free_matrix2(C);
+  free_matrix2(C0);
+  free_matrix2(S);
+  free_matrix2(S0);
+}
+
+void test_quaternion_batch(int argc, char *argv[])
+{
+  if (argc < 2) {
+    printf("usage: %s <n>\n", argv[0]);
+    return;
+  }
+
+  int i, j, n = atoi(argv[1]);
+
+  // random unit quaternions, stored both as n-by-4 (AoS) and 4-by-n (SoA)
+  double **X = new_matrix2(n, 4);
+  double **Y = new_matrix2(n, 4);
+  double **Z = new_matrix2(n, 4);
+  double **XT = new_matrix2(4, n);
+  double **YT = new_matrix2(4, n);
+  double **ZT = new_matrix2(4, n);
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < 4; j++) {
+      X[i][j] = normrand(0,1);
+      Y[i][j] = normrand(0,1);
+    }
+    normalize(X[i], X[i], 4);
+    normalize(Y[i], Y[i], 4);
+  }
+  transpose(XT, X, n, 4);
+  transpose(YT, Y, n, 4);
+
+  // quaternion_mult_batch (run everything once first, so that page faults aren't timed)
+  for (i = 0; i < n; i++)
+    quaternion_mult(Z[i], X[i], Y[i]);
+  quaternion_mult_batch(ZT, XT, YT, n);
+  double t0 = get_time_ms();
+  for (i = 0; i < n; i++)
+    quaternion_mult(Z[i], X[i], Y[i]);
+  double t1 = get_time_ms();
+  quaternion_mult_batch(ZT, XT, YT, n);
+  double t2 = get_time_ms();
+  double err = 0;
+  for (i = 0; i < n; i++)
+    for (j = 0; j < 4; j++)
+      err = MAX(err, fabs(Z[i][j] - ZT[j][i]));
+  printf("quaternion_mult: %.2f ms, quaternion_mult_batch: %.2f ms, max error = %e\n", t1-t0, t2-t1, err);
+
+  // quaternion_to_rotation_matrix_batch and rotation_matrix_to_quaternion_batch
+  double **RT = new_matrix2(9, n);
+  double **R = new_matrix2(3, 3);
+  quaternion_to_rotation_matrix_batch(RT, XT, n);
+  t0 = get_time_ms();
+  quaternion_to_rotation_matrix_batch(RT, XT, n);
+  t1 = get_time_ms();
+  err = 0;
+  for (i = 0; i < n; i++) {
+    quaternion_to_rotation_matrix(R, X[i]);
+    for (j = 0; j < 9; j++)
+      err = MAX(err, fabs(R[j/3][j%3] - RT[j][i]));
+  }
+  rotation_matrix_to_quaternion_batch(ZT, RT, n);
+  double qerr = 0;
+  for (i = 0; i < n; i++) {
+    double s = (ZT[0][i]*X[i][0] + ZT[1][i]*X[i][1] + ZT[2][i]*X[i][2] + ZT[3][i]*X[i][3] < 0 ? -1 : 1);
+    for (j = 0; j < 4; j++)
+      qerr = MAX(qerr, fabs(s*ZT[j][i] - X[i][j]));
+  }
+  printf("quaternion_to_rotation_matrix_batch: %.2f ms, max error = %e, round-trip error = %e\n", t1-t0, err, qerr);
+
+  // quaternion_rotate_points_batch
+  double **P = new_matrix2(n, 3);
+  double **P2 = new_matrix2(n, 3);
+  for (i = 0; i < n; i++)
+    for (j = 0; j < 3; j++)
+      P[i][j] = normrand(0,1);
+  memcpy(P2[0], P[0], 3*n*sizeof(double));
+  t0 = get_time_ms();
+  quaternion_to_rotation_matrix(R, X[0]);
+  for (i = 0; i < n; i++)
+    matrix_vec_mult(P2[i], R, P[i], 3, 3);
+  t1 = get_time_ms();
+  quaternion_rotate_points_batch(P, P, X[0], n);
+  t2 = get_time_ms();
+  err = 0;
+  for (i = 0; i < n; i++)
+    err = MAX(err, dist(P[i], P2[i], 3));
+  printf("matrix_vec_mult: %.2f ms, quaternion_rotate_points_batch: %.2f ms, max error = %e\n", t1-t0, t2-t1, err);
+
+  free_matrix2(X);
+  free_matrix2(Y);
+  free_matrix2(Z);
+  free_matrix2(XT);
+  free_matrix2(YT);
+  free_matrix2(ZT);
+  free_matrix2(RT);
+  free_matrix2(R);
+  free_matrix2(P);
+  free_matrix2(P2);
+}
+
+
 int main(int argc, char *argv[])
 {
   //test_regression(argc, argv);
   test_repmat();
+  //test_mat(argc, argv);
+  //test_matrix_io(argc, argv);
+  //test_trace(argc, argv);
+  //test_parallel(argc, argv);
   //test_kdtree(argc, argv);
+  //test_kdtree_flat(argc, argv);
+  //test_quaternion_index(argc, argv);
   //test_normrand(argc, argv);
+  //test_rng(argc, argv);
   //test_safe_alloc();
   //test_sort_indices();
   //test_mvnrand_pcs(argc, argv);
   //test_mvnpdf_pcs(argc, argv);
+  //test_mvnpdf_log_chol_batch(argc, argv);
+  //test_mvn(argc, argv);
   //test_pmfrand(argc, argv);
   //test_mink();
+  //test_sort_benchmark(argc, argv);
+  //test_quaternion_batch(argc, argv);
 
   return 0;
 }
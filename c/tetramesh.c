@@ -149,6 +149,242 @@ graph_t *tetramesh_graph(tetramesh_t *mesh)
 }
 
 
+/*
+ * Sort a small array of ints (in place) with insertion sort.
+ */
+static void isort_small(int *x, int n)
+{
+  int i, j;
+  for (i = 1; i < n; i++) {
+    int xi = x[i];
+    for (j = i; j > 0 && x[j-1] > xi; j--)
+      x[j] = x[j-1];
+    x[j] = xi;
+  }
+}
+
+
+/*
+ * Get the (sorted, unique) neighbors of vertex i from its cell list, along with the number of cells
+ * each neighbor shares with vertex i.  Returns the number of neighbors.
+ */
+static int tetramesh_adjacency_gather_neighbors(int *dst, int *counts, tetramesh_adjacency_t *adj, tetramesh_t *mesh, int i)
+{
+  int c, j, n = 0, m = 0;
+  for (c = adj->cell_offsets[i]; c < adj->cell_offsets[i+1]; c++) {
+    int *t = mesh->tetrahedra[adj->cells[c]];
+    for (j = 0; j < 4; j++)
+      if (t[j] != i)
+	dst[n++] = t[j];
+  }
+  isort_small(dst, n);
+  for (j = 0; j < n; j++) {
+    if (m > 0 && dst[j] == dst[m-1])
+      counts[m-1]++;
+    else {
+      dst[m] = dst[j];
+      counts[m++] = 1;
+    }
+  }
+
+  return m;
+}
+
+
+typedef struct {
+  tetramesh_t *mesh;
+  tetramesh_adjacency_t *adj;
+  int *cursor;
+} tetramesh_adjacency_data_t;
+
+
+static void tetramesh_adjacency_count_cells(int i0, int i1, void *ptr)
+{
+  tetramesh_adjacency_data_t *data = (tetramesh_adjacency_data_t *)ptr;
+  int i, j;
+  for (i = i0; i < i1; i++)
+    for (j = 0; j < 4; j++)
+      __atomic_fetch_add(&data->adj->cell_offsets[ data->mesh->tetrahedra[i][j] + 1 ], 1, __ATOMIC_RELAXED);
+}
+
+
+static void tetramesh_adjacency_fill_cells(int i0, int i1, void *ptr)
+{
+  tetramesh_adjacency_data_t *data = (tetramesh_adjacency_data_t *)ptr;
+  int i, j;
+  for (i = i0; i < i1; i++) {
+    for (j = 0; j < 4; j++) {
+      int v = data->mesh->tetrahedra[i][j];
+      int c = __atomic_fetch_add(&data->cursor[v], 1, __ATOMIC_RELAXED);
+      data->adj->cells[c] = i;
+    }
+  }
+}
+
+
+/*
+ * Gather the neighbors of vertices i0..i1-1 into slots of size 3*(# cells), starting at 3*cell_offsets[i].
+ */
+static void tetramesh_adjacency_fill_neighbors(int i0, int i1, void *ptr)
+{
+  tetramesh_adjacency_data_t *data = (tetramesh_adjacency_data_t *)ptr;
+  tetramesh_adjacency_t *adj = data->adj;
+  int i;
+  for (i = i0; i < i1; i++) {
+    // sort the cell list of each vertex, so the adjacency doesn't depend on the thread schedule
+    isort_small(adj->cells + adj->cell_offsets[i], adj->cell_offsets[i+1] - adj->cell_offsets[i]);
+    int k = 3*adj->cell_offsets[i];
+    adj->neighbor_offsets[i+1] = tetramesh_adjacency_gather_neighbors(adj->neighbors + k, adj->neighbor_counts + k,
+								      adj, data->mesh, i);
+  }
+}
+
+
+/*
+ * Build the compressed sparse row (CSR) adjacency of a mesh, vertex -> {vertices} and vertex -> {tetrahedra}.
+ * The vertex -> tetrahedra lists are filled with a (parallel) counting sort, and each vertex's neighbors
+ * are then read off of its tetrahedra, so nothing is allocated per vertex.
+ */
+tetramesh_adjacency_t *tetramesh_adjacency(tetramesh_t *mesh)
+{
+  int i, nv = mesh->nv, nt = mesh->nt;
+
+  tetramesh_adjacency_t *adj;
+  safe_calloc(adj, 1, tetramesh_adjacency_t);
+  adj->nv = nv;
+  adj->nt = nt;
+
+  tetramesh_adjacency_data_t data = {mesh, adj, NULL};
+
+  // vertex -> cells
+  safe_calloc(adj->cell_offsets, nv+1, int);
+  parallel_for(nt, tetramesh_adjacency_count_cells, &data);
+  for (i = 0; i < nv; i++)
+    adj->cell_offsets[i+1] += adj->cell_offsets[i];
+
+  safe_malloc(adj->cells, 4*nt, int);
+  safe_malloc(data.cursor, nv, int);
+  memcpy(data.cursor, adj->cell_offsets, nv*sizeof(int));
+  parallel_for(nt, tetramesh_adjacency_fill_cells, &data);
+  free(data.cursor);
+
+  // vertex -> vertices (each vertex has at most 3 neighbors per cell)
+  safe_calloc(adj->neighbor_offsets, nv+1, int);
+  safe_malloc(adj->neighbors, 12*nt, int);
+  safe_malloc(adj->neighbor_counts, 12*nt, int);
+  parallel_for(nv, tetramesh_adjacency_fill_neighbors, &data);
+
+  // compact the neighbor lists
+  for (i = 0; i < nv; i++) {
+    int n = adj->neighbor_offsets[i+1];
+    adj->neighbor_offsets[i+1] = adj->neighbor_offsets[i] + n;
+    memmove(adj->neighbors + adj->neighbor_offsets[i], adj->neighbors + 3*adj->cell_offsets[i], n*sizeof(int));
+    memmove(adj->neighbor_counts + adj->neighbor_offsets[i], adj->neighbor_counts + 3*adj->cell_offsets[i], n*sizeof(int));
+  }
+  adj->ne = adj->neighbor_offsets[nv] / 2;
+  safe_realloc(adj->neighbors, adj->neighbor_offsets[nv], int);
+  safe_realloc(adj->neighbor_counts, adj->neighbor_offsets[nv], int);
+
+  return adj;
+}
+
+
+/*
+ * Free a mesh adjacency.
+ */
+void tetramesh_adjacency_free(tetramesh_adjacency_t *adj)
+{
+  free(adj->neighbor_offsets);
+  free(adj->neighbors);
+  free(adj->neighbor_counts);
+  free(adj->cell_offsets);
+  free(adj->cells);
+  free(adj);
+}
+
+
+/*
+ * Compute a reverse Cuthill-McKee ordering of the vertices of a mesh, so that neighboring vertices
+ * (and the tetrahedra they belong to) end up close together in memory.  order[k] is the (old) index
+ * of the k'th vertex in the new ordering.
+ */
+void tetramesh_rcm_order(int *order, tetramesh_adjacency_t *adj)
+{
+  int i, j, nv = adj->nv;
+  int *off = adj->neighbor_offsets;
+
+  char *visited;
+  safe_calloc(visited, nv, char);
+
+  int head = 0, tail = 0;
+  while (tail < nv) {
+
+    // start each connected component at an unvisited vertex of minimum degree
+    int start = -1;
+    for (i = 0; i < nv; i++)
+      if (!visited[i] && (start < 0 || off[i+1] - off[i] < off[start+1] - off[start]))
+	start = i;
+    visited[start] = 1;
+    order[tail++] = start;
+
+    // breadth-first search, adding the neighbors of each vertex in order of increasing degree
+    while (head < tail) {
+      int v = order[head++];
+      int t0 = tail;
+      for (j = off[v]; j < off[v+1]; j++) {
+	int u = adj->neighbors[j];
+	if (!visited[u]) {
+	  visited[u] = 1;
+	  order[tail++] = u;
+	}
+      }
+      for (i = t0+1; i < tail; i++) {
+	int u = order[i], du = off[u+1] - off[u];
+	for (j = i; j > t0 && off[order[j-1]+1] - off[order[j-1]] > du; j--)
+	  order[j] = order[j-1];
+	order[j] = u;
+      }
+    }
+  }
+
+  // reverse
+  for (i = 0, j = nv-1; i < j; i++, j--) {
+    int tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+
+  free(visited);
+}
+
+
+/*
+ * Permute the vertices of a mesh (in place), where order[k] is the old index of the new k'th vertex.
+ * The tetrahedra keep their order, but their vertex indices are updated.
+ */
+void tetramesh_reorder_vertices(tetramesh_t *mesh, int *order)
+{
+  int i, j, nv = mesh->nv, d = mesh->d;
+
+  int *inv;
+  safe_malloc(inv, nv, int);
+  for (i = 0; i < nv; i++)
+    inv[order[i]] = i;
+
+  double **V = new_matrix2(nv, d);
+  for (i = 0; i < nv; i++)
+    memcpy(V[i], mesh->vertices[order[i]], d*sizeof(double));
+  memcpy(mesh->vertices[0], V[0], nv*d*sizeof(double));
+  free_matrix2(V);
+
+  for (i = 0; i < mesh->nt; i++)
+    for (j = 0; j < 4; j++)
+      mesh->tetrahedra[i][j] = inv[ mesh->tetrahedra[i][j] ];
+
+  free(inv);
+}
+
+
 /*
  * Count the number of distinct edges in the mesh.
  *
@@ -348,35 +584,44 @@ void tetramesh_midpoints(double **dst, tetramesh_t *mesh, graph_t *graph)
 }
 
 
+typedef struct {
+  tetramesh_t *dst;
+  tetramesh_t *src;
+  edge_map_t *edges;
+} tetramesh_subdivide_data_t;
+
+
 /*
- * Subdivide each tetrahedron in a mesh into 8 smaller tetrahedra.
+ * Compute the midpoints of edges e0..e1-1 (for tetramesh_subdivide()).
  */
-void tetramesh_subdivide(tetramesh_t *dst, tetramesh_t *src)
+static void tetramesh_subdivide_midpoints(int e0, int e1, void *ptr)
 {
-  int i;
-  int p1, p2, p3, p4;
-  int q12, q13, q14, q23, q24, q34;
-
-  int nv = src->nv;
-  int nt = src->nt;
-  int d = src->d;
-
-  // compute the midpoints of each edge in the mesh
-  //midpoint_map_t M;
-  //tetramesh_midpoints(&M, src);
+  tetramesh_subdivide_data_t *data = (tetramesh_subdivide_data_t *)ptr;
+  tetramesh_t *src = data->src;
+  double **midpoints = data->dst->vertices + src->nv;
+  edge_t *edges = data->edges->edges;
+  int e;
+  for (e = e0; e < e1; e++)
+    avg(midpoints[e], src->vertices[edges[e].i], src->vertices[edges[e].j], src->d);
+}
 
-  graph_t *graph = tetramesh_graph(src);
 
-  int nv2 = nv + graph->ne;  //M.num_edges;  // old vertices plus the midpoints
-  int nt2 = 8*nt;
+/*
+ * Subdivide tetrahedra i0..i1-1 (for tetramesh_subdivide()).
+ */
+static void tetramesh_subdivide_tetrahedra(int i0, int i1, void *ptr)
+{
+  tetramesh_subdivide_data_t *data = (tetramesh_subdivide_data_t *)ptr;
+  tetramesh_t *dst = data->dst;
+  tetramesh_t *src = data->src;
+  edge_map_t *E = data->edges;
+  int nv = src->nv;
 
-  // allocate space for the new mesh and copy old vertices plus midpoints into dst
-  tetramesh_new(dst, nv2, nt2, d);
-  memcpy(dst->vertices[0], src->vertices[0], nv*d*sizeof(double));
-  //memcpy(dst->vertices[0] + nv*d, M.points[0], (nv2-nv)*d*sizeof(double));
-  tetramesh_midpoints(dst->vertices + nv, src, graph);
+  int i;
+  int p1, p2, p3, p4;
+  int q12, q13, q14, q23, q24, q34;
 
-  for (i = 0; i < nt; i++) {    // for each tetrahedron in the original mesh
+  for (i = i0; i < i1; i++) {    // for each tetrahedron in the original mesh
 
     // original point indices
     p1 = src->tetrahedra[i][0];
@@ -385,12 +630,12 @@ void tetramesh_subdivide(tetramesh_t *dst, tetramesh_t *src)
     p4 = src->tetrahedra[i][3];
 
     // new point indices
-    q12 = nv + graph->vertices[p1].edges[ ilist_find(graph->vertices[p1].neighbors, p2) ];  //M.map[p1][p2];
-    q13 = nv + graph->vertices[p1].edges[ ilist_find(graph->vertices[p1].neighbors, p3) ];  //M.map[p1][p3];
-    q14 = nv + graph->vertices[p1].edges[ ilist_find(graph->vertices[p1].neighbors, p4) ];  //M.map[p1][p4];
-    q23 = nv + graph->vertices[p2].edges[ ilist_find(graph->vertices[p2].neighbors, p3) ];  //M.map[p2][p3];
-    q24 = nv + graph->vertices[p2].edges[ ilist_find(graph->vertices[p2].neighbors, p4) ];  //M.map[p2][p4];
-    q34 = nv + graph->vertices[p3].edges[ ilist_find(graph->vertices[p3].neighbors, p4) ];  //M.map[p3][p4];
+    q12 = nv + edge_map_find(E, p1, p2);
+    q13 = nv + edge_map_find(E, p1, p3);
+    q14 = nv + edge_map_find(E, p1, p4);
+    q23 = nv + edge_map_find(E, p2, p3);
+    q24 = nv + edge_map_find(E, p2, p4);
+    q34 = nv + edge_map_find(E, p3, p4);
 
     int *t0 = dst->tetrahedra[8*i];
     int *t1 = dst->tetrahedra[8*i+1];
@@ -410,10 +655,44 @@ void tetramesh_subdivide(tetramesh_t *dst, tetramesh_t *src)
     t6[0] = q24;  t6[1] = q12;  t6[2] = q23;  t6[3] = q34;
     t7[0] = q24;  t7[1] = q12;  t7[2] = q14;  t7[3] = q34;
   }
+}
+
+
+/*
+ * Subdivide each tetrahedron in a mesh into 8 smaller tetrahedra.  The edges are deduplicated
+ * with a hash map in a first (serial) pass, and then the midpoints and new tetrahedra are
+ * filled in in parallel.
+ */
+void tetramesh_subdivide(tetramesh_t *dst, tetramesh_t *src)
+{
+  int i, j, k;
+
+  int nv = src->nv;
+  int nt = src->nt;
+  int d = src->d;
+
+  // find the edges (in a fixed order, so that the vertex numbering is deterministic)
+  edge_map_t E;
+  edge_map_new(&E, 8*nv);
+  for (i = 0; i < nt; i++) {
+    int *t = src->tetrahedra[i];
+    for (j = 0; j < 3; j++)
+      for (k = j+1; k < 4; k++)
+	edge_map_add(&E, t[j], t[k]);
+  }
+
+  int nv2 = nv + E.ne;  // old vertices plus the midpoints
+  int nt2 = 8*nt;
+
+  // allocate space for the new mesh and copy old vertices into dst
+  tetramesh_new(dst, nv2, nt2, d);
+  memcpy(dst->vertices[0], src->vertices[0], nv*d*sizeof(double));
 
-  graph_free(graph);
+  tetramesh_subdivide_data_t data = {dst, src, &E};
+  parallel_for(E.ne, tetramesh_subdivide_midpoints, &data);
+  parallel_for(nt, tetramesh_subdivide_tetrahedra, &data);
 
-  //free_midpoint_map(&M);
+  edge_map_free(&E);
 }
 
 
@@ -596,6 +875,74 @@ void tetramesh_save_PLY(tetramesh_t *mesh, meshgraph_t *graph, char *filename)
 }
 
 
+typedef struct {
+  double **vertices;
+  tetramesh_t *src;
+  tetramesh_adjacency_t *adj;
+  double w;
+} tetramesh_smooth_data_t;
+
+
+static void tetramesh_smooth_vertices(int i0, int i1, void *ptr)
+{
+  tetramesh_smooth_data_t *data = (tetramesh_smooth_data_t *)ptr;
+  tetramesh_t *src = data->src;
+  tetramesh_adjacency_t *adj = data->adj;
+  int i, j, k, d = src->d;
+  double w = data->w;
+
+  for (i = i0; i < i1; i++) {
+    double *p = src->vertices[i];
+    double *q = data->vertices[i];
+    int n = adj->cell_offsets[i+1] - adj->cell_offsets[i];
+    if (n == 0) {
+      memcpy(q, p, d*sizeof(double));
+      continue;
+    }
+    // sum over cells of the other 3 vertices = sum over neighbors of (# shared cells) * neighbor
+    memset(q, 0, d*sizeof(double));
+    for (j = adj->neighbor_offsets[i]; j < adj->neighbor_offsets[i+1]; j++) {
+      double *x = src->vertices[ adj->neighbors[j] ];
+      double c = adj->neighbor_counts[j];
+      for (k = 0; k < d; k++)
+	q[k] += c*x[k];
+    }
+    for (k = 0; k < d; k++)
+      q[k] = w*q[k]/(3.0*n) + (1-w)*p[k];
+  }
+}
+
+
+/*
+ * Smooth a tetrahedral mesh:  each vertex is replaced with the average over its tetrahedra of
+ * w*(centroid of the other 3 vertices) + (1-w)*(the vertex).  dst may equal src.
+ */
+void tetramesh_smooth_adjacency(tetramesh_t *dst, tetramesh_t *src, tetramesh_adjacency_t *adj, double w)
+{
+  double **V = new_matrix2(src->nv, src->d);
+
+  tetramesh_smooth_data_t data = {V, src, adj, w};
+  parallel_for(src->nv, tetramesh_smooth_vertices, &data);
+
+  memcpy(dst->vertices[0], V[0], src->nv*src->d*sizeof(double));
+  if (dst != src)
+    tetramesh_copy_tetrahedra(dst, src);
+
+  free_matrix2(V);
+}
+
+
+/*
+ * Smooth a tetrahedral mesh (see tetramesh_smooth_adjacency()).
+ */
+void tetramesh_smooth(tetramesh_t *dst, tetramesh_t *src, double w)
+{
+  tetramesh_adjacency_t *adj = tetramesh_adjacency(src);
+  tetramesh_smooth_adjacency(dst, src, adj, w);
+  tetramesh_adjacency_free(adj);
+}
+
+
 /*
  * Compute statistics about tetrahedral areas, edge lengths, etc.
  */
@@ -604,8 +951,8 @@ tetramesh_stats_t tetramesh_stats(tetramesh_t *T)
   int i, j, e, nt = T->nt, d = T->d;
   tetramesh_stats_t stats;
 
-  graph_t *graph = tetramesh_graph(T);
-  stats.num_edges = graph->ne;
+  tetramesh_adjacency_t *adj = tetramesh_adjacency(T);
+  stats.num_edges = adj->ne;
 
   stats.num_vertices = T->nv;
   stats.num_tetrahedra = T->nt;
@@ -697,28 +1044,34 @@ tetramesh_stats_t tetramesh_stats(tetramesh_t *T)
   stats.std_skewness = sqrt(stats.std_skewness/(double)nt);
   stats.std_volume = sqrt(stats.std_volume/(double)nt);
 
-  for (e = 0; e < graph->ne; e++) {
-    i = graph->edges[e].i;
-    j = graph->edges[e].j;
-    double edge_len = dist(T->vertices[i], T->vertices[j], d);
-    if (edge_len < stats.min_edge_len)
-      stats.min_edge_len = edge_len;
-    if (edge_len > stats.max_edge_len)
-      stats.max_edge_len = edge_len;
-    stats.avg_edge_len += edge_len;
+  for (i = 0; i < T->nv; i++) {
+    for (e = adj->neighbor_offsets[i]; e < adj->neighbor_offsets[i+1]; e++) {
+      j = adj->neighbors[e];
+      if (j < i)
+	continue;
+      double edge_len = dist(T->vertices[i], T->vertices[j], d);
+      if (edge_len < stats.min_edge_len)
+	stats.min_edge_len = edge_len;
+      if (edge_len > stats.max_edge_len)
+	stats.max_edge_len = edge_len;
+      stats.avg_edge_len += edge_len;
+    }
   }
   stats.avg_edge_len /= (double)stats.num_edges;
 
-  for (e = 0; e < graph->ne; e++) {
-    i = graph->edges[e].i;
-    j = graph->edges[e].j;
-    double edge_len = dist(T->vertices[i], T->vertices[j], d);
-    double de = stats.avg_edge_len - edge_len;
-    stats.std_edge_len += de*de;
+  for (i = 0; i < T->nv; i++) {
+    for (e = adj->neighbor_offsets[i]; e < adj->neighbor_offsets[i+1]; e++) {
+      j = adj->neighbors[e];
+      if (j < i)
+	continue;
+      double edge_len = dist(T->vertices[i], T->vertices[j], d);
+      double de = stats.avg_edge_len - edge_len;
+      stats.std_edge_len += de*de;
+    }
   }
   stats.std_edge_len = sqrt(stats.std_edge_len/(double)stats.num_edges);
 
-  graph_free(graph);
+  tetramesh_adjacency_free(adj);
 
   return stats;
 }
@@ -863,70 +1216,6 @@ void tetramesh_smooth2(tetramesh_t *dst, tetramesh_t *src, double w)
 }
 
 
-// Smooth the tetrahedral mesh
-void tetramesh_smooth(tetramesh_t *dst, tetramesh_t *src, double w)
-{
-  // Laplacian
-  //static double L[4][4] = {{0, 1/3.0, 1/3.0, 1/3.0},
-  //			     {1/3.0, 0, 1/3.0, 1/3.0},
-  //			     {1/3.0, 1/3.0, 0, 1/3.0},
-  //			     {1/3.0, 1/3.0, 1/3.0, 0}};
-
-  int i, j, i0, i1, i2, i3;
-  int nv = src->nv;
-  int nt = src->nt;
-  int d = src->d;
-  tetramesh_t tmp;
-  int cnt[nv];
-
-  tetramesh_new(&tmp, nv, nt, d);
-  memset(cnt, 0, nv*sizeof(int));
-
-  for (i = 0; i < nt; i++) {      // for each tetrahedron
-
-    i0 = src->tetrahedra[i][0];
-    i1 = src->tetrahedra[i][1];
-    i2 = src->tetrahedra[i][2];
-    i3 = src->tetrahedra[i][3];
-
-    double *p0 = src->vertices[i0];
-    double *p1 = src->vertices[i1];
-    double *p2 = src->vertices[i2];
-    double *p3 = src->vertices[i3];
-
-    double m0[d], m1[d], m2[d], m3[d];
-
-    avg3(m0, p1, p2, p3, d);
-    avg3(m1, p0, p2, p3, d);
-    avg3(m2, p0, p1, p3, d);
-    avg3(m3, p0, p1, p2, d);
-
-    wavg(m0, m0, p0, w, d);
-    wavg(m1, m1, p1, w, d);
-    wavg(m2, m2, p2, w, d);
-    wavg(m3, m3, p3, w, d);
-
-    add(tmp.vertices[i0], tmp.vertices[i0], m0, d);
-    add(tmp.vertices[i1], tmp.vertices[i1], m1, d);
-    add(tmp.vertices[i2], tmp.vertices[i2], m2, d);
-    add(tmp.vertices[i3], tmp.vertices[i3], m3, d);
-
-    cnt[i0]++;
-    cnt[i1]++;
-    cnt[i2]++;
-    cnt[i3]++;
-  }
-
-  for (i = 0; i < nv; i++)
-    for (j = 0; j < d; j++)
-      tmp.vertices[i][j] /= (double) cnt[i];
-
-  tetramesh_copy_vertices(dst, &tmp);
-  tetramesh_copy_tetrahedra(dst, src);
-
-  tetramesh_free(&tmp);
-}
-
 ******************************************************/
 
 
@@ -5,7 +5,20 @@
 #include <time.h>
 #include <math.h>
 #include <float.h>
+#include <pthread.h>
+#include <stddef.h>
+#ifndef HAVE_WINDOWS
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "bingham/util.h"
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 //#include <lapacke.h>
 //#undef I  // fuck C99!
 
@@ -279,3077 +292,6167 @@ double get_time_ms()
 }
 
 
-// returns a pointer to the nth word (starting from 0) in string s
-char *sword(char *s, const char *delim, int n)
-{
-  if (s == NULL)
-    return NULL;
+/*
+ * Tracing.  Each thread accumulates the number of calls and total time of its (nested) scopes in
+ * a tree of trace nodes, plus its counters and (optionally) a list of trace events.  When a thread
+ * exits, its trace is merged into trace_retired.  Scopes are identified by their names, so
+ * trees from different threads are merged by matching scope paths.
+ */
+#define TRACE_MAX_DEPTH 64
+#define TRACE_MAX_EVENTS_PER_THREAD (1<<20)
+
+int trace_state = -1;               // -1 = uninitialized, 0 = off, 1 = on
+static int trace_events_on = 0;     // record trace events?
+static double trace_t0;             // start time (in microseconds)
+static char *trace_json_file = NULL;
+static char *trace_events_file = NULL;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;
 
-  s += strspn(s, delim);  // skip over initial delimeters
+typedef struct {
+  const char *name;
+  int parent;
+  int first_child;
+  int next_sibling;
+  long calls;
+  double total_us;
+} trace_node_t;
 
-  int i;
-  for (i = 0; i < n; i++) {
-    s += strcspn(s, delim);  // skip over word
-    s += strspn(s, delim);  // skip over delimeters
-  }
+typedef struct {
+  const char *name;
+  long count;
+  double sum;
+} trace_counter_t;
 
-  return s;
+typedef struct {
+  const char *name;
+  char type;         // 'X' (scope) or 'C' (counter)
+  int tid;
+  double ts;         // start time (in microseconds)
+  double value;      // duration (in microseconds) of a scope, or the value of a counter
+} trace_event_t;
+
+typedef struct trace_thread_s {
+  int tid;
+  trace_node_t *nodes;        // nodes[0] is the root
+  int num_nodes, cap_nodes;
+  trace_counter_t *counters;
+  int num_counters, cap_counters;
+  trace_event_t *events;
+  int num_events, cap_events;
+  long dropped_events;
+  int stack[TRACE_MAX_DEPTH];  // current scope path
+  double stack_t0[TRACE_MAX_DEPTH];
+  int depth;                   // may be more than TRACE_MAX_DEPTH
+  int base_depth;              // depth of the scope path inherited from parallel_for()
+  struct trace_thread_s *prev, *next;
+} trace_thread_t;
+
+typedef struct {
+  int depth;
+  const char *names[TRACE_MAX_DEPTH];
+} trace_path_t;
+
+static __thread trace_thread_t *trace_thread_state = NULL;
+static trace_thread_t trace_retired;            // traces of threads that have exited
+static trace_thread_t *trace_live = NULL;       // traces of running threads
+static int trace_num_threads = 0;
+
+static double trace_now_us()
+{
+#ifndef HAVE_WINDOWS
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return 1e6*ts.tv_sec + ts.tv_nsec/1000.;
+#else
+  return 1000.*get_time_ms();
+#endif
 }
 
+static void trace_thread_init(trace_thread_t *th)
+{
+  memset(th, 0, sizeof(trace_thread_t));
+  th->cap_nodes = 16;
+  safe_calloc(th->nodes, th->cap_nodes, trace_node_t);
+  th->nodes[0].name = "";
+  th->nodes[0].parent = th->nodes[0].first_child = th->nodes[0].next_sibling = -1;
+  th->num_nodes = 1;
+}
 
-// splits a string into k words
-char **split(char *s, const char *delim, int *k)
+static void trace_thread_free_data(trace_thread_t *th)
 {
-  char *sbuf = s + strspn(s, delim);  // skip over initial whitespace
-  s = sbuf;
+  free(th->nodes);
+  free(th->counters);
+  free(th->events);
+}
 
-  // determine the number of words
-  int num_words = 0;
-  while (*s != '\0') {
-    s = sword(s, delim, 1);
-    num_words++;
+// find (or add) the child of node p with the given name
+static int trace_child(trace_thread_t *th, int p, const char *name)
+{
+  int c, last = -1;
+  for (c = th->nodes[p].first_child; c >= 0; c = th->nodes[c].next_sibling) {
+    if (th->nodes[c].name == name || !strcmp(th->nodes[c].name, name))
+      return c;
+    last = c;
   }
 
-  // fill in the words
-  int i;
-  s = sbuf;
-  char **words;
-  safe_calloc(words, num_words, char *);
-  for (i = 0; i < num_words; i++) {
-    int slen = strcspn(s, delim);  // add "\n" ?
-    safe_calloc(words[i], slen+1, char);  // +1 to null-terminate the string
-    strncpy(words[i], s, slen);
-    s = sword(s, delim, 1);
+  if (th->num_nodes == th->cap_nodes) {
+    th->cap_nodes *= 2;
+    safe_realloc(th->nodes, th->cap_nodes, trace_node_t);
   }
+  c = th->num_nodes++;
+  trace_node_t *node = &th->nodes[c];
+  node->name = name;
+  node->parent = p;
+  node->first_child = -1;
+  node->next_sibling = -1;
+  node->calls = 0;
+  node->total_us = 0;
+
+  // keep the children in the order they were first seen
+  if (last >= 0)
+    th->nodes[last].next_sibling = c;
+  else
+    th->nodes[p].first_child = c;
 
-  *k = num_words;
-  return words;
+  return c;
 }
 
-
-// compare the first word of s1 with the first word of s2
-int wordcmp(char *s1, char *s2, const char *delim)
+static trace_counter_t *trace_counter(trace_thread_t *th, const char *name)
 {
-  int n1 = strcspn(s1, delim);
-  int n2 = strcspn(s2, delim);
+  int i;
+  for (i = 0; i < th->num_counters; i++)
+    if (th->counters[i].name == name || !strcmp(th->counters[i].name, name))
+      return &th->counters[i];
 
-  if (n1 < n2)
-    return -1;
-  else if (n1 > n2)
-    return 1;
+  if (th->num_counters == th->cap_counters) {
+    th->cap_counters = MAX(2*th->cap_counters, 8);
+    safe_realloc(th->counters, th->cap_counters, trace_counter_t);
+  }
+  trace_counter_t *c = &th->counters[th->num_counters++];
+  c->name = name;
+  c->count = 0;
+  c->sum = 0;
 
-  return strncmp(s1, s2, n1);
+  return c;
 }
 
-
-// replace a word in a string array
-void replace_word(char **words, int num_words, const char *from, const char *to)
+static void trace_add_event(trace_thread_t *th, const char *name, char type, int tid, double ts, double value)
 {
-  int i;
-  for (i = 0; i < num_words; i++) {
-    if (!strcmp(words[i], from)) {
-      safe_realloc(words[i], strlen(to)+1, char);
-      strcpy(words[i], to);
+  if (th->num_events == th->cap_events) {
+    if (th != &trace_retired && th->num_events >= TRACE_MAX_EVENTS_PER_THREAD) {
+      th->dropped_events++;
+      return;
     }
+    th->cap_events = MAX(2*th->cap_events, 256);
+    safe_realloc(th->events, th->cap_events, trace_event_t);
+  }
+  trace_event_t *e = &th->events[th->num_events++];
+  e->name = name;
+  e->type = type;
+  e->tid = tid;
+  e->ts = ts;
+  e->value = value;
+}
+
+// add the subtree of src rooted at node s to the subtree of dst rooted at node d
+static void trace_merge_nodes(trace_thread_t *dst, int d, const trace_thread_t *src, int s)
+{
+  int c;
+  for (c = src->nodes[s].first_child; c >= 0; c = src->nodes[c].next_sibling) {
+    int dc = trace_child(dst, d, src->nodes[c].name);
+    dst->nodes[dc].calls += src->nodes[c].calls;
+    dst->nodes[dc].total_us += src->nodes[c].total_us;
+    trace_merge_nodes(dst, dc, src, c);
   }
 }
 
-
-// computes the log factorial of x
-double lfact(int x)
+// merge the trace of thread src into dst
+static void trace_merge(trace_thread_t *dst, const trace_thread_t *src)
 {
-  static double logf[MAXFACT];
-  static int first = 1;
   int i;
-
-  if (first) {
-    first = 0;
-    logf[0] = 0;
-    for (i = 1; i < MAXFACT; i++)
-      logf[i] = log(i) + logf[i-1];
+  trace_merge_nodes(dst, 0, src, 0);
+  for (i = 0; i < src->num_counters; i++) {
+    trace_counter_t *c = trace_counter(dst, src->counters[i].name);
+    c->count += src->counters[i].count;
+    c->sum += src->counters[i].sum;
   }
-
-  return logf[x];
+  for (i = 0; i < src->num_events; i++) {
+    const trace_event_t *e = &src->events[i];
+    trace_add_event(dst, e->name, e->type, e->tid, e->ts, e->value);
+  }
+  dst->dropped_events += src->dropped_events;
 }
 
+// called when a thread exits
+static void trace_thread_exit(void *ptr)
+{
+  trace_thread_t *th = (trace_thread_t *)ptr;
 
-// computes the factorial of x
-double fact(int x)
+  pthread_mutex_lock(&trace_mutex);
+  trace_merge(&trace_retired, th);
+  if (th->prev)
+    th->prev->next = th->next;
+  else
+    trace_live = th->next;
+  if (th->next)
+    th->next->prev = th->prev;
+  pthread_mutex_unlock(&trace_mutex);
+
+  trace_thread_free_data(th);
+  free(th);
+}
+
+static trace_thread_t *trace_thread()
 {
-  return exp(lfact(x));
+  trace_thread_t *th = trace_thread_state;
+  if (th)
+    return th;
+
+  safe_malloc(th, 1, trace_thread_t);
+  trace_thread_init(th);
+
+  pthread_mutex_lock(&trace_mutex);
+  th->tid = trace_num_threads++;
+  th->next = trace_live;
+  if (trace_live)
+    trace_live->prev = th;
+  trace_live = th;
+  pthread_mutex_unlock(&trace_mutex);
+
+  pthread_setspecific(trace_key, th);
+  trace_thread_state = th;
+
+  return th;
 }
 
+static void trace_save_at_exit()
+{
+  if (trace_json_file)
+    trace_save_json(trace_json_file);
+  if (trace_events_file)
+    trace_save_chrome(trace_events_file);
+}
 
-// computes the surface area of a unit sphere with dimension d
-double surface_area_sphere(int d)
+static void trace_init()
 {
-  switch(d) {
-  case 0:
-    return 2;
-  case 1:
-    return 2*M_PI;
-  case 2:
-    return 4*M_PI;
-  case 3:
-    return 2*M_PI*M_PI;
-  }
+  pthread_key_create(&trace_key, trace_thread_exit);
+  trace_thread_init(&trace_retired);
+  trace_t0 = trace_now_us();
 
-  return (2*M_PI/((double)d-1))*surface_area_sphere(d-2);
+  char *s = getenv("BINGHAM_TRACE");
+  if (s && *s)
+    trace_json_file = strdup(s);
+  s = getenv("BINGHAM_TRACE_EVENTS");
+  if (s && *s)
+    trace_events_file = strdup(s);
+
+  trace_events_on = (trace_events_file != NULL);
+  trace_state = (trace_json_file || trace_events_file);
+  if (trace_state)
+    atexit(trace_save_at_exit);
 }
 
+/*
+ * Turn on tracing (and recording of trace events for trace_save_chrome(), if events is set).
+ * Tracing can also be turned on by setting BINGHAM_TRACE=<file> (to save the scope timings and
+ * counters with trace_save_json() at exit) and/or BINGHAM_TRACE_EVENTS=<file> (to save the trace
+ * events with trace_save_chrome() at exit).
+ */
+void trace_enable(int events)
+{
+  pthread_once(&trace_once, trace_init);
+  trace_events_on = events;
+  trace_state = 1;
+}
 
-// logical not of a binary array
-void vnot(int y[], int x[], int n)
+void trace_disable()
 {
-  int i;
-  for (i = 0; i < n; i++)
-    y[i] = !x[i];
+  pthread_once(&trace_once, trace_init);
+  trace_state = 0;
 }
 
+// begin a trace scope (name must outlive the trace, e.g. a string literal)
+void trace_begin(const char *name)
+{
+  if (trace_state < 0)
+    pthread_once(&trace_once, trace_init);
+  if (trace_state == 0)
+    return;
 
-// count the non-zero elements of x
-int count(int x[], int n)
+  trace_thread_t *th = trace_thread();
+  if (th->depth < TRACE_MAX_DEPTH) {
+    int p = (th->depth > 0 ? th->stack[th->depth - 1] : 0);
+    th->stack[th->depth] = trace_child(th, p, name);
+    th->stack_t0[th->depth] = trace_now_us();
+  }
+  th->depth++;
+}
+
+// end the current trace scope
+void trace_end()
 {
-  int i;
-  int cnt = 0;
-  for (i = 0; i < n; i++)
-    if (x[i] != 0)
-      cnt++;
+  trace_thread_t *th = trace_thread_state;
+  if (th == NULL || th->depth <= th->base_depth)
+    return;
 
-  return cnt;
+  th->depth--;
+  if (th->depth < TRACE_MAX_DEPTH) {
+    double t = trace_now_us();
+    double t0 = th->stack_t0[th->depth];
+    trace_node_t *node = &th->nodes[th->stack[th->depth]];
+    node->calls++;
+    node->total_us += t - t0;
+    if (trace_events_on)
+      trace_add_event(th, node->name, 'X', th->tid, t0 - trace_t0, t - t0);
+  }
 }
 
+// add value to a counter (name must outlive the trace, e.g. a string literal)
+void trace_count(const char *name, double value)
+{
+  if (trace_state < 0)
+    pthread_once(&trace_once, trace_init);
+  if (trace_state == 0)
+    return;
 
-// returns a dense array of the indices of x's non-zero elements
-int find(int *k, int x[], int n)
+  trace_thread_t *th = trace_thread();
+  trace_counter_t *c = trace_counter(th, name);
+  c->count++;
+  c->sum += value;
+  if (trace_events_on)
+    trace_add_event(th, name, 'C', th->tid, trace_now_us() - trace_t0, c->sum);
+}
+
+// get the current scope path (for parallel_for())
+static void trace_get_path(trace_path_t *path)
 {
-  int i;
-  int cnt = 0;
+  trace_thread_t *th = trace_thread_state;
+  path->depth = 0;
+  if (th == NULL)
+    return;
+  int i, n = MIN(th->depth, TRACE_MAX_DEPTH);
   for (i = 0; i < n; i++)
-    if (x[i] != 0)
-      k[cnt++] = i;
-  return cnt;
+    path->names[i] = th->nodes[th->stack[i]].name;
+  path->depth = n;
 }
 
-
-// returns a sparse array of the indices of x's non-zero elements
-int findinv(int *k, int x[], int n)
+// enter a scope path inherited from another thread (without timing it)
+static void trace_set_path(const trace_path_t *path)
 {
-  int i;
-  int cnt = 0;
-  for (i = 0; i < n; i++)
-    if (x[i] != 0)
-      k[i] = cnt++;
-  return cnt;
+  if (path->depth == 0)
+    return;
+  trace_thread_t *th = trace_thread();
+  int i, p = 0;
+  for (i = 0; i < path->depth; i++)
+    p = th->stack[i] = trace_child(th, p, path->names[i]);
+  th->depth = th->base_depth = path->depth;
 }
 
+typedef struct {
+  int depth;
+  int base_depth;
+  int n;                       // number of stack entries overwritten by the inherited path
+  int stack[TRACE_MAX_DEPTH];
+} trace_saved_path_t;
 
-// computes a dense array of the indices of x==a
-int findeq(int *k, int x[], int a, int n)
+// enter a scope path inherited from another thread, saving the current one (for trace_leave_path())
+static void trace_enter_path(trace_saved_path_t *saved, const trace_path_t *path)
 {
-  int i;
-  int cnt = 0;
-  if (k != NULL) {
-    for (i = 0; i < n; i++) {
-      if (x[i] == a)
-	k[cnt++] = i;
-    }
-  }
-  else
-    for (i = 0; i < n; i++)
-      if (x[i] == a)
-	cnt++;
-  return cnt;
+  trace_thread_t *th = trace_thread();
+  saved->depth = th->depth;
+  saved->base_depth = th->base_depth;
+  saved->n = path->depth;
+  memcpy(saved->stack, th->stack, saved->n*sizeof(int));
+  trace_set_path(path);
 }
 
+// return to the scope path saved by trace_enter_path()
+static void trace_leave_path(const trace_saved_path_t *saved)
+{
+  trace_thread_t *th = trace_thread();
+  memcpy(th->stack, saved->stack, saved->n*sizeof(int));
+  th->depth = saved->depth;
+  th->base_depth = saved->base_depth;
+}
 
-// computes the sum of x's elements
-double sum(double x[], int n)
+// merge the traces of all threads (must be called with trace_mutex locked)
+static trace_thread_t *trace_collect()
 {
-  int i;
-  double y = 0;
-  for (i = 0; i < n; i++)
-    y += x[i];
-  return y;
+  trace_thread_t *all, *th;
+  safe_malloc(all, 1, trace_thread_t);
+  trace_thread_init(all);
+  trace_merge(all, &trace_retired);
+  for (th = trace_live; th; th = th->next)
+    trace_merge(all, th);
+  return all;
 }
 
-// computes the product of x's elements
-double prod(double x[], int n)
+static void trace_fprint_string(FILE *f, const char *s)
 {
-  int i;
-  double y = 1;
-  for (i = 0; i < n; i++)
-    y *= x[i];
-  return y;
+  fputc('"', f);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fputc('\\', f);
+    if ((unsigned char)*s >= 0x20)
+      fputc(*s, f);
+  }
+  fputc('"', f);
 }
 
+static void trace_fprint_nodes(FILE *f, const trace_thread_t *th, int p, int indent)
+{
+  int c, first = 1;
+  fprintf(f, "[");
+  for (c = th->nodes[p].first_child; c >= 0; c = th->nodes[c].next_sibling) {
+    const trace_node_t *node = &th->nodes[c];
+    fprintf(f, "%s\n%*s{\"name\": ", (first ? "" : ","), indent+2, "");
+    trace_fprint_string(f, node->name);
+    fprintf(f, ", \"calls\": %ld, \"total_ms\": %.3f", node->calls, node->total_us / 1000.);
+    if (node->first_child >= 0) {
+      fprintf(f, ", \"children\": ");
+      trace_fprint_nodes(f, th, c, indent+2);
+    }
+    fprintf(f, "}");
+    first = 0;
+  }
+  if (!first)
+    fprintf(f, "\n%*s", indent, "");
+  fprintf(f, "]");
+}
 
-// computes the max of x
-double arr_max(double x[], int n)
+/*
+ * Save the scope timings and counters of all threads as JSON.  Scopes are nested by their
+ * paths; scopes in parallel_for() workers are nested under the scope that called parallel_for(),
+ * so their totals can exceed their parents' (wall clock) totals.  Should only be called when no
+ * other threads are tracing.  Returns 0 on success, or -1 on error.
+ */
+int trace_save_json(const char *fname)
 {
+  FILE *f = fopen(fname, "w");
+  if (f == NULL) {
+    fprintf(stderr, "Error: couldn't open %s for writing\n", fname);
+    return -1;
+  }
+
+  pthread_mutex_lock(&trace_mutex);
+  trace_thread_t *all = trace_collect();
+  pthread_mutex_unlock(&trace_mutex);
+
   int i;
+  fprintf(f, "{\n  \"scopes\": ");
+  trace_fprint_nodes(f, all, 0, 2);
+  fprintf(f, ",\n  \"counters\": [");
+  for (i = 0; i < all->num_counters; i++) {
+    fprintf(f, "%s\n    {\"name\": ", (i ? "," : ""));
+    trace_fprint_string(f, all->counters[i].name);
+    fprintf(f, ", \"count\": %ld, \"sum\": %.17g}", all->counters[i].count, all->counters[i].sum);
+  }
+  fprintf(f, "%s]\n}\n", (all->num_counters ? "\n  " : ""));
 
-  double y = x[0];
-  for (i = 1; i < n; i++)
-    if (x[i] > y)
-      y = x[i];
+  trace_thread_free_data(all);
+  free(all);
 
-  return y;
+  return (fclose(f) == 0 ? 0 : -1);
 }
 
-// computes the max of x
-double arr_max_i(int x[], int n)
+/*
+ * Save the trace events of all threads in the Chrome trace event format (for chrome://tracing or
+ * Perfetto).  Should only be called when no other threads are tracing.  Returns 0 on success, or
+ * -1 on error.
+ */
+int trace_save_chrome(const char *fname)
 {
+  FILE *f = fopen(fname, "w");
+  if (f == NULL) {
+    fprintf(stderr, "Error: couldn't open %s for writing\n", fname);
+    return -1;
+  }
+
+  pthread_mutex_lock(&trace_mutex);
+  trace_thread_t *all = trace_collect();
+  pthread_mutex_unlock(&trace_mutex);
+
+  if (all->dropped_events)
+    fprintf(stderr, "Warning: dropped %ld trace events\n", all->dropped_events);
+
   int i;
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  for (i = 0; i < all->num_events; i++) {
+    const trace_event_t *e = &all->events[i];
+    fprintf(f, "%s\n{\"name\": ", (i ? "," : ""));
+    trace_fprint_string(f, e->name);
+    if (e->type == 'X')
+      fprintf(f, ", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}", e->tid, e->ts, e->value);
+    else
+      fprintf(f, ", \"ph\": \"C\", \"pid\": 0, \"tid\": %d, \"ts\": %.3f, \"args\": {\"value\": %.17g}}", e->tid, e->ts, e->value);
+  }
+  fprintf(f, "\n]}\n");
 
-  int y = x[0];
-  for (i = 1; i < n; i++)
-    if (x[i] > y)
-      y = x[i];
+  trace_thread_free_data(all);
+  free(all);
 
-  return y;
+  return (fclose(f) == 0 ? 0 : -1);
 }
 
-// computes the masked max of x
-double arr_max_masked(double x[], int mask[], int n)
+// clear the traces of all threads (should only be called when no other threads are tracing)
+void trace_reset()
 {
-  int i;
+  pthread_once(&trace_once, trace_init);
+  pthread_mutex_lock(&trace_mutex);
 
-  for (i = 0; i < n; i++)
-    if (mask[i])
-      break;
-  if (i==n)
-    return NAN;
+  trace_thread_free_data(&trace_retired);
+  trace_thread_init(&trace_retired);
 
-  double y = x[i++];
-  for (; i < n; i++)
-    if (mask[i] && (x[i] > y))
-      y = x[i];
+  trace_thread_t *th;
+  for (th = trace_live; th; th = th->next) {
+    th->num_nodes = 1;
+    th->nodes[0].first_child = -1;
+    th->num_counters = 0;
+    th->num_events = 0;
+    th->dropped_events = 0;
+    th->depth = th->base_depth = 0;
+  }
 
-  return y;
+  pthread_mutex_unlock(&trace_mutex);
 }
 
-// computes the masked max of x
-float arr_maxf_masked(float x[], int mask[], int n)
-{
-  int i;
 
-  for (i = 0; i < n; i++)
-    if (mask[i])
-      break;
-  if (i==n)
-    return NAN;
+/*
+ * Parallel runtime.  Parallel work is split into tasks, which run on a persistent pool of worker
+ * threads (started on first use), or on a caller-provided executor (see set_parallel_executor()).
+ * The thread that submits a job also works on the job's tasks until they have all been started, so
+ * parallel_for() may be called from inside a parallel_for() body without deadlocking the pool.
+ */
 
-  float y = x[i++];
-  for (; i < n; i++)
-    if (mask[i] && (x[i] > y))
-      y = x[i];
+#define PARALLEL_MIN_BLOCK_SIZE 256
+#define PARALLEL_MAX_THREADS 256
 
-  return y;
-}
+typedef struct parallel_job_s {
+  void (*task)(int i, void *arg);
+  void *arg;
+  int num_tasks;
+  int next_task;                // next task to start
+  int num_done;                 // number of finished tasks
+  struct parallel_job_s *next;  // next job in the queue
+} parallel_job_t;
 
-// computes the min of x
-double arr_min(double x[], int n)
-{
-  int i;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work_cond = PTHREAD_COND_INITIALIZER;  // signaled when tasks are queued (or the pool is stopped)
+static pthread_cond_t pool_done_cond = PTHREAD_COND_INITIALIZER;  // signaled when a job is finished
+static parallel_job_t *pool_queue = NULL;  // jobs with tasks left to start (oldest first)
+static pthread_t *pool_threads = NULL;
+static int pool_size = 0;                  // number of worker threads
+static int pool_started = 0;
+static int pool_stop = 0;
 
-  double y = x[0];
-  for (i = 1; i < n; i++)
-    if (x[i] < y)
-      y = x[i];
-
-  return y;
-}
-
-// computes the min of x
-double arr_min_i(int x[], int n)
-{
-  int i;
+static int num_threads_setting = 0;        // from set_num_threads() (0 = default)
+static int num_threads_default = 1;
+static pthread_once_t num_threads_once = PTHREAD_ONCE_INIT;
 
-  int y = x[0];
-  for (i = 1; i < n; i++)
-    if (x[i] < y)
-      y = x[i];
+static parallel_executor_t parallel_executor = NULL;
+static void *parallel_executor_data = NULL;
 
-  return y;
-}
 
-// computes the masked min of x
-double arr_min_masked(double x[], int mask[], int n)
+static void num_threads_init()
 {
-  int i;
-
-  for (i = 0; i < n; i++)
-    if (mask[i])
-      break;
-  if (i==n)
-    return NAN;
-
-  double y = x[i++];
-  for (; i < n; i++)
-    if (mask[i] && (x[i] < y))
-      y = x[i];
-
-  return y;
+  char *s = getenv("BINGHAM_NUM_THREADS");
+  if (s && atoi(s) > 0) {
+    num_threads_default = MIN(atoi(s), PARALLEL_MAX_THREADS);
+    return;
+  }
+#ifndef HAVE_WINDOWS
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  num_threads_default = (n > 0 ? MIN(n, 64) : 1);
+#endif
 }
 
-// computes the masked min of x
-float arr_minf_masked(float x[], int mask[], int n)
-{
-  int i;
-
-  for (i = 0; i < n; i++)
-    if (mask[i])
-      break;
-  if (i==n)
-    return NAN;
 
-  float y = x[i++];
-  for (; i < n; i++)
-    if (mask[i] && (x[i] < y))
-      y = x[i];
+// get the number of threads to use for parallel_for()
+int get_num_threads()
+{
+  if (num_threads_setting > 0)
+    return num_threads_setting;
 
-  return y;
+  pthread_once(&num_threads_once, num_threads_init);
+  return num_threads_default;
 }
 
-// returns the index of the max of x
-int find_max(double x[], int n)
+
+// remove a job from the queue (must be called with pool_mutex locked)
+static void pool_dequeue(parallel_job_t *job)
 {
-  int i;
-  int idx = 0;
-  for (i = 1; i < n; i++)
-    if (x[i] > x[idx])
-      idx = i;
-  return idx;
+  parallel_job_t **p;
+  for (p = &pool_queue; *p; p = &(*p)->next) {
+    if (*p == job) {
+      *p = job->next;
+      return;
+    }
+  }
 }
 
-// returns the index of the min of x
-int find_min(double x[], int n)
+// start the next task of a job (must be called with pool_mutex locked)
+static int pool_next_task(parallel_job_t *job)
 {
-  int i;
-  int idx = 0;
-  for (i = 1; i < n; i++)
-    if (x[i] < x[idx])
-      idx = i;
-  return idx;
+  int i = job->next_task++;
+  if (job->next_task == job->num_tasks)
+    pool_dequeue(job);
+  return i;
 }
 
-// computes the sum of x's elements
-int isum(int x[], int n)
+// finish a task of a job (must be called with pool_mutex locked)
+static void pool_task_done(parallel_job_t *job)
 {
-  int i;
-  int y = 0;
-  for (i = 0; i < n; i++)
-    y += x[i];
-  return y;
+  if (++job->num_done == job->num_tasks)
+    pthread_cond_broadcast(&pool_done_cond);
 }
 
-// computes the max of x
-int imax(int x[], int n)
+static void *pool_worker(void *ptr)
 {
-  int i;
-
-  int y = x[0];
-  for (i = 1; i < n; i++)
-    if (x[i] > y)
-      y = x[i];
+  pthread_mutex_lock(&pool_mutex);
+  while (1) {
+    while (pool_queue == NULL && !pool_stop)
+      pthread_cond_wait(&pool_work_cond, &pool_mutex);
+    if (pool_stop)
+      break;
+    parallel_job_t *job = pool_queue;
+    int i = pool_next_task(job);
+    pthread_mutex_unlock(&pool_mutex);
+    job->task(i, job->arg);
+    pthread_mutex_lock(&pool_mutex);
+    pool_task_done(job);
+  }
+  pthread_mutex_unlock(&pool_mutex);
 
-  return y;
+  return NULL;
 }
 
-
-// computes the min of x
-int imin(int x[], int n)
+// start the worker threads (must be called with pool_mutex locked)
+static void pool_start()
 {
-  int i;
-
-  int y = x[0];
-  for (i = 1; i < n; i++)
-    if (x[i] < y)
-      y = x[i];
+  int i, n = get_num_threads() - 1;  // the calling threads do their share of the work
+  pool_started = 1;
+  pool_size = 0;
+  if (n <= 0)
+    return;
 
-  return y;
+  safe_malloc(pool_threads, n, pthread_t);
+  for (i = 0; i < n; i++)
+    if (pthread_create(&pool_threads[pool_size], NULL, pool_worker, NULL) == 0)
+      pool_size++;
 }
 
-
-// computes the norm of x
-double norm(double x[], int n)
+// stop and join the worker threads (the pool is restarted on the next parallel call)
+static void pool_shutdown()
 {
-  double d = 0.0;
   int i;
+  pthread_mutex_lock(&pool_mutex);
+  pthread_t *threads = pool_threads;
+  int n = pool_size;
+  pool_stop = 1;
+  pthread_cond_broadcast(&pool_work_cond);
+  pthread_mutex_unlock(&pool_mutex);
 
   for (i = 0; i < n; i++)
-    d += x[i]*x[i];
+    pthread_join(threads[i], NULL);
 
-  return sqrt(d);
+  pthread_mutex_lock(&pool_mutex);
+  free(pool_threads);
+  pool_threads = NULL;
+  pool_size = 0;
+  pool_started = 0;
+  pool_stop = 0;
+  pthread_mutex_unlock(&pool_mutex);
 }
 
-// computes the norm of x-y
-double dist(double x[], double y[], int n)
+// run task(i, arg) for i in [0, num_tasks) on the thread pool, and wait for them all to finish
+static void pool_run(int num_tasks, void (*task)(int i, void *arg), void *arg)
 {
-  double d = 0.0;
+  parallel_job_t job = {task, arg, num_tasks, 0, 0, NULL};
+  parallel_job_t **p;
   int i;
 
-  for (i = 0; i < n; i++)
-    d += (x[i]-y[i])*(x[i]-y[i]);
-
-  return sqrt(d);
-}
+  pthread_mutex_lock(&pool_mutex);
 
+  if (!pool_started)
+    pool_start();
 
-// computes the norm^2 of x-y
-double dist2(double x[], double y[], int n)
-{
-  double d = 0.0;
-  int i;
+  for (p = &pool_queue; *p; p = &(*p)->next);
+  *p = &job;
+  for (i = 0; i < MIN(num_tasks - 1, pool_size); i++)
+    pthread_cond_signal(&pool_work_cond);
 
-  for (i = 0; i < n; i++)
-    d += (x[i]-y[i])*(x[i]-y[i]);
+  // work on our own job (only), so that nested jobs always make progress
+  while (job.next_task < job.num_tasks) {
+    i = pool_next_task(&job);
+    pthread_mutex_unlock(&pool_mutex);
+    task(i, arg);
+    pthread_mutex_lock(&pool_mutex);
+    pool_task_done(&job);
+  }
+  while (job.num_done < job.num_tasks)
+    pthread_cond_wait(&pool_done_cond, &pool_mutex);
 
-  return d;
+  pthread_mutex_unlock(&pool_mutex);
 }
 
 
-// computes the dot product of z and y
-double dot(double x[], double y[], int n)
+/*
+ * Set the number of threads used by parallel_for() and parallel_reduce(), including the calling
+ * thread.  If n <= 0, the default is used:  $BINGHAM_NUM_THREADS, or else the number of cores.
+ * Must not be called while parallel work is running.
+ */
+void set_num_threads(int n)
 {
-  int i;
-  double z = 0.0;
-  for (i = 0; i < n; i++)
-    z += x[i]*y[i];
-  return z;
+  num_threads_setting = (n > 0 ? MIN(n, PARALLEL_MAX_THREADS) : 0);
+  pool_shutdown();
 }
 
 
-//computes the cross product of x and y
-void cross(double z[3], double x[3], double y[3])
+/*
+ * Run parallel work on a caller-provided executor, which must call task(i, arg) exactly once
+ * for each i in [0, num_tasks) (on any threads, in any order), and return when they're all done.
+ * Tasks may themselves submit parallel work.  The number of tasks per job is still limited by
+ * get_num_threads().  Set executor to NULL to go back to the built-in thread pool.
+ */
+void set_parallel_executor(parallel_executor_t executor, void *executor_data)
 {
-  z[0] = x[1]*y[2] - x[2]*y[1];
-  z[1] = x[2]*y[0] - x[0]*y[2];
-  z[2] = x[0]*y[1] - x[1]*y[0];
+  pthread_mutex_lock(&pool_mutex);
+  parallel_executor = executor;
+  parallel_executor_data = executor_data;
+  pthread_mutex_unlock(&pool_mutex);
 }
 
-void cross4d(double w[4], double x[4], double y[4], double z[4]) {
-  double **V = new_matrix2(4, 3);
-  int i;
-  for (i = 0; i < 4; ++i) {
-    V[i][0] = x[i];
-    V[i][1] = y[1];
-    V[i][2] = z[i];
-  }
-  double **W = new_matrix2(3, 3);
-  int indices[4][3] = {{2, 3, 4}, {1, 3, 4}, {1, 2, 4}, {1, 2, 3}};
-  int cut_axis = 0;
-  double dmax = 0;
-  for (i = 0; i < 4; ++i) {
-    reorder_rows(W, V, indices[i], 3, 3);
-    double tmp = fabs(det(W, 3));
-    if (dmax < tmp) {
-      dmax = tmp;
-      cut_axis = i;
-    }    
-  }
-  double *c0 = V[cut_axis];
-  int uncut_axis[3];
-  for (i = 0; i < cut_axis; ++i) {
-    uncut_axis[i] = i;
-    w[i] = 0;
-  }
-  for (i = cut_axis + 1; i < 4; ++i) {
-    uncut_axis[i-1] = i;
-    w[i] = 0;
-  }
-  w[cut_axis] = 1;
-  reorder_rows(W, V, uncut_axis, 3, 3);
-  inv(W, W, 3);
-  mult(c0, c0, -1, 3);
-  
-  double tmp[3];
-  matrix_vec_mult(tmp, W, c0, 3, 3); 
-  for (i = 0; i < 3; ++i) {
-    w[uncut_axis[i]] = tmp[i];
-  }
-  free_matrix2(V);
-  free_matrix2(W);
-}
 
-// adds two vectors, z = x+y
-void add(double z[], double x[], double y[], int n)
+static void parallel_run(int num_tasks, void (*task)(int i, void *arg), void *arg)
 {
-  int i;
-  for (i = 0; i < n; i++)
-    z[i] = x[i] + y[i];
+  pthread_mutex_lock(&pool_mutex);
+  parallel_executor_t executor = parallel_executor;
+  void *executor_data = parallel_executor_data;
+  pthread_mutex_unlock(&pool_mutex);
+
+  if (executor)
+    executor(num_tasks, task, arg, executor_data);
+  else
+    pool_run(num_tasks, task, arg);
 }
 
 
-// subtracts two vectors, z = x-y
-void sub(double z[], double x[], double y[], int n)
+typedef struct {
+  void (*f)(int, int, void *);              // parallel_for() body
+  void (*f_reduce)(int, int, void *, void *);  // parallel_reduce() body
+  void *data;
+  char *partials;                           // parallel_reduce() partial results, one per block
+  size_t partial_size;
+  int n;
+  int num_blocks;
+  pthread_t owner;                          // the calling thread
+  const trace_path_t *trace_path;           // scope path of the calling thread (or NULL)
+} parallel_for_job_t;
+
+static void parallel_for_task(int b, void *arg)
 {
-  int i;
-  for (i = 0; i < n; i++)
-    z[i] = x[i] - y[i];
-}
+  parallel_for_job_t *job = (parallel_for_job_t *)arg;
+  int i0 = (int)((long)job->n*b / job->num_blocks);
+  int i1 = (int)((long)job->n*(b+1) / job->num_blocks);
 
+  // tasks on other threads trace their scopes under the caller's current scope
+  trace_saved_path_t saved;
+  int inherit_path = (job->trace_path && !pthread_equal(pthread_self(), job->owner));
+  if (inherit_path)
+    trace_enter_path(&saved, job->trace_path);
 
-// multiplies a vector by a scalar, y = c*x
-void mult(double y[], double x[], double c, int n)
-{
-  int i;
-  for (i = 0; i < n; i++)
-    y[i] = c*x[i];
+  if (job->f_reduce)
+    job->f_reduce(i0, i1, job->partials + b*job->partial_size, job->data);
+  else
+    job->f(i0, i1, job->data);
+
+  if (inherit_path)
+    trace_leave_path(&saved);
 }
 
-// computes the cumulative sum of x
-void cumsum(double y[], double x[], int n)
+static int parallel_num_blocks(int n, int grain)
 {
-  int i;
-  double c = 0;
-  for (i = 0; i < n; i++) {
-    c += x[i];
-    y[i] = c;
-  }
+  grain = MAX(grain, 1);
+  return (int)MIN((long)get_num_threads(), ((long)n + grain - 1) / grain);
 }
 
-// takes absolute value element-wise
-void vec_func(double y[], double x[], double n, double (*f)(double)) {
-  int i;
-  for (i = 0; i < n; ++i) {
-    y[i] = (*f)(x[i]);
+static void parallel_for_run(parallel_for_job_t *job)
+{
+  trace_path_t trace_path;
+  job->owner = pthread_self();
+  job->trace_path = NULL;
+  if (trace_state > 0) {
+    trace_get_path(&trace_path);
+    job->trace_path = &trace_path;
   }
-}
 
-// sets y = x/norm(x)
-void normalize(double y[], double x[], int n)
-{
-  double d = norm(x, n);
-  int i;
-  for (i = 0; i < n; i++)
-    y[i] = x[i]/d;
+  parallel_run(job->num_blocks, parallel_for_task, job);
 }
 
 
-// sets y = x/sum(x)
-void normalize_pmf(double y[], double x[], int n)
+// call f(i0, i1, data) on blocks of [0,n) of at least grain items, in parallel (f must be thread-safe)
+void parallel_for_grain(int n, int grain, void (*f)(int i0, int i1, void *data), void *data)
 {
-  double d = sum(x, n);
-  int i;
-  for (i = 0; i < n; i++)
-    y[i] = x[i]/d;
-}
+  int num_blocks = parallel_num_blocks(n, grain);
 
+  if (num_blocks <= 1) {
+    if (n > 0)
+      f(0, n, data);
+    return;
+  }
 
-// multiplies two vectors, z = x.*y
-void vmult(double z[], double x[], double y[], int n)
-{
-  int i;
-  for (i = 0; i < n; i++)
-    z[i] = x[i]*y[i];
+  parallel_for_job_t job = {f, NULL, data, NULL, 0, n, num_blocks};
+  parallel_for_run(&job);
 }
 
 
-// averages two vectors, z = (x+y)/2
-void avg(double z[], double x[], double y[], int n)
+// call f(i0, i1, data) on blocks of [0,n) in parallel (f must be safe to call from multiple threads)
+void parallel_for(int n, void (*f)(int i0, int i1, void *data), void *data)
 {
-  add(z, x, y, n);
-  mult(z, z, .5, n);
+  parallel_for_grain(n, PARALLEL_MIN_BLOCK_SIZE, f, data);
 }
 
 
-// averages two vectors, z = w*x+(1-w)*y
-void wavg(double z[], double x[], double y[], double w, int n)
+/*
+ * Parallel reduction over [0,n).  Each block's partial result starts as a copy of *result (which
+ * must hold the identity of the reduction), f(i0, i1, partial, data) accumulates block [i0,i1) into
+ * its partial result, and combine(result, partial, data) then folds the partial results into
+ * *result in block order, so the result only depends on the number of threads, not on scheduling.
+ */
+void parallel_reduce(int n, void (*f)(int i0, int i1, void *partial, void *data),
+		     void (*combine)(void *result, const void *partial, void *data),
+		     void *result, size_t result_size, void *data)
 {
-  int i;
-  for (i = 0; i < n; i++)
-    z[i] = w*x[i] + (1-w)*y[i];
-}
+  int i, num_blocks = parallel_num_blocks(n, PARALLEL_MIN_BLOCK_SIZE);
 
+  if (num_blocks <= 1) {
+    if (n > 0)
+      f(0, n, result, data);
+    return;
+  }
 
-// averages three vectors, y = (x1+x2+x3)/3
-void avg3(double y[], double x1[], double x2[], double x3[], int n)
-{
-  add(y, x1, x2, n);
-  add(y, y, x3, n);
-  mult(y, y, 1/3.0, n);
+  char *partials;
+  safe_malloc(partials, num_blocks*result_size, char);
+  for (i = 0; i < num_blocks; i++)
+    memcpy(partials + i*result_size, result, result_size);
+
+  parallel_for_job_t job = {NULL, f, data, partials, result_size, n, num_blocks};
+  parallel_for_run(&job);
+
+  memcpy(result, partials, result_size);
+  for (i = 1; i < num_blocks; i++)
+    combine(result, partials + i*result_size, data);
+
+  free(partials);
 }
 
 
-// calculate the projection of x onto y
-void proj(double z[], double x[], double y[], int n)
+// returns a pointer to the nth word (starting from 0) in string s
+char *sword(char *s, const char *delim, int n)
 {
-  double u[n];  // y's unit vector
-  double d = norm(y, n);
-  mult(u, y, 1/d, n);
-  mult(z, u, dot(x,u,n), n);
+  if (s == NULL)
+    return NULL;
+
+  s += strspn(s, delim);  // skip over initial delimeters
+
+  int i;
+  for (i = 0; i < n; i++) {
+    s += strcspn(s, delim);  // skip over word
+    s += strspn(s, delim);  // skip over delimeters
+  }
+
+  return s;
 }
 
 
-// binary search to find i s.t. A[i-1] <= x < A[i]
-int binary_search(double x, double *A, int n)
+// splits a string into k words
+char **split(char *s, const char *delim, int *k)
 {
-  int i0 = 0;
-  int i1 = n-1;
-  int i;
+  char *sbuf = s + strspn(s, delim);  // skip over initial whitespace
+  s = sbuf;
 
-  while (i0 <= i1) {
-    i = (i0 + i1) / 2;
-    if (x > A[i])
-      i0 = i + 1;
-    else if (i > 0 && x < A[i-1])
-      i1 = i-1;
-    else
-      break;
+  // determine the number of words
+  int num_words = 0;
+  while (*s != '\0') {
+    s = sword(s, delim, 1);
+    num_words++;
   }
 
-  if (i0 <= i1)
-    return i;
+  // fill in the words
+  int i;
+  s = sbuf;
+  char **words;
+  safe_calloc(words, num_words, char *);
+  for (i = 0; i < num_words; i++) {
+    int slen = strcspn(s, delim);  // add "\n" ?
+    safe_calloc(words[i], slen+1, char);  // +1 to null-terminate the string
+    strncpy(words[i], s, slen);
+    s = sword(s, delim, 1);
+  }
 
-  return n-1;
+  *k = num_words;
+  return words;
 }
 
 
-// quaternion multiplication:  z = x*y
-void quaternion_mult(double z[4], double x[4], double y[4])
+// compare the first word of s1 with the first word of s2
+int wordcmp(char *s1, char *s2, const char *delim)
 {
-  double a = x[0];
-  double b = x[1];
-  double c = x[2];
-  double d = x[3];
-  double y0 = y[0];
-  double y1 = y[1];
-  double y2 = y[2];
-  double y3 = y[3];
+  int n1 = strcspn(s1, delim);
+  int n2 = strcspn(s2, delim);
 
-  z[0] = a*y0 - b*y1 - c*y2 - d*y3;
-  z[1] = b*y0 + a*y1 - d*y2 + c*y3;
-  z[2] = c*y0 + d*y1 + a*y2 - b*y3;
-  z[3] = d*y0 - c*y1 + b*y2 + a*y3;
+  if (n1 < n2)
+    return -1;
+  else if (n1 > n2)
+    return 1;
+
+  return strncmp(s1, s2, n1);
 }
 
 
-// invert a quaternion
-void quaternion_inverse(double q_inv[4], double q[4])
+// replace a word in a string array
+void replace_word(char **words, int num_words, const char *from, const char *to)
 {
-  q_inv[0] = q[0];
-  q_inv[1] = -q[1];
-  q_inv[2] = -q[2];
-  q_inv[3] = -q[3];
+  int i;
+  for (i = 0; i < num_words; i++) {
+    if (!strcmp(words[i], from)) {
+      safe_realloc(words[i], strlen(to)+1, char);
+      strcpy(words[i], to);
+    }
+  }
 }
 
 
-// convert a rotation matrix to a unit quaternion
-void rotation_matrix_to_quaternion(double *q, double **R)
+static double lfact_table[MAXFACT];
+static pthread_once_t lfact_once = PTHREAD_ONCE_INIT;
+
+static void lfact_init()
 {
-  double S;
-  double tr = R[0][0] + R[1][1] + R[2][2];
-  if (tr > 0) {
-    S = sqrt(tr+1.0) * 2;  // S=4*qw
-    q[0] = 0.25 * S;
-    q[1] = (R[2][1] - R[1][2]) / S;
-    q[2] = (R[0][2] - R[2][0]) / S;
-    q[3] = (R[1][0] - R[0][1]) / S;
-  }
-  else if ((R[0][0] > R[1][1]) && (R[0][0] > R[2][2])) {
-    S = sqrt(1.0 + R[0][0] - R[1][1] - R[2][2]) * 2;  // S=4*qx 
-    q[0] = (R[2][1] - R[1][2]) / S;
-    q[1] = 0.25 * S;
-    q[2] = (R[0][1] + R[1][0]) / S; 
-    q[3] = (R[0][2] + R[2][0]) / S; 
-  }
-  else if (R[1][1] > R[2][2]) {
-    S = sqrt(1.0 + R[1][1] - R[0][0] - R[2][2]) * 2;  // S=4*qy
-    q[0] = (R[0][2] - R[2][0]) / S;
-    q[1] = (R[0][1] + R[1][0]) / S; 
-    q[2] = 0.25 * S;
-    q[3] = (R[1][2] + R[2][1]) / S; 
-  }
-  else {
-    S = sqrt(1.0 + R[2][2] - R[0][0] - R[1][1]) * 2;  // S=4*qz
-    q[0] = (R[1][0] - R[0][1]) / S;
-    q[1] = (R[0][2] + R[2][0]) / S;
-    q[2] = (R[1][2] + R[2][1]) / S;
-    q[3] = 0.25 * S;
-  }
+  int i;
+  lfact_table[0] = 0;
+  for (i = 1; i < MAXFACT; i++)
+    lfact_table[i] = log(i) + lfact_table[i-1];
+}
 
-  normalize(q, q, 4);
+// computes the log factorial of x
+double lfact(int x)
+{
+  pthread_once(&lfact_once, lfact_init);
+  return lfact_table[x];
 }
 
 
-// convert a unit quaternion to a rotation matrix
-void quaternion_to_rotation_matrix(double **R, double *q)
+// computes the factorial of x
+double fact(int x)
 {
-  double a = q[0];
-  double b = q[1];
-  double c = q[2];
-  double d = q[3];
-
-  R[0][0] = a*a + b*b - c*c - d*d;
-  R[0][1] = 2*b*c - 2*a*d;
-  R[0][2] = 2*b*d + 2*a*c;
-  R[1][0] = 2*b*c + 2*a*d;
-  R[1][1] = a*a - b*b + c*c - d*d;
-  R[1][2] = 2*c*d - 2*a*b;
-  R[2][0] = 2*b*d - 2*a*c;
-  R[2][1] = 2*c*d + 2*a*b;
-  R[2][2] = a*a - b*b - c*c + d*d;
+  return exp(lfact(x));
 }
 
-int find_first_non_zero(double *v, int n)
+
+// computes the surface area of a unit sphere with dimension d
+double surface_area_sphere(int d)
 {
-  int i;
-  for (i = 0; i < n; ++i) {
-    if (v[i] != 0.)
-      return i;
+  switch(d) {
+  case 0:
+    return 2;
+  case 1:
+    return 2*M_PI;
+  case 2:
+    return 4*M_PI;
+  case 3:
+    return 2*M_PI*M_PI;
   }
-  return -1;
+
+  return (2*M_PI/((double)d-1))*surface_area_sphere(d-2);
 }
 
-int find_first_lt(double *x, double a, int n)
+
+// logical not of a binary array
+void vnot(int y[], int x[], int n)
 {
   int i;
-  for (i = 0; i < n; ++i)
-    if (x[i] < a)
-      break;
-  return i;
+  for (i = 0; i < n; i++)
+    y[i] = !x[i];
 }
 
-int find_first_gt(double *x, double a, int n)
+
+// count the non-zero elements of x
+int count(int x[], int n)
 {
   int i;
-  for (i = 0; i < n; ++i)
-    if (x[i] > a)
-      break;
-  return i;
-}
+  int cnt = 0;
+  for (i = 0; i < n; i++)
+    if (x[i] != 0)
+      cnt++;
 
-/*
-short *ismember(double *A, double *B, int n, int m) {
-  short *C;
-  safe_calloc(C, n, short);
-  int i, j;
-  // NOTE(sanja): this can be done in O(n log n + m) if necessary. Also, SSE2-able :)
-  for (i = 0; i < n; ++i) {
-    for (j = 0; j < m; ++j) {
-      if (double_is_equal(A[i], B[j])) {
-	C[i] = 1;
-	break;
-      }
-    }
-  }
-  return C;
+  return cnt;
 }
 
-short *ismemberi(int *A, int *B, int n, int m) {
-  short *C;
-  safe_calloc(C, n, short);
-  int i, j;
-  // NOTE(sanja): this can be done in O(n log n + m) if necessary. Also, SSE2-able :)
-  for (i = 0; i < n; ++i) {
-    for (j = 0; j < m; ++j) {
-      if (A[i] == B[j]) {
-	C[i] = 1;
-	break;
-      }
-    }
-  }
-  return C;
-}
-*/
 
-// check if y contains x
-int ismemberi(int x, int *y, int n)
+// returns a dense array of the indices of x's non-zero elements
+int find(int *k, int x[], int n)
 {
   int i;
-  for (i = 0; i < n; ++i)
-    if (x == y[i])
-      return 1;
-  return 0;
+  int cnt = 0;
+  for (i = 0; i < n; i++)
+    if (x[i] != 0)
+      k[cnt++] = i;
+  return cnt;
 }
 
-// reverses an array of doubles (safe for x==y)
-void reverse(double *y, double *x, int n)
+
+// returns a sparse array of the indices of x's non-zero elements
+int findinv(int *k, int x[], int n)
 {
   int i;
-  for (i = 0; i < n/2; i++) {
-    double tmp = x[i];
-    y[i] = x[n-i-1];
-    y[n-i-1] = tmp;
-  }
+  int cnt = 0;
+  for (i = 0; i < n; i++)
+    if (x[i] != 0)
+      k[i] = cnt++;
+  return cnt;
 }
 
-// reverses an array of ints (safe for x==y)
-void reversei(int *y, int *x, int n)
+
+// computes a dense array of the indices of x==a
+int findeq(int *k, int x[], int a, int n)
 {
   int i;
-  for (i = 0; i < n/2; i++) {
-    int tmp = x[i];
-    y[i] = x[n-i-1];
-    y[n-i-1] = tmp;
+  int cnt = 0;
+  if (k != NULL) {
+    for (i = 0; i < n; i++) {
+      if (x[i] == a)
+	k[cnt++] = i;
+    }
   }
+  else
+    for (i = 0; i < n; i++)
+      if (x[i] == a)
+	cnt++;
+  return cnt;
 }
 
-// reorder an array of doubles (safe for x==y)
-void reorder(double *y, double *x, int *idx, int n)
+
+// computes the sum of x's elements
+double sum(double x[], int n)
 {
   int i;
-  double *y2 = y;
-  if (x==y)
-    safe_calloc(y2, n, double);
+  double y = 0;
   for (i = 0; i < n; i++)
-    y2[i] = x[idx[i]];
-  if (x==y) {
-    memcpy(y, y2, n*sizeof(double));
-    free(y2);
-  }
+    y += x[i];
+  return y;
 }
 
-// reorder an array of ints (safe for x==y)
-void reorderi(int *y, int *x, int *idx, int n)
+// computes the product of x's elements
+double prod(double x[], int n)
 {
   int i;
-  int *y2 = y;
-  if (x==y)
-    safe_calloc(y2, n, int);
+  double y = 1;
   for (i = 0; i < n; i++)
-    y2[i] = x[idx[i]];
-  if (x==y) {
-    memcpy(y, y2, n*sizeof(int));
-    free(y2);
-  }
+    y *= x[i];
+  return y;
 }
 
-// add an element to the front of a list
-ilist_t *ilist_add(ilist_t *x, int a)
+
+// computes the max of x
+double arr_max(double x[], int n)
 {
-  ilist_t *head;
-  safe_malloc(head, 1, ilist_t);
-  head->x = a;
-  head->next = x;
-  head->len = (x ? 1 + x->len : 1);
+  int i;
 
-  return head;
-}
+  double y = x[0];
+  for (i = 1; i < n; i++)
+    if (x[i] > y)
+      y = x[i];
 
+  return y;
+}
 
-// check if a list contains an element
-int ilist_contains(ilist_t *x, int a)
+// computes the max of x
+double arr_max_i(int x[], int n)
 {
-  if (!x)
-    return 0;
+  int i;
 
-  ilist_t *tmp;
-  for (tmp = x; tmp; tmp = tmp->next)
-    if (tmp->x == a)
-      return 1;
-  return 0;
-}
+  int y = x[0];
+  for (i = 1; i < n; i++)
+    if (x[i] > y)
+      y = x[i];
 
+  return y;
+}
 
-// find the index of an element in a list (or -1 if not found)
-int ilist_find(ilist_t *x, int a)
+// computes the masked max of x
+double arr_max_masked(double x[], int mask[], int n)
 {
-  int i = 0;
-  ilist_t *tmp;
-  for (tmp = x; tmp; tmp = tmp->next) {
-    if (tmp->x == a)
-      return i;
-    i++;
-  }
+  int i;
 
-  return -1;
-}
+  for (i = 0; i < n; i++)
+    if (mask[i])
+      break;
+  if (i==n)
+    return NAN;
 
+  double y = x[i++];
+  for (; i < n; i++)
+    if (mask[i] && (x[i] > y))
+      y = x[i];
 
-// free a list
-void ilist_free(ilist_t *x)
-{
-  ilist_t *tmp, *tmp2;
-  tmp = x;
-  while (tmp) {
-    tmp2 = tmp->next;
-    free(tmp);
-    tmp = tmp2;
-  }  
+  return y;
 }
 
-
-static void init_rand()
+// computes the masked max of x
+float arr_maxf_masked(float x[], int mask[], int n)
 {
-  static int first = 1;
-  if (first) {
-    first = 0;
-    int seed = time(NULL); 
-    //    seed = 1371836140;
-    //int seed = 1368560954; <-- Crashes straw bowl on 3/9
-    //1368457226; <--- Shows overlap on 5/3
-    printf("********* seed = %d\n", seed);
-    srand (seed);
-  }
-}
+  int i;
 
+  for (i = 0; i < n; i++)
+    if (mask[i])
+      break;
+  if (i==n)
+    return NAN;
 
-// returns a random int between 0 and n-1
-int irand(int n)
-{
-  init_rand();
+  float y = x[i++];
+  for (; i < n; i++)
+    if (mask[i] && (x[i] > y))
+      y = x[i];
 
-  if (n < 0)
-    printf("Negative n: %d\n", n);
-  return rand() % n;
+  return y;
 }
 
-
-// returns a random double in [0,1]
-double frand()
+// computes the min of x
+double arr_min(double x[], int n)
 {
-  init_rand();
+  int i;
 
-  return fabs(rand()) / (double)RAND_MAX;
-}
+  double y = x[0];
+  for (i = 1; i < n; i++)
+    if (x[i] < y)
+      y = x[i];
 
+  return y;
+}
 
-// samples d integers from 0:n-1 uniformly without replacement
-void randperm(int *x, int n, int d)
+// computes the min of x
+double arr_min_i(int x[], int n)
 {
-  init_rand();
-
   int i;
 
-  if (d > n) {
-    fprintf(stderr, "Error: d > n in randperm()\n");
-    return;
-  }
-  
-  // sample a random starting point
-  int i0 = rand() % n;
-
-  // use a random prime step to cycle through x
-  static const int big_primes[100] = {996311, 163573, 481123, 187219, 963323, 103769, 786979, 826363, 874891, 168991, 442501, 318679, 810377, 471073, 914519, 251059, 321983, 220009, 211877, 875339, 605603, 578483, 219619, 860089, 644911, 398819, 544927, 444043, 161717, 301447, 201329, 252731, 301463, 458207, 140053, 906713, 946487, 524389, 522857, 387151, 904283, 415213, 191047, 791543, 433337, 302989, 445853, 178859, 208499, 943589, 957331, 601291, 148439, 296801, 400657, 829637, 112337, 134707, 240047, 669667, 746287, 668243, 488329, 575611, 350219, 758449, 257053, 704287, 252283, 414539, 647771, 791201, 166031, 931313, 787021, 520529, 474667, 484361, 358907, 540271, 542251, 825829, 804709, 664843, 423347, 820367, 562577, 398347, 940349, 880603, 578267, 644783, 611833, 273001, 354329, 506101, 292837, 851017, 262103, 288989};
-
-  int step = big_primes[rand() % 100];
-
-  int idx = i0;
-  for (i = 0; i < d; i++) {
-    x[i] = idx;
-    idx = (idx + step) % n;
-  }
+  int y = x[0];
+  for (i = 1; i < n; i++)
+    if (x[i] < y)
+      y = x[i];
 
-  /*
-  if (d > 2*sqrt(n*log(n))) {
-    double r[n];
-    int idx[n];
-    for (i = 0; i < n; i++)
-      r[i] = frand();
-    sort_indices(r, idx, n);
-    memcpy(x, idx, d*sizeof(int));
-  }
-  else {
-    for (i = 0; i < d; i++) {
-      while (1) {
-	x[i] = rand() % n;
-	for (j = 0; j < i; j++)
-	  if (x[j] == x[i])
-	    break;
-	if (j == i)  // x[i] is unique
-	  break;
-      }
-    }
-  }
-  */
+  return y;
 }
 
-// approximation to the inverse error function
-double erfinv(double x)
+// computes the masked min of x
+double arr_min_masked(double x[], int mask[], int n)
 {
-  if (x < 0)
-    return -erfinv(-x);
+  int i;
 
-  double a = .147;
+  for (i = 0; i < n; i++)
+    if (mask[i])
+      break;
+  if (i==n)
+    return NAN;
 
-  double y1 = (2/(M_PI*a) + log(1-x*x)/2.0);
-  double y2 = sqrt(y1*y1 - (1/a)*log(1-x*x));
-  double y3 = sqrt(y2 - y1);
-  
-  return y3;
-}
+  double y = x[i++];
+  for (; i < n; i++)
+    if (mask[i] && (x[i] < y))
+      y = x[i];
 
+  return y;
+}
 
-// generate a random sample from a normal distribution
-double normrand(double mu, double sigma)
+// computes the masked min of x
+float arr_minf_masked(float x[], int mask[], int n)
 {
-  double u = frand();
-  
-  return mu + sigma*sqrt(2.0)*erfinv(2*u-1);
-}
+  int i;
 
+  for (i = 0; i < n; i++)
+    if (mask[i])
+      break;
+  if (i==n)
+    return NAN;
 
-// compute the pdf of a normal random variable
-double normpdf(double x, double mu, double sigma)
-{
-  double dx = x - mu;
+  float y = x[i++];
+  for (; i < n; i++)
+    if (mask[i] && (x[i] < y))
+      y = x[i];
 
-  return exp(-dx*dx / (2*sigma*sigma)) / (sqrt(2*M_PI) * sigma);
+  return y;
 }
 
-
-// samples from the probability mass function w with n elements
-int pmfrand(double *w, int n) {
-
+// returns the index of the max of x
+int find_max(double x[], int n)
+{
   int i;
-  double r = frand();
-  double wtot = 0;
-  for (i = 0; i < n; i++) {
-    wtot += w[i];
-    if (wtot >= r)
-      return i;
-  }
+  int idx = 0;
+  for (i = 1; i < n; i++)
+    if (x[i] > x[idx])
+      idx = i;
+  return idx;
+}
 
-  return 0;
+// returns the index of the min of x
+int find_min(double x[], int n)
+{
+  int i;
+  int idx = 0;
+  for (i = 1; i < n; i++)
+    if (x[i] < x[idx])
+      idx = i;
+  return idx;
 }
 
-// samples from the cumulative mass function w with n elements (much faster than pmfrand)
-int cmfrand(double *w, int n)
+// computes the sum of x's elements
+int isum(int x[], int n)
 {
-  double r = frand();
-  return binary_search(r, w, n);
+  int i;
+  int y = 0;
+  for (i = 0; i < n; i++)
+    y += x[i];
+  return y;
 }
 
-// sample from a multivariate normal
-void mvnrand(double *x, double *mu, double **S, int d)
+// computes the max of x
+int imax(int x[], int n)
 {
-  double z[d], **V = new_matrix2(d,d);
-  eigen_symm(z,V,S,d);
   int i;
-  for (i = 0; i < d; i++)
-    z[i] = sqrt(z[i]);
 
-  mvnrand_pcs(x,mu,z,V,d);
+  int y = x[0];
+  for (i = 1; i < n; i++)
+    if (x[i] > y)
+      y = x[i];
 
-  free_matrix2(V);
+  return y;
 }
 
-double mvnpdf(double *x, double *mu, double **S, int d)
-{
-  double **S_inv = new_matrix2(d,d);
-  inv(S_inv, S, d);
-  
-  double dx[d];
-  sub(dx, x, mu, d);
-  double S_inv_dx[d];
-  matrix_vec_mult(S_inv_dx, S_inv, dx, d, d);
-  double dm = dot(dx, S_inv_dx, d);
-
-  double p = exp(-.5*dm) / sqrt(pow(2*M_PI, d) * det(S,d));
 
-  free_matrix2(S_inv);
+// computes the min of x
+int imin(int x[], int n)
+{
+  int i;
 
-  return p;
+  int y = x[0];
+  for (i = 1; i < n; i++)
+    if (x[i] < y)
+      y = x[i];
 
+  return y;
 }
 
-/* compute a multivariate normal pdf
-double mvnpdf(double *x, double *mu, double **S, int d)
+
+// computes the norm of x
+double norm(double x[], int n)
 {
-  double z[d], **V = new_matrix2(d,d);
-  eigen_symm(z,V,S,d);
+  double d = 0.0;
   int i;
-  for (i = 0; i < d; i++)
-    z[i] = sqrt(z[i]);
 
-  printf("S = [%f %f %f; %f %f %f; %f %f %f]\n", S[0][0], S[0][1], S[0][2], S[1][0], S[1][1], S[1][2], S[2][0], S[2][1], S[2][2]); //dbug
-  printf("z = [%f, %f, %f]\n", z[0], z[1], z[2]); //dbug
-
-  double p = mvnpdf_pcs(x,mu,z,V,d);
+  for (i = 0; i < n; i++)
+    d += x[i]*x[i];
 
-  free_matrix2(V);
-  return p;
+  return sqrt(d);
 }
-*/
 
-// sample from a multivariate normal in principal components form
-void mvnrand_pcs(double *x, double *mu, double *z, double **V, int d)
+// computes the norm of x-y
+double dist(double x[], double y[], int n)
 {
+  double d = 0.0;
   int i;
-  double s, v[d];
 
-  memcpy(x, mu, d*sizeof(double));
+  for (i = 0; i < n; i++)
+    d += (x[i]-y[i])*(x[i]-y[i]);
 
-  for (i = 0; i < d; i++) {
-    s = normrand(0, z[i]);
-    mult(v, V[i], s, d);  // v = s*V[i]
-    add(x, x, v, d);      // x += v
-  }
+  return sqrt(d);
 }
 
 
-// compute a multivariate normal pdf in principal components form
-double mvnpdf_pcs(double *x, double *mu, double *z, double **V, int d)
+// computes the norm^2 of x-y
+double dist2(double x[], double y[], int n)
 {
+  double d = 0.0;
   int i;
-  double xv, dx[d];
-  sub(dx, x, mu, d);  // dx = x - mu
 
-  double logp = -(d/2)*log(2*M_PI) - log(prod(z,d));
-  for (i = 0; i < d; i++) {
-    xv = dot(dx, V[i], d) / z[i];
-    logp -= 0.5*xv*xv;
-  }
+  for (i = 0; i < n; i++)
+    d += (x[i]-y[i])*(x[i]-y[i]);
 
-  return exp(logp);
+  return d;
 }
 
 
-// sample from an angular central gaussian in principal components form
-void acgrand_pcs(double *x, double *z, double **V, int d)
+// computes the dot product of z and y
+double dot(double x[], double y[], int n)
 {
   int i;
-  double mu[d];
-  for (i = 0; i < d; i++)
-    mu[i] = 0;
-
-  mvnrand_pcs(x, mu, z, V, d);
-  normalize(x, x, d);
+  double z = 0.0;
+  for (i = 0; i < n; i++)
+    z += x[i]*y[i];
+  return z;
 }
 
 
-// compute an angular central gaussian pdf in principal components form
-double acgpdf_pcs(double *x, double *z, double **V, int d)
+//computes the cross product of x and y
+void cross(double z[3], double x[3], double y[3])
 {
+  z[0] = x[1]*y[2] - x[2]*y[1];
+  z[1] = x[2]*y[0] - x[0]*y[2];
+  z[2] = x[0]*y[1] - x[1]*y[0];
+}
+
+void cross4d(double w[4], double x[4], double y[4], double z[4]) {
+  double **V = new_matrix2(4, 3);
   int i;
-  double p = 1 / (prod(z,d) * surface_area_sphere(d-1));
-  double xv, md = 0;  // mahalanobis distance
-  for (i = 0; i < d; i++) {
-    xv = dot(x, V[i], d) / z[i];
-    md += xv*xv;
+  for (i = 0; i < 4; ++i) {
+    V[i][0] = x[i];
+    V[i][1] = y[1];
+    V[i][2] = z[i];
   }
-  p *= pow(md, -d/2);
+  double **W = new_matrix2(3, 3);
+  int indices[4][3] = {{2, 3, 4}, {1, 3, 4}, {1, 2, 4}, {1, 2, 3}};
+  int cut_axis = 0;
+  double dmax = 0;
+  for (i = 0; i < 4; ++i) {
+    reorder_rows(W, V, indices[i], 3, 3);
+    double tmp = fabs(det(W, 3));
+    if (dmax < tmp) {
+      dmax = tmp;
+      cut_axis = i;
+    }    
+  }
+  double *c0 = V[cut_axis];
+  int uncut_axis[3];
+  for (i = 0; i < cut_axis; ++i) {
+    uncut_axis[i] = i;
+    w[i] = 0;
+  }
+  for (i = cut_axis + 1; i < 4; ++i) {
+    uncut_axis[i-1] = i;
+    w[i] = 0;
+  }
+  w[cut_axis] = 1;
+  reorder_rows(W, V, uncut_axis, 3, 3);
+  inv(W, W, 3);
+  mult(c0, c0, -1, 3);
   
-  return p;
+  double tmp[3];
+  matrix_vec_mult(tmp, W, c0, 3, 3); 
+  for (i = 0; i < 3; ++i) {
+    w[uncut_axis[i]] = tmp[i];
+  }
+  free_matrix2(V);
+  free_matrix2(W);
 }
 
-
-// create a new n-by-m-by-p 3d matrix of doubles
-double ***new_matrix3(int n, int m, int p)
+// adds two vectors, z = x+y
+void add(double z[], double x[], double y[], int n)
 {
-  if (n*m*p == 0) return NULL;
   int i;
-  double **X2 = new_matrix2(n*m, p);
-  double ***X;
-  safe_malloc(X, n, double**);
   for (i = 0; i < n; i++)
-    X[i] = X2 + m*i;
-
-  return X;
+    z[i] = x[i] + y[i];
 }
 
-// free a 3d matrix
-void free_matrix3(double ***X)
-{
-  free_matrix2(X[0]);
-  free(X);
-}
 
-// create a new n-by-m-by-p 3d matrix of floats
-float ***new_matrix3f(int n, int m, int p)
+// subtracts two vectors, z = x-y
+void sub(double z[], double x[], double y[], int n)
 {
-  if (n*m*p == 0) return NULL;
   int i;
-  float **X2 = new_matrix2f(n*m, p);
-  float ***X;
-  safe_malloc(X, n, float**);
   for (i = 0; i < n; i++)
-    X[i] = X2 + m*i;
-
-  return X;
+    z[i] = x[i] - y[i];
 }
 
-// free a 3d matrix
-void free_matrix3f(float ***X)
-{
-  free_matrix2f(X[0]);
-  free(X);
-}
 
-// create a new n-by-m 2d matrix of doubles
-double **new_matrix2(int n, int m)
+// multiplies a vector by a scalar, y = c*x
+void mult(double y[], double x[], double c, int n)
 {
-  if (n*m == 0) return NULL;
   int i;
-  double *raw, **X;
-  safe_calloc(raw, n*m, double);
-  safe_malloc(X, n, double*);
-
   for (i = 0; i < n; i++)
-    X[i] = raw + m*i;
-
-  return X;
+    y[i] = c*x[i];
 }
 
-void add_rows_matrix2(double ***X, int n, int m, int new_n)
+// computes the cumulative sum of x
+void cumsum(double y[], double x[], int n)
 {
   int i;
-  double *raw = (*X)[0];
-  safe_realloc(raw, m * new_n, double);
-  safe_realloc(*X, new_n, double*);
-  for (i = 0; i < new_n; i++)
-    (*X)[i] = raw + m*i;
+  double c = 0;
+  for (i = 0; i < n; i++) {
+    c += x[i];
+    y[i] = c;
+  }
 }
 
-/*
-void resize_matrix2(double ***X, int n, int m, int n2, int m2)
-{
-  if (m2 == m)
-    add_rows_matrix2(X, n, m, n2);
-  else {
-    
+// takes absolute value element-wise
+void vec_func(double y[], double x[], double n, double (*f)(double)) {
+  int i;
+  for (i = 0; i < n; ++i) {
+    y[i] = (*f)(x[i]);
   }
 }
-*/
 
-// create a new n-by-m 2d matrix of floats
-float **new_matrix2f(int n, int m)
+// sets y = x/norm(x)
+void normalize(double y[], double x[], int n)
 {
-  if (n*m == 0) return NULL;
+  double d = norm(x, n);
   int i;
-  float *raw, **X;
-  safe_calloc(raw, n*m, float);
-  safe_malloc(X, n, float*);
-
   for (i = 0; i < n; i++)
-    X[i] = raw + m*i;
-
-  return X;
+    y[i] = x[i]/d;
 }
 
-// create a new n-by-m 2d matrix of ints
-int **new_matrix2i(int n, int m)
-{
-  if (n*m == 0) return NULL;
-  int i, *raw, **X;
-  safe_calloc(raw, n*m, int);
-  safe_malloc(X, n, int*);
 
+// sets y = x/sum(x)
+void normalize_pmf(double y[], double x[], int n)
+{
+  double d = sum(x, n);
+  int i;
   for (i = 0; i < n; i++)
-    X[i] = raw + m*i;
-
-  return X;
+    y[i] = x[i]/d;
 }
 
-// create a new n-by-m 2d matrix of doubles
-double **new_matrix2_data(int n, int m, double *data)
+
+// multiplies two vectors, z = x.*y
+void vmult(double z[], double x[], double y[], int n)
 {
-  double **X = new_matrix2(n,m);
-  memcpy(X[0], data, n*m*sizeof(double));
-  return X;
+  int i;
+  for (i = 0; i < n; i++)
+    z[i] = x[i]*y[i];
 }
 
-// create a new n-by-m 2d matrix of floats
-float **new_matrix2f_data(int n, int m, float *data)
+
+// averages two vectors, z = (x+y)/2
+void avg(double z[], double x[], double y[], int n)
 {
-  float **X = new_matrix2f(n,m);
-  memcpy(X[0], data, n*m*sizeof(float));
-  return X;
+  add(z, x, y, n);
+  mult(z, z, .5, n);
 }
 
-// create a new n-by-m 2d matrix of ints
-int **new_matrix2i_data(int n, int m, int *data)
+
+// averages two vectors, z = w*x+(1-w)*y
+void wavg(double z[], double x[], double y[], double w, int n)
 {
-  int **X = new_matrix2i(n,m);
-  memcpy(X[0], data, n*m*sizeof(int));
-  return X;
+  int i;
+  for (i = 0; i < n; i++)
+    z[i] = w*x[i] + (1-w)*y[i];
 }
 
-/*
-double **add_matrix_row(double **X, int n, int m)
-{
-  //printf("DANGER! Reallocating matrix rows is not tested yet!\n");
-  double *raw = X[0];
-  safe_realloc(raw, (n + 1) * m, double);
-  safe_realloc(X, n+1, double*);
-  X[n] = raw + m * n;
 
-  return X;
+// averages three vectors, y = (x1+x2+x3)/3
+void avg3(double y[], double x1[], double x2[], double x3[], int n)
+{
+  add(y, x1, x2, n);
+  add(y, y, x3, n);
+  mult(y, y, 1/3.0, n);
 }
-*/
 
-double **new_identity_matrix2(int n) {
-  double **mat = new_matrix2(n, n);
-  int i;
-  for (i = 0; i < n; ++i)
-    mat[i][i] = 1;
-  return mat;
-}
 
-int **new_identity_matrix2i(int n) {
-  int **mat = new_matrix2i(n, n);
-  int i;
-  for (i = 0; i < n; ++i)
-    mat[i][i] = 1;
-  return mat;
+// calculate the projection of x onto y
+void proj(double z[], double x[], double y[], int n)
+{
+  double u[n];  // y's unit vector
+  double d = norm(y, n);
+  mult(u, y, 1/d, n);
+  mult(z, u, dot(x,u,n), n);
 }
 
-double **new_diag_matrix2(double *diag, int n) {
-  double **mat = new_matrix2(n, n);
+
+// binary search to find i s.t. A[i-1] <= x < A[i]
+int binary_search(double x, double *A, int n)
+{
+  int i0 = 0;
+  int i1 = n-1;
   int i;
-  for (i = 0; i < n; ++i) {
-    mat[i][i] = diag[i];
+
+  while (i0 <= i1) {
+    i = (i0 + i1) / 2;
+    if (x > A[i])
+      i0 = i + 1;
+    else if (i > 0 && x < A[i-1])
+      i1 = i-1;
+    else
+      break;
   }
-  return mat;
+
+  if (i0 <= i1)
+    return i;
+
+  return n-1;
 }
 
-int **new_diag_matrix2i(int *diag, int n) {
-  int **mat = new_matrix2i(n, n);
-  int i;
-  for (i = 0; i < n; ++i) {
-    mat[i][i] = diag[i];
-  }
-  return mat;
+
+// quaternion multiplication:  z = x*y
+void quaternion_mult(double z[4], double x[4], double y[4])
+{
+  double a = x[0];
+  double b = x[1];
+  double c = x[2];
+  double d = x[3];
+  double y0 = y[0];
+  double y1 = y[1];
+  double y2 = y[2];
+  double y3 = y[3];
+
+  z[0] = a*y0 - b*y1 - c*y2 - d*y3;
+  z[1] = b*y0 + a*y1 - d*y2 + c*y3;
+  z[2] = c*y0 + d*y1 + a*y2 - b*y3;
+  z[3] = d*y0 - c*y1 + b*y2 + a*y3;
 }
 
-// free a 2d matrix of doubles
-void free_matrix2(double **X)
+
+// invert a quaternion
+void quaternion_inverse(double q_inv[4], double q[4])
 {
-  if (X == NULL) return;
-  free(X[0]);
-  free(X);
+  q_inv[0] = q[0];
+  q_inv[1] = -q[1];
+  q_inv[2] = -q[2];
+  q_inv[3] = -q[3];
 }
 
-// free a 2d matrix of floats
-void free_matrix2f(float **X)
+
+// convert a rotation matrix to a unit quaternion
+void rotation_matrix_to_quaternion(double *q, double **R)
 {
-  if (X == NULL) return;
-  free(X[0]);
-  free(X);
+  double S;
+  double tr = R[0][0] + R[1][1] + R[2][2];
+  if (tr > 0) {
+    S = sqrt(tr+1.0) * 2;  // S=4*qw
+    q[0] = 0.25 * S;
+    q[1] = (R[2][1] - R[1][2]) / S;
+    q[2] = (R[0][2] - R[2][0]) / S;
+    q[3] = (R[1][0] - R[0][1]) / S;
+  }
+  else if ((R[0][0] > R[1][1]) && (R[0][0] > R[2][2])) {
+    S = sqrt(1.0 + R[0][0] - R[1][1] - R[2][2]) * 2;  // S=4*qx 
+    q[0] = (R[2][1] - R[1][2]) / S;
+    q[1] = 0.25 * S;
+    q[2] = (R[0][1] + R[1][0]) / S; 
+    q[3] = (R[0][2] + R[2][0]) / S; 
+  }
+  else if (R[1][1] > R[2][2]) {
+    S = sqrt(1.0 + R[1][1] - R[0][0] - R[2][2]) * 2;  // S=4*qy
+    q[0] = (R[0][2] - R[2][0]) / S;
+    q[1] = (R[0][1] + R[1][0]) / S; 
+    q[2] = 0.25 * S;
+    q[3] = (R[1][2] + R[2][1]) / S; 
+  }
+  else {
+    S = sqrt(1.0 + R[2][2] - R[0][0] - R[1][1]) * 2;  // S=4*qz
+    q[0] = (R[1][0] - R[0][1]) / S;
+    q[1] = (R[0][2] + R[2][0]) / S;
+    q[2] = (R[1][2] + R[2][1]) / S;
+    q[3] = 0.25 * S;
+  }
+
+  normalize(q, q, 4);
 }
 
-// free a 2d matrix of ints
-void free_matrix2i(int **X)
+
+// convert a unit quaternion to a rotation matrix
+void quaternion_to_rotation_matrix(double **R, double *q)
 {
-  if (X == NULL) return;
-  free(X[0]);
-  free(X);
+  double a = q[0];
+  double b = q[1];
+  double c = q[2];
+  double d = q[3];
+
+  R[0][0] = a*a + b*b - c*c - d*d;
+  R[0][1] = 2*b*c - 2*a*d;
+  R[0][2] = 2*b*d + 2*a*c;
+  R[1][0] = 2*b*c + 2*a*d;
+  R[1][1] = a*a - b*b + c*c - d*d;
+  R[1][2] = 2*c*d - 2*a*b;
+  R[2][0] = 2*b*d - 2*a*c;
+  R[2][1] = 2*c*d + 2*a*b;
+  R[2][2] = a*a - b*b - c*c + d*d;
 }
 
 /*
- * Write a matrix in the following format.
- *
- * <nrows> <ncols>
- * <row 1>
- * <row 2>
- * ...
+ * Vector types for the batch kernels below (4 doubles with AVX, 2 with SSE2,
+ * otherwise everything falls through to the scalar loops).
  */
-void save_matrix(char *fout, double **X, int n, int m)
+#if defined(__AVX__)
+#define VECD_WIDTH 4
+typedef __m256d vecd_t;
+#define vecd_load(p) _mm256_loadu_pd(p)
+#define vecd_store(p,x) _mm256_storeu_pd(p,x)
+#define vecd_set1(a) _mm256_set1_pd(a)
+#define vecd_add(x,y) _mm256_add_pd(x,y)
+#define vecd_sub(x,y) _mm256_sub_pd(x,y)
+#define vecd_mul(x,y) _mm256_mul_pd(x,y)
+#elif defined(__SSE2__)
+#define VECD_WIDTH 2
+typedef __m128d vecd_t;
+#define vecd_load(p) _mm_loadu_pd(p)
+#define vecd_store(p,x) _mm_storeu_pd(p,x)
+#define vecd_set1(a) _mm_set1_pd(a)
+#define vecd_add(x,y) _mm_add_pd(x,y)
+#define vecd_sub(x,y) _mm_sub_pd(x,y)
+#define vecd_mul(x,y) _mm_mul_pd(x,y)
+#endif
+
+
+/*
+ * Batch quaternion multiplication, Z[:,i] = X[:,i]*Y[:,i].  All quaternion arrays
+ * are stored as 4-by-n (structure of arrays), i.e. Q[j][i] is component j of quaternion i.
+ * Z may be the same as X or Y.
+ */
+void quaternion_mult_batch(double **Z, double **X, double **Y, int n)
 {
-  //fprintf(stderr, "saving matrix to %s\n", fout);
+  int i = 0;
 
-  FILE *f = fopen(fout, "w");
-  int i, j;
+#ifdef VECD_WIDTH
+  for (; i + VECD_WIDTH <= n; i += VECD_WIDTH) {
+    vecd_t a = vecd_load(X[0]+i), b = vecd_load(X[1]+i), c = vecd_load(X[2]+i), d = vecd_load(X[3]+i);
+    vecd_t y0 = vecd_load(Y[0]+i), y1 = vecd_load(Y[1]+i), y2 = vecd_load(Y[2]+i), y3 = vecd_load(Y[3]+i);
 
-  fprintf(f, "%d %d\n", n, m);
-  for (i = 0; i < n; i++) {
-    for (j = 0; j < m; j++)
-      fprintf(f, "%f ", X[i][j]);
-    fprintf(f, "\n");
-  }
+    vecd_t z0 = vecd_sub(vecd_sub(vecd_sub(vecd_mul(a,y0), vecd_mul(b,y1)), vecd_mul(c,y2)), vecd_mul(d,y3));
+    vecd_t z1 = vecd_add(vecd_sub(vecd_add(vecd_mul(b,y0), vecd_mul(a,y1)), vecd_mul(d,y2)), vecd_mul(c,y3));
+    vecd_t z2 = vecd_sub(vecd_add(vecd_add(vecd_mul(c,y0), vecd_mul(d,y1)), vecd_mul(a,y2)), vecd_mul(b,y3));
+    vecd_t z3 = vecd_add(vecd_add(vecd_sub(vecd_mul(d,y0), vecd_mul(c,y1)), vecd_mul(b,y2)), vecd_mul(a,y3));
 
-  fclose(f);
+    vecd_store(Z[0]+i, z0);
+    vecd_store(Z[1]+i, z1);
+    vecd_store(Z[2]+i, z2);
+    vecd_store(Z[3]+i, z3);
+  }
+#endif
+
+  for (; i < n; i++) {
+    double x[4] = {X[0][i], X[1][i], X[2][i], X[3][i]};
+    double y[4] = {Y[0][i], Y[1][i], Y[2][i], Y[3][i]};
+    double z[4];
+    quaternion_mult(z, x, y);
+    Z[0][i] = z[0];
+    Z[1][i] = z[1];
+    Z[2][i] = z[2];
+    Z[3][i] = z[3];
+  }
 }
 
-void save_matrixi(char *fout, int **X, int n, int m)
-{
-  //fprintf(stderr, "saving matrix to %s\n", fout);
 
-  FILE *f = fopen(fout, "w");
+/*
+ * Batch quaternion inverse (4-by-n SoA arrays, as in quaternion_mult_batch()).
+ */
+void quaternion_inverse_batch(double **Q_inv, double **Q, int n)
+{
   int i, j;
 
-  fprintf(f, "%d %d\n", n, m);
-  for (i = 0; i < n; i++) {
-    for (j = 0; j < m; j++)
-      fprintf(f, "%d ", X[i][j]);
-    fprintf(f, "\n");
-  }
-
-  fclose(f);
+  if (Q_inv[0] != Q[0])
+    memcpy(Q_inv[0], Q[0], n*sizeof(double));
+  for (j = 1; j < 4; j++)
+    for (i = 0; i < n; i++)
+      Q_inv[j][i] = -Q[j][i];
 }
 
+
 /*
- * Load a matrix in the following format.
- *
- * <nrows> <ncols>
- * <row 1>
- * <row 2>
- * ...
+ * Batch conversion of unit quaternions (4-by-n SoA) to rotation matrices (9-by-n SoA),
+ * i.e. R[3*j+k][i] = R_i[j][k].
  */
-double **load_matrix(char *fin, int *n, int *m)
+void quaternion_to_rotation_matrix_batch(double **R, double **Q, int n)
 {
-  FILE *f = fopen(fin, "r");
+  int i = 0;
 
-  if (f == NULL) {
-    fprintf(stderr, "Invalid filename: %s", fin);
-    return NULL;
+#ifdef VECD_WIDTH
+  vecd_t two = vecd_set1(2.0);
+  for (; i + VECD_WIDTH <= n; i += VECD_WIDTH) {
+    vecd_t a = vecd_load(Q[0]+i), b = vecd_load(Q[1]+i), c = vecd_load(Q[2]+i), d = vecd_load(Q[3]+i);
+    vecd_t aa = vecd_mul(a,a), bb = vecd_mul(b,b), cc = vecd_mul(c,c), dd = vecd_mul(d,d);
+    vecd_t ab = vecd_mul(two, vecd_mul(a,b)), ac = vecd_mul(two, vecd_mul(a,c)), ad = vecd_mul(two, vecd_mul(a,d));
+    vecd_t bc = vecd_mul(two, vecd_mul(b,c)), bd = vecd_mul(two, vecd_mul(b,d)), cd = vecd_mul(two, vecd_mul(c,d));
+
+    vecd_store(R[0]+i, vecd_sub(vecd_sub(vecd_add(aa,bb), cc), dd));
+    vecd_store(R[1]+i, vecd_sub(bc, ad));
+    vecd_store(R[2]+i, vecd_add(bd, ac));
+    vecd_store(R[3]+i, vecd_add(bc, ad));
+    vecd_store(R[4]+i, vecd_sub(vecd_add(vecd_sub(aa,bb), cc), dd));
+    vecd_store(R[5]+i, vecd_sub(cd, ab));
+    vecd_store(R[6]+i, vecd_sub(bd, ac));
+    vecd_store(R[7]+i, vecd_add(cd, ab));
+    vecd_store(R[8]+i, vecd_add(vecd_sub(vecd_sub(aa,bb), cc), dd));
   }
-
-  char sbuf0[128], *s = sbuf0;
-  if (fgets(s, 128, f) == NULL || sscanf(s, "%d %d", n, m) < 2) {
-    fprintf(stderr, "Corrupt matrix header in file %s\n", fin);
-    fclose(f);
-    return NULL;
+#endif
+
+  double R_raw[9], *R_i[3] = {R_raw, R_raw+3, R_raw+6};
+  int j;
+  for (; i < n; i++) {
+    double q[4] = {Q[0][i], Q[1][i], Q[2][i], Q[3][i]};
+    quaternion_to_rotation_matrix(R_i, q);
+    for (j = 0; j < 9; j++)
+      R[j][i] = R_raw[j];
   }
+}
 
-  double **X = new_matrix2(*n, *m);
-
-  const int CHARS_PER_FLOAT = 20;
-  char sbuf[CHARS_PER_FLOAT * (*m)];
 
+/*
+ * Batch conversion of rotation matrices (9-by-n SoA, as in quaternion_to_rotation_matrix_batch())
+ * to unit quaternions (4-by-n SoA).
+ */
+void rotation_matrix_to_quaternion_batch(double **Q, double **R, int n)
+{
+  double R_raw[9], *R_i[3] = {R_raw, R_raw+3, R_raw+6};
+  double q[4];
   int i, j;
-  for (i = 0; i < *n; i++) {
-    s = sbuf;
-    if (fgets(s, 10000, f) == NULL)
-      break;
-    for (j = 0; j < *m; j++) {
-      if (sscanf(s, "%lf", &X[i][j]) < 1)
-	break;
-      s = sword(s, " \t", 1);
-    }
-    if (j < *m)
-      break;
-  }
-  if (i < *n) {
-    fprintf(stderr, "Corrupt matrix file '%s' at line %d\n", fin, i+2);
-    fclose(f);
-    free_matrix2(X);
-    return NULL;
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < 9; j++)
+      R_raw[j] = R[j][i];
+    rotation_matrix_to_quaternion(q, R_i);
+    for (j = 0; j < 4; j++)
+      Q[j][i] = q[j];
   }
-
-  return X;
 }
 
 
-
-// calculate the area of a triangle
-double triangle_area(double x[], double y[], double z[], int n)
+/*
+ * Rotate an n-by-3 array of points by a unit quaternion, Y[i] = q*X[i]*q^-1.  Y may be the same as X.
+ * The rotation coefficients are kept in registers, so no rotation matrix is allocated.
+ */
+void quaternion_rotate_points_batch(double **Y, double **X, double *q, int n)
 {
-  double a = dist(x, y, n);
-  double b = dist(x, z, n);
-  double c = dist(y, z, n);
-  double s = .5*(a + b + c);
+  double a = q[0], b = q[1], c = q[2], d = q[3];
 
-  return sqrt(s*(s-a)*(s-b)*(s-c));
+  double r00 = a*a + b*b - c*c - d*d,  r01 = 2*b*c - 2*a*d,  r02 = 2*b*d + 2*a*c;
+  double r10 = 2*b*c + 2*a*d,  r11 = a*a - b*b + c*c - d*d,  r12 = 2*c*d - 2*a*b;
+  double r20 = 2*b*d - 2*a*c,  r21 = 2*c*d + 2*a*b,  r22 = a*a - b*b - c*c + d*d;
+
+  int i;
+  for (i = 0; i < n; i++) {
+    double x0 = X[i][0], x1 = X[i][1], x2 = X[i][2];
+    Y[i][0] = r00*x0 + r01*x1 + r02*x2;
+    Y[i][1] = r10*x0 + r11*x1 + r12*x2;
+    Y[i][2] = r20*x0 + r21*x1 + r22*x2;
+  }
 }
 
 
-// calculate the volume of a tetrahedron
-double tetrahedron_volume(double x1[], double x2[], double x3[], double x4[], int n)
+int find_first_non_zero(double *v, int n)
 {
-  double U = dist2(x1, x2, n);
-  double V = dist2(x1, x3, n);
-  double W = dist2(x2, x3, n);
-  double u = dist2(x3, x4, n);
-  double v = dist2(x2, x4, n);
-  double w = dist2(x1, x4, n);
-
-  double a = v+w-U;
-  double b = w+u-V;
-  double c = u+v-W;
-
-  return sqrt( (4*u*v*w - u*a*a - v*b*b - w*c*c + a*b*c) ) / 12.0 ;
+  int i;
+  for (i = 0; i < n; ++i) {
+    if (v[i] != 0.)
+      return i;
+  }
+  return -1;
 }
 
-
-// calculate the volume of a tetrahedron
-inline double tetrahedron_volume_old(double x[], double y[], double z[], double w[], int n)
+int find_first_lt(double *x, double a, int n)
 {
-  // make an orthonormal basis in the xyz plane (with x at the origin)
-  double u[n], v[n], v_proj[n];
-  sub(u, y, x, n);             // u = y-x
-  sub(v, z, x, n);             // v = z-x
-  proj(v_proj, v, u, n);       // project v onto u
-  sub(v, v, v_proj, n);        // v -= v_proj
-  mult(u, u, 1/norm(u,n), n);  // normalize u
-  mult(v, v, 1/norm(v,n), n);  // normalize v
-
-  // project (w-x) onto xyz plane
-  double w2[n], wu[n], wv[n], w_proj[n];
-  sub(w2, w, x, n);            // w2 = w-x
-  proj(wu, w2, u, n);          // project w2 onto u
-  proj(wv, w2, v, n);          // project w2 onto v
-  add(w_proj, wu, wv, n);      // w_proj = wu + wv
-  sub(w2, w2, w_proj, n);      // w2 -= w_proj
-
-  double h = norm(w2, n);  // height
-  double A = triangle_area(x, y, z, n);
-
-  return h*A/3.0;
+  int i;
+  for (i = 0; i < n; ++i)
+    if (x[i] < a)
+      break;
+  return i;
 }
 
-
-// transpose a matrix
-void transpose(double **Y, double **X, int n, int m)
+int find_first_gt(double *x, double a, int n)
 {
-  double **X2 = X;
-  if (Y == X)
-    X2 = matrix_clone(X,n,m);
+  int i;
+  for (i = 0; i < n; ++i)
+    if (x[i] > a)
+      break;
+  return i;
+}
 
+/*
+short *ismember(double *A, double *B, int n, int m) {
+  short *C;
+  safe_calloc(C, n, short);
   int i, j;
-  for (i = 0; i < n; i++)
-    for (j = 0; j < m; j++)
-      Y[j][i] = X2[i][j];
-
-  if (Y == X)
-    free_matrix2(X2);
+  // NOTE(sanja): this can be done in O(n log n + m) if necessary. Also, SSE2-able :)
+  for (i = 0; i < n; ++i) {
+    for (j = 0; j < m; ++j) {
+      if (double_is_equal(A[i], B[j])) {
+	C[i] = 1;
+	break;
+      }
+    }
+  }
+  return C;
 }
 
-
-// matrix copy, Y = X 
-void matrix_copy(double **Y, double **X, int n, int m)
-{
-  memcpy(Y[0], X[0], n*m*sizeof(double));
+short *ismemberi(int *A, int *B, int n, int m) {
+  short *C;
+  safe_calloc(C, n, short);
+  int i, j;
+  // NOTE(sanja): this can be done in O(n log n + m) if necessary. Also, SSE2-able :)
+  for (i = 0; i < n; ++i) {
+    for (j = 0; j < m; ++j) {
+      if (A[i] == B[j]) {
+	C[i] = 1;
+	break;
+      }
+    }
+  }
+  return C;
 }
+*/
 
-
-// matrix clone, Y = new(X)
-double **matrix_clone(double **X, int n, int m)
+// check if y contains x
+int ismemberi(int x, int *y, int n)
 {
-  double **Y = new_matrix2(n,m);
-  matrix_copy(Y, X, n, m);
-
-  return Y;
+  int i;
+  for (i = 0; i < n; ++i)
+    if (x == y[i])
+      return 1;
+  return 0;
 }
 
-
-// matrix addition, Z = X+Y
-void matrix_add(double **Z, double **X, double **Y, int n, int m)
+// reverses an array of doubles (safe for x==y)
+void reverse(double *y, double *x, int n)
 {
-  add(Z[0], X[0], Y[0], n*m);
+  int i;
+  for (i = 0; i < n/2; i++) {
+    double tmp = x[i];
+    y[i] = x[n-i-1];
+    y[n-i-1] = tmp;
+  }
 }
 
-// matrix subtraction, Z = X-Y
-void matrix_sub(double **Z, double **X, double **Y, int n, int m)
+// reverses an array of ints (safe for x==y)
+void reversei(int *y, int *x, int n)
 {
-  sub(Z[0], X[0], Y[0], n*m);
+  int i;
+  for (i = 0; i < n/2; i++) {
+    int tmp = x[i];
+    y[i] = x[n-i-1];
+    y[n-i-1] = tmp;
+  }
 }
 
-// matrix multiplication, Z = X*Y, where X is n-by-p and Y is p-by-m
-void matrix_mult(double **Z, double **X, double **Y, int n, int p, int m)
+// reorder an array of doubles (safe for x==y)
+void reorder(double *y, double *x, int *idx, int n)
 {
-  double **Z2 = (Z==X || Z==Y ? new_matrix2(n,m) : Z);
-  int i, j, k;
-  for (i = 0; i < n; i++) {     // row i
-    for (j = 0; j < m; j++) {   // column j
-      Z2[i][j] = 0;
-      for (k = 0; k < p; k++)
-	Z2[i][j] += X[i][k]*Y[k][j];
-    }
-  }
-  if (Z==X || Z==Y) {
-    matrix_copy(Z, Z2, n, m);
-    free_matrix2(Z2);
+  int i;
+  double *y2 = y;
+  if (x==y)
+    safe_calloc(y2, n, double);
+  for (i = 0; i < n; i++)
+    y2[i] = x[idx[i]];
+  if (x==y) {
+    memcpy(y, y2, n*sizeof(double));
+    free(y2);
   }
 }
 
-
-// matrix-vector multiplication, y = A*x
-void matrix_vec_mult(double *y, double **A, double *x, int n, int m)
+// reorder an array of ints (safe for x==y)
+void reorderi(int *y, int *x, int *idx, int n)
 {
   int i;
-  if (y == x) {
-    double z[m];
-    memcpy(z, x, m*sizeof(double));
-    for (i = 0; i < n; i++)
-      y[i] = dot(A[i], z, m);
+  int *y2 = y;
+  if (x==y)
+    safe_calloc(y2, n, int);
+  for (i = 0; i < n; i++)
+    y2[i] = x[idx[i]];
+  if (x==y) {
+    memcpy(y, y2, n*sizeof(int));
+    free(y2);
   }
-  else
-    for (i = 0; i < n; i++)
-      y[i] = dot(A[i], x, m);
 }
 
-// vector-matrix multiplication, y = x*A
-void vec_matrix_mult(double *y, double *x, double **A, int n, int m)
+// add an element to the front of a list
+ilist_t *ilist_add(ilist_t *x, int a)
 {
-  int i, j;
-  if (y == x) {
-    double z[n];
-    memcpy(z, x, n*sizeof(double));
-    for (j = 0; j < m; j++) {
-      y[j] = 0;
-      for (i = 0; i < n; i++)
-	y[j] += z[i]*A[i][j];
-    }
-  }
-  else {
-    for (j = 0; j < m; j++) {
-      y[j] = 0;
-      for (i = 0; i < n; i++)
-	y[j] += x[i]*A[i][j];
-    }
-  }
-}
+  ilist_t *head;
+  safe_malloc(head, 1, ilist_t);
+  head->x = a;
+  head->next = x;
+  head->len = (x ? 1 + x->len : 1);
 
-// matrix element-wise multiplication
-void matrix_elt_mult(double **Z, double **X, double **Y, int n, int m) {
-  int i, j;
-  for (i = 0; i < n; ++i) {
-    for (j = 0; j < m; ++j) {
-      Z[i][j] = X[i][j] * Y[i][j];
-    }
-  }
+  return head;
 }
 
-void matrix_pow(double **Y, double **X, int n, int m, double pw) {
-  int i, j;
-  for (i = 0; i < n; ++i)
-    for (j = 0; j < m; ++j)
-      Y[i][j] = pow(X[i][j], pw);
+
+// check if a list contains an element
+int ilist_contains(ilist_t *x, int a)
+{
+  if (!x)
+    return 0;
+
+  ilist_t *tmp;
+  for (tmp = x; tmp; tmp = tmp->next)
+    if (tmp->x == a)
+      return 1;
+  return 0;
 }
 
-void matrix_sum(double y[], double **X, int n, int m) {
-  int i, j;
-  memset(y, 0, n * sizeof(double));
-  for (i = 0; i < n; ++i) {
-    for (j = 0; j < m; ++j) {
-      y[j] += X[i][j];
-    }
+
+// find the index of an element in a list (or -1 if not found)
+int ilist_find(ilist_t *x, int a)
+{
+  int i = 0;
+  ilist_t *tmp;
+  for (tmp = x; tmp; tmp = tmp->next) {
+    if (tmp->x == a)
+      return i;
+    i++;
   }
+
+  return -1;
 }
 
-// outer product of x and y, Z = x'*y
-void outer_prod(double **Z, double x[], double y[], int n, int m)
+
+// free a list
+void ilist_free(ilist_t *x)
 {
-  int i, j;
-  for (i = 0; i < n; i++)
-    for (j = 0; j < m; j++)
-      Z[i][j] = x[i]*y[j];
+  ilist_t *tmp, *tmp2;
+  tmp = x;
+  while (tmp) {
+    tmp2 = tmp->next;
+    free(tmp);
+    tmp = tmp2;
+  }  
 }
 
 
-// row vector mean 
-// NOTE(sanja): this is adding up columns, not rows.
-void mean(double *mu, double **X, int n, int m)
+/*
+ * Random number generation.  Every thread has its own default stream (a xoshiro256** generator),
+ * which frand(), irand(), normrand(), etc. draw from, so they are thread-safe.  The default streams
+ * are seeded from BINGHAM_SEED (if it's set in the environment), from rng_set_seed(), or else from
+ * the clock; thread i's stream is the seed stream jumped ahead i*2^128 steps.  For reproducible
+ * multi-threaded code, pass explicit rng_t contexts (e.g. from rng_split()) to the *_rng() functions.
+ */
+
+static uint64_t rng_global_seed;
+static int rng_global_seed_set = 0;
+static int rng_generation = 0;        // incremented by rng_set_seed()
+static int rng_num_streams = 0;       // number of default streams handed out in this generation
+static pthread_mutex_t rng_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread rng_t rng_thread_stream;
+static __thread int rng_thread_generation = -1;
+
+
+static inline uint64_t rng_rotl(uint64_t x, int k)
 {
-  memset(mu, 0, m*sizeof(double));  // mu = 0
+  return (x << k) | (x >> (64 - k));
+}
 
-  int i, j;
-  for (i = 0; i < n; i++)
-    for (j = 0; j < m; j++)
-      mu[j] += X[i][j];
 
-  mult(mu, mu, 1/(double)n, m);
+static inline uint64_t splitmix64(uint64_t *x)
+{
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
 }
 
-void variance(double *vars, double **X, int n, int m)
+
+// seed a random number generator
+void rng_seed(rng_t *rng, uint64_t seed)
 {
-  double mu[m];
-  mean(mu, X, n, m);
-  memset(vars, 0, m*sizeof(double));
-  int i, j;
-  for (i = 0; i < n; i++) {
-    for (j = 0; j < m; j++) {
-      double dx = X[i][j] - mu[j];
-      vars[j] += dx*dx;
-    }
-  }
-  mult(vars, vars, 1/(double)n, m);
+  int i;
+  for (i = 0; i < 4; i++)
+    rng->s[i] = splitmix64(&seed);
 }
 
-// compute the covariance of the rows of X, given mean mu
-void cov(double **S, double **X, double *mu, int n, int m)
+
+// returns 64 random bits
+uint64_t rng_next(rng_t *rng)
 {
-  int i, j, k;
+  uint64_t *s = rng->s;
+  uint64_t result = rng_rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
 
-  memset(S[0], 0, m*m*sizeof(double));
-  double dx[m];
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rng_rotl(s[3], 45);
 
-  if (m == 3) {
-    for (i = 0; i < n; i++) {
-      dx[0] = X[i][0] - mu[0];
-      dx[1] = X[i][1] - mu[1];
-      dx[2] = X[i][2] - mu[2];
-      S[0][0] += dx[0]*dx[0];
-      S[0][1] += dx[0]*dx[1];
-      S[0][2] += dx[0]*dx[2];
-      S[1][0] += dx[1]*dx[0];
-      S[1][1] += dx[1]*dx[1];
-      S[1][2] += dx[1]*dx[2];
-      S[2][0] += dx[2]*dx[0];
-      S[2][1] += dx[2]*dx[1];
-      S[2][2] += dx[2]*dx[2];
+  return result;
+}
+
+
+// advance a random number generator by 2^128 steps (to get non-overlapping parallel streams)
+void rng_jump(rng_t *rng)
+{
+  static const uint64_t JUMP[4] = {0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL, 0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL};
+
+  uint64_t s[4] = {0, 0, 0, 0};
+  int i, b, j;
+  for (i = 0; i < 4; i++) {
+    for (b = 0; b < 64; b++) {
+      if (JUMP[i] & (1ULL << b))
+	for (j = 0; j < 4; j++)
+	  s[j] ^= rng->s[j];
+      rng_next(rng);
     }
   }
-  else {
-    for (i = 0; i < n; i++) {
-      sub(dx, X[i], mu, m);
-      for (j = 0; j < m; j++)
-	for (k = 0; k < m; k++)
-	  S[j][k] += dx[j]*dx[k];
-    }
+  memcpy(rng->s, s, sizeof(s));
+}
+
+
+// make n independent streams, starting with (a copy of) rng, each 2^128 steps apart
+void rng_split(rng_t *streams, rng_t *rng, int n)
+{
+  int i;
+  rng_t r = *rng;
+  for (i = 0; i < n; i++) {
+    streams[i] = r;
+    rng_jump(&r);
   }
+}
 
-  /*
-  double **dX = matrix_clone(X, n, m);
-  if (mu != NULL)
-    for (i = 0; i < n; i++)
-      sub(dX[i], X[i], mu, m);
-  double **dXt = new_matrix2(m, n);
-  transpose(dXt, dX, n, m);
-  matrix_mult(S, dXt, dX, m, n, m);
-  */
-  mult(S[0], S[0], 1/(double)n, m*m);
 
-  //free_matrix2(dX);
-  //free_matrix2(dXt);
+// set the seed of the default streams (and restart them)
+void rng_set_seed(uint64_t seed)
+{
+  pthread_mutex_lock(&rng_mutex);
+  rng_global_seed = seed;
+  rng_global_seed_set = 1;
+  rng_num_streams = 0;
+  rng_generation++;
+  pthread_mutex_unlock(&rng_mutex);
 }
 
 
-// weighted row vector mean
-void wmean(double *mu, double **X, double *w, int n, int m)
+// get the calling thread's default stream
+rng_t *rng_default()
 {
-  memset(mu, 0, m*sizeof(double));  // mu = 0
+  if (rng_thread_generation != rng_generation) {
+    pthread_mutex_lock(&rng_mutex);
+    if (!rng_global_seed_set) {
+      char *s = getenv("BINGHAM_SEED");
+      if (s)
+	rng_global_seed = strtoull(s, NULL, 10);
+      else {
+	rng_global_seed = time(NULL);
+	printf("********* seed = %llu\n", (unsigned long long)rng_global_seed);
+      }
+      rng_global_seed_set = 1;
+    }
+    int i, stream = rng_num_streams++;
+    rng_seed(&rng_thread_stream, rng_global_seed);
+    rng_thread_generation = rng_generation;
+    pthread_mutex_unlock(&rng_mutex);
 
-  int i, j;
-  for (i = 0; i < n; i++)
-    for (j = 0; j < m; j++)
-      mu[j] += w[i]*X[i][j];
+    for (i = 0; i < stream; i++)
+      rng_jump(&rng_thread_stream);
+  }
 
-  mult(mu, mu, 1.0/sum(w,n), m);
+  return &rng_thread_stream;
 }
 
 
-// compute the weighted covariance of the rows of X, given mean mu
-void wcov(double **S, double **X, double *w, double *mu, int n, int m)
+// returns a random double in [0,1)
+double rng_uniform(rng_t *rng)
 {
-  int i;
+  return (rng_next(rng) >> 11) * 0x1.0p-53;
+}
 
-  memset(S[0], 0, m*m*sizeof(double));
 
-  double **Si = new_matrix2(m,m);
-  for (i = 0; i < n; i++) {
-    outer_prod(Si, X[i], X[i], m, m);
-    mult(Si[0], Si[0], w[i], m*m);
-    matrix_add(S, S, Si, m, m);
-  }
+// returns a random int between 0 and n-1
+int rng_int(rng_t *rng, int n)
+{
+  return (int)(((rng_next(rng) >> 32) * (uint64_t)n) >> 32);
+}
 
-  mult(S[0], S[0], 1.0/sum(w,n), m*m);
 
-  if (mu != NULL) {
-    double **S_mu = new_matrix2(m,m);
-    outer_prod(S_mu, mu, mu, m, m);
-    sub(S[0], S[0], S_mu[0], m*m);
-    free_matrix2(S_mu);
+// fill x with n random doubles in [0,1)
+void rng_uniform_batch(rng_t *rng, double *x, int n)
+{
+  uint64_t s0 = rng->s[0], s1 = rng->s[1], s2 = rng->s[2], s3 = rng->s[3];
+  int i;
+  for (i = 0; i < n; i++) {
+    uint64_t result = rng_rotl(s1 * 5, 7) * 9;
+    uint64_t t = s1 << 17;
+    s2 ^= s0;
+    s3 ^= s1;
+    s1 ^= s2;
+    s0 ^= s3;
+    s2 ^= t;
+    s3 = rng_rotl(s3, 45);
+    x[i] = (result >> 11) * 0x1.0p-53;
   }
+  rng->s[0] = s0;  rng->s[1] = s1;  rng->s[2] = s2;  rng->s[3] = s3;
 }
 
 
-// solve the equation Ax = b, where A is a square n-by-n matrix
-void solve(double *x, double **A, double *b, int n)
-{
-  double **A_inv = new_matrix2(n,n);
-  inv(A_inv, A, n);
+// ziggurat tables for the normal distribution (Marsaglia & Tsang, 2000)
+static uint32_t zig_kn[128];
+static double zig_wn[128], zig_fn[128];
+static pthread_once_t zig_once = PTHREAD_ONCE_INIT;
 
+static void zig_init()
+{
+  const double m1 = 2147483648.0, vn = 9.91256303526217e-3;
+  double dn = 3.442619855899, tn = dn;
   int i;
-  for (i = 0; i < n; i++)
-    x[i] = dot(A_inv[i], b, n);
 
-  free_matrix2(A_inv);
+  double q = vn / exp(-.5*dn*dn);
+  zig_kn[0] = (uint32_t)((dn/q)*m1);
+  zig_kn[1] = 0;
+  zig_wn[0] = q/m1;
+  zig_wn[127] = dn/m1;
+  zig_fn[0] = 1.0;
+  zig_fn[127] = exp(-.5*dn*dn);
+
+  for (i = 126; i >= 1; i--) {
+    dn = sqrt(-2*log(vn/dn + exp(-.5*dn*dn)));
+    zig_kn[i+1] = (uint32_t)((dn/tn)*m1);
+    tn = dn;
+    zig_fn[i] = exp(-.5*dn*dn);
+    zig_wn[i] = dn/m1;
+  }
 }
 
 
-// compute the determinant of the n-by-n matrix X
-double det(double **X, int n)
+// uniform on (0,1), for logs
+static inline double rng_uniform_pos(rng_t *rng)
 {
-  if (n == 1)
-    return X[0][0];
+  return ((rng_next(rng) >> 11) + 0.5) * 0x1.0p-53;
+}
 
-  else if (n == 2)
-    return X[0][0]*X[1][1] - X[0][1]*X[1][0];
 
-  else if (n == 3) {
-    double a = X[0][0];
-    double b = X[0][1];
-    double c = X[0][2];
-    double d = X[1][0];
-    double e = X[1][1];
-    double f = X[1][2];
-    double g = X[2][0];
-    double h = X[2][1];
-    double i = X[2][2];
-    return a*e*i - a*f*h + b*f*g - b*d*i + c*d*h - c*e*g;
-  }
+// returns a standard normal random variable (ziggurat method)
+double rng_normal(rng_t *rng)
+{
+  const double r = 3.442619855899;
 
-  else if (n == 4) {
-    double a00 = X[0][0];
-    double a01 = X[0][1];
-    double a02 = X[0][2];
-    double a03 = X[0][3];
-    double a10 = X[1][0];
-    double a11 = X[1][1];
-    double a12 = X[1][2];
-    double a13 = X[1][3];
-    double a20 = X[2][0];
-    double a21 = X[2][1];
-    double a22 = X[2][2];
-    double a23 = X[2][3];
-    double a30 = X[3][0];
-    double a31 = X[3][1];
-    double a32 = X[3][2];
-    double a33 = X[3][3];
+  pthread_once(&zig_once, zig_init);
 
-    return a00*a11*a22*a33 - a00*a11*a23*a32 - a00*a12*a21*a33 + a00*a12*a23*a31 + a00*a13*a21*a32
-      - a00*a13*a22*a31 - a01*a10*a22*a33 + a01*a10*a23*a32 + a01*a12*a20*a33 - a01*a12*a23*a30
-      - a01*a13*a20*a32 + a01*a13*a22*a30 + a02*a10*a21*a33 - a02*a10*a23*a31 - a02*a11*a20*a33
-      + a02*a11*a23*a30 + a02*a13*a20*a31 - a02*a13*a21*a30 - a03*a10*a21*a32 + a03*a10*a22*a31
-      + a03*a11*a20*a32 - a03*a11*a22*a30 - a03*a12*a20*a31 + a03*a12*a21*a30;
+  while (1) {
+    int32_t hz = (int32_t)(rng_next(rng) >> 32);
+    int iz = hz & 127;
+    uint32_t ahz = (hz < 0 ? -(uint32_t)hz : (uint32_t)hz);
+    double x = hz * zig_wn[iz];
+
+    if (ahz < zig_kn[iz])  // inside the rectangle
+      return x;
+
+    if (iz == 0) {  // sample from the tail
+      double y;
+      do {
+	x = -log(rng_uniform_pos(rng)) / r;
+	y = -log(rng_uniform_pos(rng));
+      } while (y + y < x*x);
+      return (hz > 0 ? r + x : -r - x);
+    }
 
+    // wedge
+    if (zig_fn[iz] + rng_uniform(rng)*(zig_fn[iz-1] - zig_fn[iz]) < exp(-.5*x*x))
+      return x;
   }
+}
 
-  else {
-    fprintf(stderr, "Error: det() not supported for > 4x4 matrices\n");
-    exit(1);
-  }
 
-  return 0;
+// fill x with n standard normal random variables
+void rng_normal_batch(rng_t *rng, double *x, int n)
+{
+  int i;
+  for (i = 0; i < n; i++)
+    x[i] = rng_normal(rng);
 }
 
 
-// compute the inverse (Y) of the n-by-n matrix X
-void inv(double **Y, double **X, int n)
+// samples d integers from 0:n-1 uniformly without replacement
+void rng_randperm(rng_t *rng, int *x, int n, int d)
 {
-  double d = det(X,n);
-
-  if (n == 1)
-    Y[0][0] = 1/d;
+  int i;
 
-  else if (n == 2) {
-    Y[0][0] = X[1][1] / d;
-    Y[0][1] = -X[0][1] / d;
-    Y[1][0] = -X[1][0] / d;
-    Y[1][1] = X[0][0] / d;
+  if (d > n) {
+    fprintf(stderr, "Error: d > n in randperm()\n");
+    return;
   }
+  
+  // sample a random starting point
+  int i0 = rng_int(rng, n);
 
-  else if (n == 3) {
-    Y[0][0] = (X[1][1]*X[2][2] - X[1][2]*X[2][1]) / d;
-    Y[0][1] = (X[0][2]*X[2][1] - X[0][1]*X[2][2]) / d;
-    Y[0][2] = (X[0][1]*X[1][2] - X[0][2]*X[1][1]) / d;
-    Y[1][0] = (X[1][2]*X[2][0] - X[1][0]*X[2][2]) / d;
-    Y[1][1] = (X[0][0]*X[2][2] - X[0][2]*X[2][0]) / d;
-    Y[1][2] = (X[0][2]*X[1][0] - X[0][0]*X[1][2]) / d;
-    Y[2][0] = (X[1][0]*X[2][1] - X[1][1]*X[2][0]) / d;
-    Y[2][1] = (X[0][1]*X[2][0] - X[0][0]*X[2][1]) / d;
-    Y[2][2] = (X[0][0]*X[1][1] - X[0][1]*X[1][0]) / d;
-  }
+  // use a random prime step to cycle through x
+  static const int big_primes[100] = {996311, 163573, 481123, 187219, 963323, 103769, 786979, 826363, 874891, 168991, 442501, 318679, 810377, 471073, 914519, 251059, 321983, 220009, 211877, 875339, 605603, 578483, 219619, 860089, 644911, 398819, 544927, 444043, 161717, 301447, 201329, 252731, 301463, 458207, 140053, 906713, 946487, 524389, 522857, 387151, 904283, 415213, 191047, 791543, 433337, 302989, 445853, 178859, 208499, 943589, 957331, 601291, 148439, 296801, 400657, 829637, 112337, 134707, 240047, 669667, 746287, 668243, 488329, 575611, 350219, 758449, 257053, 704287, 252283, 414539, 647771, 791201, 166031, 931313, 787021, 520529, 474667, 484361, 358907, 540271, 542251, 825829, 804709, 664843, 423347, 820367, 562577, 398347, 940349, 880603, 578267, 644783, 611833, 273001, 354329, 506101, 292837, 851017, 262103, 288989};
 
-  else if (n == 4) {
-    double a00 = X[0][0];
-    double a01 = X[0][1];
-    double a02 = X[0][2];
-    double a03 = X[0][3];
-    double a10 = X[1][0];
-    double a11 = X[1][1];
-    double a12 = X[1][2];
-    double a13 = X[1][3];
-    double a20 = X[2][0];
-    double a21 = X[2][1];
-    double a22 = X[2][2];
-    double a23 = X[2][3];
-    double a30 = X[3][0];
-    double a31 = X[3][1];
-    double a32 = X[3][2];
-    double a33 = X[3][3];
+  int step = big_primes[rng_int(rng, 100)];
 
-    Y[0][0] = (a11*a22*a33 - a11*a23*a32 - a12*a21*a33 + a12*a23*a31 + a13*a21*a32 - a13*a22*a31) / d;
-    Y[0][1] = (a01*a23*a32 - a01*a22*a33 + a02*a21*a33 - a02*a23*a31 - a03*a21*a32 + a03*a22*a31) / d;
-    Y[0][2] = (a01*a12*a33 - a01*a13*a32 - a02*a11*a33 + a02*a13*a31 + a03*a11*a32 - a03*a12*a31) / d;
-    Y[0][3] = (a01*a13*a22 - a01*a12*a23 + a02*a11*a23 - a02*a13*a21 - a03*a11*a22 + a03*a12*a21) / d;
-    Y[1][0] = (a10*a23*a32 - a10*a22*a33 + a12*a20*a33 - a12*a23*a30 - a13*a20*a32 + a13*a22*a30) / d;
-    Y[1][1] = (a00*a22*a33 - a00*a23*a32 - a02*a20*a33 + a02*a23*a30 + a03*a20*a32 - a03*a22*a30) / d;
-    Y[1][2] = (a00*a13*a32 - a00*a12*a33 + a02*a10*a33 - a02*a13*a30 - a03*a10*a32 + a03*a12*a30) / d;
-    Y[1][3] = (a00*a12*a23 - a00*a13*a22 - a02*a10*a23 + a02*a13*a20 + a03*a10*a22 - a03*a12*a20) / d;
-    Y[2][0] = (a10*a21*a33 - a10*a23*a31 - a11*a20*a33 + a11*a23*a30 + a13*a20*a31 - a13*a21*a30) / d;
-    Y[2][1] = (a00*a23*a31 - a00*a21*a33 + a01*a20*a33 - a01*a23*a30 - a03*a20*a31 + a03*a21*a30) / d;
-    Y[2][2] = (a00*a11*a33 - a00*a13*a31 - a01*a10*a33 + a01*a13*a30 + a03*a10*a31 - a03*a11*a30) / d;
-    Y[2][3] = (a00*a13*a21 - a00*a11*a23 + a01*a10*a23 - a01*a13*a20 - a03*a10*a21 + a03*a11*a20) / d;
-    Y[3][0] = (a10*a22*a31 - a10*a21*a32 + a11*a20*a32 - a11*a22*a30 - a12*a20*a31 + a12*a21*a30) / d;
-    Y[3][1] = (a00*a21*a32 - a00*a22*a31 - a01*a20*a32 + a01*a22*a30 + a02*a20*a31 - a02*a21*a30) / d;
-    Y[3][2] = (a00*a12*a31 - a00*a11*a32 + a01*a10*a32 - a01*a12*a30 - a02*a10*a31 + a02*a11*a30) / d;
-    Y[3][3] = (a00*a11*a22 - a00*a12*a21 - a01*a10*a22 + a01*a12*a20 + a02*a10*a21 - a02*a11*a20) / d;
+  int idx = i0;
+  for (i = 0; i < d; i++) {
+    x[i] = idx;
+    idx = (idx + step) % n;
   }
+}
 
-  else {
-    fprintf(stderr, "Error: inv() not supported for > 4x4 matrices\n");
-    exit(1);
+
+// samples from the probability mass function w with n elements
+int rng_pmf(rng_t *rng, double *w, int n)
+{
+  int i;
+  double r = rng_uniform(rng);
+  double wtot = 0;
+  for (i = 0; i < n; i++) {
+    wtot += w[i];
+    if (wtot >= r)
+      return i;
   }
+
+  return 0;
 }
 
-/**
- * Solves the quadratic equation: f(x) = a*x^2 + b*x + c
- * Sets x[0] and x[1] to be the real roots of f(x), if found.
- * Returns the number of real roots found.
- */
-int solve_quadratic(double *x, double a, double b, double c)
+
+// samples from the cumulative mass function w with n elements (much faster than rng_pmf)
+int rng_cmf(rng_t *rng, double *w, int n)
 {
-  double s2 = b*b - 4*a*c;
-  if (s2 < 0.0)
-    return 0;
+  double r = rng_uniform(rng);
+  return binary_search(r, w, n);
+}
 
-  double s = sqrt(s2);
-  x[0] = .5*(-b + s)/a;
-  x[1] = .5*(-b - s)/a;
 
-  return 2;
+// returns a random int between 0 and n-1
+int irand(int n)
+{
+  if (n < 0)
+    printf("Negative n: %d\n", n);
+  return rng_int(rng_default(), n);
 }
 
-/**
- * Solves the cubic equation: f(x) = a*x^3 + b*x^2 + c*x + d
- * Sets x[0], x[1], and x[2] to be the real roots of f(x), if found.
- * Returns the number of real roots found.
- *
-int solve_cubic(double *x, double a, double b, double c, double d)
+
+// returns a random double in [0,1)
+double frand()
 {
-  double p = -b/(3.0*a);
-  double q = p*p*p + (b*c - 3.0*a*d)/(6*a*a);
-  double r = c/(3.0*a);
-    
+  return rng_uniform(rng_default());
 }
-*/
 
 
-/**
- * Compute the eigenvalues z and eigenvectors V of a real symmetric n-by-n matrix X
- * The eigenvalues, z, will be sorted from smallest to largest in magnitude, and the
- * eigenvectors will be stored in the rows of V.
- * @param X (input) Symmetric n-by-n matrix
- * @param n (input) Dimensionality of X
- * @param z (output) Eigenvalues of X, from smallest to largest in magnitude
- * @param V (output) Eigenvectors of X, in the rows
- */
+// samples d integers from 0:n-1 uniformly without replacement
+void randperm(int *x, int n, int d)
+{
+  rng_randperm(rng_default(), x, n, d);
+}
 
-/*
-void eigen_symm(double z[], double **V, double **X, int n)
+// approximation to the inverse error function
+double erfinv(double x)
 {
-  double **Vt = matrix_clone(X,n,n);
-  double z2[n];
-  int i, j;
+  if (x < 0)
+    return -erfinv(-x);
 
-  //TODO: replace this with solve_cubic() for n < 4
+  double a = .147;
 
-  int info = LAPACKE_dsyevd(LAPACK_COL_MAJOR, 'V', 'U', n, Vt[0], n, z2);
-  if (info)
-    fprintf(stderr, "Error: eigen_symm failed to converge!\n");
+  double y1 = (2/(M_PI*a) + log(1-x*x)/2.0);
+  double y2 = sqrt(y1*y1 - (1/a)*log(1-x*x));
+  double y3 = sqrt(y2 - y1);
+  
+  return y3;
+}
 
-  // sort eigenvalues
-  double tolerance = 1e-10;
-  int idx[n];
-  sort_indices(z2, idx, n);
-  if (z2[idx[0]] < -tolerance)  // negative eigenvalues --> sort in reverse order
-    reversei(idx, idx, n);
-  for (i = 0; i < n; i++)
-    z[i] = z2[idx[i]];
-  for (i = 0; i < n; i++)
-    for (j = 0; j < n; j++)
-      V[i][j] = Vt[j][idx[i]];
 
-  //cleanup
-  free_matrix2(Vt);
+// generate a random sample from a normal distribution
+double normrand(double mu, double sigma)
+{
+  return mu + sigma*rng_normal(rng_default());
 }
-*/
 
 
-void eigen_symm_2d(double z[], double **V, double **X)
+// compute the pdf of a normal random variable
+double normpdf(double x, double mu, double sigma)
 {
-  double a = X[0][0];
-  double b = X[0][1];
-  double c = X[1][1];
-
-  const double epsilon = 1e-16;
+  double dx = x - mu;
 
-  if (b*b < epsilon * fabs(a*c)) {
-    if (fabs(a) < fabs(c)) {
-      z[0] = a;
-      z[1] = c;
-      V[0][0] = V[1][1] = 1.0;
-      V[0][1] = V[1][0] = 0.0;
-    }
-    else {
-      z[0] = c;
-      z[1] = a;
-      V[0][0] = V[1][1] = 0.0;
-      V[0][1] = V[1][0] = 1.0;
-    }
-    return;
-  }
+  return exp(-dx*dx / (2*sigma*sigma)) / (sqrt(2*M_PI) * sigma);
+}
 
-  double s = sqrt((a+c)*(a+c) + 4.*(b*b-a*c));
-  double z1 = (a+c+s)/2.;
-  double z2 = (a+c-s)/2.;
-  if (fabs(z1) < fabs(z2)) {
-    z[0] = z1;
-    z[1] = z2;
-  }
-  else {
-    z[1] = z1;
-    z[0] = z2;
-  }
 
-  double d0 = hypot(b, z[0]-a);
-  double d1 = hypot(b, z[1]-a);
-  V[0][0] = b/d0;
-  V[0][1] = (z[0]-a)/d0;
-  V[1][0] = b/d1;
-  V[1][1] = (z[1]-a)/d1;
+// samples from the probability mass function w with n elements
+int pmfrand(double *w, int n)
+{
+  return rng_pmf(rng_default(), w, n);
 }
 
+// samples from the cumulative mass function w with n elements (much faster than pmfrand)
+int cmfrand(double *w, int n)
+{
+  return rng_cmf(rng_default(), w, n);
+}
 
-void eigen_symm(double z[], double **V, double **X, int n)
+// sample from a multivariate normal
+void mvnrand(double *x, double *mu, double **S, int d)
 {
-  if (n == 2) {
-    eigen_symm_2d(z,V,X);
+  mvn_t mvn;
+  if (mvn_new(&mvn, mu, S, d) == 0) {
+    mvn_sample(x, &mvn, NULL);
+    mvn_free(&mvn);
     return;
   }
 
-  // naive Jacobi method
-  int i, j;
-  double tolerance = 1e-10;
-  double **A = matrix_clone(X,n,n);
-  double **B = new_matrix2(n,n);
-  double **G = new_matrix2(n,n);
-  double **Gt = new_matrix2(n,n);
+  // S isn't positive definite, so sample from its principal components
+  double z[d], **V = new_matrix2(d,d);
+  eigen_symm(z,V,S,d);
+  int i;
+  for (i = 0; i < d; i++)
+    z[i] = sqrt(MAX(z[i], 0));
 
-  int cnt = 1; //dbug
+  mvnrand_pcs(x,mu,z,V,d);
 
-  // initialize V = I
-  for (i = 0; i < n; i++) {
-    V[i][i] = 1;
-    for (j = i+1; j < n; j++)
-      V[i][j] = V[j][i] = 0;
+  free_matrix2(V);
+}
+
+double mvnpdf(double *x, double *mu, double **S, int d)
+{
+  mvn_t mvn;
+  if (mvn_new(&mvn, mu, S, d) == 0) {
+    double p = mvn_pdf(&mvn, x);
+    mvn_free(&mvn);
+    return p;
   }
 
-  //printf("break 1\n");  //dbug
+  // S isn't positive definite
+  double **S_inv = new_matrix2(d,d);
+  inv(S_inv, S, d);
+  
+  double dx[d];
+  sub(dx, x, mu, d);
+  double S_inv_dx[d];
+  matrix_vec_mult(S_inv_dx, S_inv, dx, d, d);
+  double dm = dot(dx, S_inv_dx, d);
 
-  while (1) {
+  double p = exp(-.5*dm) / sqrt(pow(2*M_PI, d) * det(S,d));
 
-    //dbug
-    //printf("A:\n");
-    //print_matrix(A, n, n);
-    //printf("\n");
+  free_matrix2(S_inv);
 
-    // check for convergence
-    double d_off = 0, d_diag = 0;
-    for (i = 0; i < n; i++) {
-      d_diag += A[i][i]*A[i][i];
-      for (j = i+1; j < n; j++)
-	d_off = MAX(d_off, fabs(A[i][j]));
-    }
-    d_diag = sqrt(d_diag / (double)n);
-    if (d_off < MAX(tolerance * d_diag, tolerance))
-      break;
+  return p;
 
-    //dbug
-    if (cnt++ % 1000 == 0)
-      fprintf(stderr, "d_off = %e, d_diag = %e\n", d_off, d_diag);  //dbug
+}
 
-    // find largest pivot
-    double pivot = 0;
-    int ip=0, jp=0;
-    for (i = 0; i < n; i++) {
-      for (j = i+1; j < n; j++) {
-	double p = fabs(A[i][j]);
-	if (p > pivot) {
-	  pivot = p;
-	  ip = i;
-	  jp = j;
-	}
-      }
-    }
-
-    //printf("pivot = %f, ip = %d, jp = %d\n", pivot, ip, jp);  //dbug
-    
-    // compute Givens cos, sin
-    double a = (A[jp][jp] - A[ip][ip]) / (2 * A[ip][jp]);
-    double t = 1 / (fabs(a) + sqrt(1 + a*a));  // tan
-    if (a < 0)
-      t = -t;
-    double c = 1 / sqrt(1 + t*t);  // cos
-    double s = t*c;  // sin
 
-    //printf("a = %f, t = %f, c = %f, s = %f\n", a, t, c, s);  //dbug
+#define MVN_BATCH_BLOCK 64
 
-    // compute Givens rotation matrix
-    for (i = 0; i < n; i++) {
-      G[i][i] = 1;
-      for (j = i+1; j < n; j++)
-	G[i][j] = G[j][i] = 0;
+/*
+ * Compute the log multivariate normal pdfs of the n rows of X, given the mean mu and the
+ * Cholesky factor L of the covariance (see cholesky()).  Points are processed in blocks,
+ * transposed so that the triangular solves are vectorized over points.
+ */
+void mvnpdf_log_chol_batch(double *logp, double **X, int n, double *mu, double **L, int d)
+{
+  int j, k, b, i0, nb;
+  double c = -.5*d*log(2*M_PI);
+  for (j = 0; j < d; j++)
+    c -= log(L[j][j]);
+
+  double Y[d][MVN_BATCH_BLOCK];  // Y[j][b] = component j of L^{-1}*(x_b - mu)
+  double m[MVN_BATCH_BLOCK];     // m[b] = squared mahalanobis distance of x_b
+
+  for (i0 = 0; i0 < n; i0 += MVN_BATCH_BLOCK) {
+    nb = MIN(MVN_BATCH_BLOCK, n - i0);
+
+    for (b = 0; b < nb; b++)
+      for (j = 0; j < d; j++)
+	Y[j][b] = X[i0+b][j] - mu[j];
+    memset(m, 0, nb*sizeof(double));
+
+    // forward substitution, y_j = (dx_j - sum_{k<j} L[j][k]*y_k) / L[j][j]
+    for (j = 0; j < d; j++) {
+      double *yj = Y[j];
+      for (k = 0; k < j; k++) {
+	double a = L[j][k], *yk = Y[k];
+	b = 0;
+#ifdef VECD_WIDTH
+	vecd_t va = vecd_set1(a);
+	for (; b + VECD_WIDTH <= nb; b += VECD_WIDTH)
+	  vecd_store(yj+b, vecd_sub(vecd_load(yj+b), vecd_mul(va, vecd_load(yk+b))));
+#endif
+	for (; b < nb; b++)
+	  yj[b] -= a*yk[b];
+      }
+      double a = 1/L[j][j];
+      b = 0;
+#ifdef VECD_WIDTH
+      vecd_t va = vecd_set1(a);
+      for (; b + VECD_WIDTH <= nb; b += VECD_WIDTH) {
+	vecd_t y = vecd_mul(va, vecd_load(yj+b));
+	vecd_store(yj+b, y);
+	vecd_store(m+b, vecd_add(vecd_load(m+b), vecd_mul(y, y)));
+      }
+#endif
+      for (; b < nb; b++) {
+	yj[b] *= a;
+	m[b] += yj[b]*yj[b];
+      }
     }
-    G[ip][ip] = G[jp][jp] = c;
-    G[ip][jp] = s;
-    G[jp][ip] = -s;
-
-    //dbug
-    //printf("givens rotation matrix:\n");
-    //print_matrix(G, n, n);
-    //printf("\n");
-    
-    // compute new A
-    transpose(Gt, G, n, n);
-    matrix_mult(B, A, G, n, n, n);   // B = A*G
-    matrix_mult(A, Gt, B, n, n, n);  // A = Gt*B
-    
-    // compute new V (with eigenvectors in the rows)
-    matrix_mult(B, Gt, V, n, n, n);  // B = Gt*V
-    matrix_copy(V, B, n, n);     // V = B;
+
+    for (b = 0; b < nb; b++)
+      logp[i0+b] = c - .5*m[b];
   }
+}
 
-  //printf("break 2\n");  //dbug
 
-  // sort eigenvalues
-  int idx[n];
-  double z2[n];
-  for (i = 0; i < n; i++)
-    z[i] = A[i][i];
-  sort_indices(z, idx, n);
-  if (z[idx[0]] < -tolerance) {  // negative eigenvalues --> sort in reverse order
-    reversei(idx, idx, n);
-    //for (i = 0; i < n/2; i++) {
-    //  int tmp = idx[i];
-    //  idx[i] = idx[n-i-1];
-    //  idx[n-i-1] = tmp;
-    //}
+/*
+ * Initialize a multivariate normal distribution with mean mu and covariance S.  Returns 0 on
+ * success, or -1 if S isn't positive definite (in which case mvn is left empty).
+ */
+int mvn_new(mvn_t *mvn, double *mu, double **S, int d)
+{
+  memset(mvn, 0, sizeof(mvn_t));
+  mvn->d = d;
+  safe_calloc(mvn->mu, d, double);
+  mvn->S = new_matrix2(d,d);
+  mvn->L = new_matrix2(d,d);
+  mvn->S_inv = new_matrix2(d,d);
+
+  if (mvn_set(mvn, mu, S) < 0) {
+    mvn_free(mvn);
+    return -1;
   }
-  for (i = 0; i < n; i++)
-    z2[i] = z[idx[i]];
-  for (i = 0; i < n; i++)
-    z[i] = z2[i];
-  for (i = 0; i < n; i++)
-    for (j = 0; j < n; j++)
-      B[i][j] = V[idx[i]][j];
-  matrix_copy(V, B, n, n);
 
-  free_matrix2(A);
-  free_matrix2(B);
-  free_matrix2(G);
-  free_matrix2(Gt);
+  return 0;
 }
 
 
-// reorder the rows of X, Y = X(idx,:)
-void reorder_rows(double **Y, double **X, int *idx, int n, int m)
+/*
+ * Change the mean and covariance of a multivariate normal.  Returns 0 on success, or -1 if S
+ * isn't positive definite (in which case mvn is unchanged).
+ */
+int mvn_set(mvn_t *mvn, double *mu, double **S)
 {
-  int i;
-  double **Y2 = (X==Y ? new_matrix2(n,m) : Y);
-  for (i = 0; i < n; i++)
-    memcpy(Y2[i], X[idx[i]], m*sizeof(double));
-  if (X==Y) {
-    matrix_copy(Y, Y2, n, m);
-    free_matrix2(Y2);
+  int i, j, k, d = mvn->d;
+
+  double L_raw[d*d], *L[d];
+  for (i = 0; i < d; i++)
+    L[i] = L_raw + i*d;
+  if (cholesky(L, S, d) < 0)
+    return -1;
+
+  memcpy(mvn->mu, mu, d*sizeof(double));
+  matrix_copy(mvn->S, S, d, d);
+  matrix_copy(mvn->L, L, d, d);
+
+  mvn->logdet = 0;
+  for (i = 0; i < d; i++)
+    mvn->logdet += 2*log(L[i][i]);
+
+  // S_inv = L^{-T}*L^{-1}, with L^{-1} computed by forward substitution (into L)
+  for (j = 0; j < d; j++) {
+    for (i = j; i < d; i++) {
+      double s = (i == j ? 1 : 0);
+      for (k = j; k < i; k++)
+	s -= mvn->L[i][k] * L[k][j];
+      L[i][j] = s / mvn->L[i][i];
+    }
+  }
+  for (i = 0; i < d; i++) {
+    for (j = i; j < d; j++) {
+      double s = 0;
+      for (k = j; k < d; k++)
+	s += L[k][i] * L[k][j];
+      mvn->S_inv[i][j] = mvn->S_inv[j][i] = s;
+    }
   }
+
+  return 0;
 }
 
-// reorder the rows of X, Y = X(idx,:)
-void reorder_rowsi(int **Y, int **X, int *idx, int n, int m)
+
+void mvn_free(mvn_t *mvn)
 {
-  int i;
-  int **Y2 = (X==Y ? new_matrix2i(n,m) : Y);
-  for (i = 0; i < n; i++)
-    memcpy(Y2[i], X[idx[i]], m*sizeof(int));
-  if (X==Y) {
-    memcpy(Y[0], Y2[0], n*m*sizeof(int));
-    free_matrix2i(Y2);
-  }
+  if (mvn->mu)
+    free(mvn->mu);
+  if (mvn->S)
+    free_matrix2(mvn->S);
+  if (mvn->L)
+    free_matrix2(mvn->L);
+  if (mvn->S_inv)
+    free_matrix2(mvn->S_inv);
+  memset(mvn, 0, sizeof(mvn_t));
 }
 
-void repmat(double **B, double **A, int rep_n, int rep_m, int n, int m)
-{
-  int i, rep_i, rep_j;
 
-  // copy A into top-left corner of B
-  if (A != B)
-    for (i = 0; i < n; ++i)
-      memcpy(B[i], A[i], m * sizeof(double)); 
+double mvn_logpdf(mvn_t *mvn, double *x)
+{
+  int i, k, d = mvn->d;
+  double y[d], m = 0;
 
-  // repeat top-left corner to the right
-  for (i = 0; i < n; ++i)
-    for (rep_j = 1; rep_j < rep_m; ++rep_j)
-      memcpy(&B[i][rep_j * m], B[i], m * sizeof(double)); 
+  // y = L^{-1}*(x - mu)
+  for (i = 0; i < d; i++) {
+    double s = x[i] - mvn->mu[i];
+    for (k = 0; k < i; k++)
+      s -= mvn->L[i][k] * y[k];
+    y[i] = s / mvn->L[i][i];
+    m += y[i]*y[i];
+  }
 
-  // repeat top of B downwards
-  for (rep_i = 1; rep_i < rep_n; ++rep_i)
-    memcpy(B[rep_i * n], B[0], m * rep_m * n * sizeof(double));
+  return -.5*(d*log(2*M_PI) + mvn->logdet + m);
 }
 
-void repmati(int **B, int **A, int rep_n, int rep_m, int n, int m)
+
+double mvn_pdf(mvn_t *mvn, double *x)
 {
-  int i, rep_i, rep_j;
+  return exp(mvn_logpdf(mvn, x));
+}
 
-  // copy A into top-left corner of B
-  if (A != B)
-    for (i = 0; i < n; ++i)
-      memcpy(B[i], A[i], m * sizeof(int)); 
 
-  // repeat top-left corner to the right
-  for (i = 0; i < n; ++i)
-    for (rep_j = 1; rep_j < rep_m; ++rep_j)
-      memcpy(&B[i][rep_j * m], B[i], m * sizeof(int)); 
+typedef struct {
+  double *logp;
+  mvn_t *mvn;
+  double **X;
+} mvn_logpdf_batch_t;
 
-  // repeat top of B downwards
-  for (rep_i = 1; rep_i < rep_n; ++rep_i)
-    memcpy(B[rep_i * n], B[0], m * rep_m * n * sizeof(int));
+static void mvn_logpdf_batch_block(int i0, int i1, void *data)
+{
+  mvn_logpdf_batch_t *args = (mvn_logpdf_batch_t *)data;
+  mvn_t *mvn = args->mvn;
+  mvnpdf_log_chol_batch(args->logp + i0, args->X + i0, i1 - i0, mvn->mu, mvn->L, mvn->d);
 }
 
 /*
- * blur matrix with a 3x3 gaussian filter with sigma=.5
+ * Compute the log pdfs of the n rows of X (in parallel, for large n).
  */
-void blur_matrix(double **dst, double **src, int n, int m)
+void mvn_logpdf_batch(double *logp, mvn_t *mvn, double **X, int n)
 {
-  double G[3] = {.6193, .0838, .0113};
-
-  double **I = (dst==src ? new_matrix2(n,m) : dst);
-  memcpy(I[0], src[0], n*m*sizeof(double));
+  mvn_logpdf_batch_t args = {logp, mvn, X};
+  parallel_for(n, mvn_logpdf_batch_block, &args);
+}
 
-  int i,j;
-  for (i = 1; i < n-1; i++)
-    for (j = 1; j < m-1; j++)
-      I[i][j] = G[0]*src[i][j] + G[1]*(src[i+1][j] + src[i-1][j] + src[i][j+1] + src[i][j-1]) + G[2]*(src[i+1][j+1] + src[i+1][j-1] + src[i-1][j+1] + src[i-1][j-1]);
 
-  if (dst==src) {
-    memcpy(dst[0], I[0], n*m*sizeof(double));
-    free_matrix2(I);
-  }
+/*
+ * Sample from a multivariate normal, x = mu + L*z (rng may be NULL for the default stream).
+ */
+void mvn_sample(double *x, mvn_t *mvn, rng_t *rng)
+{
+  mvn_sample_batch(&x, mvn, 1, rng);
 }
 
+
 /*
- * blur masked matrix with a 3x3 gaussian filter with sigma=.5
+ * Sample n points (the rows of X) from a multivariate normal (rng may be NULL for the default stream).
  */
-void blur_matrix_masked(double **dst, double **src, int **mask, int n, int m)
+void mvn_sample_batch(double **X, mvn_t *mvn, int n, rng_t *rng)
 {
-  double G[3] = {.6193, .0838, .0113};
-
-  double **I = (dst==src ? new_matrix2(n,m) : dst);
-  memcpy(I[0], src[0], n*m*sizeof(double));
+  if (rng == NULL)
+    rng = rng_default();
 
-  int i,j;
-  for (i = 1; i < n-1; i++) {
-    for (j = 1; j < m-1; j++) {
-      double x[9] = {mask[i][j] ? src[i][j] : 0., mask[i+1][j] ? src[i+1][j] : 0., mask[i-1][j] ? src[i-1][j] : 0., mask[i][j+1] ? src[i][j+1] : 0., mask[i][j-1] ? src[i][j-1] : 0.,
-		  mask[i+1][j+1] ? src[i+1][j+1] : 0., mask[i+1][j-1] ? src[i+1][j-1] : 0., mask[i-1][j+1] ? src[i-1][j+1] : 0., mask[i-1][j-1] ? src[i-1][j-1] : 0.};
+  int i, j, k, d = mvn->d;
+  for (i = 0; i < n; i++) {
+    double *x = X[i];
+    rng_normal_batch(rng, x, d);
+
+    // x = mu + L*z (in place, from the bottom up, since L is lower triangular)
+    for (j = d-1; j >= 0; j--) {
+      double s = mvn->mu[j];
+      for (k = 0; k <= j; k++)
+	s += mvn->L[j][k] * x[k];
+      x[j] = s;
+    }
+  }
+}
 
-      double v = G[0]*x[0] + G[1]*(x[1] + x[2] + x[3] + x[4]) + G[2]*(x[5] + x[6] + x[7] + x[8]);
+/* compute a multivariate normal pdf
+double mvnpdf(double *x, double *mu, double **S, int d)
+{
+  double z[d], **V = new_matrix2(d,d);
+  eigen_symm(z,V,S,d);
+  int i;
+  for (i = 0; i < d; i++)
+    z[i] = sqrt(z[i]);
 
-      int n0 = !!mask[i][j];
-      int n1 = !!mask[i+1][j] + !!mask[i-1][j] + !!mask[i][j+1] + !!mask[i][j-1];
-      int n2 = !!mask[i+1][j+1] + !!mask[i-1][j-1] + !!mask[i-1][j+1] + !!mask[i+1][j-1];
-      double g_tot = n0*G[0] + n1*G[1] + n2*G[2];
+  printf("S = [%f %f %f; %f %f %f; %f %f %f]\n", S[0][0], S[0][1], S[0][2], S[1][0], S[1][1], S[1][2], S[2][0], S[2][1], S[2][2]); //dbug
+  printf("z = [%f, %f, %f]\n", z[0], z[1], z[2]); //dbug
 
-      I[i][j] = v / g_tot;
-    }
-  }
+  double p = mvnpdf_pcs(x,mu,z,V,d);
 
-  if (dst==src) {
-    memcpy(dst[0], I[0], n*m*sizeof(double));
-    free_matrix2(I);
-  }
+  free_matrix2(V);
+  return p;
 }
+*/
 
-void print_matrix(double **X, int n, int m)
+// sample from a multivariate normal in principal components form
+void mvnrand_pcs(double *x, double *mu, double *z, double **V, int d)
 {
-  int i, j;
-  for (i = 0; i < n; i++) {
-    for (j = 0; j < m; j++)
-      printf("%E ", X[i][j]);
-    printf("\n");
-  }
+  mvnrand_pcs_rng(x, mu, z, V, d, rng_default());
 }
 
-
-// perform linear regression: dot(b,x[i]) = y[i], i=1..n
-void linear_regression(double *b, double **X, double *y, int n, int d)
+// sample from a multivariate normal in principal components form, with a given random number generator
+void mvnrand_pcs_rng(double *x, double *mu, double *z, double **V, int d, rng_t *rng)
 {
-  double **Xt = new_matrix2(d,n);
-  transpose(Xt,X,n,d);
-
-  double **XtX = new_matrix2(d,d);
-  matrix_mult(XtX,Xt,X,d,n,d);
-
-  double Xty[d];
-  matrix_vec_mult(Xty,Xt,y,d,n);
+  int i;
+  double s, v[d];
 
-  solve(b, XtX, Xty, d);
+  memcpy(x, mu, d*sizeof(double));
 
-  free_matrix2(Xt);
-  free_matrix2(XtX);
+  for (i = 0; i < d; i++) {
+    s = z[i]*rng_normal(rng);
+    mult(v, V[i], s, d);  // v = s*V[i]
+    add(x, x, v, d);      // x += v
+  }
 }
 
 
-// fit a polynomial: \sum{b[i]*x[j]^i} = y[j], i=1..n, j=1..d
-void polynomial_regression(double *b, double *x, double *y, int n, int d)
+// compute a multivariate normal pdf in principal components form
+double mvnpdf_pcs(double *x, double *mu, double *z, double **V, int d)
 {
-  double **X = new_matrix2(n,d);
-
-  int i, j;
-  for (i = 0; i < n; i++)
-    X[i][0] = 1;
-
-  for (i = 0; i < n; i++)
-    for (j = 1; j < d; j++)
-      X[i][j] = X[i][j-1]*x[i];
+  int i;
+  double xv, dx[d];
+  sub(dx, x, mu, d);  // dx = x - mu
 
-  linear_regression(b,X,y,n,d);
+  double logp = -(d/2.0)*log(2*M_PI) - log(prod(z,d));
+  for (i = 0; i < d; i++) {
+    xv = dot(dx, V[i], d) / z[i];
+    logp -= 0.5*xv*xv;
+  }
 
-  free_matrix2(X);
+  return exp(logp);
 }
 
 
+// sample from an angular central gaussian in principal components form
+void acgrand_pcs(double *x, double *z, double **V, int d)
+{
+  acgrand_pcs_rng(x, z, V, d, rng_default());
+}
 
-
-
-
-/* create a new graph
-graph_t *graph_new(int num_vertices, int edge_capacity)
+// sample from an angular central gaussian in principal components form, with a given random number generator
+void acgrand_pcs_rng(double *x, double *z, double **V, int d, rng_t *rng)
 {
   int i;
-  graph_t *g = (graph_t *)malloc(sizeof(graph_t));
-
-  g->nv = num_vertices;
-  g->vertices = (vertex_t *)calloc(g->nv, sizeof(vertex_t));
-  for (i = 0; i < g->nv; i++)
-    g->vertices[i].index = i;
-
-  g->ne = 0;
-  g->_edge_capacity = edge_capacity;
-  g->edges = (edge_t *)calloc(edge_capacity, sizeof(edge_t));
+  double mu[d];
+  for (i = 0; i < d; i++)
+    mu[i] = 0;
 
-  return g;
+  mvnrand_pcs_rng(x, mu, z, V, d, rng);
+  normalize(x, x, d);
 }
-*/
 
 
-// free a graph
-void graph_free(graph_t *g)
+// compute an angular central gaussian pdf in principal components form
+double acgpdf_pcs(double *x, double *z, double **V, int d)
 {
   int i;
-  free(g->edges);
-  for (i = 0; i < g->nv; i++) {
-    free(g->vertices[i].edges);
-    ilist_free(g->vertices[i].neighbors);
+  double p = 1 / (prod(z,d) * surface_area_sphere(d-1));
+  double xv, md = 0;  // mahalanobis distance
+  for (i = 0; i < d; i++) {
+    xv = dot(x, V[i], d) / z[i];
+    md += xv*xv;
   }
-  free(g);
+  p *= pow(md, -d/2);
+  
+  return p;
 }
 
 
-/* add an edge to a graph
-void graph_add_edge(graph_t *g, int i, int j)
+// create a new n-by-m-by-p 3d matrix of doubles
+double ***new_matrix3(int n, int m, int p)
 {
-  ilist
-  for 
+  if (n*m*p == 0) return NULL;
+  int i;
+  double **X2 = new_matrix2(n*m, p);
+  double ***X;
+  safe_malloc(X, n, double**);
+  for (i = 0; i < n; i++)
+    X[i] = X2 + m*i;
 
+  return X;
+}
 
-  if (g->ne == g->_edge_capacity) {
-    g->_edge_capacity *= 2;
-    g->edges = (edge_t *)realloc(g->edges, g->_edge_capacity * sizeof(edge_t));
-  }
+// free a 3d matrix
+void free_matrix3(double ***X)
+{
+  free_matrix2(X[0]);
+  free(X);
+}
 
-  g->edges[g->ne].i = i;
-  g->edges[g->ne].j = j;
-  g->ne++;
+// create a new n-by-m-by-p 3d matrix of floats
+float ***new_matrix3f(int n, int m, int p)
+{
+  if (n*m*p == 0) return NULL;
+  int i;
+  float **X2 = new_matrix2f(n*m, p);
+  float ***X;
+  safe_malloc(X, n, float**);
+  for (i = 0; i < n; i++)
+    X[i] = X2 + m*i;
 
-  g->vertices[i]
+  return X;
 }
-*/
 
+// free a 3d matrix
+void free_matrix3f(float ***X)
+{
+  free_matrix2f(X[0]);
+  free(X);
+}
 
-// find the index of an edge in a graph
-int graph_find_edge(graph_t *g, int i, int j)
+// create a new n-by-m 2d matrix of doubles
+double **new_matrix2(int n, int m)
 {
-  int k = ilist_find(g->vertices[i].neighbors, j);
+  if (n*m == 0) return NULL;
+  int i;
+  double *raw, **X;
+  safe_calloc(raw, n*m, double);
+  safe_malloc(X, n, double*);
 
-  if (k < 0)
-    return -1;
+  for (i = 0; i < n; i++)
+    X[i] = raw + m*i;
 
-  return g->vertices[i].edges[k];
+  return X;
 }
 
-
-// smooth the edges of a graph
-void graph_smooth(double **dst, double **src, graph_t *g, int d, double w)
+void add_rows_matrix2(double ***X, int n, int m, int new_n)
 {
-  int i, j;
-  double p[d];
-  ilist_t *v;
-
-  if (dst != src)
-    memcpy(dst[0], src[0], d*g->nv*sizeof(double));
-
-  for (i = 0; i < g->nv; i++) {
-    memset(p, 0, d * sizeof(double));                        // p = 0
-    for (v = g->vertices[i].neighbors; v; v = v->next) {
-      j = v->x;
-      add(p, p, dst[j], d);                                  // p += dst[j]
-    }
-    mult(p, p, 1/norm(p, d), d);                             // p = p/norm(p)
+  int i;
+  double *raw = (*X)[0];
+  safe_realloc(raw, m * new_n, double);
+  safe_realloc(*X, new_n, double*);
+  for (i = 0; i < new_n; i++)
+    (*X)[i] = raw + m*i;
+}
 
-    wavg(dst[i], p, dst[i], w, d);                           // dst[i] = w*p + (1-w)*dst[i]
+/*
+void resize_matrix2(double ***X, int n, int m, int n2, int m2)
+{
+  if (m2 == m)
+    add_rows_matrix2(X, n, m, n2);
+  else {
+    
   }
 }
+*/
 
-
-static int dcomp(const void *px, const void *py)
+// create a new n-by-m 2d matrix of floats
+float **new_matrix2f(int n, int m)
 {
-  double x = *(double *)px;
-  double y = *(double *)py;
+  if (n*m == 0) return NULL;
+  int i;
+  float *raw, **X;
+  safe_calloc(raw, n*m, float);
+  safe_malloc(X, n, float*);
 
-  if (x == y)
-    return 0;
+  for (i = 0; i < n; i++)
+    X[i] = raw + m*i;
 
-  return (x < y ? -1 : 1);
+  return X;
 }
 
-// sample uniformly from a simplex S with n vertices
-void sample_simplex(double x[], double **S, int n, int d)
+// create a new n-by-m 2d matrix of ints
+int **new_matrix2i(int n, int m)
 {
-  int i;
-
-  // get n-1 uniform samples, u, on [0,1], and sort them
-  double u[n];
-  for (i = 0; i < n-1; i++)
-    u[i] = frand();
-  u[n-1] = 1;
-
-  qsort((void *)u, n-1, sizeof(double), dcomp);
+  if (n*m == 0) return NULL;
+  int i, *raw, **X;
+  safe_calloc(raw, n*m, int);
+  safe_malloc(X, n, int*);
 
-  // mixing coefficients are the order statistics of u
-  double c[n];
-  c[0] = u[0];
-  for (i = 1; i < n; i++)
-    c[i] = u[i] - u[i-1];
+  for (i = 0; i < n; i++)
+    X[i] = raw + m*i;
 
-  // x = sum(c[i]*S[i])
-  mult(x, S[0], c[0], d);
-  for (i = 1; i < n; i++) {
-    double y[d];
-    mult(y, S[i], c[i], d);
-    add(x, x, y, d);
-  }
+  return X;
 }
 
+// create a new n-by-m 2d matrix of doubles
+double **new_matrix2_data(int n, int m, double *data)
+{
+  double **X = new_matrix2(n,m);
+  memcpy(X[0], data, n*m*sizeof(double));
+  return X;
+}
 
-/*******************
-typedef struct {
-  int nv;
-  int ne;
-  int nf;
-  int *vertices;
-  edge_t *edges;
-  face_t *faces;
-  int *nvn;  // # vertex neighbors
-  int *nen;  // # edge neighbors
-  int **vertex_neighbors;  // vertex -> {vertices}
-  int **vertex_edges;      // vertex -> {edges}
-  int **edge_neighbors;    // edge -> {vertices}
-  int **edge_faces;        // edge -> {faces}
-  // internal vars
-  int _vcap;
-  int _ecap;
-  int _fcap;
-  int *_vncap;
-  int *_encap;
-} meshgraph_t;
-******************/
+// create a new n-by-m 2d matrix of floats
+float **new_matrix2f_data(int n, int m, float *data)
+{
+  float **X = new_matrix2f(n,m);
+  memcpy(X[0], data, n*m*sizeof(float));
+  return X;
+}
 
+// create a new n-by-m 2d matrix of ints
+int **new_matrix2i_data(int n, int m, int *data)
+{
+  int **X = new_matrix2i(n,m);
+  memcpy(X[0], data, n*m*sizeof(int));
+  return X;
+}
 
 /*
- * Create a new meshgraph with initial vertex capacity 'vcap' and degree capacity 'dcap'.
- */
-meshgraph_t *meshgraph_new(int vcap, int dcap)
+double **add_matrix_row(double **X, int n, int m)
 {
-  int i;
-  meshgraph_t *g;
-  safe_calloc(g, 1, meshgraph_t);
+  //printf("DANGER! Reallocating matrix rows is not tested yet!\n");
+  double *raw = X[0];
+  safe_realloc(raw, (n + 1) * m, double);
+  safe_realloc(X, n+1, double*);
+  X[n] = raw + m * n;
 
-  safe_malloc(g->vertices, vcap, int);
-  safe_malloc(g->edges, vcap, edge_t);
-  safe_malloc(g->faces, vcap, face_t);
+  return X;
+}
+*/
 
-  g->_vcap = g->_ecap = g->_fcap = vcap;
-  safe_malloc(g->_vncap, vcap, int);
-  safe_malloc(g->_encap, vcap, int);
+double **new_identity_matrix2(int n) {
+  double **mat = new_matrix2(n, n);
+  int i;
+  for (i = 0; i < n; ++i)
+    mat[i][i] = 1;
+  return mat;
+}
 
-  safe_malloc(g->vertex_neighbors, vcap, int *);
-  safe_malloc(g->vertex_edges, vcap, int *);
-  safe_calloc(g->nvn, vcap, int);
-  for (i = 0; i < vcap; i++) {
-    safe_malloc(g->vertex_neighbors[i], dcap, int);
-    safe_malloc(g->vertex_edges[i], dcap, int);
-    g->_vncap[i] = dcap;
-  }
+int **new_identity_matrix2i(int n) {
+  int **mat = new_matrix2i(n, n);
+  int i;
+  for (i = 0; i < n; ++i)
+    mat[i][i] = 1;
+  return mat;
+}
 
-  safe_malloc(g->edge_neighbors, vcap, int *);
-  safe_malloc(g->edge_faces, vcap, int *);
-  safe_calloc(g->nen, vcap, int);
-  for (i = 0; i < vcap; i++) {
-    safe_malloc(g->edge_neighbors[i], dcap, int);
-    safe_malloc(g->edge_faces[i], dcap, int);
-    g->_encap[i] = dcap;
+double **new_diag_matrix2(double *diag, int n) {
+  double **mat = new_matrix2(n, n);
+  int i;
+  for (i = 0; i < n; ++i) {
+    mat[i][i] = diag[i];
   }
-
-  return g;
+  return mat;
 }
 
+int **new_diag_matrix2i(int *diag, int n) {
+  int **mat = new_matrix2i(n, n);
+  int i;
+  for (i = 0; i < n; ++i) {
+    mat[i][i] = diag[i];
+  }
+  return mat;
+}
+
+// free a 2d matrix of doubles
+void free_matrix2(double **X)
+{
+  if (X == NULL) return;
+  free(X[0]);
+  free(X);
+}
+
+// free a 2d matrix of floats
+void free_matrix2f(float **X)
+{
+  if (X == NULL) return;
+  free(X[0]);
+  free(X);
+}
+
+// free a 2d matrix of ints
+void free_matrix2i(int **X)
+{
+  if (X == NULL) return;
+  free(X[0]);
+  free(X);
+}
+
+/*
+ * Binary matrix files have a 32 byte header followed by the matrix entries in row-major
+ * order, as doubles (MATRIX_FILE_DOUBLE) or floats (MATRIX_FILE_FLOAT).
+ */
+#define MATRIX_FILE_MAGIC "BHMATRIX"
+#define MATRIX_FILE_VERSION 1
+#define MATRIX_FILE_DOUBLE 0
+#define MATRIX_FILE_FLOAT 1
+
+typedef struct {
+  char magic[8];
+  int32_t version;
+  int32_t dtype;
+  int64_t rows;
+  int64_t cols;
+} matrix_file_header_t;
+
+// does fname end in ".bmat"?
+static int matrix_file_is_binary_name(const char *fname)
+{
+  size_t len = strlen(fname);
+  return (len >= 5 && !strcmp(fname + len - 5, ".bmat"));
+}
+
+// check the header of a binary matrix file with size bytes (returns 1 if it's valid)
+static int matrix_file_check_header(const matrix_file_header_t *header, size_t size)
+{
+  if (size < sizeof(matrix_file_header_t) ||
+      memcmp(header->magic, MATRIX_FILE_MAGIC, 8) != 0 ||
+      header->version != MATRIX_FILE_VERSION ||
+      (header->dtype != MATRIX_FILE_DOUBLE && header->dtype != MATRIX_FILE_FLOAT) ||
+      header->rows < 0 || header->cols < 0 || header->rows > INT32_MAX || header->cols > INT32_MAX)
+    return 0;
+  size_t esize = (header->dtype == MATRIX_FILE_DOUBLE ? sizeof(double) : sizeof(float));
+  return (header->cols == 0 || (size - sizeof(matrix_file_header_t)) / esize / header->cols >= (uint64_t)header->rows);
+}
+
+/*
+ * Write a matrix in binary format (as floats if use_float is set).  Returns 0 on success, or -1
+ * on error.
+ */
+int save_matrix_binary(char *fout, double **X, int n, int m, int use_float)
+{
+  FILE *f = fopen(fout, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Error: couldn't open %s for writing\n", fout);
+    return -1;
+  }
+
+  matrix_file_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MATRIX_FILE_MAGIC, 8);
+  header.version = MATRIX_FILE_VERSION;
+  header.dtype = (use_float ? MATRIX_FILE_FLOAT : MATRIX_FILE_DOUBLE);
+  header.rows = n;
+  header.cols = m;
+  int ok = (fwrite(&header, sizeof(header), 1, f) == 1);
+
+  int i, j;
+  float buf[MAX(m,1)];
+  for (i = 0; i < n && m > 0 && ok; i++) {
+    if (use_float) {
+      for (j = 0; j < m; j++)
+	buf[j] = (float)X[i][j];
+      ok = (fwrite(buf, sizeof(float), m, f) == (size_t)m);
+    }
+    else
+      ok = (fwrite(X[i], sizeof(double), m, f) == (size_t)m);
+  }
+
+  if (fclose(f) != 0 || !ok) {
+    fprintf(stderr, "Error writing matrix to %s\n", fout);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Write a matrix in the following format.
+ *
+ * <nrows> <ncols>
+ * <row 1>
+ * <row 2>
+ * ...
+ *
+ * (or in binary format, if fout ends in ".bmat").
+ */
+void save_matrix(char *fout, double **X, int n, int m)
+{
+  //fprintf(stderr, "saving matrix to %s\n", fout);
+
+  if (matrix_file_is_binary_name(fout)) {
+    save_matrix_binary(fout, X, n, m, 0);
+    return;
+  }
+
+  FILE *f = fopen(fout, "w");
+  if (f == NULL) {
+    fprintf(stderr, "Error: couldn't open %s for writing\n", fout);
+    return;
+  }
+  int i, j;
+
+  fprintf(f, "%d %d\n", n, m);
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < m; j++)
+      fprintf(f, "%f ", X[i][j]);
+    fprintf(f, "\n");
+  }
+
+  fclose(f);
+}
+
+void save_matrixi(char *fout, int **X, int n, int m)
+{
+  //fprintf(stderr, "saving matrix to %s\n", fout);
+
+  FILE *f = fopen(fout, "w");
+  int i, j;
+
+  fprintf(f, "%d %d\n", n, m);
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < m; j++)
+      fprintf(f, "%d ", X[i][j]);
+    fprintf(f, "\n");
+  }
+
+  fclose(f);
+}
+
+// read a line of any length from f into *buf (which is grown as needed)
+static char *matrix_read_line(FILE *f, char **buf, size_t *cap)
+{
+  size_t len = 0;
+  if (*buf == NULL) {
+    *cap = 1024;
+    safe_malloc(*buf, *cap, char);
+  }
+  while (fgets(*buf + len, *cap - len, f)) {
+    len += strlen(*buf + len);
+    if ((*buf)[len-1] == '\n')
+      return *buf;
+    if (len + 1 == *cap) {
+      *cap *= 2;
+      safe_realloc(*buf, *cap, char);
+    }
+  }
+  return (len > 0 ? *buf : NULL);
+}
+
+// load a binary matrix file (after its magic number has been read)
+static double **load_matrix_binary(FILE *f, char *fin, int *n, int *m)
+{
+  matrix_file_header_t header;
+  memcpy(header.magic, MATRIX_FILE_MAGIC, 8);
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 8, SEEK_SET);
+  if (fread((char *)&header + 8, sizeof(header) - 8, 1, f) < 1 || !matrix_file_check_header(&header, size)) {
+    fprintf(stderr, "Corrupt matrix header in file %s\n", fin);
+    return NULL;
+  }
+
+  *n = header.rows;
+  *m = header.cols;
+  if (*n == 0 || *m == 0) {
+    fprintf(stderr, "Warning: empty (%d x %d) matrix in file %s\n", *n, *m, fin);
+    return NULL;
+  }
+  double **X = new_matrix2(*n, *m);
+
+  size_t i, cnt = (size_t)(*n) * (*m);
+  if (header.dtype == MATRIX_FILE_DOUBLE) {
+    if (fread(X[0], sizeof(double), cnt, f) == cnt)
+      return X;
+  }
+  else {
+    const size_t chunk = 4096;
+    float buf[chunk];
+    for (i = 0; i < cnt; i += chunk) {
+      size_t j, c = MIN(chunk, cnt - i);
+      if (fread(buf, sizeof(float), c, f) != c)
+	break;
+      for (j = 0; j < c; j++)
+	X[0][i+j] = buf[j];
+    }
+    if (i >= cnt)
+      return X;
+  }
+
+  fprintf(stderr, "Corrupt matrix file '%s'\n", fin);
+  free_matrix2(X);
+  return NULL;
+}
+
+/*
+ * Load a matrix in the following format.
+ *
+ * <nrows> <ncols>
+ * <row 1>
+ * <row 2>
+ * ...
+ *
+ * (or in binary format, see save_matrix_binary()).  Returns NULL on error, or if the matrix
+ * is empty (0 rows or columns), in which case *n and *m are still set.
+ */
+double **load_matrix(char *fin, int *n, int *m)
+{
+  FILE *f = fopen(fin, "rb");
+
+  if (f == NULL) {
+    fprintf(stderr, "Invalid filename: %s", fin);
+    return NULL;
+  }
+
+  char magic[8];
+  if (fread(magic, 1, 8, f) == 8 && !memcmp(magic, MATRIX_FILE_MAGIC, 8)) {
+    double **X = load_matrix_binary(f, fin, n, m);
+    fclose(f);
+    return X;
+  }
+  rewind(f);
+
+  char *s = NULL;
+  size_t cap;
+  if (matrix_read_line(f, &s, &cap) == NULL || sscanf(s, "%d %d", n, m) < 2 || *n < 0 || *m < 0) {
+    fprintf(stderr, "Corrupt matrix header in file %s\n", fin);
+    free(s);
+    fclose(f);
+    return NULL;
+  }
+  if (*n == 0 || *m == 0) {
+    fprintf(stderr, "Warning: empty (%d x %d) matrix in file %s\n", *n, *m, fin);
+    free(s);
+    fclose(f);
+    return NULL;
+  }
+
+  double **X = new_matrix2(*n, *m);
+
+  int i, j;
+  for (i = 0; i < *n; i++) {
+    if (matrix_read_line(f, &s, &cap) == NULL)
+      break;
+    char *p = s, *end;
+    for (j = 0; j < *m; j++) {
+      X[i][j] = strtod(p, &end);
+      if (end == p)
+	break;
+      p = end;
+    }
+    if (j < *m)
+      break;
+  }
+  free(s);
+  fclose(f);
+
+  if (i < *n) {
+    fprintf(stderr, "Corrupt matrix file '%s' at line %d\n", fin, i+2);
+    free_matrix2(X);
+    return NULL;
+  }
+
+  return X;
+}
+
+
+/*
+ * A read-only matrix whose rows point into a memory-mapped binary matrix file.
+ */
+typedef struct {
+  char *data;        // file contents (or a copy of the matrix, if the file couldn't be mapped)
+  size_t size;
+  int mapped;        // is data mmapped?
+  double *rows[];    // row pointers (the matrix returned by load_matrix_mmap() is &rows[0])
+} matrix_map_t;
+
+static matrix_map_t *matrix_map_new(int n)
+{
+  matrix_map_t *map = (matrix_map_t *)calloc(1, sizeof(matrix_map_t) + MAX(n,1)*sizeof(double *));
+  test_alloc(map);
+  return map;
+}
+
+/*
+ * Load a matrix without copying it, by memory-mapping a (double precision) binary matrix
+ * file.  The matrix is read-only, and must be freed with free_matrix_mmap().  Other matrix
+ * files are loaded (into a copy) with load_matrix().  Like load_matrix(), returns NULL for
+ * empty matrices (with *n and *m set).
+ */
+double **load_matrix_mmap(char *fin, int *n, int *m)
+{
+  matrix_map_t *map = NULL;
+
+#ifndef HAVE_WINDOWS
+  int fd = open(fin, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Invalid filename: %s", fin);
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(matrix_file_header_t)) {
+    matrix_file_header_t header;
+    if (pread(fd, &header, sizeof(header), 0) == sizeof(header) && matrix_file_check_header(&header, st.st_size) &&
+	header.dtype == MATRIX_FILE_DOUBLE && header.rows > 0 && header.cols > 0) {
+      char *data = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+	*n = header.rows;
+	*m = header.cols;
+	map = matrix_map_new(*n);
+	map->data = data;
+	map->size = st.st_size;
+	map->mapped = 1;
+	double *X = (double *)(data + sizeof(matrix_file_header_t));
+	int i;
+	for (i = 0; i < *n; i++)
+	  map->rows[i] = X + i*(*m);
+      }
+    }
+  }
+  close(fd);
+  if (map)
+    return map->rows;
+#endif
+
+  double **X = load_matrix(fin, n, m);
+  if (X == NULL)
+    return NULL;
+
+  // take ownership of X's (contiguous) data
+  map = matrix_map_new(*n);
+  map->data = (char *)X[0];
+  memcpy(map->rows, X, (*n)*sizeof(double *));
+  free(X);
+
+  return map->rows;
+}
+
+// free a matrix from load_matrix_mmap()
+void free_matrix_mmap(double **X)
+{
+  if (X == NULL)
+    return;
+
+  matrix_map_t *map = (matrix_map_t *)((char *)X - offsetof(matrix_map_t, rows));
+#ifndef HAVE_WINDOWS
+  if (map->mapped)
+    munmap(map->data, map->size);
+  else
+#endif
+    free(map->data);
+  free(map);
+}
+
+
+
+// calculate the area of a triangle
+double triangle_area(double x[], double y[], double z[], int n)
+{
+  double a = dist(x, y, n);
+  double b = dist(x, z, n);
+  double c = dist(y, z, n);
+  double s = .5*(a + b + c);
+
+  return sqrt(s*(s-a)*(s-b)*(s-c));
+}
+
+
+// calculate the volume of a tetrahedron
+double tetrahedron_volume(double x1[], double x2[], double x3[], double x4[], int n)
+{
+  double U = dist2(x1, x2, n);
+  double V = dist2(x1, x3, n);
+  double W = dist2(x2, x3, n);
+  double u = dist2(x3, x4, n);
+  double v = dist2(x2, x4, n);
+  double w = dist2(x1, x4, n);
+
+  double a = v+w-U;
+  double b = w+u-V;
+  double c = u+v-W;
+
+  return sqrt( (4*u*v*w - u*a*a - v*b*b - w*c*c + a*b*c) ) / 12.0 ;
+}
+
+
+// calculate the volume of a tetrahedron
+inline double tetrahedron_volume_old(double x[], double y[], double z[], double w[], int n)
+{
+  // make an orthonormal basis in the xyz plane (with x at the origin)
+  double u[n], v[n], v_proj[n];
+  sub(u, y, x, n);             // u = y-x
+  sub(v, z, x, n);             // v = z-x
+  proj(v_proj, v, u, n);       // project v onto u
+  sub(v, v, v_proj, n);        // v -= v_proj
+  mult(u, u, 1/norm(u,n), n);  // normalize u
+  mult(v, v, 1/norm(v,n), n);  // normalize v
+
+  // project (w-x) onto xyz plane
+  double w2[n], wu[n], wv[n], w_proj[n];
+  sub(w2, w, x, n);            // w2 = w-x
+  proj(wu, w2, u, n);          // project w2 onto u
+  proj(wv, w2, v, n);          // project w2 onto v
+  add(w_proj, wu, wv, n);      // w_proj = wu + wv
+  sub(w2, w2, w_proj, n);      // w2 -= w_proj
+
+  double h = norm(w2, n);  // height
+  double A = triangle_area(x, y, z, n);
+
+  return h*A/3.0;
+}
+
+
+/*
+ * Strided matrix views and BLAS-style kernels.  A mat_t doesn't own its data, so views of
+ * new_matrix2() matrices (or of blocks of them) are free to make.
+ */
+
+#define MAT_KC 128   // gemm block size along the inner dimension
+#define MAT_NC 64    // gemm block size along the columns of C
+
+
+// make a view of a double** matrix; returns 0 if the rows aren't evenly spaced in memory
+int mat_view(mat_t *A, double **X, int n, int m)
+{
+  int i, stride = (n > 1 ? (int)(X[1] - X[0]) : m);
+
+  if (stride < m && n > 1)
+    return 0;
+  for (i = 2; i < n; i++)
+    if (X[i] - X[i-1] != stride)
+      return 0;
+
+  A->data = (n > 0 ? X[0] : NULL);
+  A->n = n;
+  A->m = m;
+  A->stride = stride;
+
+  return 1;
+}
+
+
+// make a view of the n-by-m block of A starting at (i0,j0)
+mat_t mat_block(mat_t A, int i0, int j0, int n, int m)
+{
+  mat_t B;
+  B.data = A.data + (size_t)i0*A.stride + j0;
+  B.n = n;
+  B.m = m;
+  B.stride = A.stride;
+
+  return B;
+}
+
+
+// y[0..n) += a*x[0..n)
+static inline void mat_axpy(double *y, double a, double *x, int n)
+{
+  int j = 0;
+#ifdef VECD_WIDTH
+  vecd_t va = vecd_set1(a);
+  for (; j + 2*VECD_WIDTH <= n; j += 2*VECD_WIDTH) {
+    vecd_store(y+j, vecd_add(vecd_load(y+j), vecd_mul(va, vecd_load(x+j))));
+    vecd_store(y+j+VECD_WIDTH, vecd_add(vecd_load(y+j+VECD_WIDTH), vecd_mul(va, vecd_load(x+j+VECD_WIDTH))));
+  }
+#endif
+  for (; j < n; j++)
+    y[j] += a*x[j];
+}
+
+
+// dot product of x[0..n) and y[0..n)
+static inline double mat_dot(double *x, double *y, int n)
+{
+  int j = 0;
+  double z = 0;
+#ifdef VECD_WIDTH
+  if (n >= 2*VECD_WIDTH) {
+    vecd_t s0 = vecd_set1(0), s1 = vecd_set1(0);
+    for (; j + 2*VECD_WIDTH <= n; j += 2*VECD_WIDTH) {
+      s0 = vecd_add(s0, vecd_mul(vecd_load(x+j), vecd_load(y+j)));
+      s1 = vecd_add(s1, vecd_mul(vecd_load(x+j+VECD_WIDTH), vecd_load(y+j+VECD_WIDTH)));
+    }
+    double s[VECD_WIDTH];
+    vecd_store(s, vecd_add(s0, s1));
+    int k;
+    for (k = 0; k < VECD_WIDTH; k++)
+      z += s[k];
+  }
+#endif
+  for (; j < n; j++)
+    z += x[j]*y[j];
+  return z;
+}
+
+
+// C = beta*C (with beta = 0 overwriting any NaNs in C)
+static void mat_scale(mat_t C, double beta)
+{
+  int i, j;
+  if (beta == 1.0)
+    return;
+  for (i = 0; i < C.n; i++) {
+    double *c = C.data + (size_t)i*C.stride;
+    if (beta == 0.0)
+      memset(c, 0, C.m*sizeof(double));
+    else
+      for (j = 0; j < C.m; j++)
+	c[j] *= beta;
+  }
+}
+
+
+/*
+ * General matrix multiply, C = alpha*op(A)*op(B) + beta*C, where op(X) is X or X' (if transX is non-zero).
+ * C must not overlap A or B.  Blocks of op(B) are packed into a contiguous (stack) buffer, so that the
+ * inner loop is a vectorized axpy over a row of C.
+ */
+void mat_gemm(mat_t C, double alpha, mat_t A, int transA, mat_t B, int transB, double beta)
+{
+  int p = (transA ? A.n : A.m);  // inner dimension
+  int i, j0, k0, kk, jj;
+  double Bp[MAT_KC*MAT_NC];
+
+  mat_scale(C, beta);
+  if (alpha == 0.0)
+    return;
+
+  for (k0 = 0; k0 < p; k0 += MAT_KC) {
+    int kc = MIN(MAT_KC, p - k0);
+    for (j0 = 0; j0 < C.m; j0 += MAT_NC) {
+      int nc = MIN(MAT_NC, C.m - j0);
+
+      // pack op(B)[k0:k0+kc, j0:j0+nc]
+      for (kk = 0; kk < kc; kk++) {
+	double *bp = Bp + kk*nc;
+	if (transB)
+	  for (jj = 0; jj < nc; jj++)
+	    bp[jj] = B.data[(size_t)(j0+jj)*B.stride + k0+kk];
+	else
+	  memcpy(bp, B.data + (size_t)(k0+kk)*B.stride + j0, nc*sizeof(double));
+      }
+
+      for (i = 0; i < C.n; i++) {
+	double *c = C.data + (size_t)i*C.stride + j0;
+	for (kk = 0; kk < kc; kk++) {
+	  double a = (transA ? A.data[(size_t)(k0+kk)*A.stride + i] : A.data[(size_t)i*A.stride + k0+kk]);
+	  if (a != 0.0)
+	    mat_axpy(c, alpha*a, Bp + kk*nc, nc);
+	}
+      }
+    }
+  }
+}
+
+
+/*
+ * Symmetric rank-k update (weighted scatter matrix), C = alpha*A'*diag(w)*A + beta*C, where A is n-by-m,
+ * C is m-by-m, and w may be NULL (for unit weights).  Only the upper triangle is accumulated; it's then
+ * copied into the lower triangle.
+ */
+void mat_syrk(mat_t C, double alpha, mat_t A, double *w, double beta)
+{
+  int i, j, k, m = A.m;
+
+  mat_scale(C, beta);
+
+  for (i = 0; i < A.n; i++) {
+    double *a = A.data + (size_t)i*A.stride;
+    double wi = alpha * (w ? w[i] : 1.0);
+    if (wi == 0.0)
+      continue;
+    for (j = 0; j < m; j++)
+      mat_axpy(C.data + (size_t)j*C.stride + j, wi*a[j], a + j, m - j);
+  }
+
+  for (j = 0; j < m; j++)
+    for (k = 0; k < j; k++)
+      C.data[(size_t)j*C.stride + k] = C.data[(size_t)k*C.stride + j];
+}
+
+
+/*
+ * Matrix-vector multiply, y = alpha*op(A)*x + beta*y.  y must not overlap x.
+ */
+void mat_gemv(double *y, double alpha, mat_t A, int transA, double *x, double beta)
+{
+  int i, ny = (transA ? A.m : A.n);
+
+  if (beta == 0.0)
+    memset(y, 0, ny*sizeof(double));
+  else if (beta != 1.0)
+    for (i = 0; i < ny; i++)
+      y[i] *= beta;
+
+  if (transA)
+    for (i = 0; i < A.n; i++)
+      mat_axpy(y, alpha*x[i], A.data + (size_t)i*A.stride, A.m);
+  else
+    for (i = 0; i < A.n; i++)
+      y[i] += alpha*mat_dot(A.data + (size_t)i*A.stride, x, A.m);
+}
+
+
+// transpose a matrix
+void transpose(double **Y, double **X, int n, int m)
+{
+  double **X2 = X;
+  if (Y == X)
+    X2 = matrix_clone(X,n,m);
+
+  int i, j;
+  for (i = 0; i < n; i++)
+    for (j = 0; j < m; j++)
+      Y[j][i] = X2[i][j];
+
+  if (Y == X)
+    free_matrix2(X2);
+}
+
+
+// matrix copy, Y = X 
+void matrix_copy(double **Y, double **X, int n, int m)
+{
+  memcpy(Y[0], X[0], n*m*sizeof(double));
+}
+
+
+// matrix clone, Y = new(X)
+double **matrix_clone(double **X, int n, int m)
+{
+  double **Y = new_matrix2(n,m);
+  matrix_copy(Y, X, n, m);
+
+  return Y;
+}
+
+
+// matrix addition, Z = X+Y
+void matrix_add(double **Z, double **X, double **Y, int n, int m)
+{
+  add(Z[0], X[0], Y[0], n*m);
+}
+
+// matrix subtraction, Z = X-Y
+void matrix_sub(double **Z, double **X, double **Y, int n, int m)
+{
+  sub(Z[0], X[0], Y[0], n*m);
+}
+
+// matrix multiplication, Z = X*Y, where X is n-by-p and Y is p-by-m
+void matrix_mult(double **Z, double **X, double **Y, int n, int p, int m)
+{
+  matrix_mult_work(Z, X, Y, n, p, m, NULL);
+}
+
+
+// matrix multiplication, Z = X*Y, with a workspace of n*m doubles for when Z is X or Y (or NULL to allocate one)
+void matrix_mult_work(double **Z, double **X, double **Y, int n, int p, int m, double *work)
+{
+  int aliased = (Z==X || Z==Y);
+  double *Z2_raw[aliased ? n : 1];
+  double **Z2 = Z;
+  int i, j, k;
+
+  if (aliased) {
+    double *w = work;
+    if (w == NULL)
+      safe_malloc(w, n*m, double);
+    for (i = 0; i < n; i++)
+      Z2_raw[i] = w + i*m;
+    Z2 = Z2_raw;
+  }
+
+  mat_t Zv, Xv, Yv;
+  if (n*p*m > 64 && mat_view(&Zv, Z2, n, m) && mat_view(&Xv, X, n, p) && mat_view(&Yv, Y, p, m))
+    mat_gemm(Zv, 1.0, Xv, 0, Yv, 0, 0.0);
+  else {
+    for (i = 0; i < n; i++) {     // row i
+      for (j = 0; j < m; j++) {   // column j
+	Z2[i][j] = 0;
+	for (k = 0; k < p; k++)
+	  Z2[i][j] += X[i][k]*Y[k][j];
+      }
+    }
+  }
+
+  if (aliased) {
+    for (i = 0; i < n; i++)
+      memcpy(Z[i], Z2[i], m*sizeof(double));
+    if (work == NULL)
+      free(Z2[0]);
+  }
+}
+
+
+// matrix-vector multiplication, y = A*x
+void matrix_vec_mult(double *y, double **A, double *x, int n, int m)
+{
+  int i;
+  if (y == x) {
+    double z[m];
+    memcpy(z, x, m*sizeof(double));
+    for (i = 0; i < n; i++)
+      y[i] = dot(A[i], z, m);
+  }
+  else
+    for (i = 0; i < n; i++)
+      y[i] = dot(A[i], x, m);
+}
+
+// vector-matrix multiplication, y = x*A
+void vec_matrix_mult(double *y, double *x, double **A, int n, int m)
+{
+  int i, j;
+  if (y == x) {
+    double z[n];
+    memcpy(z, x, n*sizeof(double));
+    for (j = 0; j < m; j++) {
+      y[j] = 0;
+      for (i = 0; i < n; i++)
+	y[j] += z[i]*A[i][j];
+    }
+  }
+  else {
+    for (j = 0; j < m; j++) {
+      y[j] = 0;
+      for (i = 0; i < n; i++)
+	y[j] += x[i]*A[i][j];
+    }
+  }
+}
+
+// matrix element-wise multiplication
+void matrix_elt_mult(double **Z, double **X, double **Y, int n, int m) {
+  int i, j;
+  for (i = 0; i < n; ++i) {
+    for (j = 0; j < m; ++j) {
+      Z[i][j] = X[i][j] * Y[i][j];
+    }
+  }
+}
+
+void matrix_pow(double **Y, double **X, int n, int m, double pw) {
+  int i, j;
+  for (i = 0; i < n; ++i)
+    for (j = 0; j < m; ++j)
+      Y[i][j] = pow(X[i][j], pw);
+}
+
+void matrix_sum(double y[], double **X, int n, int m) {
+  int i, j;
+  memset(y, 0, n * sizeof(double));
+  for (i = 0; i < n; ++i) {
+    for (j = 0; j < m; ++j) {
+      y[j] += X[i][j];
+    }
+  }
+}
+
+// outer product of x and y, Z = x'*y
+void outer_prod(double **Z, double x[], double y[], int n, int m)
+{
+  int i, j;
+  for (i = 0; i < n; i++)
+    for (j = 0; j < m; j++)
+      Z[i][j] = x[i]*y[j];
+}
+
+
+// row vector mean 
+// NOTE(sanja): this is adding up columns, not rows.
+void mean(double *mu, double **X, int n, int m)
+{
+  memset(mu, 0, m*sizeof(double));  // mu = 0
+
+  int i, j;
+  for (i = 0; i < n; i++)
+    for (j = 0; j < m; j++)
+      mu[j] += X[i][j];
+
+  mult(mu, mu, 1/(double)n, m);
+}
+
+void variance(double *vars, double **X, int n, int m)
+{
+  double mu[m];
+  mean(mu, X, n, m);
+  memset(vars, 0, m*sizeof(double));
+  int i, j;
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < m; j++) {
+      double dx = X[i][j] - mu[j];
+      vars[j] += dx*dx;
+    }
+  }
+  mult(vars, vars, 1/(double)n, m);
+}
+
+// compute the covariance of the rows of X, given mean mu
+void cov(double **S, double **X, double *mu, int n, int m)
+{
+  int i, j, k;
+
+  memset(S[0], 0, m*m*sizeof(double));
+  double dx[m];
+
+  if (m == 3) {
+    for (i = 0; i < n; i++) {
+      dx[0] = X[i][0] - mu[0];
+      dx[1] = X[i][1] - mu[1];
+      dx[2] = X[i][2] - mu[2];
+      S[0][0] += dx[0]*dx[0];
+      S[0][1] += dx[0]*dx[1];
+      S[0][2] += dx[0]*dx[2];
+      S[1][0] += dx[1]*dx[0];
+      S[1][1] += dx[1]*dx[1];
+      S[1][2] += dx[1]*dx[2];
+      S[2][0] += dx[2]*dx[0];
+      S[2][1] += dx[2]*dx[1];
+      S[2][2] += dx[2]*dx[2];
+    }
+  }
+  else {
+    for (i = 0; i < n; i++) {
+      sub(dx, X[i], mu, m);
+      for (j = 0; j < m; j++)
+	for (k = 0; k < m; k++)
+	  S[j][k] += dx[j]*dx[k];
+    }
+  }
+
+  /*
+  double **dX = matrix_clone(X, n, m);
+  if (mu != NULL)
+    for (i = 0; i < n; i++)
+      sub(dX[i], X[i], mu, m);
+  double **dXt = new_matrix2(m, n);
+  transpose(dXt, dX, n, m);
+  matrix_mult(S, dXt, dX, m, n, m);
+  */
+  mult(S[0], S[0], 1/(double)n, m*m);
+
+  //free_matrix2(dX);
+  //free_matrix2(dXt);
+}
+
+
+// weighted row vector mean
+void wmean(double *mu, double **X, double *w, int n, int m)
+{
+  memset(mu, 0, m*sizeof(double));  // mu = 0
+
+  int i, j;
+  for (i = 0; i < n; i++)
+    for (j = 0; j < m; j++)
+      mu[j] += w[i]*X[i][j];
+
+  mult(mu, mu, 1.0/sum(w,n), m);
+}
+
+
+// compute the weighted covariance of the rows of X, given mean mu
+void wcov(double **S, double **X, double *w, double *mu, int n, int m)
+{
+  int j, k;
+
+  matrix_scatter(S, X, w, n, m);
+  mult(S[0], S[0], 1.0/sum(w,n), m*m);
+
+  if (mu != NULL)
+    for (j = 0; j < m; j++)
+      for (k = 0; k < m; k++)
+	S[j][k] -= mu[j]*mu[k];
+}
+
+
+// compute the (weighted) scatter matrix of the rows of X, S = X'*diag(w)*X (w may be NULL for unit weights)
+void matrix_scatter(double **S, double **X, double *w, int n, int m)
+{
+  mat_t Sv, Xv;
+  if (mat_view(&Sv, S, m, m) && mat_view(&Xv, X, n, m)) {
+    mat_syrk(Sv, 1.0, Xv, w, 0.0);
+    return;
+  }
+
+  int i, j, k;
+  for (j = 0; j < m; j++)
+    memset(S[j], 0, m*sizeof(double));
+  for (i = 0; i < n; i++) {
+    double wi = (w ? w[i] : 1.0);
+    for (j = 0; j < m; j++)
+      for (k = j; k < m; k++)
+	S[j][k] += wi*X[i][j]*X[i][k];
+  }
+  for (j = 0; j < m; j++)
+    for (k = 0; k < j; k++)
+      S[j][k] = S[k][j];
+}
+
+
+// solve the equation Ax = b, where A is a square n-by-n matrix
+void solve(double *x, double **A, double *b, int n)
+{
+  double A_inv_raw[n*n], *A_inv[n];
+  int i;
+  for (i = 0; i < n; i++)
+    A_inv[i] = A_inv_raw + i*n;
+  inv(A_inv, A, n);
+
+  double y[n];
+  for (i = 0; i < n; i++)
+    y[i] = dot(A_inv[i], b, n);
+  memcpy(x, y, n*sizeof(double));
+}
+
+
+// compute the determinant of the n-by-n matrix X
+double det(double **X, int n)
+{
+  if (n == 1)
+    return X[0][0];
+
+  else if (n == 2)
+    return X[0][0]*X[1][1] - X[0][1]*X[1][0];
+
+  else if (n == 3) {
+    double a = X[0][0];
+    double b = X[0][1];
+    double c = X[0][2];
+    double d = X[1][0];
+    double e = X[1][1];
+    double f = X[1][2];
+    double g = X[2][0];
+    double h = X[2][1];
+    double i = X[2][2];
+    return a*e*i - a*f*h + b*f*g - b*d*i + c*d*h - c*e*g;
+  }
+
+  else if (n == 4) {
+    double a00 = X[0][0];
+    double a01 = X[0][1];
+    double a02 = X[0][2];
+    double a03 = X[0][3];
+    double a10 = X[1][0];
+    double a11 = X[1][1];
+    double a12 = X[1][2];
+    double a13 = X[1][3];
+    double a20 = X[2][0];
+    double a21 = X[2][1];
+    double a22 = X[2][2];
+    double a23 = X[2][3];
+    double a30 = X[3][0];
+    double a31 = X[3][1];
+    double a32 = X[3][2];
+    double a33 = X[3][3];
+
+    return a00*a11*a22*a33 - a00*a11*a23*a32 - a00*a12*a21*a33 + a00*a12*a23*a31 + a00*a13*a21*a32
+      - a00*a13*a22*a31 - a01*a10*a22*a33 + a01*a10*a23*a32 + a01*a12*a20*a33 - a01*a12*a23*a30
+      - a01*a13*a20*a32 + a01*a13*a22*a30 + a02*a10*a21*a33 - a02*a10*a23*a31 - a02*a11*a20*a33
+      + a02*a11*a23*a30 + a02*a13*a20*a31 - a02*a13*a21*a30 - a03*a10*a21*a32 + a03*a10*a22*a31
+      + a03*a11*a20*a32 - a03*a11*a22*a30 - a03*a12*a20*a31 + a03*a12*a21*a30;
+
+  }
+
+  else {
+    fprintf(stderr, "Error: det() not supported for > 4x4 matrices\n");
+    exit(1);
+  }
+
+  return 0;
+}
+
+
+// compute the inverse (Y) of the n-by-n matrix X
+void inv(double **Y, double **X, int n)
+{
+  double d = det(X,n);
+
+  if (n == 1)
+    Y[0][0] = 1/d;
+
+  else if (n == 2) {
+    Y[0][0] = X[1][1] / d;
+    Y[0][1] = -X[0][1] / d;
+    Y[1][0] = -X[1][0] / d;
+    Y[1][1] = X[0][0] / d;
+  }
+
+  else if (n == 3) {
+    Y[0][0] = (X[1][1]*X[2][2] - X[1][2]*X[2][1]) / d;
+    Y[0][1] = (X[0][2]*X[2][1] - X[0][1]*X[2][2]) / d;
+    Y[0][2] = (X[0][1]*X[1][2] - X[0][2]*X[1][1]) / d;
+    Y[1][0] = (X[1][2]*X[2][0] - X[1][0]*X[2][2]) / d;
+    Y[1][1] = (X[0][0]*X[2][2] - X[0][2]*X[2][0]) / d;
+    Y[1][2] = (X[0][2]*X[1][0] - X[0][0]*X[1][2]) / d;
+    Y[2][0] = (X[1][0]*X[2][1] - X[1][1]*X[2][0]) / d;
+    Y[2][1] = (X[0][1]*X[2][0] - X[0][0]*X[2][1]) / d;
+    Y[2][2] = (X[0][0]*X[1][1] - X[0][1]*X[1][0]) / d;
+  }
+
+  else if (n == 4) {
+    double a00 = X[0][0];
+    double a01 = X[0][1];
+    double a02 = X[0][2];
+    double a03 = X[0][3];
+    double a10 = X[1][0];
+    double a11 = X[1][1];
+    double a12 = X[1][2];
+    double a13 = X[1][3];
+    double a20 = X[2][0];
+    double a21 = X[2][1];
+    double a22 = X[2][2];
+    double a23 = X[2][3];
+    double a30 = X[3][0];
+    double a31 = X[3][1];
+    double a32 = X[3][2];
+    double a33 = X[3][3];
+
+    Y[0][0] = (a11*a22*a33 - a11*a23*a32 - a12*a21*a33 + a12*a23*a31 + a13*a21*a32 - a13*a22*a31) / d;
+    Y[0][1] = (a01*a23*a32 - a01*a22*a33 + a02*a21*a33 - a02*a23*a31 - a03*a21*a32 + a03*a22*a31) / d;
+    Y[0][2] = (a01*a12*a33 - a01*a13*a32 - a02*a11*a33 + a02*a13*a31 + a03*a11*a32 - a03*a12*a31) / d;
+    Y[0][3] = (a01*a13*a22 - a01*a12*a23 + a02*a11*a23 - a02*a13*a21 - a03*a11*a22 + a03*a12*a21) / d;
+    Y[1][0] = (a10*a23*a32 - a10*a22*a33 + a12*a20*a33 - a12*a23*a30 - a13*a20*a32 + a13*a22*a30) / d;
+    Y[1][1] = (a00*a22*a33 - a00*a23*a32 - a02*a20*a33 + a02*a23*a30 + a03*a20*a32 - a03*a22*a30) / d;
+    Y[1][2] = (a00*a13*a32 - a00*a12*a33 + a02*a10*a33 - a02*a13*a30 - a03*a10*a32 + a03*a12*a30) / d;
+    Y[1][3] = (a00*a12*a23 - a00*a13*a22 - a02*a10*a23 + a02*a13*a20 + a03*a10*a22 - a03*a12*a20) / d;
+    Y[2][0] = (a10*a21*a33 - a10*a23*a31 - a11*a20*a33 + a11*a23*a30 + a13*a20*a31 - a13*a21*a30) / d;
+    Y[2][1] = (a00*a23*a31 - a00*a21*a33 + a01*a20*a33 - a01*a23*a30 - a03*a20*a31 + a03*a21*a30) / d;
+    Y[2][2] = (a00*a11*a33 - a00*a13*a31 - a01*a10*a33 + a01*a13*a30 + a03*a10*a31 - a03*a11*a30) / d;
+    Y[2][3] = (a00*a13*a21 - a00*a11*a23 + a01*a10*a23 - a01*a13*a20 - a03*a10*a21 + a03*a11*a20) / d;
+    Y[3][0] = (a10*a22*a31 - a10*a21*a32 + a11*a20*a32 - a11*a22*a30 - a12*a20*a31 + a12*a21*a30) / d;
+    Y[3][1] = (a00*a21*a32 - a00*a22*a31 - a01*a20*a32 + a01*a22*a30 + a02*a20*a31 - a02*a21*a30) / d;
+    Y[3][2] = (a00*a12*a31 - a00*a11*a32 + a01*a10*a32 - a01*a12*a30 - a02*a10*a31 + a02*a11*a30) / d;
+    Y[3][3] = (a00*a11*a22 - a00*a12*a21 - a01*a10*a22 + a01*a12*a20 + a02*a10*a21 - a02*a11*a20) / d;
+  }
+
+  else {
+    fprintf(stderr, "Error: inv() not supported for > 4x4 matrices\n");
+    exit(1);
+  }
+}
+
+
+/*
+ * Cholesky decomposition of a symmetric positive definite n-by-n matrix A = L*L', where L is lower
+ * triangular (L may be A).  Only the lower triangle of A is used.  Returns 0 on success, or -1 if A
+ * isn't positive definite.
+ */
+int cholesky(double **L, double **A, int n)
+{
+  int i, j, k;
+  for (j = 0; j < n; j++) {
+    double s = A[j][j];
+    for (k = 0; k < j; k++)
+      s -= L[j][k]*L[j][k];
+    if (!(s > 0))
+      return -1;
+    double ljj = sqrt(s);
+    for (i = j+1; i < n; i++) {
+      double t = A[i][j];
+      for (k = 0; k < j; k++)
+	t -= L[i][k]*L[j][k];
+      L[i][j] = t / ljj;
+    }
+    L[j][j] = ljj;
+  }
+
+  for (i = 0; i < n; i++)
+    for (j = i+1; j < n; j++)
+      L[i][j] = 0;
+
+  return 0;
+}
+
+/**
+ * Solves the quadratic equation: f(x) = a*x^2 + b*x + c
+ * Sets x[0] and x[1] to be the real roots of f(x), if found.
+ * Returns the number of real roots found.
+ */
+int solve_quadratic(double *x, double a, double b, double c)
+{
+  double s2 = b*b - 4*a*c;
+  if (s2 < 0.0)
+    return 0;
+
+  double s = sqrt(s2);
+  x[0] = .5*(-b + s)/a;
+  x[1] = .5*(-b - s)/a;
+
+  return 2;
+}
+
+/**
+ * Solves the cubic equation: f(x) = a*x^3 + b*x^2 + c*x + d
+ * Sets x[0], x[1], and x[2] to be the real roots of f(x), if found.
+ * Returns the number of real roots found.
+ *
+int solve_cubic(double *x, double a, double b, double c, double d)
+{
+  double p = -b/(3.0*a);
+  double q = p*p*p + (b*c - 3.0*a*d)/(6*a*a);
+  double r = c/(3.0*a);
+    
+}
+*/
+
+
+/**
+ * Compute the eigenvalues z and eigenvectors V of a real symmetric n-by-n matrix X
+ * The eigenvalues, z, will be sorted from smallest to largest in magnitude, and the
+ * eigenvectors will be stored in the rows of V.
+ * @param X (input) Symmetric n-by-n matrix
+ * @param n (input) Dimensionality of X
+ * @param z (output) Eigenvalues of X, from smallest to largest in magnitude
+ * @param V (output) Eigenvectors of X, in the rows
+ */
+
+/*
+void eigen_symm(double z[], double **V, double **X, int n)
+{
+  double **Vt = matrix_clone(X,n,n);
+  double z2[n];
+  int i, j;
+
+  //TODO: replace this with solve_cubic() for n < 4
+
+  int info = LAPACKE_dsyevd(LAPACK_COL_MAJOR, 'V', 'U', n, Vt[0], n, z2);
+  if (info)
+    fprintf(stderr, "Error: eigen_symm failed to converge!\n");
+
+  // sort eigenvalues
+  double tolerance = 1e-10;
+  int idx[n];
+  sort_indices(z2, idx, n);
+  if (z2[idx[0]] < -tolerance)  // negative eigenvalues --> sort in reverse order
+    reversei(idx, idx, n);
+  for (i = 0; i < n; i++)
+    z[i] = z2[idx[i]];
+  for (i = 0; i < n; i++)
+    for (j = 0; j < n; j++)
+      V[i][j] = Vt[j][idx[i]];
+
+  //cleanup
+  free_matrix2(Vt);
+}
+*/
+
+
+void eigen_symm_2d(double z[], double **V, double **X)
+{
+  double a = X[0][0];
+  double b = X[0][1];
+  double c = X[1][1];
+
+  const double epsilon = 1e-16;
+
+  if (b*b < epsilon * fabs(a*c)) {
+    if (fabs(a) < fabs(c)) {
+      z[0] = a;
+      z[1] = c;
+      V[0][0] = V[1][1] = 1.0;
+      V[0][1] = V[1][0] = 0.0;
+    }
+    else {
+      z[0] = c;
+      z[1] = a;
+      V[0][0] = V[1][1] = 0.0;
+      V[0][1] = V[1][0] = 1.0;
+    }
+    return;
+  }
+
+  double s = sqrt((a+c)*(a+c) + 4.*(b*b-a*c));
+  double z1 = (a+c+s)/2.;
+  double z2 = (a+c-s)/2.;
+  if (fabs(z1) < fabs(z2)) {
+    z[0] = z1;
+    z[1] = z2;
+  }
+  else {
+    z[1] = z1;
+    z[0] = z2;
+  }
+
+  double d0 = hypot(b, z[0]-a);
+  double d1 = hypot(b, z[1]-a);
+  V[0][0] = b/d0;
+  V[0][1] = (z[0]-a)/d0;
+  V[1][0] = b/d1;
+  V[1][1] = (z[1]-a)/d1;
+}
+
+
+/*
+ * Get evals. z and evecs. V of a real symm. n-by-n matrix A, without any memory
+ * allocation.  A is destroyed (it is diagonalized in place).  Eigenvectors are
+ * returned in the rows of V, which may have non-contiguous rows.
+ */
+void eigen_symm_inplace(double z[], double **V, double **A, int n)
+{
+  if (n <= 0)
+    return;
+
+  if (n == 2) {
+    eigen_symm_2d(z,V,A);
+    return;
+  }
+
+  // naive Jacobi method, applying each Givens rotation directly to the rows/columns of A and V
+  int i, j, k;
+  double tolerance = 1e-10;
+
+  // initialize V = I
+  for (i = 0; i < n; i++) {
+    V[i][i] = 1;
+    for (j = i+1; j < n; j++)
+      V[i][j] = V[j][i] = 0;
+  }
+
+  while (1) {
+
+    // check for convergence
+    double d_off = 0, d_diag = 0;
+    for (i = 0; i < n; i++) {
+      d_diag += A[i][i]*A[i][i];
+      for (j = i+1; j < n; j++)
+	d_off = MAX(d_off, fabs(A[i][j]));
+    }
+    d_diag = sqrt(d_diag / (double)n);
+    if (d_off < MAX(tolerance * d_diag, tolerance))
+      break;
+
+    // find largest pivot
+    double pivot = 0;
+    int ip=0, jp=0;
+    for (i = 0; i < n; i++) {
+      for (j = i+1; j < n; j++) {
+	double p = fabs(A[i][j]);
+	if (p > pivot) {
+	  pivot = p;
+	  ip = i;
+	  jp = j;
+	}
+      }
+    }
+
+    // compute Givens cos, sin
+    double a = (A[jp][jp] - A[ip][ip]) / (2 * A[ip][jp]);
+    double t = 1 / (fabs(a) + sqrt(1 + a*a));  // tan
+    if (a < 0)
+      t = -t;
+    double c = 1 / sqrt(1 + t*t);  // cos
+    double s = t*c;  // sin
+
+    // A = A*G
+    for (k = 0; k < n; k++) {
+      double ai = A[k][ip], aj = A[k][jp];
+      A[k][ip] = c*ai - s*aj;
+      A[k][jp] = s*ai + c*aj;
+    }
+
+    // A = G'*A
+    for (k = 0; k < n; k++) {
+      double ai = A[ip][k], aj = A[jp][k];
+      A[ip][k] = c*ai - s*aj;
+      A[jp][k] = s*ai + c*aj;
+    }
+
+    // V = G'*V (with eigenvectors in the rows)
+    for (k = 0; k < n; k++) {
+      double vi = V[ip][k], vj = V[jp][k];
+      V[ip][k] = c*vi - s*vj;
+      V[jp][k] = s*vi + c*vj;
+    }
+  }
+
+  // sort eigenvalues (insertion sort on indices, since n is small)
+  int idx[n];
+  for (i = 0; i < n; i++)
+    idx[i] = i;
+  for (i = 1; i < n; i++) {
+    for (j = i; j > 0 && A[idx[j-1]][idx[j-1]] > A[idx[j]][idx[j]]; j--) {
+      int tmp = idx[j];
+      idx[j] = idx[j-1];
+      idx[j-1] = tmp;
+    }
+  }
+  if (A[idx[0]][idx[0]] < -tolerance)  // negative eigenvalues --> sort in reverse order
+    reversei(idx, idx, n);
+
+  // permute the rows of V in place, following the cycles of idx
+  int done[n];
+  for (i = 0; i < n; i++) {
+    z[i] = A[idx[i]][idx[i]];
+    done[i] = 0;
+  }
+  for (i = 0; i < n; i++) {
+    if (done[i])
+      continue;
+    double *v0 = V[i];
+    double tmp[n];
+    memcpy(tmp, v0, n*sizeof(double));
+    for (j = i; ; j = idx[j]) {
+      done[j] = 1;
+      if (idx[j] == i) {
+	memcpy(V[j], tmp, n*sizeof(double));
+	break;
+      }
+      memcpy(V[j], V[idx[j]], n*sizeof(double));
+    }
+  }
+}
+
+
+void eigen_symm(double z[], double **V, double **X, int n)
+{
+  if (n == 2) {
+    eigen_symm_2d(z,V,X);
+    return;
+  }
+
+  double A_raw[n*n], *A[n];
+  int i;
+  for (i = 0; i < n; i++) {
+    A[i] = A_raw + n*i;
+    memcpy(A[i], X[i], n*sizeof(double));
+  }
+
+  eigen_symm_inplace(z, V, A, n);
+}
+
+
+// reorder the rows of X, Y = X(idx,:)
+void reorder_rows(double **Y, double **X, int *idx, int n, int m)
+{
+  int i;
+  double **Y2 = (X==Y ? new_matrix2(n,m) : Y);
+  for (i = 0; i < n; i++)
+    memcpy(Y2[i], X[idx[i]], m*sizeof(double));
+  if (X==Y) {
+    matrix_copy(Y, Y2, n, m);
+    free_matrix2(Y2);
+  }
+}
+
+// reorder the rows of X, Y = X(idx,:)
+void reorder_rowsi(int **Y, int **X, int *idx, int n, int m)
+{
+  int i;
+  int **Y2 = (X==Y ? new_matrix2i(n,m) : Y);
+  for (i = 0; i < n; i++)
+    memcpy(Y2[i], X[idx[i]], m*sizeof(int));
+  if (X==Y) {
+    memcpy(Y[0], Y2[0], n*m*sizeof(int));
+    free_matrix2i(Y2);
+  }
+}
+
+void repmat(double **B, double **A, int rep_n, int rep_m, int n, int m)
+{
+  int i, rep_i, rep_j;
+
+  // copy A into top-left corner of B
+  if (A != B)
+    for (i = 0; i < n; ++i)
+      memcpy(B[i], A[i], m * sizeof(double)); 
+
+  // repeat top-left corner to the right
+  for (i = 0; i < n; ++i)
+    for (rep_j = 1; rep_j < rep_m; ++rep_j)
+      memcpy(&B[i][rep_j * m], B[i], m * sizeof(double)); 
+
+  // repeat top of B downwards
+  for (rep_i = 1; rep_i < rep_n; ++rep_i)
+    memcpy(B[rep_i * n], B[0], m * rep_m * n * sizeof(double));
+}
+
+void repmati(int **B, int **A, int rep_n, int rep_m, int n, int m)
+{
+  int i, rep_i, rep_j;
+
+  // copy A into top-left corner of B
+  if (A != B)
+    for (i = 0; i < n; ++i)
+      memcpy(B[i], A[i], m * sizeof(int)); 
+
+  // repeat top-left corner to the right
+  for (i = 0; i < n; ++i)
+    for (rep_j = 1; rep_j < rep_m; ++rep_j)
+      memcpy(&B[i][rep_j * m], B[i], m * sizeof(int)); 
+
+  // repeat top of B downwards
+  for (rep_i = 1; rep_i < rep_n; ++rep_i)
+    memcpy(B[rep_i * n], B[0], m * rep_m * n * sizeof(int));
+}
+
+/*
+ * blur matrix with a 3x3 gaussian filter with sigma=.5
+ */
+void blur_matrix(double **dst, double **src, int n, int m)
+{
+  double G[3] = {.6193, .0838, .0113};
+
+  double **I = (dst==src ? new_matrix2(n,m) : dst);
+  memcpy(I[0], src[0], n*m*sizeof(double));
+
+  int i,j;
+  for (i = 1; i < n-1; i++)
+    for (j = 1; j < m-1; j++)
+      I[i][j] = G[0]*src[i][j] + G[1]*(src[i+1][j] + src[i-1][j] + src[i][j+1] + src[i][j-1]) + G[2]*(src[i+1][j+1] + src[i+1][j-1] + src[i-1][j+1] + src[i-1][j-1]);
+
+  if (dst==src) {
+    memcpy(dst[0], I[0], n*m*sizeof(double));
+    free_matrix2(I);
+  }
+}
+
+/*
+ * blur masked matrix with a 3x3 gaussian filter with sigma=.5
+ */
+void blur_matrix_masked(double **dst, double **src, int **mask, int n, int m)
+{
+  double G[3] = {.6193, .0838, .0113};
+
+  double **I = (dst==src ? new_matrix2(n,m) : dst);
+  memcpy(I[0], src[0], n*m*sizeof(double));
+
+  int i,j;
+  for (i = 1; i < n-1; i++) {
+    for (j = 1; j < m-1; j++) {
+      double x[9] = {mask[i][j] ? src[i][j] : 0., mask[i+1][j] ? src[i+1][j] : 0., mask[i-1][j] ? src[i-1][j] : 0., mask[i][j+1] ? src[i][j+1] : 0., mask[i][j-1] ? src[i][j-1] : 0.,
+		  mask[i+1][j+1] ? src[i+1][j+1] : 0., mask[i+1][j-1] ? src[i+1][j-1] : 0., mask[i-1][j+1] ? src[i-1][j+1] : 0., mask[i-1][j-1] ? src[i-1][j-1] : 0.};
+
+      double v = G[0]*x[0] + G[1]*(x[1] + x[2] + x[3] + x[4]) + G[2]*(x[5] + x[6] + x[7] + x[8]);
+
+      int n0 = !!mask[i][j];
+      int n1 = !!mask[i+1][j] + !!mask[i-1][j] + !!mask[i][j+1] + !!mask[i][j-1];
+      int n2 = !!mask[i+1][j+1] + !!mask[i-1][j-1] + !!mask[i-1][j+1] + !!mask[i+1][j-1];
+      double g_tot = n0*G[0] + n1*G[1] + n2*G[2];
+
+      I[i][j] = v / g_tot;
+    }
+  }
+
+  if (dst==src) {
+    memcpy(dst[0], I[0], n*m*sizeof(double));
+    free_matrix2(I);
+  }
+}
+
+void print_matrix(double **X, int n, int m)
+{
+  int i, j;
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < m; j++)
+      printf("%E ", X[i][j]);
+    printf("\n");
+  }
+}
+
+
+// perform linear regression: dot(b,x[i]) = y[i], i=1..n
+void linear_regression(double *b, double **X, double *y, int n, int d)
+{
+  double **Xt = new_matrix2(d,n);
+  transpose(Xt,X,n,d);
+
+  double **XtX = new_matrix2(d,d);
+  matrix_mult(XtX,Xt,X,d,n,d);
+
+  double Xty[d];
+  matrix_vec_mult(Xty,Xt,y,d,n);
+
+  solve(b, XtX, Xty, d);
+
+  free_matrix2(Xt);
+  free_matrix2(XtX);
+}
+
+
+// fit a polynomial: \sum{b[i]*x[j]^i} = y[j], i=1..n, j=1..d
+void polynomial_regression(double *b, double *x, double *y, int n, int d)
+{
+  double **X = new_matrix2(n,d);
+
+  int i, j;
+  for (i = 0; i < n; i++)
+    X[i][0] = 1;
+
+  for (i = 0; i < n; i++)
+    for (j = 1; j < d; j++)
+      X[i][j] = X[i][j-1]*x[i];
+
+  linear_regression(b,X,y,n,d);
+
+  free_matrix2(X);
+}
+
+
+
+
+
+
+/* create a new graph
+graph_t *graph_new(int num_vertices, int edge_capacity)
+{
+  int i;
+  graph_t *g = (graph_t *)malloc(sizeof(graph_t));
+
+  g->nv = num_vertices;
+  g->vertices = (vertex_t *)calloc(g->nv, sizeof(vertex_t));
+  for (i = 0; i < g->nv; i++)
+    g->vertices[i].index = i;
+
+  g->ne = 0;
+  g->_edge_capacity = edge_capacity;
+  g->edges = (edge_t *)calloc(edge_capacity, sizeof(edge_t));
+
+  return g;
+}
+*/
+
+
+// free a graph
+void graph_free(graph_t *g)
+{
+  int i;
+  free(g->edges);
+  for (i = 0; i < g->nv; i++) {
+    free(g->vertices[i].edges);
+    ilist_free(g->vertices[i].neighbors);
+  }
+  free(g);
+}
+
+
+/* add an edge to a graph
+void graph_add_edge(graph_t *g, int i, int j)
+{
+  ilist
+  for 
+
+
+  if (g->ne == g->_edge_capacity) {
+    g->_edge_capacity *= 2;
+    g->edges = (edge_t *)realloc(g->edges, g->_edge_capacity * sizeof(edge_t));
+  }
+
+  g->edges[g->ne].i = i;
+  g->edges[g->ne].j = j;
+  g->ne++;
+
+  g->vertices[i]
+}
+*/
+
+
+// find the index of an edge in a graph
+int graph_find_edge(graph_t *g, int i, int j)
+{
+  int k = ilist_find(g->vertices[i].neighbors, j);
+
+  if (k < 0)
+    return -1;
+
+  return g->vertices[i].edges[k];
+}
+
+
+// smooth the edges of a graph
+void graph_smooth(double **dst, double **src, graph_t *g, int d, double w)
+{
+  int i, j;
+  double p[d];
+  ilist_t *v;
+
+  if (dst != src)
+    memcpy(dst[0], src[0], d*g->nv*sizeof(double));
+
+  for (i = 0; i < g->nv; i++) {
+    memset(p, 0, d * sizeof(double));                        // p = 0
+    for (v = g->vertices[i].neighbors; v; v = v->next) {
+      j = v->x;
+      add(p, p, dst[j], d);                                  // p += dst[j]
+    }
+    mult(p, p, 1/norm(p, d), d);                             // p = p/norm(p)
+
+    wavg(dst[i], p, dst[i], w, d);                           // dst[i] = w*p + (1-w)*dst[i]
+  }
+}
+
+
+static int dcomp(const void *px, const void *py)
+{
+  double x = *(double *)px;
+  double y = *(double *)py;
+
+  if (x == y)
+    return 0;
+
+  return (x < y ? -1 : 1);
+}
+
+// sample uniformly from a simplex S with n vertices
+void sample_simplex(double x[], double **S, int n, int d)
+{
+  sample_simplex_rng(x, S, n, d, rng_default());
+}
+
+// sample uniformly from a simplex S with n vertices, with a given random number generator
+void sample_simplex_rng(double x[], double **S, int n, int d, rng_t *rng)
+{
+  int i;
+
+  // get n-1 uniform samples, u, on [0,1], and sort them
+  double u[n];
+  for (i = 0; i < n-1; i++)
+    u[i] = rng_uniform(rng);
+  u[n-1] = 1;
+
+  qsort((void *)u, n-1, sizeof(double), dcomp);
+
+  // mixing coefficients are the order statistics of u
+  double c[n];
+  c[0] = u[0];
+  for (i = 1; i < n; i++)
+    c[i] = u[i] - u[i-1];
+
+  // x = sum(c[i]*S[i])
+  mult(x, S[0], c[0], d);
+  for (i = 1; i < n; i++) {
+    double y[d];
+    mult(y, S[i], c[i], d);
+    add(x, x, y, d);
+  }
+}
+
+
+/*******************
+typedef struct {
+  int nv;
+  int ne;
+  int nf;
+  int *vertices;
+  edge_t *edges;
+  face_t *faces;
+  int *nvn;  // # vertex neighbors
+  int *nen;  // # edge neighbors
+  int **vertex_neighbors;  // vertex -> {vertices}
+  int **vertex_edges;      // vertex -> {edges}
+  int **edge_neighbors;    // edge -> {vertices}
+  int **edge_faces;        // edge -> {faces}
+  // internal vars
+  int _vcap;
+  int _ecap;
+  int _fcap;
+  int *_vncap;
+  int *_encap;
+} meshgraph_t;
+******************/
+
+
+/*
+ * Create a new meshgraph with initial vertex capacity 'vcap' and degree capacity 'dcap'.
+ */
+meshgraph_t *meshgraph_new(int vcap, int dcap)
+{
+  int i;
+  meshgraph_t *g;
+  safe_calloc(g, 1, meshgraph_t);
+
+  safe_malloc(g->vertices, vcap, int);
+  safe_malloc(g->edges, vcap, edge_t);
+  safe_malloc(g->faces, vcap, face_t);
+
+  g->_vcap = g->_ecap = g->_fcap = vcap;
+  safe_malloc(g->_vncap, vcap, int);
+  safe_malloc(g->_encap, vcap, int);
+
+  safe_malloc(g->vertex_neighbors, vcap, int *);
+  safe_malloc(g->vertex_edges, vcap, int *);
+  safe_calloc(g->nvn, vcap, int);
+  for (i = 0; i < vcap; i++) {
+    safe_malloc(g->vertex_neighbors[i], dcap, int);
+    safe_malloc(g->vertex_edges[i], dcap, int);
+    g->_vncap[i] = dcap;
+  }
+
+  safe_malloc(g->edge_neighbors, vcap, int *);
+  safe_malloc(g->edge_faces, vcap, int *);
+  safe_calloc(g->nen, vcap, int);
+  for (i = 0; i < vcap; i++) {
+    safe_malloc(g->edge_neighbors[i], dcap, int);
+    safe_malloc(g->edge_faces[i], dcap, int);
+    g->_encap[i] = dcap;
+  }
+
+  return g;
+}
+
+
+void meshgraph_free(meshgraph_t *g)
+{
+  int i;
+
+  free(g->vertices);
+  free(g->edges);
+  free(g->faces);
+  free(g->nvn);
+  free(g->nen);
+  free(g->_vncap);
+  free(g->_encap);
+
+  for (i = 0; i < g->nv; i++) {
+    free(g->vertex_neighbors[i]);
+    free(g->vertex_edges[i]);
+  }
+  free(g->vertex_neighbors);
+  free(g->vertex_edges);
+
+  for (i = 0; i < g->ne; i++) {
+    free(g->edge_neighbors[i]);
+    free(g->edge_faces[i]);
+  }
+  free(g->edge_neighbors);
+  free(g->edge_faces);
+
+  free(g);
+}
+
+
+int meshgraph_find_edge(meshgraph_t *g, int i, int j)
+{
+  int n;
+  for (n = 0; n < g->nvn[i]; n++)
+    if (g->vertex_neighbors[i][n] == j)
+      return g->vertex_edges[i][n];
+
+  return -1;
+}
+
+
+int meshgraph_find_face(meshgraph_t *g, int i, int j, int k)
+{
+  int e = meshgraph_find_edge(g, i, j);
+  if (e < 0)
+    return -1;
+
+  int n;
+  for (n = 0; n < g->nen[e]; n++)
+    if (g->edge_neighbors[e][n] == k)
+      return g->edge_faces[e][n];
+
+  return -1;
+}
+
+
+static inline int meshgraph_add_vertex_neighbor(meshgraph_t *g, int i, int vertex, int edge)
+{
+  int n = g->nvn[i];
+  if (n == g->_vncap[i]) {
+    g->_vncap[i] *= 2;
+    safe_realloc(g->vertex_neighbors[i], g->_vncap[i], int);
+    safe_realloc(g->vertex_edges[i], g->_vncap[i], int);
+  }
+  g->vertex_neighbors[i][n] = vertex;
+  g->vertex_edges[i][n] = edge;
+  g->nvn[i]++;
+
+  return n;
+}
+
+
+int meshgraph_add_edge(meshgraph_t *g, int i, int j)
+{
+  //printf("meshgraph_add_edge(%d, %d)\n", i, j);
+
+  int edge = meshgraph_find_edge(g, i, j);
+  if (edge >= 0)
+    return edge;
+
+  //printf("  break 1\n");
+
+  // add the edge
+  if (g->ne == g->_ecap) {
+    int old_ecap = g->_ecap;
+    g->_ecap *= 2;
+    safe_realloc(g->edges, g->_ecap, edge_t);
+    safe_realloc(g->edge_neighbors, g->_ecap, int *);
+    safe_realloc(g->edge_faces, g->_ecap, int *);
+    safe_realloc(g->nen, g->_ecap, int);
+    safe_realloc(g->_encap, g->_ecap, int);
+
+    //printf("  break 1.1\n");
+
+    int e;
+    for (e = old_ecap; e < g->_ecap; e++) {
+      //printf("    e = %d\n", e);
+      g->nen[e] = 0;
+      int dcap = g->_encap[0];
+
+      //printf("    dcap = %d\n", dcap);
+
+      safe_malloc(g->edge_neighbors[e], dcap, int);
+
+      //printf("    break 1.1.1\n");
+
+      safe_malloc(g->edge_faces[e], dcap, int);
+
+      //printf("    break 1.1.2\n");
+
+      g->_encap[e] = dcap;
+    }
+  }
+
+  //printf("  break 2\n");
+
+  edge = g->ne;
+  g->edges[edge].i = i;
+  g->edges[edge].j = j;
+  g->ne++;
+
+  //printf("  break 3\n");
+
+  // add the vertex neighbors
+  meshgraph_add_vertex_neighbor(g, i, j, edge);
+  meshgraph_add_vertex_neighbor(g, j, i, edge);
+
+  //printf("  break 4\n");
+
+  return edge;
+}
+
+
+static inline int meshgraph_add_edge_neighbor(meshgraph_t *g, int i, int vertex, int face)
+{
+  int n = g->nen[i];
+
+  //printf("g->nen[%d] = %d, g->_encap[%d] = %d\n", i, n, i, g->_encap[i]);
+
+  if (n == g->_encap[i]) {
+
+    //printf("n == g->_encap[%d]\n", i);
+
+    g->_encap[i] *= 2;
+    safe_realloc(g->edge_neighbors[i], g->_encap[i], int);
+    safe_realloc(g->edge_faces[i], g->_encap[i], int);
+  }
+
+  //printf("  break 1\n");
+
+  g->edge_neighbors[i][n] = vertex;
+
+  //printf("  break 2\n");
+
+  g->edge_faces[i][n] = face;
+
+  //printf("  break 3\n");
+
+  g->nen[i]++;
+
+  return n;
+}
+
+
+int meshgraph_add_face(meshgraph_t *g, int i, int j, int k)
+{
+  //printf("meshgraph_add_face(%d, %d, %d)\n", i, j, k);
+
+  int face = meshgraph_find_face(g, i, j, k);
+  if (face >= 0)
+    return face;
+
+  //printf("  break 1\n");
+
+  // add the edges
+  int edge_ij = meshgraph_add_edge(g, i, j);
+  int edge_ik = meshgraph_add_edge(g, i, k);
+  int edge_jk = meshgraph_add_edge(g, j, k);
+
+  //printf("  break 2\n");
+
+  // add the face
+  //printf("g->nf = %d, g->_fcap = %d\n", g->nf, g->_fcap);
+
+  if (g->nf == g->_fcap) {
+    g->_fcap *= 2;
+    safe_realloc(g->faces, g->_fcap, face_t);
+  }
+  face = g->nf;
+  g->faces[face].i = i;
+  g->faces[face].j = j;
+  g->faces[face].k = k;
+  g->nf++;
+
+  //printf("  break 3\n");
+
+  // add the edge neighbors
+  meshgraph_add_edge_neighbor(g, edge_ij, k, face);
+  meshgraph_add_edge_neighbor(g, edge_ik, j, face);
+  meshgraph_add_edge_neighbor(g, edge_jk, i, face);
+
+  //printf("  break 4\n");
+
+  return face;
+}
+
+
+static inline unsigned int edge_map_hash(int i, int j)
+{
+  unsigned long long key = ((unsigned long long)(unsigned int)i << 32) | (unsigned int)j;
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return (unsigned int)key;
+}
+
+static void edge_map_rehash(edge_map_t *map, int hcap)
+{
+  int e;
+  map->_hcap = hcap;
+  safe_realloc(map->_table, hcap, int);
+  memset(map->_table, -1, hcap*sizeof(int));  // all bytes 0xff --> -1
+  for (e = 0; e < map->ne; e++) {
+    unsigned int h = edge_map_hash(map->edges[e].i, map->edges[e].j) & (hcap-1);
+    while (map->_table[h] >= 0)
+      h = (h+1) & (hcap-1);
+    map->_table[h] = e;
+  }
+}
+
+
+// create an edge map with room for edge_capacity edges
+void edge_map_new(edge_map_t *map, int edge_capacity)
+{
+  edge_capacity = MAX(edge_capacity, 16);
+  int hcap = 16;
+  while (hcap < 2*edge_capacity)
+    hcap *= 2;
+
+  map->ne = 0;
+  map->_ecap = edge_capacity;
+  safe_malloc(map->edges, edge_capacity, edge_t);
+  map->_table = NULL;
+  edge_map_rehash(map, hcap);
+}
+
+
+// free the contents of an edge map
+void edge_map_free(edge_map_t *map)
+{
+  free(map->edges);
+  free(map->_table);
+  map->edges = NULL;
+  map->_table = NULL;
+  map->ne = map->_ecap = map->_hcap = 0;
+}
+
+
+// find the index of an edge (or -1); thread-safe (as long as no edges are being added)
+int edge_map_find(edge_map_t *map, int i, int j)
+{
+  if (i > j) {
+    int tmp = i;  i = j;  j = tmp;
+  }
+
+  unsigned int h = edge_map_hash(i,j) & (map->_hcap - 1);
+  int e;
+  while ((e = map->_table[h]) >= 0) {
+    if (map->edges[e].i == i && map->edges[e].j == j)
+      return e;
+    h = (h+1) & (map->_hcap - 1);
+  }
+
+  return -1;
+}
+
+
+// add an edge (if it's not already there) and return its index
+int edge_map_add(edge_map_t *map, int i, int j)
+{
+  if (i > j) {
+    int tmp = i;  i = j;  j = tmp;
+  }
+
+  unsigned int h = edge_map_hash(i,j) & (map->_hcap - 1);
+  int e;
+  while ((e = map->_table[h]) >= 0) {
+    if (map->edges[e].i == i && map->edges[e].j == j)
+      return e;
+    h = (h+1) & (map->_hcap - 1);
+  }
+
+  // add the edge
+  e = map->ne++;
+  if (e == map->_ecap) {
+    map->_ecap *= 2;
+    safe_realloc(map->edges, map->_ecap, edge_t);
+  }
+  map->edges[e].i = i;
+  map->edges[e].j = j;
+  map->_table[h] = e;
+
+  if (2*map->ne > map->_hcap)  // keep the load factor <= 1/2
+    edge_map_rehash(map, 2*map->_hcap);
+
+  return e;
+}
+
+
+/*
+ * Doubles are sorted by (key, index) pairs, where the key is the bit pattern of the double
+ * transformed so that unsigned integer order matches floating point order.  All of the sorts
+ * below are stable (ties are kept in index order), so their results don't depend on the
+ * number of threads.
+ */
+typedef struct {
+  uint64_t key;
+  int i;
+} sort_pair_t;
+
+#define SORT_INSERTION_MAX 48
+#define SORT_RADIX_BITS 8
+#define SORT_RADIX_BUCKETS (1 << SORT_RADIX_BITS)
+#define SORT_RADIX_PASSES (64 / SORT_RADIX_BITS)
+#define MINK_HEAP_RATIO 16   // mink() uses a heap when k <= n/MINK_HEAP_RATIO, and selection otherwise
+
+static inline uint64_t sort_key(double x)
+{
+  uint64_t u;
+  if (x == 0)  // -0 == +0
+    x = 0;
+  memcpy(&u, &x, sizeof(uint64_t));
+  return (u >> 63 ? ~u : u | ((uint64_t)1 << 63));
+}
+
+static inline int sort_pair_less(const sort_pair_t *a, const sort_pair_t *b)
+{
+  return (a->key < b->key || (a->key == b->key && a->i < b->i));
+}
+
+// stable insertion sort of P[0..n-1] by key
+static void sort_pairs_insertion(sort_pair_t *P, int n)
+{
+  int i, j;
+  for (i = 1; i < n; i++) {
+    sort_pair_t p = P[i];
+    for (j = i; j > 0 && P[j-1].key > p.key; j--)
+      P[j] = P[j-1];
+    P[j] = p;
+  }
+}
+
+// stable LSD radix sort of P[0..n-1] by key, using tmp[0..n-1] as scratch space
+static void sort_pairs_radix(sort_pair_t *P, sort_pair_t *tmp, int n)
+{
+  if (n <= SORT_INSERTION_MAX) {
+    sort_pairs_insertion(P, n);
+    return;
+  }
+
+  // histograms of all of the digits in one pass over the data
+  int i, pass;
+  int *counts;
+  safe_calloc(counts, SORT_RADIX_PASSES * SORT_RADIX_BUCKETS, int);
+  for (i = 0; i < n; i++) {
+    uint64_t key = P[i].key;
+    for (pass = 0; pass < SORT_RADIX_PASSES; pass++)
+      counts[pass*SORT_RADIX_BUCKETS + ((key >> (pass*SORT_RADIX_BITS)) & (SORT_RADIX_BUCKETS-1))]++;
+  }
+
+  sort_pair_t *src = P, *dst = tmp;
+  for (pass = 0; pass < SORT_RADIX_PASSES; pass++) {
+    int *c = counts + pass*SORT_RADIX_BUCKETS;
+    int shift = pass*SORT_RADIX_BITS;
+
+    // skip digits that are the same for every key
+    if (c[(src[0].key >> shift) & (SORT_RADIX_BUCKETS-1)] == n)
+      continue;
+
+    int b, offset = 0;
+    for (b = 0; b < SORT_RADIX_BUCKETS; b++) {
+      int cnt = c[b];
+      c[b] = offset;
+      offset += cnt;
+    }
+    for (i = 0; i < n; i++)
+      dst[c[(src[i].key >> shift) & (SORT_RADIX_BUCKETS-1)]++] = src[i];
+
+    sort_pair_t *swap = src;
+    src = dst;
+    dst = swap;
+  }
+
+  if (src != P)
+    memcpy(P, src, n*sizeof(sort_pair_t));
+
+  free(counts);
+}
+
+
+typedef struct {
+  double *x;
+  sort_pair_t *P;
+  sort_pair_t *tmp;
+  int *runs;         // run boundaries (for merging)
+  int num_runs;
+} sort_args_t;
+
+static void sort_block(int i0, int i1, void *data)
+{
+  sort_args_t *args = (sort_args_t *)data;
+  int i;
+  for (i = i0; i < i1; i++) {
+    args->P[i].key = sort_key(args->x[i]);
+    args->P[i].i = i;
+  }
+  sort_pairs_radix(args->P + i0, args->tmp + i0, i1 - i0);
+}
+
+/*
+ * Find the number of elements taken from A in the first k elements of the stable merge of A and B
+ * (i.e. the merge path split point), by binary search.
+ */
+static int sort_merge_split(const sort_pair_t *A, int na, const sort_pair_t *B, int nb, int k)
+{
+  int lo = MAX(0, k - nb), hi = MIN(k, na);
+  while (lo < hi) {
+    int i = (lo + hi) / 2;
+    // take A[i] before B[k-i-1]?
+    if (A[i].key <= B[k-i-1].key)
+      lo = i + 1;
+    else
+      hi = i;
+  }
+  return lo;
+}
 
-void meshgraph_free(meshgraph_t *g)
+// merge adjacent pairs of runs from P into tmp, for output positions [i0,i1)
+static void sort_merge_block(int i0, int i1, void *data)
+{
+  sort_args_t *args = (sort_args_t *)data;
+  const sort_pair_t *src = args->P;
+  sort_pair_t *dst = args->tmp;
+  int r;
+
+  for (r = 0; r < args->num_runs; r += 2) {
+    int s = args->runs[r];
+    int m = args->runs[MIN(r+1, args->num_runs)];
+    int e = args->runs[MIN(r+2, args->num_runs)];
+    if (e <= i0)
+      continue;
+    if (s >= i1)
+      break;
+
+    const sort_pair_t *A = src + s, *B = src + m;
+    int na = m - s, nb = e - m;
+    int k0 = MAX(i0, s) - s, k1 = MIN(i1, e) - s;
+    int a = sort_merge_split(A, na, B, nb, k0), b = k0 - a;
+    int a1 = sort_merge_split(A, na, B, nb, k1), b1 = k1 - a1;
+    sort_pair_t *out = dst + s + k0;
+    while (a < a1 && b < b1)
+      *out++ = (A[a].key <= B[b].key ? A[a++] : B[b++]);
+    while (a < a1)
+      *out++ = A[a++];
+    while (b < b1)
+      *out++ = B[b++];
+  }
+}
+
+/*
+ * Stable sort of the (key, index) pairs of x into P.  Blocks of x are radix sorted in parallel,
+ * then merged with parallel merges.
+ */
+static void sort_pairs(sort_pair_t *P, double *x, int n)
+{
+  sort_args_t args;
+  args.x = x;
+  args.P = P;
+  safe_malloc(args.tmp, n, sort_pair_t);
+  parallel_for(n, sort_block, &args);
+
+  // find the sorted runs
+  int i, *runs, num_runs = 1;
+  for (i = 1; i < n; i++)
+    if (P[i].key < P[i-1].key)
+      num_runs++;
+  if (num_runs > 1) {
+    safe_malloc(runs, num_runs+1, int);
+    runs[0] = 0;
+    num_runs = 1;
+    for (i = 1; i < n; i++)
+      if (P[i].key < P[i-1].key)
+	runs[num_runs++] = i;
+    runs[num_runs] = n;
+
+    args.runs = runs;
+    while (num_runs > 1) {
+      args.num_runs = num_runs;
+      parallel_for(n, sort_merge_block, &args);
+      sort_pair_t *swap = args.P;
+      args.P = args.tmp;
+      args.tmp = swap;
+
+      int r;
+      for (r = 0; 2*r < num_runs; r++)
+	runs[r] = runs[2*r];
+      num_runs = r;
+      runs[num_runs] = n;
+    }
+    free(runs);
+
+    if (args.P != P) {
+      memcpy(P, args.P, n*sizeof(sort_pair_t));
+      args.tmp = args.P;
+    }
+  }
+
+  free(args.tmp);
+}
+
+/*
+ * Partially sort P[0..n-1] (by key, then index) so that P[k] is in its sorted position, with
+ * smaller pairs before it and larger pairs after it.  Expected O(n) time.
+ */
+static void select_pairs(sort_pair_t *P, int n, int k)
+{
+  int lo = 0, hi = n-1;
+  while (hi > lo) {
+    // median of 3 pivot
+    int mid = lo + (hi - lo) / 2;
+    sort_pair_t tmp;
+    if (sort_pair_less(&P[mid], &P[lo])) { tmp = P[mid];  P[mid] = P[lo];  P[lo] = tmp; }
+    if (sort_pair_less(&P[hi], &P[lo])) { tmp = P[hi];  P[hi] = P[lo];  P[lo] = tmp; }
+    if (sort_pair_less(&P[hi], &P[mid])) { tmp = P[hi];  P[hi] = P[mid];  P[mid] = tmp; }
+    if (hi - lo < 3)
+      return;
+    sort_pair_t pivot = P[mid];
+
+    // Hoare partition of P[lo+1..hi-1] (the pairs are unique, so there are no ties with the pivot)
+    int i = lo, j = hi;
+    while (1) {
+      do i++; while (sort_pair_less(&P[i], &pivot));
+      do j--; while (sort_pair_less(&pivot, &P[j]));
+      if (i >= j)
+	break;
+      tmp = P[i];  P[i] = P[j];  P[j] = tmp;
+    }
+    // now P[lo..j] <= pivot < P[j+1..hi]
+    if (k <= j)
+      hi = j;
+    else
+      lo = j+1;
+  }
+}
+
+// sift P[i] down in the max-heap P[0..n-1]
+static void sort_heap_sift_down(sort_pair_t *P, int n, int i)
+{
+  sort_pair_t p = P[i];
+  while (1) {
+    int c = 2*i+1;
+    if (c >= n)
+      break;
+    if (c+1 < n && sort_pair_less(&P[c], &P[c+1]))
+      c++;
+    if (!sort_pair_less(&p, &P[c]))
+      break;
+    P[i] = P[c];
+    i = c;
+  }
+  P[i] = p;
+}
+
+/*
+ * Fill P[0..k-1] with the k smallest pairs of x, in sorted order, using a max-heap of the k
+ * smallest pairs seen so far.  Most entries of x are rejected by one comparison with the top of
+ * the heap, so this is faster than selection when k << n.
+ */
+static void mink_pairs_heap(sort_pair_t *P, double *x, int n, int k)
 {
   int i;
+  for (i = 0; i < k; i++) {
+    P[i].key = sort_key(x[i]);
+    P[i].i = i;
+  }
+  for (i = k/2 - 1; i >= 0; i--)
+    sort_heap_sift_down(P, k, i);
 
-  free(g->vertices);
-  free(g->edges);
-  free(g->faces);
-  free(g->nvn);
-  free(g->nen);
-  free(g->_vncap);
-  free(g->_encap);
+  for (i = k; i < n; i++) {
+    sort_pair_t p = {sort_key(x[i]), i};
+    if (sort_pair_less(&p, &P[0])) {
+      P[0] = p;
+      sort_heap_sift_down(P, k, 0);
+    }
+  }
 
-  for (i = 0; i < g->nv; i++) {
-    free(g->vertex_neighbors[i]);
-    free(g->vertex_edges[i]);
+  // heap sort
+  for (i = k-1; i > 0; i--) {
+    sort_pair_t tmp = P[0];
+    P[0] = P[i];
+    P[i] = tmp;
+    sort_heap_sift_down(P, i, 0);
+  }
+}
+
+/*
+ * Fill idx with the indices of the k smallest entries of x, in sorted order.  Selects the k-th
+ * smallest pair and then collects (in index order) and sorts only the pairs below it, for
+ * O(n + k) expected time.
+ */
+static void mink_pairs(sort_pair_t *P, double *x, int n, int k)
+{
+  int i, j;
+  for (i = 0; i < n; i++) {
+    P[i].key = sort_key(x[i]);
+    P[i].i = i;
+  }
+  select_pairs(P, n, k-1);
+  sort_pair_t kth = P[k-1];
+
+  for (i = j = 0; i < n && j < k; i++) {
+    sort_pair_t p = {sort_key(x[i]), i};
+    if (!sort_pair_less(&kth, &p))
+      P[j++] = p;
+  }
+  sort_pair_t *tmp;
+  safe_malloc(tmp, k, sort_pair_t);
+  sort_pairs_radix(P, tmp, k);
+  free(tmp);
+}
+
+
+// sort an array of weighted data by value (stable)
+void sort_data(sortable_t *x, size_t n)
+{
+  size_t i;
+  double *values;
+  int *idx;
+  sortable_t *y;
+  safe_malloc(values, n, double);
+  safe_malloc(idx, n, int);
+  safe_malloc(y, n, sortable_t);
+
+  for (i = 0; i < n; i++)
+    values[i] = x[i].value;
+  sort_indices(values, idx, n);
+  for (i = 0; i < n; i++)
+    y[i] = x[idx[i]];
+  memcpy(x, y, n*sizeof(sortable_t));
+
+  free(values);
+  free(idx);
+  free(y);
+}
+
+
+// sort the indices of x (leaving x unchanged)
+void sort_indices(double *x, int *idx, int n)
+{
+  if (n <= 0)
+    return;
+
+  int i;
+  sort_pair_t *P;
+  safe_malloc(P, n, sort_pair_t);
+  sort_pairs(P, x, n);
+  for (i = 0; i < n; i++)
+    idx[i] = P[i].i;
+  free(P);
+}
+
+
+// fills idx with the indices of the k min entries of x, sorted from smallest to biggest
+void mink(double *x, int *idx, int n, int k)
+{
+  k = MIN(k, n);
+  if (k <= 0)
+    return;
+
+  int i;
+  sort_pair_t *P;
+  if (k <= n / MINK_HEAP_RATIO) {
+    safe_malloc(P, k, sort_pair_t);
+    mink_pairs_heap(P, x, n, k);
+  }
+  else {
+    safe_malloc(P, n, sort_pair_t);
+    mink_pairs(P, x, n, k);
+  }
+  for (i = 0; i < k; i++)
+    idx[i] = P[i].i;
+  free(P);
+}
+
+short double_is_equal(double a, double b)
+{
+  return fabs(a - b) < 0.00001;
+}
+
+// fast select algorithm (returns the index of the k-th smallest entry of x, counting from 0)
+int qselect(double *x, int n, int k)
+{
+  int i;
+  sort_pair_t *P;
+  safe_malloc(P, n, sort_pair_t);
+  for (i = 0; i < n; i++) {
+    P[i].key = sort_key(x[i]);
+    P[i].i = i;
+  }
+  select_pairs(P, n, k);
+  i = P[k].i;
+  free(P);
+
+  return i;
+}
+
+
+static kdtree_t *build_kdtree(double **X, int *xi, int n, int d, int depth)
+{
+  if (n == 0)
+    return NULL;
+
+  int i, axis = depth % d;
+  kdtree_t *node;
+  safe_calloc(node, 1, kdtree_t);
+  node->axis = axis;
+
+  double *x;
+  safe_calloc(x, n, double);
+  for (i = 0; i < n; i++)
+    x[i] = X[i][axis];
+
+  int median = qselect(x, n, n/2);
+
+  // node location
+  node->i = xi[median];
+  node->d = d;
+  safe_malloc(node->x, d, double);
+  memcpy(node->x, X[median], d*sizeof(double));
+
+  // node bbox init:  bbox_min = bbox_max = x
+  safe_malloc(node->bbox_min, d, double);
+  safe_malloc(node->bbox_max, d, double);
+  memcpy(node->bbox_min, node->x, d*sizeof(double));
+  memcpy(node->bbox_max, node->x, d*sizeof(double));
+
+  // partition x into y < pivot, z > pivot
+  double pivot = x[median];
+  int ny=0, nz=0;
+  for (i = 0; i < n; i++) {
+    if (i == median)
+      continue;
+    if (x[i] <= pivot)
+      ny++;
+    else if (x[i] > pivot)
+      nz++;
+  }
+
+  //printf("n = %d, d = %d, depth = %d, axis = %d --> median = %d, X[median] = (%f, %f, %f), ny = %d, nz = %d\n",
+  //	 n, d, depth, axis, median, X[median][0], X[median][1], X[median][2], ny, nz);
+
+
+  if (ny > 0) {
+    double **Y = new_matrix2(ny, d);
+    int *yi;
+    safe_calloc(yi, ny, int);
+    ny = 0;
+    for (i = 0; i < n; i++) {
+      if (i == median)
+	continue;
+      if (x[i] <= pivot) {
+	yi[ny] = xi[i];
+	memcpy(Y[ny], X[i], d*sizeof(double));
+	ny++;
+      }
+    }
+    node->left = build_kdtree(Y, yi, ny, d, depth+1);
+
+    // update bbox
+    for (i = 0; i < d; i++) {
+      if (node->left->bbox_min[i] < node->bbox_min[i])
+	node->bbox_min[i] = node->left->bbox_min[i];
+      if (node->left->bbox_max[i] > node->bbox_max[i])
+	node->bbox_max[i] = node->left->bbox_max[i];
+    }
+
+    free_matrix2(Y);
+    free(yi);
+  }
+
+  if (nz > 0) {
+    double **Z = new_matrix2(nz, d);
+    int *zi;
+    safe_calloc(zi, nz, int);
+    nz = 0;
+    for (i = 0; i < n; i++) {
+      if (i == median)
+	continue;
+      if (x[i] > pivot) {
+	zi[nz] = xi[i];
+	memcpy(Z[nz], X[i], d*sizeof(double));
+	nz++;
+      }
+    }
+    node->right = build_kdtree(Z, zi, nz, d, depth+1);
+
+    // update bbox
+    for (i = 0; i < d; i++) {
+      if (node->right->bbox_min[i] < node->bbox_min[i])
+	node->bbox_min[i] = node->right->bbox_min[i];
+      if (node->right->bbox_max[i] > node->bbox_max[i])
+	node->bbox_max[i] = node->right->bbox_max[i];
+    }
+
+    free_matrix2(Z);
+    free(zi);
+  }
+
+  free(x);
+  return node;
+}
+
+
+kdtree_t *kdtree(double **X, int n, int d)
+{
+  int i, *xi;
+  safe_malloc(xi, n, int);
+  for (i = 0; i < n; i++)
+    xi[i] = i;
+
+  kdtree_t *tree = build_kdtree(X, xi, n, d, 0);
+
+  free(xi);
+  return tree;
+}
+
+
+static kdtree_t *kdtree_NN_node(kdtree_t *tree, double *x, kdtree_t *best)
+{
+  if (tree == NULL)
+    return best;
+
+  //printf("node %d", tree->i);
+
+  int i, d = tree->d;
+  double dbest = (best ? dist(x, best->x, d) : DBL_MAX);
+
+  // first, check if any node in tree can possibly be better than 'best'
+  if (best) {
+    double y[d];  // closest point on the tree's bbox to x
+    for (i = 0; i < d; i++) {
+      if (x[i] < tree->bbox_min[i])
+	y[i] = tree->bbox_min[i];
+      else if (x[i] > tree->bbox_max[i])
+	y[i] = tree->bbox_max[i];
+      else
+	y[i] = x[i];
+    }
+    if (dist(y, x, d) >= dbest) {  // 'best' is closer than the closest possible point in tree, so return
+      //printf("  --> pruned!\n");
+      return best;
+    }
   }
-  free(g->vertex_neighbors);
-  free(g->vertex_edges);
 
-  for (i = 0; i < g->ne; i++) {
-    free(g->edge_neighbors[i]);
-    free(g->edge_faces[i]);
-  }
-  free(g->edge_neighbors);
-  free(g->edge_faces);
+  int axis = tree->axis;
+  kdtree_t *nn = best;
 
-  free(g);
-}
+  // compare with the node itself
+  double dtree = dist(x, tree->x, d);
+  //printf(" (%f)", dtree);
+  if (dtree < dbest) {
+    nn = tree;
+    dbest = dtree;
+    //printf(" --> new best");
+  }
+  //printf("\n");
 
+  // compare with the NN in each sub-tree
+  if (x[axis] <= tree->x[axis]) {
+    nn = kdtree_NN_node(tree->left, x, nn);
+    nn = kdtree_NN_node(tree->right, x, nn);
+  }
+  else if (x[axis] > tree->x[axis]) {
+    nn = kdtree_NN_node(tree->right, x, nn);
+    nn = kdtree_NN_node(tree->left, x, nn);
+  }
 
-int meshgraph_find_edge(meshgraph_t *g, int i, int j)
-{
-  int n;
-  for (n = 0; n < g->nvn[i]; n++)
-    if (g->vertex_neighbors[i][n] == j)
-      return g->vertex_edges[i][n];
+  //dbest = dist(x, nn->x, d);
+  //printf(" ... return %d (%f)\n", nn->i, dbest);
 
-  return -1;
+  return nn;
 }
 
-
-int meshgraph_find_face(meshgraph_t *g, int i, int j, int k)
+int kdtree_NN(kdtree_t *tree, double *x)
 {
-  int e = meshgraph_find_edge(g, i, j);
-  if (e < 0)
-    return -1;
-
-  int n;
-  for (n = 0; n < g->nen[e]; n++)
-    if (g->edge_neighbors[e][n] == k)
-      return g->edge_faces[e][n];
-
-  return -1;
+  kdtree_t *nn = kdtree_NN_node(tree, x, NULL);
+  return (nn ? nn->i : -1);
 }
 
 
-static inline int meshgraph_add_vertex_neighbor(meshgraph_t *g, int i, int vertex, int edge)
+void kdtree_free(kdtree_t *tree)
 {
-  int n = g->nvn[i];
-  if (n == g->_vncap[i]) {
-    g->_vncap[i] *= 2;
-    safe_realloc(g->vertex_neighbors[i], g->_vncap[i], int);
-    safe_realloc(g->vertex_edges[i], g->_vncap[i], int);
-  }
-  g->vertex_neighbors[i][n] = vertex;
-  g->vertex_edges[i][n] = edge;
-  g->nvn[i]++;
+  if (tree == NULL)
+    return;
 
-  return n;
-}
+  kdtree_free(tree->left);
+  kdtree_free(tree->right);
 
+  free(tree->x);
+  free(tree->bbox_min);
+  free(tree->bbox_max);
 
-int meshgraph_add_edge(meshgraph_t *g, int i, int j)
-{
-  //printf("meshgraph_add_edge(%d, %d)\n", i, j);
+  free(tree);
+}
 
-  int edge = meshgraph_find_edge(g, i, j);
-  if (edge >= 0)
-    return edge;
 
-  //printf("  break 1\n");
+#define KDTREE_FLAT_LEAF_SIZE 8
 
-  // add the edge
-  if (g->ne == g->_ecap) {
-    int old_ecap = g->_ecap;
-    g->_ecap *= 2;
-    safe_realloc(g->edges, g->_ecap, edge_t);
-    safe_realloc(g->edge_neighbors, g->_ecap, int *);
-    safe_realloc(g->edge_faces, g->_ecap, int *);
-    safe_realloc(g->nen, g->_ecap, int);
-    safe_realloc(g->_encap, g->_ecap, int);
+typedef struct {
+  double **X;              /* source points (double trees) */
+  float **Xf;              /* source points (float trees) */
+  int d;
+  int *perm;               /* original point indices, permuted into tree order */
+  double *key;             /* scratch: split coordinate of each point, aligned with perm */
+  kdtree_flat_node_t *nodes;
+} kdtree_flat_build_t;
 
-    //printf("  break 1.1\n");
 
-    int e;
-    for (e = old_ecap; e < g->_ecap; e++) {
-      //printf("    e = %d\n", e);
-      g->nen[e] = 0;
-      int dcap = g->_encap[0];
+/*
+ * In-place quickselect on (key, perm): afterwards key[k] is the k-th smallest key, with
+ * smaller (or equal) keys to its left and larger (or equal) keys to its right.
+ */
+static void kdtree_flat_select(double *key, int *perm, int n, int k)
+{
+  int lo = 0, hi = n-1;
+
+#define KDTREE_FLAT_SWAP(a,b) do { double tk = key[a]; key[a] = key[b]; key[b] = tk; \
+    int tp = perm[a]; perm[a] = perm[b]; perm[b] = tp; } while (0)
+
+  while (hi > lo) {
+    // median-of-three pivot
+    int mid = lo + (hi-lo)/2;
+    if (key[mid] < key[lo])
+      KDTREE_FLAT_SWAP(mid, lo);
+    if (key[hi] < key[lo])
+      KDTREE_FLAT_SWAP(hi, lo);
+    if (key[hi] < key[mid])
+      KDTREE_FLAT_SWAP(hi, mid);
+    double pivot = key[mid];
+
+    int i = lo, j = hi;
+    while (i <= j) {
+      while (key[i] < pivot)
+	i++;
+      while (key[j] > pivot)
+	j--;
+      if (i <= j) {
+	KDTREE_FLAT_SWAP(i, j);
+	i++;
+	j--;
+      }
+    }
 
-      //printf("    dcap = %d\n", dcap);
+    if (k <= j)
+      hi = j;
+    else if (k >= i)
+      lo = i;
+    else
+      break;
+  }
 
-      safe_malloc(g->edge_neighbors[e], dcap, int);
+#undef KDTREE_FLAT_SWAP
+}
 
-      //printf("    break 1.1.1\n");
 
-      safe_malloc(g->edge_faces[e], dcap, int);
+static void kdtree_flat_build_node(kdtree_flat_build_t *b, int k, int begin, int end, int depth)
+{
+  kdtree_flat_node_t *node = &b->nodes[k];
+  node->begin = begin;
+  node->end = end;
+  node->split = 0;
+  node->axis = -1;
 
-      //printf("    break 1.1.2\n");
+  if (depth == 0)
+    return;
 
-      g->_encap[e] = dcap;
+  // split on the axis of max spread
+  int i, j, d = b->d, axis = 0;
+  double max_spread = -1;
+  for (j = 0; j < d; j++) {
+    double xmin = DBL_MAX, xmax = -DBL_MAX;
+    for (i = begin; i < end; i++) {
+      double x = (b->X ? b->X[b->perm[i]][j] : b->Xf[b->perm[i]][j]);
+      xmin = MIN(xmin, x);
+      xmax = MAX(xmax, x);
+    }
+    if (xmax - xmin > max_spread) {
+      max_spread = xmax - xmin;
+      axis = j;
     }
   }
+  for (i = begin; i < end; i++)
+    b->key[i] = (b->X ? b->X[b->perm[i]][axis] : b->Xf[b->perm[i]][axis]);
 
-  //printf("  break 2\n");
+  int m = begin + (end-begin)/2;
+  if (end > begin) {
+    kdtree_flat_select(b->key + begin, b->perm + begin, end-begin, m-begin);
+    node->split = b->key[m];
+  }
+  node->axis = axis;
 
-  edge = g->ne;
-  g->edges[edge].i = i;
-  g->edges[edge].j = j;
-  g->ne++;
+  kdtree_flat_build_node(b, 2*k+1, begin, m, depth-1);
+  kdtree_flat_build_node(b, 2*k+2, m, end, depth-1);
+}
 
-  //printf("  break 3\n");
 
-  // add the vertex neighbors
-  meshgraph_add_vertex_neighbor(g, i, j, edge);
-  meshgraph_add_vertex_neighbor(g, j, i, edge);
+static kdtree_flat_t *kdtree_flat_build(double **X, float **Xf, int n, int d, int leaf_size)
+{
+  int i;
 
-  //printf("  break 4\n");
+  if (leaf_size <= 0)
+    leaf_size = KDTREE_FLAT_LEAF_SIZE;
+
+  // depth of the tree, so that every leaf has at most leaf_size points
+  int depth = 0;
+  while (depth < 30 && (n + (1<<depth) - 1) >> depth > leaf_size)
+    depth++;
+
+  kdtree_flat_t *tree;
+  safe_calloc(tree, 1, kdtree_flat_t);
+  tree->n = n;
+  tree->d = d;
+  tree->num_nodes = (2 << depth) - 1;
+  safe_calloc(tree->nodes, tree->num_nodes, kdtree_flat_node_t);
+  safe_malloc(tree->idx, MAX(n,1), int);
+  for (i = 0; i < n; i++)
+    tree->idx[i] = i;
+
+  kdtree_flat_build_t b;
+  b.X = X;
+  b.Xf = Xf;
+  b.d = d;
+  b.perm = tree->idx;
+  b.nodes = tree->nodes;
+  safe_malloc(b.key, MAX(n,1), double);
+  kdtree_flat_build_node(&b, 0, 0, n, depth);
+  free(b.key);
+
+  // copy the points in tree order
+  if (X) {
+    safe_malloc(tree->X, MAX(n*d,1), double);
+    for (i = 0; i < n; i++)
+      memcpy(tree->X + i*d, X[tree->idx[i]], d*sizeof(double));
+  }
+  else {
+    safe_malloc(tree->Xf, MAX(n*d,1), float);
+    for (i = 0; i < n; i++)
+      memcpy(tree->Xf + i*d, Xf[tree->idx[i]], d*sizeof(float));
+  }
 
-  return edge;
+  return tree;
 }
 
 
-static inline int meshgraph_add_edge_neighbor(meshgraph_t *g, int i, int vertex, int face)
+/*
+ * Build a flat kd-tree on the rows of X (n-by-d).  The points are copied, so X may be freed afterwards.
+ */
+kdtree_flat_t *kdtree_flat(double **X, int n, int d, int leaf_size)
 {
-  int n = g->nen[i];
+  return kdtree_flat_build(X, NULL, n, d, leaf_size);
+}
 
-  //printf("g->nen[%d] = %d, g->_encap[%d] = %d\n", i, n, i, g->_encap[i]);
 
-  if (n == g->_encap[i]) {
+/*
+ * Build a flat kd-tree that stores its points as floats (half the memory of kdtree_flat()).
+ */
+kdtree_flat_t *kdtree_flat_float(float **X, int n, int d, int leaf_size)
+{
+  return kdtree_flat_build(NULL, X, n, d, leaf_size);
+}
 
-    //printf("n == g->_encap[%d]\n", i);
 
-    g->_encap[i] *= 2;
-    safe_realloc(g->edge_neighbors[i], g->_encap[i], int);
-    safe_realloc(g->edge_faces[i], g->_encap[i], int);
-  }
+void kdtree_flat_free(kdtree_flat_t *tree)
+{
+  if (tree == NULL)
+    return;
 
-  //printf("  break 1\n");
+  free(tree->nodes);
+  free(tree->idx);
+  if (tree->X)
+    free(tree->X);
+  if (tree->Xf)
+    free(tree->Xf);
+  free(tree);
+}
 
-  g->edge_neighbors[i][n] = vertex;
 
-  //printf("  break 2\n");
+typedef struct {
+  kdtree_flat_t *tree;
+  double *q;
+  double *off;             /* per-axis offset from q to the current cell */
+  double eps2;             /* (1+eps)^2 */
+  double r2;               /* squared search radius */
+  int k;                   /* max number of results */
+  int cnt;                 /* current number of results */
+  int *idx;                /* results (a max-heap on d2 for kNN queries) */
+  double *d2;
+} kdtree_flat_query_t;
+
+
+static inline double kdtree_flat_dist2(kdtree_flat_t *tree, int i, double *q)
+{
+  int j, d = tree->d;
+  double d2 = 0;
+  if (tree->X) {
+    double *x = tree->X + i*d;
+    for (j = 0; j < d; j++)
+      d2 += (x[j]-q[j])*(x[j]-q[j]);
+  }
+  else {
+    float *x = tree->Xf + i*d;
+    for (j = 0; j < d; j++)
+      d2 += (x[j]-q[j])*(x[j]-q[j]);
+  }
+  return d2;
+}
 
-  g->edge_faces[i][n] = face;
 
-  //printf("  break 3\n");
+/*
+ * Add a point to the kNN max-heap (if it's closer than the current k-th neighbor).
+ */
+static void kdtree_flat_heap_add(kdtree_flat_query_t *Q, int i, double d2)
+{
+  int *idx = Q->idx;
+  double *hd2 = Q->d2;
+  int c, p;
 
-  g->nen[i]++;
+  if (Q->cnt < Q->k) {  // sift up
+    c = Q->cnt++;
+    while (c > 0) {
+      p = (c-1)/2;
+      if (hd2[p] >= d2)
+	break;
+      idx[c] = idx[p];
+      hd2[c] = hd2[p];
+      c = p;
+    }
+    idx[c] = i;
+    hd2[c] = d2;
+    return;
+  }
 
-  return n;
+  if (d2 >= hd2[0])
+    return;
+
+  // replace the root and sift down
+  p = 0;
+  while (1) {
+    c = 2*p+1;
+    if (c >= Q->cnt)
+      break;
+    if (c+1 < Q->cnt && hd2[c+1] > hd2[c])
+      c++;
+    if (hd2[c] <= d2)
+      break;
+    idx[p] = idx[c];
+    hd2[p] = hd2[c];
+    p = c;
+  }
+  idx[p] = i;
+  hd2[p] = d2;
 }
 
 
-int meshgraph_add_face(meshgraph_t *g, int i, int j, int k)
+static void kdtree_flat_knn_node(kdtree_flat_query_t *Q, int k, double rd)
 {
-  //printf("meshgraph_add_face(%d, %d, %d)\n", i, j, k);
+  kdtree_flat_node_t *node = &Q->tree->nodes[k];
+  int i;
 
-  int face = meshgraph_find_face(g, i, j, k);
-  if (face >= 0)
-    return face;
+  if (node->axis < 0) {
+    for (i = node->begin; i < node->end; i++)
+      kdtree_flat_heap_add(Q, i, kdtree_flat_dist2(Q->tree, i, Q->q));
+    return;
+  }
 
-  //printf("  break 1\n");
+  int axis = node->axis;
+  double diff = Q->q[axis] - node->split;
+  int near = (diff < 0 ? 2*k+1 : 2*k+2);
+  int far = (diff < 0 ? 2*k+2 : 2*k+1);
 
-  // add the edges
-  int edge_ij = meshgraph_add_edge(g, i, j);
-  int edge_ik = meshgraph_add_edge(g, i, k);
-  int edge_jk = meshgraph_add_edge(g, j, k);
+  kdtree_flat_knn_node(Q, near, rd);
 
-  //printf("  break 2\n");
+  // incremental distance to the far cell
+  double old = Q->off[axis];
+  double rd_far = rd - old*old + diff*diff;
+  if (Q->cnt < Q->k || rd_far * Q->eps2 < Q->d2[0]) {
+    Q->off[axis] = diff;
+    kdtree_flat_knn_node(Q, far, rd_far);
+    Q->off[axis] = old;
+  }
+}
 
-  // add the face
-  //printf("g->nf = %d, g->_fcap = %d\n", g->nf, g->_fcap);
 
-  if (g->nf == g->_fcap) {
-    g->_fcap *= 2;
-    safe_realloc(g->faces, g->_fcap, face_t);
-  }
-  face = g->nf;
-  g->faces[face].i = i;
-  g->faces[face].j = j;
-  g->faces[face].k = k;
-  g->nf++;
+static void kdtree_flat_radius_node(kdtree_flat_query_t *Q, int k, double rd)
+{
+  kdtree_flat_node_t *node = &Q->tree->nodes[k];
+  int i;
 
-  //printf("  break 3\n");
+  if (node->axis < 0) {
+    for (i = node->begin; i < node->end && Q->cnt < Q->k; i++) {
+      double d2 = kdtree_flat_dist2(Q->tree, i, Q->q);
+      if (d2 <= Q->r2) {
+	Q->idx[Q->cnt] = Q->tree->idx[i];
+	Q->d2[Q->cnt] = d2;
+	Q->cnt++;
+      }
+    }
+    return;
+  }
 
-  // add the edge neighbors
-  meshgraph_add_edge_neighbor(g, edge_ij, k, face);
-  meshgraph_add_edge_neighbor(g, edge_ik, j, face);
-  meshgraph_add_edge_neighbor(g, edge_jk, i, face);
+  int axis = node->axis;
+  double diff = Q->q[axis] - node->split;
+  int near = (diff < 0 ? 2*k+1 : 2*k+2);
+  int far = (diff < 0 ? 2*k+2 : 2*k+1);
 
-  //printf("  break 4\n");
+  kdtree_flat_radius_node(Q, near, rd);
 
-  return face;
+  double old = Q->off[axis];
+  double rd_far = rd - old*old + diff*diff;
+  if (Q->cnt < Q->k && rd_far <= Q->r2) {
+    Q->off[axis] = diff;
+    kdtree_flat_radius_node(Q, far, rd_far);
+    Q->off[axis] = old;
+  }
 }
 
 
-static int _sortable_cmp(const void *x1, const void *x2)
+/*
+ * Find the (approximate) k nearest neighbors of q.  Each returned neighbor is within a factor of (1+eps)
+ * of the distance to the true neighbor of the same rank; eps = 0 gives the exact kNN.  Returns the
+ * number of neighbors found, min(k,n), in nn_idx (original point indices) and nn_d2 (squared
+ * distances), sorted by distance.
+ */
+int kdtree_flat_knn_approx(int *nn_idx, double *nn_d2, kdtree_flat_t *tree, double *q, int k, double eps)
 {
-  double v1 = ((sortable_t *)x1)->value;
-  double v2 = ((sortable_t *)x2)->value;
-
-  if (v1 == v2)
+  if (tree == NULL || tree->n == 0 || k <= 0)
     return 0;
 
-  return (v1 < v2 ? -1 : 1);
+  double off[tree->d];
+  memset(off, 0, tree->d*sizeof(double));
+
+  kdtree_flat_query_t Q;
+  Q.tree = tree;
+  Q.q = q;
+  Q.off = off;
+  Q.eps2 = (1+eps)*(1+eps);
+  Q.k = MIN(k, tree->n);
+  Q.cnt = 0;
+  Q.idx = nn_idx;
+  Q.d2 = nn_d2;
+
+  kdtree_flat_knn_node(&Q, 0, 0);
+
+  // heap sort the results (in place), then map to original indices
+  int i, n = Q.cnt;
+  for (i = n-1; i > 0; i--) {
+    int top_idx = nn_idx[0];
+    double top_d2 = nn_d2[0];
+    Q.cnt = i;
+    Q.k = i;
+    int last_idx = nn_idx[i];
+    double last_d2 = nn_d2[i];
+    nn_d2[0] = DBL_MAX;  // force the sift down
+    kdtree_flat_heap_add(&Q, last_idx, last_d2);
+    nn_idx[i] = top_idx;
+    nn_d2[i] = top_d2;
+  }
+  for (i = 0; i < n; i++)
+    nn_idx[i] = tree->idx[nn_idx[i]];
 
+  return n;
 }
 
-// sort an array of weighted data using qsort
-void sort_data(sortable_t *x, size_t n)
+
+/*
+ * Find the k nearest neighbors of q (see kdtree_flat_knn_approx()).
+ */
+int kdtree_flat_knn(int *nn_idx, double *nn_d2, kdtree_flat_t *tree, double *q, int k)
 {
-  qsort(x, n, sizeof(sortable_t), _sortable_cmp);
+  return kdtree_flat_knn_approx(nn_idx, nn_d2, tree, q, k, 0);
 }
 
 
-// sort the indices of x (leaving x unchanged)
-void sort_indices(double *x, int *idx, int n)
+/*
+ * Find the k nearest neighbors of a float query point.
+ */
+int kdtree_flat_knn_float(int *nn_idx, double *nn_d2, kdtree_flat_t *tree, float *q, int k)
 {
-  int i;
-  sortable_t *s;
-  int *xi;
-  safe_malloc(s, n, sortable_t);
-  safe_malloc(xi, n, int);
-
-  for (i = 0; i < n; i++) {
-    xi[i] = i;
-    s[i].value = x[i];
-    s[i].data = (void *)(&xi[i]);
-  }
+  int j, d = (tree ? tree->d : 0);
+  double qd[MAX(d,1)];
+  for (j = 0; j < d; j++)
+    qd[j] = q[j];
 
-  sort_data(s, n);
+  return kdtree_flat_knn_approx(nn_idx, nn_d2, tree, qd, k, 0);
+}
 
-  for (i = 0; i < n; i++)
-    idx[i] = *(int *)(s[i].data);
 
-  free(s);
-  free(xi);
+/*
+ * Find the nearest neighbor of q.  Returns its (original) index, or -1 if the tree is empty.
+ */
+int kdtree_flat_NN(kdtree_flat_t *tree, double *q, double *d2)
+{
+  int i;
+  double di;
+  if (kdtree_flat_knn(&i, &di, tree, q, 1) == 0)
+    return -1;
+  if (d2)
+    *d2 = di;
+  return i;
 }
 
 
 /*
- * fills idx with the indices of the k min entries of x
- *   --> works by maintaining the invariant that idx[0] always has the
- *       largest x value of the min k found so far
- */       
-void mink(double *x, int *idx, int n, int k)
+ * Find up to max_results points within distance r of q.  Returns the number of points found, in idx
+ * (original point indices) and d2 (squared distances), in no particular order.
+ */
+int kdtree_flat_radius(int *idx, double *d2, kdtree_flat_t *tree, double *q, double r, int max_results)
 {
-  int i, j;
+  if (tree == NULL || tree->n == 0 || max_results <= 0)
+    return 0;
 
-  // initialize idx with 1:k
-  for (i = 0; i < k; i++)
-    idx[i] = i;
+  double off[tree->d];
+  memset(off, 0, tree->d*sizeof(double));
 
-  // maintain invariant
-  for (i = 1; i < k; i++) {
-    if (x[idx[i]] > x[idx[0]]) {
-      int tmp = idx[i];
-      idx[i] = idx[0];
-      idx[0] = tmp;
-    }
-  }
+  kdtree_flat_query_t Q;
+  Q.tree = tree;
+  Q.q = q;
+  Q.off = off;
+  Q.r2 = r*r;
+  Q.k = max_results;
+  Q.cnt = 0;
+  Q.idx = idx;
+  Q.d2 = d2;
 
-  // process the rest of x
-  for (i = k; i < n; i++) {
-    if (x[i] < x[idx[0]]) {
-      idx[0] = i;
-
-      // maintain invariant
-      for (j = 1; j < k; j++) {
-	if (x[idx[j]] > x[idx[0]]) {
-	  int tmp = idx[j];
-	  idx[j] = idx[0];
-	  idx[0] = tmp;
-	}
-      }
-    }
-  }
+  kdtree_flat_radius_node(&Q, 0, 0);
 
-  // sort the min k values
-  double xmink[k];
-  int idx2[k];
-  for (i = 0; i < k; i++)
-    xmink[i] = x[idx[i]];
-  sort_indices(xmink, idx2, k);
-  for (i = 0; i < k; i++)
-    idx2[i] = idx[idx2[i]];
-  for (i = 0; i < k; i++)
-    idx[i] = idx2[i];
+  return Q.cnt;
 }
 
-short double_is_equal(double a, double b)
+
+typedef struct {
+  kdtree_flat_t *tree;
+  double **Q;
+  int k;
+  double eps;
+  double r;
+  int *cnt;
+  int **idx;
+  double **d2;
+} kdtree_flat_batch_t;
+
+static void kdtree_flat_knn_batch_block(int i0, int i1, void *data)
+{
+  kdtree_flat_batch_t *b = (kdtree_flat_batch_t *)data;
+  int i;
+  for (i = i0; i < i1; i++)
+    kdtree_flat_knn_approx(b->idx[i], b->d2[i], b->tree, b->Q[i], b->k, b->eps);
+}
+
+static void kdtree_flat_radius_batch_block(int i0, int i1, void *data)
 {
-  return fabs(a - b) < 0.00001;
+  kdtree_flat_batch_t *b = (kdtree_flat_batch_t *)data;
+  int i;
+  for (i = i0; i < i1; i++)
+    b->cnt[i] = kdtree_flat_radius(b->idx[i], b->d2[i], b->tree, b->Q[i], b->r, b->k);
 }
 
-// fast select algorithm
-int qselect(double *x, int n, int k)
+
+/*
+ * Find the (approximate) k nearest neighbors of each row of Q (nq-by-d), in parallel.
+ * nn_idx and nn_d2 are nq-by-k.
+ */
+void kdtree_flat_knn_batch(int **nn_idx, double **nn_d2, kdtree_flat_t *tree, double **Q, int nq, int k, double eps)
 {
-  if (n == 1)
-    return 0;
+  kdtree_flat_batch_t b;
+  b.tree = tree;
+  b.Q = Q;
+  b.k = k;
+  b.eps = eps;
+  b.idx = nn_idx;
+  b.d2 = nn_d2;
 
-  double pivot = x[k];
+  parallel_for(nq, kdtree_flat_knn_batch_block, &b);
+}
 
-  // partition x into y < pivot, z > pivot
-  int i, ny=0, nz=0;
-  for (i = 0; i < n; i++) {
-    if (x[i] < pivot)
-      ny++;
-    else if (x[i] > pivot)
-      nz++;
-  }
 
-  if (k < ny) {
-    double *y;
-    int *yi;
-    safe_calloc(y, ny, double);
-    safe_calloc(yi, ny, int);
-    ny = 0;
-    for (i = 0; i < n; i++) {
-      if (x[i] < pivot) {
-	yi[ny] = i;
-	y[ny++] = x[i];
-      }
-    }
-    i = yi[qselect(y, ny, k)];
-    free(y);
-    free(yi);
-    return i;
-  }
+/*
+ * Find up to max_results points within distance r of each row of Q (nq-by-d), in parallel.
+ * idx and d2 are nq-by-max_results, and cnt[i] is the number of points found for Q[i].
+ */
+void kdtree_flat_radius_batch(int *cnt, int **idx, double **d2, kdtree_flat_t *tree, double **Q, int nq, double r, int max_results)
+{
+  kdtree_flat_batch_t b;
+  b.tree = tree;
+  b.Q = Q;
+  b.k = max_results;
+  b.r = r;
+  b.cnt = cnt;
+  b.idx = idx;
+  b.d2 = d2;
+
+  parallel_for(nq, kdtree_flat_radius_batch_block, &b);
+}
 
-  else if (k >= n - nz) {
-    double *z;
-    int *zi;
-    safe_calloc(z, nz, double);
-    safe_calloc(zi, nz, int);
-    nz = 0;
-    for (i = 0; i < n; i++) {
-      if (x[i] > pivot) {
-	zi[nz] = i;
-	z[nz++] = x[i];
-      }
-    }
-    i = zi[qselect(z, nz, k-(n-nz))];
-    free(z);
-    free(zi);
-    return i;
-  }
 
-  return k;
+/*
+ * Normalize q and flip it onto the x[0] >= 0 hemisphere.
+ */
+static void quaternion_index_canonicalize(double *q2, double *q, int d)
+{
+  normalize(q2, q, d);
+  if (q2[0] < 0)
+    mult(q2, q2, -1, d);
 }
 
 
-static kdtree_t *build_kdtree(double **X, int *xi, int n, int d, int depth)
+/*
+ * Convert a squared (chordal) distance between unit vectors to an angle.
+ */
+static inline double quaternion_index_angle(double d2)
 {
-  if (n == 0)
-    return NULL;
+  return 2*asin(MIN(sqrt(d2)/2, 1.0));
+}
 
-  int i, axis = depth % d;
-  kdtree_t *node;
-  safe_calloc(node, 1, kdtree_t);
-  node->axis = axis;
 
-  double *x;
-  safe_calloc(x, n, double);
+/*
+ * Build a nearest-neighbor index on n (unit) quaternions, where q and -q are the same point.
+ */
+quaternion_index_t *quaternion_index(double **Q, int n, int d)
+{
+  int i;
+  double **Q2 = new_matrix2(MAX(n,1), d);
   for (i = 0; i < n; i++)
-    x[i] = X[i][axis];
+    quaternion_index_canonicalize(Q2[i], Q[i], d);
 
-  int median = qselect(x, n, n/2);
-
-  // node location
-  node->i = xi[median];
-  node->d = d;
-  safe_malloc(node->x, d, double);
-  memcpy(node->x, X[median], d*sizeof(double));
+  quaternion_index_t *index;
+  safe_calloc(index, 1, quaternion_index_t);
+  index->n = n;
+  index->d = d;
+  index->tree = kdtree_flat(Q2, n, d, 0);
 
-  // node bbox init:  bbox_min = bbox_max = x
-  safe_malloc(node->bbox_min, d, double);
-  safe_malloc(node->bbox_max, d, double);
-  memcpy(node->bbox_min, node->x, d*sizeof(double));
-  memcpy(node->bbox_max, node->x, d*sizeof(double));
+  free_matrix2(Q2);
 
-  // partition x into y < pivot, z > pivot
-  double pivot = x[median];
-  int ny=0, nz=0;
-  for (i = 0; i < n; i++) {
-    if (i == median)
-      continue;
-    if (x[i] <= pivot)
-      ny++;
-    else if (x[i] > pivot)
-      nz++;
-  }
+  return index;
+}
 
-  //printf("n = %d, d = %d, depth = %d, axis = %d --> median = %d, X[median] = (%f, %f, %f), ny = %d, nz = %d\n",
-  //	 n, d, depth, axis, median, X[median][0], X[median][1], X[median][2], ny, nz);
 
+void quaternion_index_free(quaternion_index_t *index)
+{
+  if (index == NULL)
+    return;
 
-  if (ny > 0) {
-    double **Y = new_matrix2(ny, d);
-    int *yi;
-    safe_calloc(yi, ny, int);
-    ny = 0;
-    for (i = 0; i < n; i++) {
-      if (i == median)
-	continue;
-      if (x[i] <= pivot) {
-	yi[ny] = xi[i];
-	memcpy(Y[ny], X[i], d*sizeof(double));
-	ny++;
-      }
-    }
-    node->left = build_kdtree(Y, yi, ny, d, depth+1);
+  kdtree_flat_free(index->tree);
+  free(index);
+}
 
-    // update bbox
-    for (i = 0; i < d; i++) {
-      if (node->left->bbox_min[i] < node->bbox_min[i])
-	node->bbox_min[i] = node->left->bbox_min[i];
-      if (node->left->bbox_max[i] > node->bbox_max[i])
-	node->bbox_max[i] = node->left->bbox_max[i];
-    }
 
-    free_matrix2(Y);
-    free(yi);
-  }
+/*
+ * Find the k nearest neighbors of q (by angle, with q == -q).  Returns the number of neighbors
+ * found, min(k,n), in nn_idx and nn_dq, sorted by angle.
+ */
+int quaternion_index_knn(int *nn_idx, double *nn_dq, quaternion_index_t *index, double *q, int k)
+{
+  if (index == NULL || index->n == 0 || k <= 0)
+    return 0;
 
-  if (nz > 0) {
-    double **Z = new_matrix2(nz, d);
-    int *zi;
-    safe_calloc(zi, nz, int);
-    nz = 0;
-    for (i = 0; i < n; i++) {
-      if (i == median)
-	continue;
-      if (x[i] > pivot) {
-	zi[nz] = xi[i];
-	memcpy(Z[nz], X[i], d*sizeof(double));
-	nz++;
+  int i, j, d = index->d;
+  double q1[d];
+  quaternion_index_canonicalize(q1, q, d);
+
+  int n1 = kdtree_flat_knn(nn_idx, nn_dq, index->tree, q1, k);
+
+  // every point is on the x[0] >= 0 hemisphere, so its squared distance to -q1 is at least q1[0]^2
+  if (nn_dq[n1-1] > q1[0]*q1[0]) {
+
+    // merge with the kNN of -q1
+    int idx[2*n1], order[2*n1];
+    double d2[2*n1];
+    memcpy(idx, nn_idx, n1*sizeof(int));
+    memcpy(d2, nn_dq, n1*sizeof(double));
+    mult(q1, q1, -1, d);
+    int n2 = kdtree_flat_knn(idx + n1, d2 + n1, index->tree, q1, k);
+    sort_indices(d2, order, n1+n2);
+
+    int cnt = 0;
+    for (i = 0; i < n1+n2 && cnt < n1; i++) {
+      int p = idx[order[i]];
+      for (j = 0; j < cnt; j++)  // skip points that were already found (closer) around the other pole
+	if (nn_idx[j] == p)
+	  break;
+      if (j == cnt) {
+	nn_idx[cnt] = p;
+	nn_dq[cnt++] = d2[order[i]];
       }
     }
-    node->right = build_kdtree(Z, zi, nz, d, depth+1);
-
-    // update bbox
-    for (i = 0; i < d; i++) {
-      if (node->right->bbox_min[i] < node->bbox_min[i])
-	node->bbox_min[i] = node->right->bbox_min[i];
-      if (node->right->bbox_max[i] > node->bbox_max[i])
-	node->bbox_max[i] = node->right->bbox_max[i];
-    }
-
-    free_matrix2(Z);
-    free(zi);
   }
 
-  free(x);
-  return node;
+  for (i = 0; i < n1; i++)
+    nn_dq[i] = quaternion_index_angle(nn_dq[i]);
+
+  return n1;
 }
 
 
-kdtree_t *kdtree(double **X, int n, int d)
+/*
+ * Find the nearest neighbor of q (by angle, with q == -q).  Returns its index, or -1 if the index is empty.
+ */
+int quaternion_index_NN(quaternion_index_t *index, double *q, double *dq)
 {
-  int i, *xi;
-  safe_malloc(xi, n, int);
-  for (i = 0; i < n; i++)
-    xi[i] = i;
-
-  kdtree_t *tree = build_kdtree(X, xi, n, d, 0);
-
-  free(xi);
-  return tree;
+  int i;
+  double di;
+  if (quaternion_index_knn(&i, &di, index, q, 1) == 0)
+    return -1;
+  if (dq)
+    *dq = di;
+  return i;
 }
 
 
-static kdtree_t *kdtree_NN_node(kdtree_t *tree, double *x, kdtree_t *best)
+/*
+ * Find up to max_results points within angle max_dq of q (with q == -q).  Returns the number of
+ * points found, in idx and dq, in no particular order.
+ */
+int quaternion_index_radius(int *idx, double *dq, quaternion_index_t *index, double *q, double max_dq, int max_results)
 {
-  if (tree == NULL)
-    return best;
+  if (index == NULL || index->n == 0 || max_results <= 0 || max_dq < 0)
+    return 0;
 
-  //printf("node %d", tree->i);
+  int i, d = index->d;
+  double q1[d];
+  quaternion_index_canonicalize(q1, q, d);
 
-  int i, d = tree->d;
-  double dbest = (best ? dist(x, best->x, d) : DBL_MAX);
+  double r = 2*sin(MIN(max_dq, M_PI/2)/2);  // chordal radius (at most sqrt(2))
+  int cnt = kdtree_flat_radius(idx, dq, index->tree, q1, r, max_results);
 
-  // first, check if any node in tree can possibly be better than 'best'
-  if (best) {
-    double y[d];  // closest point on the tree's bbox to x
-    for (i = 0; i < d; i++) {
-      if (x[i] < tree->bbox_min[i])
-	y[i] = tree->bbox_min[i];
-      else if (x[i] > tree->bbox_max[i])
-	y[i] = tree->bbox_max[i];
-      else
-	y[i] = x[i];
-    }
-    if (dist(y, x, d) >= dbest) {  // 'best' is closer than the closest possible point in tree, so return
-      //printf("  --> pruned!\n");
-      return best;
+  // search around -q1 if its ball reaches the x[0] >= 0 hemisphere
+  if (r > q1[0] && cnt < max_results) {
+    mult(q1, q1, -1, d);
+    int n1 = cnt;
+    int n2 = kdtree_flat_radius(idx + n1, dq + n1, index->tree, q1, r, max_results - n1);
+
+    // keep the points that are closer to -q1 than to q1 (the others were already found around q1)
+    for (i = n1; i < n1 + n2; i++) {
+      if (dq[i] < 2) {
+	idx[cnt] = idx[i];
+	dq[cnt++] = dq[i];
+      }
     }
   }
 
-  int axis = tree->axis;
-  kdtree_t *nn = best;
-
-  // compare with the node itself
-  double dtree = dist(x, tree->x, d);
-  //printf(" (%f)", dtree);
-  if (dtree < dbest) {
-    nn = tree;
-    dbest = dtree;
-    //printf(" --> new best");
-  }
-  //printf("\n");
+  for (i = 0; i < cnt; i++)
+    dq[i] = quaternion_index_angle(dq[i]);
 
-  // compare with the NN in each sub-tree
-  if (x[axis] <= tree->x[axis]) {
-    nn = kdtree_NN_node(tree->left, x, nn);
-    nn = kdtree_NN_node(tree->right, x, nn);
-  }
-  else if (x[axis] > tree->x[axis]) {
-    nn = kdtree_NN_node(tree->right, x, nn);
-    nn = kdtree_NN_node(tree->left, x, nn);
-  }
+  return cnt;
+}
 
-  //dbest = dist(x, nn->x, d);
-  //printf(" ... return %d (%f)\n", nn->i, dbest);
 
-  return nn;
+typedef struct {
+  quaternion_index_t *index;
+  double **Q;
+  int k;
+  double max_dq;
+  int *cnt;
+  int **idx;
+  double **dq;
+} quaternion_index_batch_t;
+
+static void quaternion_index_knn_batch_block(int i0, int i1, void *data)
+{
+  quaternion_index_batch_t *b = (quaternion_index_batch_t *)data;
+  int i;
+  for (i = i0; i < i1; i++)
+    quaternion_index_knn(b->idx[i], b->dq[i], b->index, b->Q[i], b->k);
 }
 
-int kdtree_NN(kdtree_t *tree, double *x)
+static void quaternion_index_radius_batch_block(int i0, int i1, void *data)
 {
-  kdtree_t *nn = kdtree_NN_node(tree, x, NULL);
-  return (nn ? nn->i : -1);
+  quaternion_index_batch_t *b = (quaternion_index_batch_t *)data;
+  int i;
+  for (i = i0; i < i1; i++)
+    b->cnt[i] = quaternion_index_radius(b->idx[i], b->dq[i], b->index, b->Q[i], b->max_dq, b->k);
 }
 
 
-void kdtree_free(kdtree_t *tree)
+/*
+ * Find the k nearest neighbors of each row of Q (nq-by-d), in parallel.  nn_idx and nn_dq are nq-by-k.
+ */
+void quaternion_index_knn_batch(int **nn_idx, double **nn_dq, quaternion_index_t *index, double **Q, int nq, int k)
 {
-  if (tree == NULL)
-    return;
+  quaternion_index_batch_t b;
+  b.index = index;
+  b.Q = Q;
+  b.k = k;
+  b.idx = nn_idx;
+  b.dq = nn_dq;
 
-  kdtree_free(tree->left);
-  kdtree_free(tree->right);
+  parallel_for(nq, quaternion_index_knn_batch_block, &b);
+}
 
-  free(tree->x);
-  free(tree->bbox_min);
-  free(tree->bbox_max);
 
-  free(tree);
+/*
+ * Find up to max_results points within angle max_dq of each row of Q (nq-by-d), in parallel.
+ * idx and dq are nq-by-max_results, and cnt[i] is the number of points found for Q[i].
+ */
+void quaternion_index_radius_batch(int *cnt, int **idx, double **dq, quaternion_index_t *index, double **Q, int nq, double max_dq, int max_results)
+{
+  quaternion_index_batch_t b;
+  b.index = index;
+  b.Q = Q;
+  b.k = max_results;
+  b.max_dq = max_dq;
+  b.cnt = cnt;
+  b.idx = idx;
+  b.dq = dq;
+
+  parallel_for(nq, quaternion_index_radius_batch_block, &b);
 }
 
 // RGB to CIELAB color space